@@ -19,8 +19,139 @@
 *                   Name
 *                   Size (in bytes)
 *                   Last access date and time
+*
+*               Usage: File_dir_info [-j threads] [-e engine] [-n] [-C]
+*                                    [-s snapshot [-c]] [-w seconds]
+*                                    [-r depth] [-t count]
+*                                    [-o text|json|bin] [-D] [filters]
+*                                    file|directory
+*
+*               -j runs the directory traversal on a pool of worker threads
+*               (0 selects one thread per online core). Each worker keeps a
+*               deque of pending directories and steals from the others when
+*               its own deque runs dry; the main thread prints each subtree
+*               as soon as it has been scanned, so the output is identical
+*               to the single-threaded listing. Each directory is opened
+*               relative to its parent's descriptor, which is kept until
+*               all its subdirectories are open, and symbolic links back to
+*               a parent are not followed. Compile with -pthread.
+*
+*               -e selects how directories are read:
+*                   readdir   opendir()/readdir() and stat() on the full path
+*                             of every entry (the default)
+*                   getdents  large getdents64() reads on a directory fd, with
+*                             entries stat'ed relative to that fd. Entries
+*                             are only stat'ed when d_type cannot answer the
+*                             question or the listing needs size and time
+*                   uring     the getdents engine with each directory's stat
+*                             calls (and, in the serial walk, the opening of
+*                             its first subdirectories) submitted to io_uring
+*                             in batches and completed as they finish. Falls
+*                             back to getdents when io_uring is unavailable
+*               -n lists names only, which lets the getdents engine skip
+*               stat() for every entry whose type the kernel reports.
+*               -C walks the tree once with every engine, discarding the
+*               listing, and prints how long each one took.
+*               The single-threaded walk is iterative and opens directories
+*               relative to their parent, so trees of any depth and path
+*               length can be listed. It holds at most 64 directories open
+*               (fewer under a low descriptor limit) and reopens ancestors
+*               as it climbs back to them. A symbolic link that leads back
+*               to a directory being walked is listed but not followed.
+*               The same walk drives -s, -w, -r, -t and -D.
+*
+*               -s keeps an index of the tree in the given snapshot file.
+*               Directories are keyed by (device, inode); when a directory's
+*               mtime and ctime match the snapshot its entries are taken from
+*               the snapshot instead of being read and stat'ed again, and only
+*               its subdirectories are checked. The snapshot is rewritten at
+*               the end of every run. -c prints only what changed since the
+*               snapshot: + added, - removed, ~ size or mtime changed.
+*               A directory's mtime only moves when entries are added,
+*               removed or renamed, so a file rewritten in place keeps its
+*               snapshot size and times until its directory changes.
+*               Snapshot runs use the single-threaded walk.
+*
+*               -w (or --watch[=seconds]) lists the tree once, keeps it in
+*               memory and follows changes instead of rescanning. Events come
+*               from a fanotify filesystem mark when the kernel and our
+*               privileges allow it and from inotify otherwise (and for
+*               directories on other mounts). Events are gathered for a
+*               short window, duplicates are merged, and each touched entry
+*               is stat'ed once and reported as + added, - removed or
+*               ~ changed. Every interval (default 10 seconds) the listing is
+*               printed again from memory if anything changed, including
+*               access times. Directories that cannot get an inotify watch
+*               because the watch limit is reached are re-read each interval
+*               instead.
+*
+*               -r replaces the listing with per-directory rollups in the
+*               spirit of du: cumulative bytes and count of the regular files
+*               below each directory, with their oldest and newest access
+*               times. Directories are printed as they are finished, down to
+*               the given depth (-1 for all). -t prints the given number of
+*               largest files and largest directories. Only the current path
+*               and the top-N heaps are held in memory, so any size of tree
+*               can be summarized.
+*
+*               -D lists sets of regular files with identical contents,
+*               largest first, and how many bytes removing the copies would
+*               free. Files are grouped by size, hard links to one inode are
+*               counted once, and the remaining candidates are compared by a
+*               hash of their first and last 16 KB before any file is read
+*               in full. The hash is fast rather than cryptographic, so files
+*               whose whole-file hashes match are compared byte for byte
+*               before they are reported. Hashing and comparing run on -j
+*               threads (default one per core). Empty files are ignored;
+*               files that cannot be read are reported, left out and
+*               counted in the summary.
+*
+*               Filters narrow the listing (or -D) down to matching entries;
+*               a directory is listed only once something below it matches.
+*                   --name glob     files whose name matches (repeatable,
+*                                   any may match)
+*                   --prune glob    do not enter directories whose name
+*                                   matches (repeatable)
+*                   --type f|d      only files, or only directories (--name
+*                                   then matches directory names)
+*                   --min-size n    files of at least n bytes, and
+*                   --max-size n    at most n; k, M, G and T suffixes
+*                   --older date    files modified before the date, and
+*                   --newer date    at or after it: YYYY-MM-DD[ HH:MM[:SS]],
+*                                   @seconds or Nd for N days ago
+*               Name, type and prune filters are applied to what the
+*               directory read returns, before anything is stat'ed, and the
+*               uring engine does not even queue a statx for a rejected
+*               entry; size and time need one statx per file. Filtered
+*               listings use the single-threaded walk and cannot be
+*               combined with -C, -s, -w, -r or -t.
+*
+*               -o selects the listing format. text is the format above. json
+*               prints one JSON object per line for every entry, with its
+*               path, type ("file", "dir" or "other") and depth and, for
+*               files, size, atime, mtime (seconds since the epoch), mode
+*               (octal permission bits), uid and user. bin writes the header
+*               "FDIBIN1\n", a 32-bit root path length and the root path,
+*               followed by one packed record per entry in host byte order:
+*                   uint32  record length, name included
+*                   uint32  depth
+*                   int64   size, atime, mtime
+*                   uint32  st_mode, uid
+*                   int8    fileOrDir() kind (1 file, 2 dir, -1 other)
+*                   uint8   flags (1 when the stat fields are valid)
+*                   uint16  name length, then the name without a NUL
+*               A record's path is the root joined with the names of the
+*               last directory record seen at each smaller depth. For a
+*               file argument the root is empty and the record's name is
+*               the argument. json and bin apply to listings and snapshot
+*               runs without -c.
+*               Listings are built in memory and written in large blocks;
+*               times are formatted without calling ctime() for every entry
+*               and user names are looked up once per owner.
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -31,29 +162,783 @@
 #include <fcntl.h>
 #include <pwd.h>
 #include <dirent.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <linux/io_uring.h>
+#include <fnmatch.h>
+#include <limits.h>
+
+#define ENGINE_READDIR      0
+#define ENGINE_GETDENTS     1
+#define ENGINE_URING        2
+
+#define GETDENTS_BUF_SIZE   (256 * 1024)
+#define URING_ENTRIES       256     //operations kept in flight per ring
+#define URING_MAX_PREOPEN   16      //subdirectories opened ahead per directory
+
+#define SCAN_PREOPEN        1       //scanOpen(): caller uses scanTakeFd()
+#define SCAN_FILTER         2       //scanOpen(): skip entries filterName()
+                                    //rejects
+#define SCAN_BARE           4       //scanOpen(): only open, the caller
+                                    //reads the directory itself
+
+#define FILTER_DROP         0       //filterEntry(): leave the entry out
+#define FILTER_MATCH        1       //list the entry
+#define FILTER_PASS         2       //a directory to search but not list
+
+#define OPT_NAME            256     //long options without a short form
+#define OPT_PRUNE           257
+#define OPT_TYPE            258
+#define OPT_MIN_SIZE        259
+#define OPT_MAX_SIZE        260
+#define OPT_OLDER           261
+#define OPT_NEWER           262
+
+#define DUP_BLOCK           (16 * 1024)     //head and tail compared first
+#define DUP_READ_SIZE       (1024 * 1024)   //read size for whole-file hashes
+
+#define WALK_MAX_OPEN       64      //directories walkTree() keeps open
+#define WALK_FD_RESERVE     32      //descriptors left for everything else
+
+#define SNAP_MAGIC          "FDISNAP"
+#define SNAP_VERSION        2
+
+#define FORMAT_TEXT         0
+#define FORMAT_JSON         1
+#define FORMAT_BIN          2
+
+#define OUT_BUF_SIZE        (1024 * 1024)   //listing bytes held before write()
+#define BIN_MAGIC           "FDIBIN1\n"
+#define BIN_HAS_STAT        1               //record flag: stat fields valid
+#define TIME_CACHE_SLOTS    64
+#define USER_CACHE_SLOTS    256
+
+#define WATCH_INTERVAL      10      //default seconds between refreshes
+#define WATCH_COALESCE_MS   100     //window for gathering related events
+#define WATCH_EVENT_BUF     (64 * 1024)
+#define WATCH_IN_MASK       (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                            IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_ACCESS)
+#define WATCH_FAN_MASK      (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | \
+                            FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | \
+                            FAN_ACCESS | FAN_ONDIR)
+
+//settings chosen on the command line
+struct Options
+{
+    int engine;
+    int namesOnly;
+    int fullStat;               //every file must be stat'ed (snapshots)
+    unsigned int statxMask;     //fields the getdents/uring engines ask for
+    char* snapshot;
+    int changesOnly;
+    int format;                 //FORMAT_TEXT, FORMAT_JSON or FORMAT_BIN
+};
+
+static struct Options opts;
+
+//pushdown filters chosen on the command line
+struct Filters
+{
+    int active;                 //any filter was given
+    char** names;               //file name globs, any of which may match
+    int nNames;
+    char** prunes;              //names of directories not to descend into
+    int nPrunes;
+    int type;                   //0 for any, else the fileOrDir() kind wanted
+    int byStat;                 //size or time limits were given
+    long long minSize;
+    long long maxSize;
+    time_t older;               //mtime must be before this
+    time_t newer;               //mtime must be at or after this
+};
+
+static struct Filters filters;
+
+//a formatted quarter hour of local time: within it only the minutes and
+//seconds of a timestamp change
+struct TimeSlot
+{
+    int used;
+    long long block;            //time / 900
+    char prefix[16];            //"Www Mmm dd "
+    char year[8];               //" yyyy\n"
+    int yearLen;
+    int hour;
+    int min;
+};
+
+struct UserSlot
+{
+    int used;
+    uid_t uid;
+    char name[64];
+};
+
+static __thread struct TimeSlot timeCache[TIME_CACHE_SLOTS];
+static __thread struct UserSlot userCache[USER_CACHE_SLOTS];
+
+//record layout returned by getdents64()
+struct LinuxDirent64
+{
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+//one entry of a directory read ahead by the uring engine
+struct ScanItem
+{
+    size_t nameOff;
+    int type;
+    int res;                    //0 or -errno from the statx
+    int fd;                     //pre-opened subdirectory or -1
+    struct stat st;
+};
+
+//an open directory being read by one of the engines
+struct DirScan
+{
+    int fd;
+    DIR* dir;
+    char* path;                 //used by the readdir engine to stat entries
+    char* buf;
+    long pos;
+    long len;
+    struct ScanItem* items;     //uring engine: the whole directory
+    long nItems;
+    long cur;
+    long long next;             //where to resume after scanSuspend()
+    int filter;                 //SCAN_FILTER was given
+};
+
+//a raw io_uring instance, one per thread
+struct Ring
+{
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sqPtr;
+    size_t sqLen;
+    void* cqPtr;
+    size_t cqLen;
+    size_t sqesLen;
+    struct statx stx[URING_ENTRIES];
+    long slotItem[URING_ENTRIES];
+    int freeSlots[URING_ENTRIES];
+    int nFree;
+};
+
+static __thread struct Ring* threadRing;
+
+//snapshot file layout: header, directories sorted by (dev, ino), entries
+//grouped by directory, then NUL-terminated names
+struct SnapHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t nDirs;
+    uint64_t nEntries;
+    uint64_t namesLen;
+};
+
+struct SnapDir
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime;
+    int64_t mtimeNsec;
+    int64_t ctime;
+    int64_t ctimeNsec;
+    uint64_t first;             //index of the directory's first entry
+    uint64_t count;
+};
+
+struct SnapEntry
+{
+    uint64_t nameOff;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mode;
+    int32_t kind;               //fileOrDir() result
+    uint32_t uid;
+    uint32_t reserved;
+};
+
+//an entry of the in-memory tree kept by watch mode
+struct WatchEntry
+{
+    struct WatchEntry* next;    //listing order within the directory
+    struct WatchEntry* prev;
+    struct WatchEntry* hashNext;
+    struct WatchDir* owner;
+    struct WatchDir* dir;       //the subdirectory when kind is 2
+    char* name;
+    int kind;                   //fileOrDir() result
+    long long size;
+    time_t atime;
+    time_t mtime;
+};
+
+struct WatchDir
+{
+    struct WatchDir* parent;
+    struct WatchEntry* self;    //entry in the parent, NULL for the root
+    struct WatchEntry* first;
+    struct WatchEntry* last;
+    int wd;                     //inotify watch or -1
+    int polled;
+    struct WatchDir* pollNext;
+    struct WatchDir* pollPrev;
+    int handleType;             //fanotify file handle, when registered
+    unsigned int handleBytes;
+    unsigned char* handle;
+    struct WatchDir* handleNext;
+    int dead;
+    struct WatchDir* graveNext;
+};
+
+//a directory/name pair touched by an event
+struct Dirty
+{
+    struct WatchDir* dir;
+    char* name;
+};
+
+struct Watch
+{
+    int inFd;
+    int fanFd;
+    int rootMount;
+    char* rootPath;
+    struct WatchDir* root;
+    struct WatchDir** byWd;
+    int capWd;
+    struct WatchEntry** entryHash;
+    size_t hashSize;
+    size_t nHashed;
+    struct WatchDir** handleHash;
+    size_t handleHashSize;
+    struct WatchDir* polled;
+    long nPolled;
+    long nDirs;
+    struct WatchDir* graveyard;
+    struct Dirty* dirty;
+    size_t nDirty;
+    size_t capDirty;
+    char* pathBuf;
+    size_t pathCap;
+    char* eventBuf;
+    int interval;
+    int changed;
+};
+
+//totals for a subtree in rollup mode
+struct Rollup
+{
+    long long bytes;
+    long files;
+    time_t oldest;
+    time_t newest;
+};
+
+//bounded min-heap of the largest sizes seen
+struct TopItem
+{
+    long long size;
+    char* path;
+};
+
+struct TopHeap
+{
+    struct TopItem* items;
+    int n;
+    int cap;
+};
+
+//a snapshot mapped from disk (all NULL when there is none) or being built
+struct Snapshot
+{
+    void* map;
+    size_t mapLen;
+    struct SnapDir* dirs;
+    uint64_t nDirs;
+    uint64_t capDirs;
+    struct SnapEntry* entries;
+    uint64_t nEntries;
+    uint64_t capEntries;
+    char* names;
+    uint64_t namesLen;
+    uint64_t namesCap;
+};
+
+//one directory on walkTree()'s stack
+struct WalkFrame
+{
+    struct DirScan ds;
+    size_t pathLen;             //length of the directory's path
+    int suspended;              //closed to stay under the descriptor cap
+    int shown;                  //passed to the visitor
+    int haveId;                 //dev and ino are known
+    dev_t dev;
+    ino_t ino;
+    uint64_t next;              //WalkOps list(): entries still to return
+    uint64_t end;
+};
+
+//what walkTree() does with the directories and entries it finds; enter,
+//list and leave may be NULL
+struct WalkOps
+{
+    //called with each entry, as for emitEntry()
+    void (*visit)(void*, char*, char*, int, int, struct stat*);
+    //called with each directory once it is open, with its path and depth
+    void (*enter)(void*, struct WalkFrame*, char*, int);
+    //replaces reading the directory: returns the next entry's name, d_type,
+    //fileOrDir() kind and stat struct, or NULL at the end
+    char* (*list)(void*, struct WalkFrame*, int*, int*, struct stat*);
+    //called with each directory once everything below it has been visited
+    void (*leave)(void*, char*, int);
+};
+
+//state of a snapshot run while walkTree() drives it
+struct SnapRun
+{
+    struct Snapshot* old;
+    struct Snapshot* cur;
+    char name[NAME_MAX + 1];    //entry snapList() returned last
+};
+
+//state of a rollup run while walkTree() drives it
+struct RollupRun
+{
+    struct Rollup* sums;        //totals of each directory on the stack
+    int capSums;
+    struct Rollup total;
+    int maxDepth;
+    struct TopHeap* files;
+    struct TopHeap* dirs;
+};
+
+//state of watchLoadDir() while walkTree() drives it
+struct WatchLoad
+{
+    struct Watch* w;
+    struct WatchDir** dirs;     //the directory of each level of the walk
+    int capDirs;
+    struct WatchDir* next;      //directory the walk enters next
+    int report;
+};
+
+//growable text buffer used to collect a directory's listing off-thread
+struct OutBuf
+{
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+//listing output of the main thread, written with write() in large blocks
+static struct OutBuf outBuf;
+
+//a regular file seen by the duplicate finder
+struct DupFile
+{
+    size_t pathOff;             //into the finder's path buffer
+    long long size;
+    dev_t dev;
+    ino_t ino;
+    int links;                  //paths to this inode, which follow this one
+    int failed;                 //could not be read
+    int pair;                   //dupFilter() left it exactly one partner
+    uint64_t hash[2];
+    size_t set;                 //first file of its byte-identical set, once
+                                //compared
+};
+
+struct DupFinder
+{
+    struct DupFile* files;
+    size_t nFiles;
+    size_t capFiles;
+    struct OutBuf paths;
+    size_t* cand;               //first path of each inode still in the running
+    size_t nCand;
+    size_t next;                //next candidate to hash, taken atomically
+    int stage;                  //see dupStage()
+    long long bytesRead;
+    size_t skipped;             //candidates that could not be read
+};
+
+//a directory descriptor shared by the subdirectories still to be opened
+//relative to it; closed when the last of them has been
+struct SharedFd
+{
+    int fd;
+    int refs;
+};
+
+//one directory in the parallel traversal
+struct DirNode
+{
+    char* path;
+    size_t nameOff;             //the directory's own name within path
+    struct DirNode* parent;     //kept until every subdirectory is scanned
+    struct SharedFd* parentFd;  //to open the directory from, NULL for root
+    int haveId;                 //dev and ino are known
+    dev_t dev;
+    ino_t ino;
+    int depth;
+    int done;
+    struct OutBuf out;
+    struct DirNode** kids;      //subdirectories in readdir order
+    size_t* kidOffsets;         //where each subdirectory is spliced into out
+    int nKids;
+    int capKids;
+};
+
+//work-stealing deque: the owner pushes and pops at the tail, thieves take
+//from the head
+struct Deque
+{
+    pthread_mutex_t lock;
+    struct DirNode** items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+struct Pool
+{
+    struct Deque* deques;
+    int nThreads;
+    long queued;                //nodes sitting in a deque
+    long active;                //nodes queued or being scanned
+    int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        //work was queued or the walk finished
+    pthread_cond_t finished;    //a DirNode finished scanning
+};
+
+struct Worker
+{
+    struct Pool* pool;
+    int id;
+    pthread_t thread;
+};
 
 int fileOrDir(struct stat*);
+int scanOpen(struct DirScan*, int, char*, char*, int);
+char* scanNext(struct DirScan*, int*);
+int scanStat(struct DirScan*, char*, struct stat*);
+void scanClose(struct DirScan*);
+int entryMode(struct DirScan*, char*, int, struct stat*);
+int scanTakeFd(struct DirScan*);
+void scanSuspend(struct DirScan*);
+int scanResume(struct DirScan*, int);
+void statxToStat(struct statx*, struct stat*);
+struct Ring* ringOpen(unsigned);
+void ringFree(struct Ring*);
+int uringProbe(void);
+void uringReadAhead(struct DirScan*, int);
+void compareEngines(char*, int);
+int typeNeedsStat(int);
+void snapshotDirInfo(char*);
+void snapVisit(void*, char*, char*, int, int, struct stat*);
+void snapEnter(void*, struct WalkFrame*, char*, int);
+char* snapList(void*, struct WalkFrame*, int*, int*, struct stat*);
+int snapLoad(char*, struct Snapshot*);
+int snapSave(char*, struct Snapshot*);
+struct SnapDir* snapFindDir(struct Snapshot*, uint64_t, uint64_t);
+void snapAddEntry(struct Snapshot*, char*, struct SnapEntry*);
+void statToEntry(struct stat*, int, struct SnapEntry*);
+void snapDiff(struct Snapshot*, struct SnapDir*, struct Snapshot*, uint64_t,
+        uint64_t, char*);
+int snapDirCompare(const void*, const void*);
+int snapNameCompare(const void*, const void*, void*);
+void watchDirInfo(char*, int);
+void watchLoadDir(struct Watch*, struct WatchDir*, int);
+void watchVisit(void*, char*, char*, int, int, struct stat*);
+void watchEnter(void*, struct WalkFrame*, char*, int);
+void watchAddDir(struct Watch*, struct WatchDir*, int);
+struct WatchEntry* watchInsert(struct Watch*, struct WatchDir*, char*, int,
+        struct stat*);
+void watchRemove(struct Watch*, struct WatchEntry*);
+struct WatchEntry* watchFind(struct Watch*, struct WatchDir*, char*);
+struct WatchDir* watchFindHandle(struct Watch*, struct file_handle*);
+char* watchPath(struct Watch*, struct WatchDir*, char*);
+void watchMark(struct Watch*, struct WatchDir*, char*);
+void watchResync(struct Watch*, struct WatchDir*, int);
+void watchReconcile(struct Watch*, struct WatchDir*, char*);
+void watchRead(struct Watch*);
+void watchFlush(struct Watch*);
+void watchPrint(struct WatchDir*, int);
+unsigned long watchHash(struct WatchDir*, char*);
+unsigned long handleHash(int, unsigned char*, unsigned int);
+int dirtyCompare(const void*, const void*);
+void rollupDirInfo(char*, int, int);
+void rollupVisit(void*, char*, char*, int, int, struct stat*);
+void rollupEnter(void*, struct WalkFrame*, char*, int);
+void rollupLeave(void*, char*, int);
+void rollupPrint(struct Rollup*, char*);
+int topWants(struct TopHeap*, long long);
+void topPush(struct TopHeap*, long long, char*, char*);
+void topPrint(struct TopHeap*, char*);
 void fileInfo(char*, struct stat*);
 char* getUserName(uid_t);
 char* getPerms(mode_t, char*);
-void dirInfo(char*, char*);
-void processFile(char*, char*, struct stat*);
+void dirInfo(char*);
+void listVisit(void*, char*, char*, int, int, struct stat*);
+void walkTree(char*, struct WalkOps*, void*);
+void dupDirInfo(char*, int);
+void dupVisit(void*, char*, char*, int, int, struct stat*);
+void dupStage(struct DupFinder*, int, int);
+void* dupWorker(void*);
+long long dupHashFile(struct DupFinder*, struct DupFile*, unsigned char*);
+long long dupVerify(struct DupFinder*, size_t, unsigned char*);
+int dupEqual(struct DupFinder*, struct DupFile*, struct DupFile*, 
+        unsigned char*, long long*);
+int dupOpen(struct DupFinder*, struct DupFile*);
+ssize_t dupRead(int, unsigned char*, size_t);
+void hashUpdate(uint64_t*, const unsigned char*, size_t);
+void hashFinish(uint64_t*, long long);
+void dupFilter(struct DupFinder*);
+int dupFileCompare(const void*, const void*);
+int dupCandCompare(const void*, const void*, void*);
+int dupSame(struct DupFile*, struct DupFile*);
+int dupSameHash(struct DupFile*, struct DupFile*);
+void walkPop(struct WalkFrame*, int*, int*, struct OutBuf*, struct WalkOps*,
+        void*);
+void walkSuspend(struct WalkFrame*);
+int walkReopen(struct WalkFrame*, int, struct OutBuf*);
+int walkCycle(struct WalkFrame*, int, struct stat*);
+int openPath(char*, int);
+int walkOpenLimit(void);
+void walkSetPath(struct OutBuf*, size_t);
+void walkShow(struct WalkFrame*, int, struct OutBuf*, 
+        void (*)(void*, char*, char*, int, int, struct stat*), void*);
+char* scanRead(struct DirScan*, int*);
+int filterName(char*, int);
+int filterEntry(char*, int, struct stat*);
+int filterGlob(char**, int, char*);
+void filterAdd(char***, int*, char*);
+int parseSize(char*, long long*);
+int parseDate(char*, time_t*);
 char* nameTrim(char*, char*);
+void parallelDirInfo(char*, int);
+void* dirWorker(void*);
+void scanNode(struct Worker*, struct DirNode*);
+void printNode(struct Pool*, struct DirNode*);
+struct DirNode* newNode(struct DirNode*, char*, char*, int);
+void freeNode(struct DirNode*);
+int nodeCycle(struct DirNode*, struct stat*);
+void sharedRelease(struct SharedFd*);
+void dequePush(struct Deque*, struct DirNode*);
+struct DirNode* dequePop(struct Deque*);
+struct DirNode* dequeSteal(struct Deque*);
+void poolPush(struct Pool*, int, struct DirNode*);
+int waitForWork(struct Pool*);
+void bufPrintf(struct OutBuf*, const char*, ...);
+void bufReserve(struct OutBuf*, size_t);
+void bufAppend(struct OutBuf*, const char*, size_t);
+void bufNumber(struct OutBuf*, long long);
+void bufJsonString(struct OutBuf*, char*, char*);
+void outFlush(void);
+void outWrite(char*, size_t);
+void outHeader(char*);
+void emitEntry(struct OutBuf*, char*, char*, int, int, struct stat*);
+int fmtTime(time_t, char*);
+void entryToStat(struct SnapEntry*, struct stat*);
 
 int main(int argc, char** argv)
 {    
     struct stat st;
-    int modeNum;
-    char tabs[50];
+    int modeNum, opt;
+    int threads = -1;
+    char* end;
+    char* target;
+    
+    opts.engine = ENGINE_READDIR;
+    opts.namesOnly = 0;
+    opts.fullStat = 0;
+    opts.statxMask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_ATIME;
+    opts.snapshot = NULL;
+    opts.changesOnly = 0;
+    opts.format = FORMAT_TEXT;
     
-    strcpy(tabs, "");
+    int compare = 0, watch = 0, rollupDepth = -2, topN = 0, dedupe = 0;
+    struct option longOpts[] = {
+        {"watch", optional_argument, NULL, 'w'},
+        {"name", required_argument, NULL, OPT_NAME},
+        {"prune", required_argument, NULL, OPT_PRUNE},
+        {"type", required_argument, NULL, OPT_TYPE},
+        {"min-size", required_argument, NULL, OPT_MIN_SIZE},
+        {"max-size", required_argument, NULL, OPT_MAX_SIZE},
+        {"older", required_argument, NULL, OPT_OLDER},
+        {"newer", required_argument, NULL, OPT_NEWER},
+        {NULL, 0, NULL, 0}
+    };
+    
+    filters.minSize = 0;
+    filters.maxSize = LLONG_MAX;
+    filters.older = LLONG_MAX;
+    filters.newer = LLONG_MIN;
+    
+    while((opt = getopt_long(argc, argv, "j:e:nCs:cw:r:t:o:D", longOpts, NULL)) 
+            != -1)
+    {
+        if(opt == 'j')
+        {
+            threads = strtol(optarg, &end, 10);
+            if(*end != '\0' || threads < 0)
+                threads = -2;
+        }
+        else if(opt == 'e' && strcmp(optarg, "readdir") == 0)
+            opts.engine = ENGINE_READDIR;
+        else if(opt == 'e' && strcmp(optarg, "getdents") == 0)
+            opts.engine = ENGINE_GETDENTS;
+        else if(opt == 'e' && strcmp(optarg, "uring") == 0)
+            opts.engine = ENGINE_URING;
+        else if(opt == 'n')
+            opts.namesOnly = 1;
+        else if(opt == 'C')
+            compare = 1;
+        else if(opt == 's')
+            opts.snapshot = optarg;
+        else if(opt == 'c')
+            opts.changesOnly = 1;
+        else if(opt == 'w')
+        {
+            watch = optarg ? strtol(optarg, &end, 10) : WATCH_INTERVAL;
+            if((optarg && *end != '\0') || watch < 1)
+                threads = -2;
+        }
+        else if(opt == 'r')
+        {
+            rollupDepth = strtol(optarg, &end, 10);
+            if(*end != '\0' || rollupDepth < -1)
+                threads = -2;
+        }
+        else if(opt == 't')
+        {
+            topN = strtol(optarg, &end, 10);
+            if(*end != '\0' || topN < 1)
+                threads = -2;
+        }
+        else if(opt == 'D')
+            dedupe = 1;
+        else if(opt == OPT_NAME)
+            filterAdd(&filters.names, &filters.nNames, optarg);
+        else if(opt == OPT_PRUNE)
+            filterAdd(&filters.prunes, &filters.nPrunes, optarg);
+        else if(opt == OPT_TYPE && strcmp(optarg, "f") == 0)
+            filters.type = 1;
+        else if(opt == OPT_TYPE && strcmp(optarg, "d") == 0)
+            filters.type = 2;
+        else if(opt == OPT_MIN_SIZE || opt == OPT_MAX_SIZE)
+        {
+            if(parseSize(optarg, opt == OPT_MIN_SIZE ? &filters.minSize : 
+                    &filters.maxSize) == -1)
+                threads = -2;
+            filters.byStat = 1;
+        }
+        else if(opt == OPT_OLDER || opt == OPT_NEWER)
+        {
+            if(parseDate(optarg, opt == OPT_OLDER ? &filters.older : 
+                    &filters.newer) == -1)
+                threads = -2;
+            filters.byStat = 1;
+        }
+        else if(opt == 'o' && strcmp(optarg, "text") == 0)
+            opts.format = FORMAT_TEXT;
+        else if(opt == 'o' && strcmp(optarg, "json") == 0)
+            opts.format = FORMAT_JSON;
+        else if(opt == 'o' && strcmp(optarg, "bin") == 0)
+            opts.format = FORMAT_BIN;
+        else
+            threads = -2;
+    }
 	
-	if(argc != 2)
+    filters.active = filters.nNames > 0 || filters.nPrunes > 0 || 
+            filters.type != 0 || filters.byStat;
+	
+	if(optind != argc - 1 || threads == -2 || 
+            (filters.active && (compare || watch || opts.snapshot != NULL || 
+            rollupDepth != -2 || topN > 0)) || 
+            (opts.changesOnly && opts.snapshot == NULL) ||
+            (opts.format != FORMAT_TEXT && (compare || watch || 
+            opts.changesOnly || rollupDepth != -2 || topN > 0 || dedupe)) ||
+            (dedupe && (compare || watch || opts.snapshot != NULL || 
+            rollupDepth != -2 || topN > 0)))
 	{
-		printf("Usage: %s file|directory\n", argv[0]);
+		printf("Usage: %s [-j threads] [-e readdir|getdents|uring] [-n] "
+                "[-C] [-s snapshot [-c]] [-w seconds] [-r depth] [-t count] "
+                "[-o text|json|bin] [-D] [--name glob] [--prune glob] "
+                "[--type f|d] [--min-size n] [--max-size n] [--older date] "
+                "[--newer date] file|directory\n", argv[0]);
         return -1;
 	}
-    else if(stat(argv[1], &st) == -1)
+    
+    target = argv[optind];
+    
+    //-j 0 means one worker per online core
+    if(threads == 0 && (threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        threads = 1;
+    
+    //snapshots record every entry's identity and times, watch mode keeps
+    //every file's size and times, rollups add them up and duplicates are
+    //grouped by size and inode
+    if(opts.snapshot != NULL || watch || rollupDepth != -2 || topN > 0 ||
+            dedupe)
+    {
+        opts.fullStat = 1;
+        opts.statxMask |= STATX_INO | STATX_MTIME | STATX_CTIME;
+    }
+    if(opts.format != FORMAT_TEXT)
+        opts.statxMask |= STATX_UID | STATX_MTIME;
+    
+    //size and time limits need every file stat'ed, even with -n
+    if(filters.byStat)
+    {
+        opts.fullStat = 1;
+        opts.statxMask |= STATX_MTIME;
+    }
+    
+    //fmtTime() relies on the time zone being loaded once up front
+    tzset();
+    
+    if(opts.engine == ENGINE_URING && !uringProbe())
+    {
+        fprintf(stderr, "io_uring is unavailable, using the getdents "
+                "engine\n");
+        opts.engine = ENGINE_GETDENTS;
+    }
+    
+    if(stat(target, &st) == -1)
     {
         perror("Error in main");
         return -1;
@@ -63,18 +948,46 @@ int main(int argc, char** argv)
     
     if(modeNum == -1)
     {
-        printf("Error: %s is not a file or directory\n", argv[1]);
+        printf("Error: %s is not a file or directory\n", target);
     }
     else if(modeNum == 1)
     {
-        fileInfo(argv[1], &st);
+        fileInfo(target, &st);
+    }
+    else if(compare)
+    {
+        compareEngines(target, threads);
+    }
+    else if(watch)
+    {
+        watchDirInfo(target, watch);
+    }
+    else if(rollupDepth != -2 || topN > 0)
+    {
+        rollupDirInfo(target, rollupDepth, topN);
+    }
+    else if(dedupe)
+    {
+        //hashing is I/O bound, so use every core unless told otherwise
+        if(threads < 0 && (threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+            threads = 1;
+        dupDirInfo(target, threads);
     }
     else
     {
-        printf("===========================================================\n");
-        dirInfo(argv[1], tabs);
-        printf("===========================================================\n");
+        outHeader(target);
+        if(opts.snapshot != NULL)
+            snapshotDirInfo(target);
+        else if(threads >= 0 && !filters.active)
+            parallelDirInfo(target, threads);
+        else
+            dirInfo(target);
+        if(opts.format == FORMAT_TEXT)
+            bufAppend(&outBuf, "==========================================="
+                    "================\n", 60);
     }
+    
+    outFlush();
 	
 	return 0;
 }
@@ -118,6 +1031,13 @@ void fileInfo(char* fileName, struct stat* st)
     char f[FILENAME_MAX];
     char* p;
     
+    if(opts.format != FORMAT_TEXT)
+    {
+        outHeader("");
+        emitEntry(&outBuf, NULL, fileName, 0, 1, st);
+        return;
+    }
+    
     printf("====================================================\n");
     printf("File Name:\t   %s\n", nameTrim(fileName, f));
     printf("File Size:\t   %d bytes\n", st->st_size);
@@ -131,19 +1051,36 @@ void fileInfo(char* fileName, struct stat* st)
 /*******************************************************************************
 * Function name:  getUserName
 *                                                                             
-* Description:    Returns a user's login name for the given user ID
+* Description:    Returns a user's login name for the given user ID. Names
+*                   are cached per thread, so a listing looks each owner up
+*                   only once; an ID without a passwd entry is returned as a
+*                   number
 *                                                                             
 * Parameters:     uid_t userID - IMPORT - user ID to look up
 *                                                                             
-* Return Value:   pointer to a character string containing user's name
+* Return Value:   pointer to a character string containing user's name, valid
+*                   until the calling thread looks up another ID
 *******************************************************************************/
 char* getUserName(uid_t userID)
 {
-    struct passwd* pass;
+    struct UserSlot* slot = &userCache[userID % USER_CACHE_SLOTS];
+    struct passwd pass;
+    struct passwd* found;
+    char buf[1024];
+    
+    if(slot->used && slot->uid == userID)
+        return slot->name;
+    
+    if(getpwuid_r(userID, &pass, buf, sizeof(buf), &found) == 0 && 
+            found != NULL && strlen(found->pw_name) < sizeof(slot->name))
+        strcpy(slot->name, found->pw_name);
+    else
+        snprintf(slot->name, sizeof(slot->name), "%u", (unsigned)userID);
     
-    pass = getpwuid(userID);
+    slot->used = 1;
+    slot->uid = userID;
     
-    return pass->pw_name;
+    return slot->name;
 }
 
 /*******************************************************************************
@@ -195,124 +1132,5138 @@ char* getPerms(mode_t mode, char* p)
 /*******************************************************************************
 * Function name:  dirInfo
 *                                                                             
-* Description:    Recursively print information about the subdirectories within 
-*                   a directory. Files found within a directory are passed to 
-*                   processFile() to print file-specific information
+* Description:    Print information about the subdirectories within a
+*                   directory, depth first. Every entry found within a
+*                   directory is passed to emitEntry() to print its
+*                   information
 *                                                                             
 * Parameters:     char* dirName - IMPORT - name of the directory to begin
 *                   processing
-*                 char* indent  - IMPORT/EXPORT - string used to format 
-*                   indentation while printing
 *                                                                             
 * Return Value:   none
 *******************************************************************************/
-void dirInfo(char* dirName, char* indent)
+void dirInfo(char* dirName)
+{
+    struct WalkOps ops = {listVisit, NULL, NULL, NULL};
+    
+    walkTree(dirName, &ops, &outBuf);
+}
+
+/*******************************************************************************
+* Function name:  listVisit
+*                                                                             
+* Description:    walkTree() visitor that prints each entry
+*                                                                             
+* Parameters:     void* arg       - IMPORT - output buffer
+*                 the rest as for emitEntry()
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void listVisit(void* arg, char* dirPath, char* name, int depth, int kind, 
+        struct stat* st)
+{
+    emitEntry(arg, dirPath, name, depth, kind, st);
+}
+
+/*******************************************************************************
+* Function name:  walkTree
+*                                                                             
+* Description:    Walk a hierarchy depth first, in directory order, handing
+*                   every entry to a visitor before descending into it. The
+*                   walk keeps an explicit stack of open directories and the
+*                   current path in one growing buffer, so its depth is
+*                   limited only by memory; at most walkOpenLimit()
+*                   directories are open at once, deeper ancestors are
+*                   closed and reopened when the walk returns to them
+*                                                                             
+* Parameters:     char* dirName       - IMPORT - name of the directory to
+*                   begin processing
+*                 struct WalkOps* ops - IMPORT - visitor and the optional
+*                   enter, list and leave hooks
+*                 void* arg           - IMPORT/EXPORT - passed through to ops
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void walkTree(char* dirName, struct WalkOps* ops, void* arg)
 {
-    int dirLen, modeNum;
-    DIR* entries;
+    struct WalkFrame* frames;
+    struct WalkFrame* top;
+    struct WalkFrame* kid;
+    struct OutBuf path = {NULL, 0, 0};
     struct stat st;
-    struct dirent* directory;
-    char currPath[FILENAME_MAX];
-    char nextIndent[50];
+    int n = 1, cap = 64, lowOpen = 0, maxOpen, modeNum, type, fd, verdict;
+    int flags = ops->list != NULL ? SCAN_BARE : 
+            SCAN_PREOPEN | (filters.active ? SCAN_FILTER : 0);
+    size_t nameLen;
+    char* name;
+    
+    frames = malloc(cap * sizeof(struct WalkFrame));
+    if(frames == NULL)
+    {
+        perror("Error in walkTree (malloc)");
+        exit(1);
+    }
+    maxOpen = walkOpenLimit();
     
-    //set the indent for printing at the next (deeper) level
-    strcpy(nextIndent, indent);
-    strcat(nextIndent, "  ");
+    bufAppend(&path, dirName, strlen(dirName));
+    walkSetPath(&path, path.len);
+    frames[0].pathLen = path.len;
+    frames[0].suspended = 0;
+    frames[0].haveId = 0;
+    frames[0].shown = 1;
     
-    entries = opendir(dirName);
-    if(entries == NULL)
-        perror("Error in dirInfo (opendir)");
+    //the root may be a path too long to open in one call
+    fd = openPath(dirName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1 || scanOpen(&frames[0].ds, fd, NULL, path.data, flags) == -1)
+    {
+        perror("Error in walkTree (opendir)");
+        n = 0;
+    }
+    else if(ops->enter != NULL)
+        ops->enter(arg, &frames[0], path.data, 0);
     
-    errno = 0;
-    directory = readdir(entries);
-    if(errno != 0)
-        perror("Error in dirInfo (readdir)");
-
-    while(directory != NULL)
+    while(n > 0)
     {
-        //set the current path for the file/directory
-        strcpy(currPath, dirName);
-        strcat(currPath, "/");
-        strcat(currPath, directory->d_name);
+        top = &frames[n - 1];
+        
+        //the buffer may have moved since the readdir engine last used it
+        top->ds.path = path.data;
         
-        if(strcmp(directory->d_name, ".") != 0 && 
-                strcmp(directory->d_name, "..") != 0)
+        if(top->ds.fd == -1)
+            name = NULL;
+        else if(ops->list != NULL)
+            name = ops->list(arg, top, &type, &modeNum, &st);
+        else
+            name = scanNext(&top->ds, &type);
+        if(name == NULL)
         {
-            if(stat(currPath, &st) == -1)
-            {
-                perror("Error in dirInfo (stat)");
-                break;
-            }
-            
-            modeNum = fileOrDir(&st);
-            
-            if(modeNum == -1)
-                printf("Error: %s is not a file or directory\n", 
-                        directory->d_name);
-            else if(modeNum == 1)
-                processFile(currPath, indent, &st);
-            else
+            walkPop(frames, &n, &lowOpen, &path, ops, arg);
+            continue;
+        }
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        
+        if(ops->list == NULL)
+            modeNum = entryMode(&top->ds, name, type, &st);
+        if(modeNum == 0)
+        {
+            perror("Error in walkTree (stat)");
+            walkPop(frames, &n, &lowOpen, &path, ops, arg);
+            continue;
+        }
+        
+        //with filters, directories are listed once something in them is
+        verdict = filters.active ? filterEntry(name, modeNum, &st) : 
+                FILTER_MATCH;
+        if(verdict == FILTER_DROP)
+            continue;
+        if(verdict == FILTER_MATCH)
+        {
+            walkShow(frames, n, &path, ops->visit, arg);
+            ops->visit(arg, path.data, name, n - 1, modeNum, &st);
+        }
+        if(modeNum != 2)
+            continue;
+        
+        //only a symbolic link can lead back to an ancestor
+        if((type == DT_LNK || type == DT_UNKNOWN) && 
+                walkCycle(frames, n, &st))
+        {
+            fprintf(stderr, "Error in walkTree: %s/%s leads back to one of "
+                    "its parents, not descending\n", path.data, name);
+            continue;
+        }
+        
+        if(n - lowOpen >= maxOpen)
+            walkSuspend(&frames[lowOpen++]);
+        
+        if(n == cap)
+        {
+            cap *= 2;
+            frames = realloc(frames, cap * sizeof(struct WalkFrame));
+            if(frames == NULL)
             {
-                printf("%s%s/\n", indent, directory->d_name);
-                dirInfo(currPath, nextIndent);
+                perror("Error in walkTree (realloc)");
+                exit(1);
             }
+            top = &frames[n - 1];
+        }
+        
+        kid = &frames[n];
+        kid->suspended = 0;
+        kid->shown = verdict == FILTER_MATCH;
+        kid->haveId = type == DT_LNK || type == DT_UNKNOWN;
+        kid->dev = st.st_dev;
+        kid->ino = st.st_ino;
+        
+        nameLen = strlen(name);
+        bufAppend(&path, "/", 1);
+        bufAppend(&path, name, nameLen);
+        walkSetPath(&path, path.len);
+        kid->pathLen = path.len;
+        
+        if((fd = scanTakeFd(&top->ds)) != -1)
+            fd = scanOpen(&kid->ds, fd, NULL, NULL, flags);
+        else
+            fd = scanOpen(&kid->ds, top->ds.fd, name, NULL, flags);
+        
+        if(fd == -1)
+        {
+            perror("Error in walkTree (opendir)");
+            walkSetPath(&path, top->pathLen);
+        }
+        else
+        {
+            n++;
+            if(ops->enter != NULL)
+                ops->enter(arg, kid, path.data, n - 1);
         }
+    }
+    
+    free(frames);
+    free(path.data);
+}
 
-        errno = 0;
-        directory = readdir(entries);
-        if(errno != 0)
-            perror("Error in dirInfo (readdir)");
+/*******************************************************************************
+* Function name:  walkPop
+*                                                                             
+* Description:    Finish the directory on top of the walk's stack. If its
+*                   parent was closed to save descriptors it is reopened
+*                   first, through ".." when that leads back to the same
+*                   directory
+*                                                                             
+* Parameters:     struct WalkFrame* frames - IMPORT/EXPORT - the stack
+*                 int* n                   - IMPORT/EXPORT - stack height
+*                 int* lowOpen             - IMPORT/EXPORT - lowest frame
+*                   that is still open
+*                 struct OutBuf* path      - IMPORT/EXPORT - current path
+*                 struct WalkOps* ops      - IMPORT - its leave hook is called
+*                   for the finished directory
+*                 void* arg                - IMPORT/EXPORT - hook argument
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void walkPop(struct WalkFrame* frames, int* n, int* lowOpen, 
+        struct OutBuf* path, struct WalkOps* ops, void* arg)
+{
+    struct WalkFrame* top = &frames[*n - 1];
+    struct WalkFrame* parent = *n > 1 ? &frames[*n - 2] : NULL;
+    struct stat st;
+    int fd;
+    
+    if(parent != NULL && parent->suspended)
+    {
+        fd = openat(top->ds.fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd != -1 && (fstat(fd, &st) == -1 || st.st_dev != parent->dev || 
+                st.st_ino != parent->ino))
+        {
+            close(fd);
+            fd = -1;
+        }
+        if(fd == -1)
+            fd = walkReopen(frames, *n - 2, path);
+        
+        if(fd == -1 || scanResume(&parent->ds, fd) == -1)
+        {
+            //the rest of the parent is lost, but the walk can go on
+            perror("Error in walkTree (reopen)");
+            if(fd != -1)
+                close(fd);
+            scanClose(&parent->ds);
+        }
+        parent->suspended = 0;
+        *lowOpen = *n - 2;
     }
     
-    closedir(entries);
+    if(ops->leave != NULL)
+        ops->leave(arg, path->data, *n - 1);
+    scanClose(&top->ds);
+    if(parent != NULL)
+        walkSetPath(path, parent->pathLen);
+    (*n)--;
 }
 
 /*******************************************************************************
-* Function name:  processFile
+* Function name:  walkSuspend
 *                                                                             
-* Description:    Print formatted information about the given file
+* Description:    Close an ancestor's descriptor and buffers, remembering its
+*                   identity and read position so that walkPop() can resume it
 *                                                                             
-* Parameters:     char* fileName  - IMPORT - name of the file to process
-*                 char* indent    - IMPORT - string used to format indentation 
-*                   while printing
-*                 struct stat* st - IMPORT - stat struct containing file info
+* Parameters:     struct WalkFrame* frame - IMPORT/EXPORT - frame to close
 *                                                                             
 * Return Value:   none
 *******************************************************************************/
-void processFile(char* fileName, char* indent, struct stat* st)
+void walkSuspend(struct WalkFrame* frame)
 {
-    char f[FILENAME_MAX];
+    struct stat st;
+    
+    if(!frame->haveId && fstat(frame->ds.fd, &st) == 0)
+    {
+        frame->dev = st.st_dev;
+        frame->ino = st.st_ino;
+        frame->haveId = 1;
+    }
+    
+    scanSuspend(&frame->ds);
+    frame->suspended = 1;
+}
 
-    printf("%s%-20s\t%8d bytes\t%s", indent, nameTrim(fileName, f),
-            st->st_size, ctime(&(st->st_atime)));
+/*******************************************************************************
+* Function name:  walkReopen
+*                                                                             
+* Description:    Open a suspended directory by walking down from the root
+*                   one path component at a time, which works at any depth
+*                                                                             
+* Parameters:     struct WalkFrame* frames - IMPORT - the stack
+*                 int k                    - IMPORT - frame to reopen
+*                 struct OutBuf* path      - IMPORT - current path, which
+*                   extends at least to frame k
+*                                                                             
+* Return Value:   open descriptor, or -1 on failure with errno set
+*******************************************************************************/
+int walkReopen(struct WalkFrame* frames, int k, struct OutBuf* path)
+{
+    char name[NAME_MAX + 1];
+    char* root;
+    size_t len;
+    int i, fd, next;
+    
+    root = strndup(path->data, frames[0].pathLen);
+    if(root == NULL)
+        return -1;
+    fd = openPath(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(root);
+    
+    for(i = 1; i <= k && fd != -1; i++)
+    {
+        len = frames[i].pathLen - frames[i - 1].pathLen - 1;
+        memcpy(name, path->data + frames[i - 1].pathLen + 1, len);
+        name[len] = '\0';
+        
+        next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = next;
+    }
+    
+    return fd;
 }
 
 /*******************************************************************************
-* Function name:  nameTrim
+* Function name:  walkCycle
 *                                                                             
-* Description:    Removes leading directory information from a file path
+* Description:    Check whether a directory is already on the walk's stack
 *                                                                             
-* Parameters:     char* dir  - IMPORT - full directory path
-*                 char* name - IMPORT/EXPORT - external pointer to the 
-*                   trimmed file name
+* Parameters:     struct WalkFrame* frames - IMPORT/EXPORT - the stack; open
+*                   frames have their identity filled in as needed
+*                 int n                    - IMPORT - stack height
+*                 struct stat* st          - IMPORT - the directory
 *                                                                             
-* Return Value:   pointer to a character string containing trimmed file name
+* Return Value:   1 if the directory is an ancestor, 0 if not
 *******************************************************************************/
-char* nameTrim(char* dir, char* name)
+int walkCycle(struct WalkFrame* frames, int n, struct stat* st)
 {
-    char* loc;
-    char* end;
-    char temp[FILENAME_MAX];
+    struct stat own;
+    int i;
     
-    end = strtok(dir, "/");
-    while(end != NULL)
+    for(i = n - 1; i >= 0; i--)
     {
-		loc = end;
-		end = strtok(NULL, "/");
-	}	
+        if(!frames[i].haveId)
+        {
+            if(fstat(frames[i].ds.fd, &own) == -1)
+                continue;
+            frames[i].dev = own.st_dev;
+            frames[i].ino = own.st_ino;
+            frames[i].haveId = 1;
+        }
+        if(frames[i].dev == st->st_dev && frames[i].ino == st->st_ino)
+            return 1;
+    }
     
-    strcpy(temp, loc);
-    name = temp;
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  openPath
+*                                                                             
+* Description:    open() a path, falling back to opening it one component at
+*                   a time with openat() when it is longer than the kernel
+*                   accepts in one call
+*                                                                             
+* Parameters:     char* path - IMPORT - path to open
+*                 int flags  - IMPORT - open() flags for the last component
+*                                                                             
+* Return Value:   open descriptor, or -1 on failure with errno set
+*******************************************************************************/
+int openPath(char* path, int flags)
+{
+    char* copy;
+    char* name;
+    char* next;
+    int fd, dirFd, saved;
     
-    return name;
+    fd = open(path, flags);
+    if(fd != -1 || errno != ENAMETOOLONG)
+        return fd;
+    
+    copy = strdup(path);
+    if(copy == NULL)
+        return -1;
+    
+    dirFd = open(*copy == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | 
+            O_CLOEXEC);
+    name = copy;
+    while(dirFd != -1)
+    {
+        while(*name == '/')
+            name++;
+        next = strchr(name, '/');
+        if(next != NULL)
+            *next++ = '\0';
+        
+        //the last component is opened with the caller's flags
+        while(next != NULL && *next == '/')
+            next++;
+        if(next == NULL || *next == '\0')
+        {
+            fd = openat(dirFd, *name ? name : ".", flags);
+            break;
+        }
+        
+        fd = openat(dirFd, *name ? name : ".", O_RDONLY | O_DIRECTORY | 
+                O_CLOEXEC);
+        close(dirFd);
+        dirFd = fd;
+        name = next;
+    }
+    
+    saved = errno;
+    if(dirFd != -1)
+        close(dirFd);
+    free(copy);
+    errno = saved;
+    
+    return fd;
+}
+
+/*******************************************************************************
+* Function name:  walkOpenLimit
+*                                                                             
+* Description:    Decide how many directories walkTree() may hold open: at
+*                   most WALK_MAX_OPEN, and few enough that every one of them
+*                   (with the subdirectories the uring engine opens ahead)
+*                   fits under the descriptor limit
+*                                                                             
+* Parameters:     none
+*                                                                             
+* Return Value:   number of directories, at least 2
+*******************************************************************************/
+int walkOpenLimit(void)
+{
+    struct rlimit rl;
+    long avail = WALK_MAX_OPEN * (1 + URING_MAX_PREOPEN) + WALK_FD_RESERVE;
+    long perDir = opts.engine == ENGINE_URING ? 1 + URING_MAX_PREOPEN : 1;
+    long limit;
+    
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+            (long)rl.rlim_cur < avail)
+        avail = rl.rlim_cur;
+    
+    limit = (avail - WALK_FD_RESERVE) / perDir;
+    if(limit > WALK_MAX_OPEN)
+        limit = WALK_MAX_OPEN;
+    if(limit < 2)
+        limit = 2;
+    
+    return limit;
+}
+
+/*******************************************************************************
+* Function name:  walkShow
+*                                                                             
+* Description:    Pass the directories on the walk's stack that filtering has
+*                   held back to the visitor, outermost first, so that a
+*                   matching entry appears under its parents
+*                                                                             
+* Parameters:     struct WalkFrame* frames - IMPORT/EXPORT - the stack
+*                 int n                    - IMPORT - stack height
+*                 struct OutBuf* path      - IMPORT/EXPORT - current path,
+*                   briefly cut into directory and name for each call
+*                 void (*visit)(...)       - IMPORT - walkTree()'s visitor
+*                 void* arg                - IMPORT/EXPORT - its argument
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void walkShow(struct WalkFrame* frames, int n, struct OutBuf* path, 
+        void (*visit)(void*, char*, char*, int, int, struct stat*), void* arg)
+{
+    int i = n - 1;
+    char slash, end;
+    
+    while(i > 0 && !frames[i].shown)
+        i--;
+    
+    for(i++; i < n; i++)
+    {
+        slash = path->data[frames[i - 1].pathLen];
+        end = path->data[frames[i].pathLen];
+        path->data[frames[i - 1].pathLen] = '\0';
+        path->data[frames[i].pathLen] = '\0';
+        
+        visit(arg, path->data, path->data + frames[i - 1].pathLen + 1, i - 1,
+                2, NULL);
+        
+        path->data[frames[i - 1].pathLen] = slash;
+        path->data[frames[i].pathLen] = end;
+        frames[i].shown = 1;
+    }
+}
+
+/*******************************************************************************
+* Function name:  filterName
+*                                                                             
+* Description:    Apply the filters that need only a name and d_type, before
+*                   the entry is stat'ed: pruned directories and regular
+*                   files that fail the name or type filter are dropped.
+*                   Entries whose type d_type leaves open are kept for
+*                   filterEntry()
+*                                                                             
+* Parameters:     char* name - IMPORT - entry name
+*                 int type   - IMPORT - d_type of the entry
+*                                                                             
+* Return Value:   1 to keep the entry, 0 to drop it
+*******************************************************************************/
+int filterName(char* name, int type)
+{
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 1;
+    
+    if(type == DT_DIR)
+        return !filterGlob(filters.prunes, filters.nPrunes, name);
+    if(type == DT_REG)
+        return filters.type != 2 && (filters.nNames == 0 || 
+                filterGlob(filters.names, filters.nNames, name));
+    if(type == DT_LNK || type == DT_UNKNOWN)
+        return 1;
+    
+    return filters.type == 0 && !filters.byStat && (filters.nNames == 0 || 
+            filterGlob(filters.names, filters.nNames, name));
+}
+
+/*******************************************************************************
+* Function name:  filterEntry
+*                                                                             
+* Description:    Apply every filter to an entry once its kind (and, for
+*                   files, its size and times) is known
+*                                                                             
+* Parameters:     char* name      - IMPORT - entry name
+*                 int kind        - IMPORT - fileOrDir() result
+*                 struct stat* st - IMPORT - stat struct, valid for files
+*                                                                             
+* Return Value:   FILTER_DROP, FILTER_MATCH, or FILTER_PASS for a directory
+*                   to search without listing it yet
+*******************************************************************************/
+int filterEntry(char* name, int kind, struct stat* st)
+{
+    int named = filters.nNames == 0 || 
+            filterGlob(filters.names, filters.nNames, name);
+    
+    if(kind == 2)
+    {
+        if(filterGlob(filters.prunes, filters.nPrunes, name))
+            return FILTER_DROP;
+        return filters.type == 2 && named ? FILTER_MATCH : FILTER_PASS;
+    }
+    
+    if(filters.type != 0 && filters.type != kind)
+        return FILTER_DROP;
+    if(!named || (kind != 1 && filters.byStat))
+        return FILTER_DROP;
+    
+    if(kind == 1 && (st->st_size < filters.minSize || 
+            st->st_size > filters.maxSize || st->st_mtime >= filters.older ||
+            st->st_mtime < filters.newer))
+        return FILTER_DROP;
+    
+    return FILTER_MATCH;
+}
+
+/*******************************************************************************
+* Function name:  filterGlob
+*                                                                             
+* Description:    Match a name against a list of shell patterns
+*                                                                             
+* Parameters:     char** globs - IMPORT - patterns
+*                 int n        - IMPORT - number of patterns
+*                 char* name   - IMPORT - name to match
+*                                                                             
+* Return Value:   1 if any pattern matches, 0 if none does
+*******************************************************************************/
+int filterGlob(char** globs, int n, char* name)
+{
+    int i;
+    
+    for(i = 0; i < n; i++)
+        if(fnmatch(globs[i], name, 0) == 0)
+            return 1;
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  filterAdd
+*                                                                             
+* Description:    Append a pattern to one of the filter lists
+*                                                                             
+* Parameters:     char*** globs - IMPORT/EXPORT - the list
+*                 int* n        - IMPORT/EXPORT - its length
+*                 char* glob    - IMPORT - pattern to add
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void filterAdd(char*** globs, int* n, char* glob)
+{
+    *globs = realloc(*globs, (*n + 1) * sizeof(char*));
+    if(*globs == NULL)
+    {
+        perror("Error in filterAdd (realloc)");
+        exit(1);
+    }
+    (*globs)[(*n)++] = glob;
+}
+
+/*******************************************************************************
+* Function name:  parseSize
+*                                                                             
+* Description:    Read a byte count with an optional k, M, G or T suffix
+*                   (powers of 1024)
+*                                                                             
+* Parameters:     char* text       - IMPORT - text to read
+*                 long long* size  - EXPORT - the number of bytes
+*                                                                             
+* Return Value:   0 on success, -1 if the text is not a size
+*******************************************************************************/
+int parseSize(char* text, long long* size)
+{
+    char* end;
+    char* units = "kMGT";
+    char* unit;
+    
+    *size = strtoll(text, &end, 10);
+    if(end == text || *size < 0)
+        return -1;
+    
+    if(*end != '\0' && (unit = strchr(units, *end)) != NULL && 
+            end[1] == '\0')
+    {
+        *size <<= 10 * (unit - units + 1);
+        end++;
+    }
+    
+    return *end == '\0' ? 0 : -1;
+}
+
+/*******************************************************************************
+* Function name:  parseDate
+*                                                                             
+* Description:    Read a point in time given as local "YYYY-MM-DD", 
+*                   "YYYY-MM-DD HH:MM[:SS]" (or with a T), "@seconds" since
+*                   the epoch, or "Nd" for N days ago
+*                                                                             
+* Parameters:     char* text - IMPORT - text to read
+*                 time_t* t  - EXPORT - the time
+*                                                                             
+* Return Value:   0 on success, -1 if the text is not a date
+*******************************************************************************/
+int parseDate(char* text, time_t* t)
+{
+    char* formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", 
+            "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d"};
+    struct tm tm;
+    char* end;
+    long long n;
+    int i;
+    
+    if(text[0] == '@')
+    {
+        n = strtoll(text + 1, &end, 10);
+        *t = n;
+        return end == text + 1 || *end != '\0' ? -1 : 0;
+    }
+    
+    n = strtoll(text, &end, 10);
+    if(end != text && strcmp(end, "d") == 0)
+    {
+        *t = time(NULL) - n * 86400;
+        return 0;
+    }
+    
+    for(i = 0; i < 5; i++)
+    {
+        memset(&tm, 0, sizeof(struct tm));
+        end = strptime(text, formats[i], &tm);
+        if(end != NULL && *end == '\0')
+        {
+            tm.tm_isdst = -1;
+            *t = mktime(&tm);
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+/*******************************************************************************
+* Function name:  walkSetPath
+*                                                                             
+* Description:    Cut the walk's path back (or extend it) to the given length
+*                   and keep it NUL-terminated
+*                                                                             
+* Parameters:     struct OutBuf* path - IMPORT/EXPORT - current path
+*                 size_t len          - IMPORT - new length
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void walkSetPath(struct OutBuf* path, size_t len)
+{
+    path->len = len;
+    bufReserve(path, 1);
+    path->data[len] = '\0';
+}
+
+/*******************************************************************************
+* Function name:  nameTrim
+*                                                                             
+* Description:    Removes leading directory information from a file path
+*                                                                             
+* Parameters:     char* dir  - IMPORT - full directory path
+*                 char* name - IMPORT/EXPORT - external pointer to the 
+*                   trimmed file name
+*                                                                             
+* Return Value:   pointer to a character string containing trimmed file name
+*******************************************************************************/
+char* nameTrim(char* dir, char* name)
+{
+    char* loc;
+    char* end;
+    char temp[FILENAME_MAX];
+    
+    end = strtok(dir, "/");
+    while(end != NULL)
+    {
+		loc = end;
+		end = strtok(NULL, "/");
+	}	
+    
+    strcpy(temp, loc);
+    name = temp;
+    
+    return name;
+}
+
+/*******************************************************************************
+* Function name:  parallelDirInfo
+*                                                                             
+* Description:    Print the same hierarchy as dirInfo() using a pool of worker
+*                   threads. Workers scan directories into per-directory
+*                   buffers while the calling thread prints finished subtrees
+*                   in traversal order
+*                                                                             
+* Parameters:     char* dirName - IMPORT - name of the directory to begin
+*                   processing
+*                 int nThreads  - IMPORT - number of worker threads
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void parallelDirInfo(char* dirName, int nThreads)
+{
+    struct Pool pool;
+    struct Worker* workers;
+    struct DirNode* root;
+    int i;
+    
+    pool.nThreads = nThreads;
+    pool.queued = 0;
+    pool.active = 1;
+    pool.sleepers = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+    
+    pool.deques = calloc(nThreads, sizeof(struct Deque));
+    workers = calloc(nThreads, sizeof(struct Worker));
+    if(pool.deques == NULL || workers == NULL)
+    {
+        perror("Error in parallelDirInfo (calloc)");
+        exit(1);
+    }
+    
+    for(i = 0; i < nThreads; i++)
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    
+    root = newNode(NULL, dirName, NULL, 0);
+    poolPush(&pool, 0, root);
+    
+    for(i = 0; i < nThreads; i++)
+    {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if(pthread_create(&workers[i].thread, NULL, dirWorker, &workers[i]))
+        {
+            perror("Error in parallelDirInfo (pthread_create)");
+            exit(1);
+        }
+    }
+    
+    printNode(&pool, root);
+    fflush(stdout);
+    
+    for(i = 0; i < nThreads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        free(pool.deques[i].items);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    
+    free(pool.deques);
+    free(workers);
+    pthread_cond_destroy(&pool.finished);
+    pthread_cond_destroy(&pool.wake);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+/*******************************************************************************
+* Function name:  dirWorker
+*                                                                             
+* Description:    Thread body for the traversal pool. Takes directories from
+*                   the worker's own deque, stealing from the other workers
+*                   when it is empty, until no directories remain anywhere
+*                                                                             
+* Parameters:     void* arg - IMPORT - the struct Worker for this thread
+*                                                                             
+* Return Value:   NULL
+*******************************************************************************/
+void* dirWorker(void* arg)
+{
+    struct Worker* self = arg;
+    struct Pool* pool = self->pool;
+    struct DirNode* node;
+    int i, victim;
+    
+    for(;;)
+    {
+        node = dequePop(&pool->deques[self->id]);
+        
+        //own deque is empty, try everyone else starting with our neighbour
+        for(i = 1; node == NULL && i < pool->nThreads; i++)
+        {
+            victim = (self->id + i) % pool->nThreads;
+            node = dequeSteal(&pool->deques[victim]);
+        }
+        
+        if(node == NULL)
+        {
+            if(!waitForWork(pool))
+                break;
+            continue;
+        }
+        
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        scanNode(self, node);
+        
+        if(__atomic_sub_fetch(&pool->active, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    
+    ringFree(threadRing);
+    threadRing = NULL;
+    
+    return NULL;
+}
+
+/*******************************************************************************
+* Function name:  waitForWork
+*                                                                             
+* Description:    Put an idle worker to sleep until a directory is queued or
+*                   the traversal has finished
+*                                                                             
+* Parameters:     struct Pool* pool - IMPORT - the traversal pool
+*                                                                             
+* Return Value:   1 if there may be work to take
+*                 0 if the traversal is finished
+*******************************************************************************/
+int waitForWork(struct Pool* pool)
+{
+    int more;
+    
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    
+    while(__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&pool->active, __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_wait(&pool->wake, &pool->lock);
+    
+    __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    more = __atomic_load_n(&pool->active, __ATOMIC_SEQ_CST) > 0;
+    pthread_mutex_unlock(&pool->lock);
+    
+    return more;
+}
+
+/*******************************************************************************
+* Function name:  poolPush
+*                                                                             
+* Description:    Queue a directory on a worker's deque and wake a sleeping
+*                   worker if there is one
+*                                                                             
+* Parameters:     struct Pool* pool     - IMPORT - the traversal pool
+*                 int id                - IMPORT - index of the owning worker
+*                 struct DirNode* node  - IMPORT - directory to queue
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void poolPush(struct Pool* pool, int id, struct DirNode* node)
+{
+    dequePush(&pool->deques[id], node);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    
+    if(__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*******************************************************************************
+* Function name:  scanNode
+*                                                                             
+* Description:    Read one directory, formatting its files into the node's
+*                   output buffer and queueing its subdirectories as child
+*                   nodes on the calling worker's deque. The directory is
+*                   opened relative to its parent's descriptor, so paths of
+*                   any length can be walked, and a symbolic link back to
+*                   one of its parents is listed but not followed
+*                                                                             
+* Parameters:     struct Worker* self   - IMPORT - the calling worker
+*                 struct DirNode* node  - IMPORT/EXPORT - directory to scan
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void scanNode(struct Worker* self, struct DirNode* node)
+{
+    int modeNum, type, fd;
+    struct DirScan ds;
+    struct stat st;
+    struct DirNode* kid;
+    struct SharedFd* shared = NULL;
+    char* name;
+    
+    if(node->parentFd == NULL)
+        fd = scanOpen(&ds, AT_FDCWD, node->path, node->path, 0);
+    else
+    {
+        fd = scanOpen(&ds, node->parentFd->fd, node->path + node->nameOff, 
+                node->path, 0);
+        sharedRelease(node->parentFd);
+        node->parentFd = NULL;
+    }
+    
+    if(fd != -1 && !node->haveId && fstat(ds.fd, &st) == 0)
+    {
+        node->dev = st.st_dev;
+        node->ino = st.st_ino;
+        node->haveId = 1;
+    }
+    
+    if(fd == -1)
+        fprintf(stderr, "Error in scanNode (opendir): %s: %s\n", node->path,
+                strerror(errno));
+    else while((name = scanNext(&ds, &type)) != NULL)
+    {
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        
+        modeNum = entryMode(&ds, name, type, &st);
+        
+        if(modeNum == 0)
+        {
+            perror("Error in scanNode (stat)");
+            break;
+        }
+        
+        emitEntry(&node->out, node->path, name, node->depth, modeNum, &st);
+        
+        if(modeNum != 2)
+            continue;
+        
+        //only a symbolic link can lead back to a parent
+        if((type == DT_LNK || type == DT_UNKNOWN) && nodeCycle(node, &st))
+        {
+            fprintf(stderr, "Error in scanNode: %s/%s leads back to one of "
+                    "its parents, not descending\n", node->path, name);
+            continue;
+        }
+        
+        if(shared == NULL)
+        {
+            shared = malloc(sizeof(struct SharedFd));
+            if(shared == NULL)
+            {
+                perror("Error in scanNode (malloc)");
+                exit(1);
+            }
+            shared->fd = fcntl(ds.fd, F_DUPFD_CLOEXEC, 0);
+            shared->refs = 1;
+            if(shared->fd == -1)
+            {
+                perror("Error in scanNode (dup)");
+                break;
+            }
+        }
+        
+        kid = newNode(node, node->path, name, node->depth + 1);
+        kid->parentFd = shared;
+        __atomic_add_fetch(&shared->refs, 1, __ATOMIC_SEQ_CST);
+        
+        //stat() has already identified the directory
+        if(opts.engine == ENGINE_READDIR || typeNeedsStat(type))
+        {
+            kid->dev = st.st_dev;
+            kid->ino = st.st_ino;
+            kid->haveId = 1;
+        }
+        
+        if(node->nKids == node->capKids)
+        {
+            node->capKids = node->capKids ? node->capKids * 2 : 8;
+            node->kids = realloc(node->kids, 
+                    node->capKids * sizeof(struct DirNode*));
+            node->kidOffsets = realloc(node->kidOffsets, 
+                    node->capKids * sizeof(size_t));
+            if(node->kids == NULL || node->kidOffsets == NULL)
+            {
+                perror("Error in scanNode (realloc)");
+                exit(1);
+            }
+        }
+        node->kids[node->nKids] = kid;
+        node->kidOffsets[node->nKids] = node->out.len;
+        node->nKids++;
+        
+        __atomic_add_fetch(&self->pool->active, 1, __ATOMIC_SEQ_CST);
+        poolPush(self->pool, self->id, kid);
+    }
+    
+    if(shared != NULL)
+        sharedRelease(shared);
+    scanClose(&ds);
+    
+    pthread_mutex_lock(&self->pool->lock);
+    node->done = 1;
+    pthread_cond_broadcast(&self->pool->finished);
+    pthread_mutex_unlock(&self->pool->lock);
+}
+
+/*******************************************************************************
+* Function name:  printNode
+*                                                                             
+* Description:    Wait for a directory to be scanned, then print its listing
+*                   with each subdirectory's listing spliced in after the
+*                   subdirectory's name. Printed nodes are freed
+*                                                                             
+* Parameters:     struct Pool* pool     - IMPORT - the traversal pool
+*                 struct DirNode* node  - IMPORT - directory to print
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void printNode(struct Pool* pool, struct DirNode* node)
+{
+    int i;
+    size_t pos = 0;
+    
+    pthread_mutex_lock(&pool->lock);
+    while(!node->done)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for(i = 0; i < node->nKids; i++)
+    {
+        outWrite(node->out.data + pos, node->kidOffsets[i] - pos);
+        pos = node->kidOffsets[i];
+        printNode(pool, node->kids[i]);
+    }
+    outWrite(node->out.data + pos, node->out.len - pos);
+    
+    freeNode(node);
+}
+
+/*******************************************************************************
+* Function name:  newNode
+*                                                                             
+* Description:    Allocate a traversal node for a directory
+*                                                                             
+* Parameters:     struct DirNode* parent - IMPORT - the parent's node, or
+*                   NULL for the root
+*                 char* dirName - IMPORT - directory path, or parent path when
+*                   name is not NULL
+*                 char* name    - IMPORT - entry name within dirName, or NULL
+*                 int depth     - IMPORT - nesting level below the root
+*                                                                             
+* Return Value:   pointer to the new node
+*******************************************************************************/
+struct DirNode* newNode(struct DirNode* parent, char* dirName, char* name, 
+        int depth)
+{
+    struct DirNode* node = calloc(1, sizeof(struct DirNode));
+    size_t len = strlen(dirName);
+    
+    if(node != NULL)
+        node->path = malloc(len + (name ? strlen(name) + 2 : 1));
+    if(node == NULL || node->path == NULL)
+    {
+        perror("Error in newNode (malloc)");
+        exit(1);
+    }
+    
+    strcpy(node->path, dirName);
+    if(name != NULL)
+    {
+        node->path[len] = '/';
+        strcpy(node->path + len + 1, name);
+        node->nameOff = len + 1;
+    }
+    node->parent = parent;
+    node->depth = depth;
+    
+    return node;
+}
+
+/*******************************************************************************
+* Function name:  freeNode
+*                                                                             
+* Description:    Release a traversal node. Child nodes are not freed
+*                                                                             
+* Parameters:     struct DirNode* node - IMPORT - node to release
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void freeNode(struct DirNode* node)
+{
+    free(node->path);
+    free(node->out.data);
+    free(node->kids);
+    free(node->kidOffsets);
+    free(node);
+}
+
+/*******************************************************************************
+* Function name:  nodeCycle
+*                                                                             
+* Description:    Check whether a directory is the given node or one of its
+*                   parents, the test walkCycle() makes for the serial walk
+*                                                                             
+* Parameters:     struct DirNode* node - IMPORT - the directory being read
+*                 struct stat* st      - IMPORT - the subdirectory
+*                                                                             
+* Return Value:   1 if the subdirectory leads back up the tree, 0 if not
+*******************************************************************************/
+int nodeCycle(struct DirNode* node, struct stat* st)
+{
+    for(; node != NULL; node = node->parent)
+        if(node->haveId && node->dev == st->st_dev && node->ino == st->st_ino)
+            return 1;
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  sharedRelease
+*                                                                             
+* Description:    Drop one reference to a shared directory descriptor,
+*                   closing it with the last
+*                                                                             
+* Parameters:     struct SharedFd* shared - IMPORT/EXPORT - the descriptor
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void sharedRelease(struct SharedFd* shared)
+{
+    if(__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_SEQ_CST) > 0)
+        return;
+    
+    if(shared->fd != -1)
+        close(shared->fd);
+    free(shared);
+}
+
+/*******************************************************************************
+* Function name:  dequePush
+*                                                                             
+* Description:    Push a node onto the owner's end of a deque, growing it
+*                   when full
+*                                                                             
+* Parameters:     struct Deque* dq      - IMPORT/EXPORT - deque to push onto
+*                 struct DirNode* node  - IMPORT - node to push
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void dequePush(struct Deque* dq, struct DirNode* node)
+{
+    struct DirNode** items;
+    size_t i, newCap;
+    
+    pthread_mutex_lock(&dq->lock);
+    
+    if(dq->tail - dq->head == dq->cap)
+    {
+        newCap = dq->cap ? dq->cap * 2 : 64;
+        items = malloc(newCap * sizeof(struct DirNode*));
+        if(items == NULL)
+        {
+            perror("Error in dequePush (malloc)");
+            exit(1);
+        }
+        for(i = dq->head; i != dq->tail; i++)
+            items[i & (newCap - 1)] = dq->items[i & (dq->cap - 1)];
+        free(dq->items);
+        dq->items = items;
+        dq->cap = newCap;
+    }
+    
+    dq->items[dq->tail & (dq->cap - 1)] = node;
+    dq->tail++;
+    
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/*******************************************************************************
+* Function name:  dequePop
+*                                                                             
+* Description:    Take the most recently pushed node from a deque
+*                                                                             
+* Parameters:     struct Deque* dq - IMPORT/EXPORT - deque to pop from
+*                                                                             
+* Return Value:   pointer to a node or null pointer if the deque is empty
+*******************************************************************************/
+struct DirNode* dequePop(struct Deque* dq)
+{
+    struct DirNode* node = NULL;
+    
+    pthread_mutex_lock(&dq->lock);
+    if(dq->tail != dq->head)
+    {
+        dq->tail--;
+        node = dq->items[dq->tail & (dq->cap - 1)];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    
+    return node;
+}
+
+/*******************************************************************************
+* Function name:  dequeSteal
+*                                                                             
+* Description:    Take the oldest node from another worker's deque. The oldest
+*                   entries are closest to the root and so tend to carry the
+*                   largest subtrees
+*                                                                             
+* Parameters:     struct Deque* dq - IMPORT/EXPORT - deque to steal from
+*                                                                             
+* Return Value:   pointer to a node or null pointer if the deque is empty
+*******************************************************************************/
+struct DirNode* dequeSteal(struct Deque* dq)
+{
+    struct DirNode* node = NULL;
+    
+    pthread_mutex_lock(&dq->lock);
+    if(dq->tail != dq->head)
+    {
+        node = dq->items[dq->head & (dq->cap - 1)];
+        dq->head++;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    
+    return node;
+}
+
+/*******************************************************************************
+* Function name:  bufPrintf
+*                                                                             
+* Description:    printf() onto the end of an output buffer
+*                                                                             
+* Parameters:     struct OutBuf* buf - IMPORT/EXPORT - buffer to append to
+*                 const char* fmt    - IMPORT - printf format string
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void bufPrintf(struct OutBuf* buf, const char* fmt, ...)
+{
+    va_list args;
+    int n;
+    
+    for(;;)
+    {
+        va_start(args, fmt);
+        n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+        
+        if(n < 0)
+            return;
+        if(buf->len + n < buf->cap)
+            break;
+        
+        buf->cap = (buf->cap + n + 1) * 2;
+        buf->data = realloc(buf->data, buf->cap);
+        if(buf->data == NULL)
+        {
+            perror("Error in bufPrintf (realloc)");
+            exit(1);
+        }
+    }
+    
+    buf->len += n;
+}
+
+/*******************************************************************************
+* Function name:  bufReserve
+*                                                                             
+* Description:    Make room for at least n more bytes in an output buffer
+*                                                                             
+* Parameters:     struct OutBuf* buf - IMPORT/EXPORT - buffer to grow
+*                 size_t n           - IMPORT - bytes about to be appended
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void bufReserve(struct OutBuf* buf, size_t n)
+{
+    if(buf->cap - buf->len >= n)
+        return;
+    
+    buf->cap = (buf->len + n) * 2;
+    if(buf->cap < 4096)
+        buf->cap = 4096;
+    buf->data = realloc(buf->data, buf->cap);
+    if(buf->data == NULL)
+    {
+        perror("Error in bufReserve (realloc)");
+        exit(1);
+    }
+}
+
+/*******************************************************************************
+* Function name:  bufAppend
+*                                                                             
+* Description:    Copy bytes onto the end of an output buffer
+*                                                                             
+* Parameters:     struct OutBuf* buf - IMPORT/EXPORT - buffer to append to
+*                 const char* data   - IMPORT - bytes to copy
+*                 size_t n           - IMPORT - number of bytes
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void bufAppend(struct OutBuf* buf, const char* data, size_t n)
+{
+    bufReserve(buf, n);
+    memcpy(buf->data + buf->len, data, n);
+    buf->len += n;
+}
+
+/*******************************************************************************
+* Function name:  bufNumber
+*                                                                             
+* Description:    Append the decimal form of a number to an output buffer
+*                                                                             
+* Parameters:     struct OutBuf* buf - IMPORT/EXPORT - buffer to append to
+*                 long long value    - IMPORT - number to format
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void bufNumber(struct OutBuf* buf, long long value)
+{
+    char digits[24];
+    char* p = digits + sizeof(digits);
+    unsigned long long u = value < 0 ? -(unsigned long long)value : value;
+    
+    do
+    {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while(u != 0);
+    if(value < 0)
+        *--p = '-';
+    
+    bufAppend(buf, p, digits + sizeof(digits) - p);
+}
+
+/*******************************************************************************
+* Function name:  bufJsonString
+*                                                                             
+* Description:    Append a quoted JSON string made of prefix, a '/' and name,
+*                   escaping quotes, backslashes and control characters.
+*                   Other bytes are copied as they are, so names that are not
+*                   UTF-8 come out as they are stored on disk
+*                                                                             
+* Parameters:     struct OutBuf* buf - IMPORT/EXPORT - buffer to append to
+*                 char* prefix       - IMPORT - leading part, or NULL
+*                 char* name         - IMPORT - trailing part
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void bufJsonString(struct OutBuf* buf, char* prefix, char* name)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char* p;
+    char* out;
+    int part;
+    
+    bufReserve(buf, 6 * ((prefix ? strlen(prefix) + 1 : 0) + strlen(name)) 
+            + 2);
+    out = buf->data + buf->len;
+    *out++ = '"';
+    
+    for(part = prefix ? 0 : 1; part < 2; part++)
+    {
+        for(p = (unsigned char*)(part ? name : prefix); *p != '\0'; p++)
+        {
+            if(*p == '"' || *p == '\\')
+            {
+                *out++ = '\\';
+                *out++ = *p;
+            }
+            else if(*p < 0x20)
+            {
+                memcpy(out, "\\u00", 4);
+                out[4] = hex[*p >> 4];
+                out[5] = hex[*p & 15];
+                out += 6;
+            }
+            else
+                *out++ = *p;
+        }
+        if(part == 0)
+            *out++ = '/';
+    }
+    
+    *out++ = '"';
+    buf->len = out - buf->data;
+}
+
+/*******************************************************************************
+* Function name:  outFlush
+*                                                                             
+* Description:    Write everything the main thread has buffered to standard
+*                   output. Anything printed with stdio is flushed first so
+*                   the two streams stay in order
+*                                                                             
+* Parameters:     none
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void outFlush(void)
+{
+    outWrite(NULL, 0);
+}
+
+/*******************************************************************************
+* Function name:  outWrite
+*                                                                             
+* Description:    Add a block of listing output to the main thread's buffer.
+*                   A block that would overflow the buffer is written out
+*                   together with the buffer in a single writev() instead of
+*                   being copied
+*                                                                             
+* Parameters:     char* data - IMPORT - bytes to output, or NULL to flush
+*                 size_t n   - IMPORT - number of bytes
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void outWrite(char* data, size_t n)
+{
+    struct iovec iov[2];
+    struct iovec* next = iov;
+    int count = 2;
+    ssize_t done;
+    
+    if(data != NULL && outBuf.len + n <= OUT_BUF_SIZE)
+    {
+        bufAppend(&outBuf, data, n);
+        return;
+    }
+    
+    fflush(stdout);
+    
+    iov[0].iov_base = outBuf.data;
+    iov[0].iov_len = outBuf.len;
+    iov[1].iov_base = data;
+    iov[1].iov_len = data ? n : 0;
+    
+    while(count > 0)
+    {
+        done = writev(STDOUT_FILENO, next, count);
+        if(done == -1 && errno == EINTR)
+            continue;
+        if(done == -1)
+        {
+            perror("Error in outWrite (writev)");
+            exit(1);
+        }
+        
+        while(count > 0 && (size_t)done >= next->iov_len)
+        {
+            done -= next->iov_len;
+            next++;
+            count--;
+        }
+        if(count > 0)
+        {
+            next->iov_base = (char*)next->iov_base + done;
+            next->iov_len -= done;
+        }
+    }
+    
+    outBuf.len = 0;
+}
+
+/*******************************************************************************
+* Function name:  outHeader
+*                                                                             
+* Description:    Start a listing: the separator line for text, the stream
+*                   header for the binary format and nothing for JSON
+*                                                                             
+* Parameters:     char* root - IMPORT - directory being listed, "" for a file
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void outHeader(char* root)
+{
+    uint32_t rootLen = strlen(root);
+    
+    if(opts.format == FORMAT_TEXT)
+        bufAppend(&outBuf, "==========================================="
+                "================\n", 60);
+    else if(opts.format == FORMAT_BIN)
+    {
+        bufAppend(&outBuf, BIN_MAGIC, 8);
+        bufAppend(&outBuf, (char*)&rootLen, sizeof(uint32_t));
+        bufAppend(&outBuf, root, rootLen);
+    }
+}
+
+/*******************************************************************************
+* Function name:  emitEntry
+*                                                                             
+* Description:    Format one directory entry in the selected output format.
+*                   This is the only place listing lines are produced, so
+*                   every engine and mode prints the same bytes
+*                                                                             
+* Parameters:     struct OutBuf* buf - IMPORT/EXPORT - buffer to append to
+*                 char* dirPath      - IMPORT - path of the containing
+*                   directory for JSON, or NULL to use name alone
+*                 char* name         - IMPORT - entry name
+*                 int depth          - IMPORT - nesting level below the root
+*                 int kind           - IMPORT - fileOrDir() result
+*                 struct stat* st    - IMPORT - entry information; only read
+*                   for files, and not at all with -n
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void emitEntry(struct OutBuf* buf, char* dirPath, char* name, int depth, 
+        int kind, struct stat* st)
+{
+    size_t nameLen = strlen(name);
+    int withStat = kind == 1 && !opts.namesOnly;
+    long long size;
+    char* out;
+    char digits[24];
+    char* d;
+    int pad;
+    uint32_t u32;
+    int64_t i64;
+    uint16_t u16;
+    char mode[8];
+    
+    if(opts.format == FORMAT_JSON)
+    {
+        bufAppend(buf, "{\"path\":", 8);
+        bufJsonString(buf, dirPath, name);
+        bufAppend(buf, kind == 1 ? ",\"type\":\"file\",\"depth\":" :
+                kind == 2 ? ",\"type\":\"dir\",\"depth\":" : 
+                ",\"type\":\"other\",\"depth\":", 
+                kind == 1 ? 23 : kind == 2 ? 22 : 24);
+        bufNumber(buf, depth);
+        if(withStat)
+        {
+            bufAppend(buf, ",\"size\":", 8);
+            bufNumber(buf, st->st_size);
+            bufAppend(buf, ",\"atime\":", 9);
+            bufNumber(buf, st->st_atime);
+            bufAppend(buf, ",\"mtime\":", 9);
+            bufNumber(buf, st->st_mtime);
+            sprintf(mode, "%04o", (unsigned)(st->st_mode & 07777));
+            bufAppend(buf, ",\"mode\":\"", 9);
+            bufAppend(buf, mode, strlen(mode));
+            bufAppend(buf, "\",\"uid\":", 8);
+            bufNumber(buf, st->st_uid);
+            bufAppend(buf, ",\"user\":", 8);
+            bufJsonString(buf, NULL, getUserName(st->st_uid));
+        }
+        bufAppend(buf, "}\n", 2);
+    }
+    else if(opts.format == FORMAT_BIN)
+    {
+        if(nameLen > UINT16_MAX)
+            nameLen = UINT16_MAX;
+        u32 = 44 + nameLen;
+        bufAppend(buf, (char*)&u32, 4);
+        u32 = depth;
+        bufAppend(buf, (char*)&u32, 4);
+        i64 = withStat ? st->st_size : 0;
+        bufAppend(buf, (char*)&i64, 8);
+        i64 = withStat ? st->st_atime : 0;
+        bufAppend(buf, (char*)&i64, 8);
+        i64 = withStat ? st->st_mtime : 0;
+        bufAppend(buf, (char*)&i64, 8);
+        u32 = withStat ? st->st_mode : 0;
+        bufAppend(buf, (char*)&u32, 4);
+        u32 = withStat ? st->st_uid : 0;
+        bufAppend(buf, (char*)&u32, 4);
+        bufReserve(buf, 4);
+        buf->data[buf->len++] = kind;
+        buf->data[buf->len++] = withStat ? BIN_HAS_STAT : 0;
+        u16 = nameLen;
+        bufAppend(buf, (char*)&u16, 2);
+        bufAppend(buf, name, nameLen);
+    }
+    else if(kind == -1)
+    {
+        bufAppend(buf, "Error: ", 7);
+        bufAppend(buf, name, nameLen);
+        bufAppend(buf, " is not a file or directory\n", 28);
+    }
+    else
+    {
+        //indent, name, padding, size, time and newline
+        bufReserve(buf, depth * 2 + nameLen + 128);
+        out = buf->data + buf->len;
+        memset(out, ' ', depth * 2);
+        out += depth * 2;
+        memcpy(out, name, nameLen);
+        out += nameLen;
+        
+        if(kind == 2)
+            *out++ = '/';
+        if(!withStat)
+            *out++ = '\n';
+        else
+        {
+            for(pad = nameLen; pad < 20; pad++)
+                *out++ = ' ';
+            *out++ = '\t';
+            
+            size = st->st_size;
+            d = digits + sizeof(digits);
+            do
+            {
+                *--d = '0' + (size < 0 ? -(size % 10) : size % 10);
+                size /= 10;
+            } while(size != 0);
+            if(st->st_size < 0)
+                *--d = '-';
+            for(pad = digits + sizeof(digits) - d; pad < 8; pad++)
+                *out++ = ' ';
+            memcpy(out, d, digits + sizeof(digits) - d);
+            out += digits + sizeof(digits) - d;
+            
+            memcpy(out, " bytes\t", 7);
+            out += 7;
+            out += fmtTime(st->st_atime, out);
+        }
+        
+        buf->len = out - buf->data;
+    }
+    
+    if(buf == &outBuf && outBuf.len >= OUT_BUF_SIZE)
+        outFlush();
+}
+
+/*******************************************************************************
+* Function name:  fmtTime
+*                                                                             
+* Description:    Format a time exactly as ctime() does, newline included.
+*                   Local time is only worked out once per quarter hour: the
+*                   date, hour and year of each recently seen quarter hour
+*                   are cached per thread and the minutes and seconds are
+*                   added arithmetically. Zones whose offset is not a whole
+*                   number of quarter hours, and years ctime() would not
+*                   print in four digits, go through ctime_r()
+*                                                                             
+* Parameters:     time_t t  - IMPORT - time to format
+*                 char* out - EXPORT - at least 64 bytes to write into
+*                                                                             
+* Return Value:   number of characters written
+*******************************************************************************/
+int fmtTime(time_t t, char* out)
+{
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct TimeSlot* slot;
+    struct tm tm;
+    long long block;
+    time_t start;
+    int offset, min;
+    
+    if(t < 0)
+        goto fallback;
+    
+    block = t / 900;
+    slot = &timeCache[block % TIME_CACHE_SLOTS];
+    if(slot->used == 0 || slot->block != block)
+    {
+        start = block * 900;
+        slot->block = block;
+        slot->used = -1;
+        if(localtime_r(&start, &tm) != NULL && tm.tm_gmtoff % 900 == 0 &&
+                tm.tm_year + 1900 >= 1000 && tm.tm_year + 1900 <= 9999)
+        {
+            sprintf(slot->prefix, "%.3s %.3s%3d ", days + tm.tm_wday * 3, 
+                    months + tm.tm_mon * 3, tm.tm_mday);
+            slot->yearLen = sprintf(slot->year, " %d\n", tm.tm_year + 1900);
+            slot->hour = tm.tm_hour;
+            slot->min = tm.tm_min;
+            slot->used = 1;
+        }
+    }
+    if(slot->used == -1)
+        goto fallback;
+    
+    offset = t - block * 900;
+    min = slot->min + offset / 60;
+    memcpy(out, slot->prefix, 11);
+    out[11] = '0' + slot->hour / 10;
+    out[12] = '0' + slot->hour % 10;
+    out[13] = ':';
+    out[14] = '0' + min / 10;
+    out[15] = '0' + min % 10;
+    out[16] = ':';
+    out[17] = '0' + offset % 60 / 10;
+    out[18] = '0' + offset % 10;
+    memcpy(out + 19, slot->year, slot->yearLen);
+    
+    return 19 + slot->yearLen;
+    
+fallback:
+    if(ctime_r(&t, out) == NULL)
+        strcpy(out, "(null)");
+    return strlen(out);
+}
+
+/*******************************************************************************
+* Function name:  scanOpen
+*                                                                             
+* Description:    Open a directory for reading with the selected engine
+*                                                                             
+* Parameters:     struct DirScan* ds - EXPORT - scan state to initialize
+*                 int parentFd       - IMPORT - directory that name is
+*                   relative to, or AT_FDCWD
+*                 char* name         - IMPORT - directory to open, or NULL if
+*                   parentFd is the directory itself and should be adopted
+*                 char* path         - IMPORT - full path of the directory,
+*                   which the readdir engine opens when parentFd is AT_FDCWD
+*                   and stats entries by; NULL makes it stat relative to
+*                   the directory descriptor instead
+*                 int flags          - IMPORT - SCAN_PREOPEN if the caller
+*                   opens subdirectories through scanTakeFd(), SCAN_FILTER
+*                   to apply the name filters before anything is stat'ed,
+*                   SCAN_BARE if the directory will not be read through ds
+*                                                                             
+* Return Value:   0 on success
+*                -1 on failure with errno set
+*******************************************************************************/
+int scanOpen(struct DirScan* ds, int parentFd, char* name, char* path, 
+        int flags)
+{
+    ds->fd = -1;
+    ds->dir = NULL;
+    ds->path = path;
+    ds->buf = NULL;
+    ds->pos = 0;
+    ds->len = 0;
+    ds->items = NULL;
+    ds->nItems = 0;
+    ds->cur = -1;
+    ds->next = 0;
+    ds->filter = (flags & SCAN_FILTER) != 0;
+    
+    if(opts.engine == ENGINE_READDIR && parentFd == AT_FDCWD)
+    {
+        ds->dir = opendir(path);
+        if(ds->dir == NULL)
+            return -1;
+        ds->fd = dirfd(ds->dir);
+        return 0;
+    }
+    
+    if(name == NULL)
+        ds->fd = parentFd;
+    else
+        ds->fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(ds->fd == -1)
+        return -1;
+    
+    if(opts.engine == ENGINE_READDIR && scanResume(ds, ds->fd) == -1)
+    {
+        close(ds->fd);
+        ds->fd = -1;
+        return -1;
+    }
+    if(opts.engine == ENGINE_READDIR)
+        return 0;
+    
+    ds->buf = malloc(GETDENTS_BUF_SIZE);
+    if(ds->buf == NULL)
+    {
+        perror("Error in scanOpen (malloc)");
+        exit(1);
+    }
+    
+    if(opts.engine == ENGINE_URING && !(flags & SCAN_BARE))
+        uringReadAhead(ds, flags);
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  scanNext
+*                                                                             
+* Description:    Return the next entry of a directory opened by scanOpen(),
+*                   skipping the ones filterName() rejects if the scan was
+*                   opened with SCAN_FILTER
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT/EXPORT - scan state
+*                 int* type          - EXPORT - d_type of the entry
+*                                                                             
+* Return Value:   pointer to the entry name, valid until the next call, or
+*                  null pointer at the end of the directory or on error
+*******************************************************************************/
+char* scanNext(struct DirScan* ds, int* type)
+{
+    char* name;
+    
+    //entries collected by uringReadAhead() were filtered there
+    while((name = scanRead(ds, type)) != NULL && ds->filter && 
+            ds->items == NULL && !filterName(name, *type))
+        ;
+    
+    return name;
+}
+
+/*******************************************************************************
+* Function name:  scanRead
+*                                                                             
+* Description:    Return the next raw entry of a directory for scanNext()
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT/EXPORT - scan state
+*                 int* type          - EXPORT - d_type of the entry
+*                                                                             
+* Return Value:   pointer to the entry name, valid until the next call, or
+*                  null pointer at the end of the directory or on error
+*******************************************************************************/
+char* scanRead(struct DirScan* ds, int* type)
+{
+    struct dirent* directory;
+    struct LinuxDirent64* d;
+    
+    if(ds->items != NULL)
+    {
+        if(++ds->cur >= ds->nItems)
+            return NULL;
+        *type = ds->items[ds->cur].type;
+        return ds->buf + ds->items[ds->cur].nameOff;
+    }
+    
+    if(ds->dir != NULL)
+    {
+        errno = 0;
+        directory = readdir(ds->dir);
+        if(directory == NULL)
+        {
+            if(errno != 0)
+                perror("Error in scanNext (readdir)");
+            return NULL;
+        }
+        *type = directory->d_type;
+        return directory->d_name;
+    }
+    
+    if(ds->pos >= ds->len)
+    {
+        ds->len = syscall(SYS_getdents64, ds->fd, ds->buf, GETDENTS_BUF_SIZE);
+        ds->pos = 0;
+        if(ds->len <= 0)
+        {
+            if(ds->len == -1)
+                perror("Error in scanNext (getdents64)");
+            return NULL;
+        }
+    }
+    
+    d = (struct LinuxDirent64*)(ds->buf + ds->pos);
+    ds->pos += d->d_reclen;
+    ds->next = d->d_off;
+    *type = d->d_type;
+    
+    return d->d_name;
+}
+
+/*******************************************************************************
+* Function name:  scanStat
+*                                                                             
+* Description:    stat() an entry of a directory opened by scanOpen(). The
+*                   readdir engine stats the full path; the getdents engine
+*                   asks for just the fields the listing prints, relative to
+*                   the directory descriptor; the uring engine returns the
+*                   result collected by uringReadAhead()
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT - scan state
+*                 char* name         - IMPORT - entry name
+*                 struct stat* st    - EXPORT - entry information
+*                                                                             
+* Return Value:   0 on success
+*                -1 on failure with errno set
+*******************************************************************************/
+int scanStat(struct DirScan* ds, char* name, struct stat* st)
+{
+    char currPath[FILENAME_MAX];
+    struct statx stx;
+    
+    if(opts.engine == ENGINE_READDIR && ds->path == NULL)
+        return fstatat(ds->fd, name, st, 0);
+    if(opts.engine == ENGINE_READDIR)
+    {
+        //set the current path for the file/directory; paths too long
+        //for stat() are resolved relative to the directory instead
+        if(snprintf(currPath, FILENAME_MAX, "%s/%s", ds->path, name) 
+                >= FILENAME_MAX)
+            return fstatat(ds->fd, name, st, 0);
+        return stat(currPath, st);
+    }
+    
+    if(ds->items != NULL)
+    {
+        if(ds->items[ds->cur].res < 0)
+        {
+            errno = -ds->items[ds->cur].res;
+            return -1;
+        }
+        *st = ds->items[ds->cur].st;
+        return 0;
+    }
+    
+    if(statx(ds->fd, name, AT_NO_AUTOMOUNT, opts.statxMask, &stx) == -1)
+    {
+        if(errno != ENOSYS)
+            return -1;
+        return fstatat(ds->fd, name, st, 0);
+    }
+    
+    statxToStat(&stx, st);
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  entryMode
+*                                                                             
+* Description:    Classify a directory entry the way fileOrDir() does, calling
+*                   scanStat() only when it is needed. The readdir engine
+*                   always stats; the getdents engine trusts d_type for
+*                   directories and, with -n, for regular files
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT - scan state
+*                 char* name         - IMPORT - entry name
+*                 int type           - IMPORT - d_type of the entry
+*                 struct stat* st    - EXPORT - entry information, only
+*                   filled in for files when their size and time are needed
+*                                                                             
+* Return Value:   1 if a file
+*                 2 if a directory
+*                -1 if other
+*                 0 if the entry could not be stat'ed
+*******************************************************************************/
+int entryMode(struct DirScan* ds, char* name, int type, struct stat* st)
+{
+    if(opts.engine != ENGINE_READDIR && !typeNeedsStat(type))
+        return type == DT_DIR ? 2 : type == DT_REG ? 1 : -1;
+    
+    if(scanStat(ds, name, st) == -1)
+        return 0;
+    
+    return fileOrDir(st);
+}
+
+/*******************************************************************************
+* Function name:  scanClose
+*                                                                             
+* Description:    Close a directory opened by scanOpen()
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT/EXPORT - scan state
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void scanClose(struct DirScan* ds)
+{
+    long i;
+    
+    for(i = 0; i < ds->nItems; i++)
+        if(ds->items[i].fd != -1)
+            close(ds->items[i].fd);
+    free(ds->items);
+    ds->items = NULL;
+    ds->nItems = 0;
+    
+    if(ds->dir != NULL)
+        closedir(ds->dir);
+    else if(ds->fd != -1)
+        close(ds->fd);
+    free(ds->buf);
+    ds->dir = NULL;
+    ds->fd = -1;
+    ds->buf = NULL;
+}
+
+/*******************************************************************************
+* Function name:  scanSuspend
+*                                                                             
+* Description:    Release the descriptor and read buffer of a directory that
+*                   is part way through being read, keeping the position of
+*                   the next entry. Entries the uring engine has already
+*                   collected are kept, but its pre-opened subdirectories are
+*                   closed
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT/EXPORT - scan state
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void scanSuspend(struct DirScan* ds)
+{
+    long i;
+    
+    for(i = 0; i < ds->nItems; i++)
+    {
+        if(ds->items[i].fd != -1)
+            close(ds->items[i].fd);
+        ds->items[i].fd = -1;
+    }
+    
+    if(ds->dir != NULL)
+    {
+        ds->next = telldir(ds->dir);
+        closedir(ds->dir);
+    }
+    else
+        close(ds->fd);
+    
+    if(ds->items == NULL)
+    {
+        free(ds->buf);
+        ds->buf = NULL;
+        ds->pos = 0;
+        ds->len = 0;
+    }
+    ds->dir = NULL;
+    ds->fd = -1;
+}
+
+/*******************************************************************************
+* Function name:  scanResume
+*                                                                             
+* Description:    Continue reading a directory released by scanSuspend() (or
+*                   start reading one, at position 0) on a new descriptor
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT/EXPORT - scan state
+*                 int fd             - IMPORT - the directory, opened again;
+*                   the scan becomes its owner
+*                                                                             
+* Return Value:   0 on success
+*                -1 on failure with errno set
+*******************************************************************************/
+int scanResume(struct DirScan* ds, int fd)
+{
+    ds->fd = fd;
+    
+    if(ds->items != NULL)
+        return 0;
+    
+    if(opts.engine == ENGINE_READDIR)
+    {
+        ds->dir = fdopendir(fd);
+        if(ds->dir == NULL)
+            return -1;
+        if(ds->next != 0)
+            seekdir(ds->dir, ds->next);
+        return 0;
+    }
+    
+    if(lseek(fd, ds->next, SEEK_SET) == -1)
+        return -1;
+    
+    ds->buf = malloc(GETDENTS_BUF_SIZE);
+    if(ds->buf == NULL)
+    {
+        perror("Error in scanResume (malloc)");
+        exit(1);
+    }
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  typeNeedsStat
+*                                                                             
+* Description:    Decide whether an entry's d_type is enough for the listing
+*                   or whether the entry has to be stat'ed. Symbolic links
+*                   are followed, like stat() does, so they always need one.
+*                   Snapshot runs need every file stat'ed
+*                                                                             
+* Parameters:     int type - IMPORT - d_type of the entry
+*                                                                             
+* Return Value:   1 if the entry must be stat'ed
+*                 0 if d_type is enough
+*******************************************************************************/
+int typeNeedsStat(int type)
+{
+    if(type == DT_REG)
+        return !opts.namesOnly || opts.fullStat;
+    
+    return type == DT_LNK || type == DT_UNKNOWN;
+}
+
+/*******************************************************************************
+* Function name:  scanTakeFd
+*                                                                             
+* Description:    Hand over the descriptor the uring engine pre-opened for the
+*                   current entry, if any. The caller becomes its owner
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT/EXPORT - scan state
+*                                                                             
+* Return Value:   open directory descriptor, or -1 if none was pre-opened
+*******************************************************************************/
+int scanTakeFd(struct DirScan* ds)
+{
+    int fd;
+    
+    if(ds->items == NULL || ds->cur < 0 || ds->cur >= ds->nItems)
+        return -1;
+    
+    fd = ds->items[ds->cur].fd;
+    ds->items[ds->cur].fd = -1;
+    
+    return fd;
+}
+
+/*******************************************************************************
+* Function name:  statxToStat
+*                                                                             
+* Description:    Copy the fields of a statx result into a stat struct
+*                                                                             
+* Parameters:     struct statx* stx - IMPORT - statx result
+*                 struct stat* st   - EXPORT - stat struct to fill in
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void statxToStat(struct statx* stx, struct stat* st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = stx->stx_mode;
+    st->st_size = stx->stx_size;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_ino = stx->stx_ino;
+    st->st_nlink = stx->stx_nlink;
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+}
+
+/*******************************************************************************
+* Function name:  ringOpen
+*                                                                             
+* Description:    Create an io_uring instance and map its queues
+*                                                                             
+* Parameters:     unsigned entries - IMPORT - submission queue size, at most
+*                   URING_ENTRIES
+*                                                                             
+* Return Value:   pointer to the ring or null pointer if io_uring cannot be
+*                  used
+*******************************************************************************/
+struct Ring* ringOpen(unsigned entries)
+{
+    struct io_uring_params params;
+    struct Ring* ring;
+    unsigned i;
+    
+    ring = calloc(1, sizeof(struct Ring));
+    if(ring == NULL)
+        return NULL;
+    
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd == -1)
+    {
+        free(ring);
+        return NULL;
+    }
+    
+    ring->sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqLen = params.cq_off.cqes + 
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    //newer kernels map both rings with one call
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cqLen > ring->sqLen)
+            ring->sqLen = ring->cqLen;
+        ring->cqLen = 0;
+    }
+    
+    ring->sqPtr = mmap(NULL, ring->sqLen, PROT_READ | PROT_WRITE, 
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqPtr = ring->sqPtr;
+    if(ring->cqLen != 0 && ring->sqPtr != MAP_FAILED)
+        ring->cqPtr = mmap(NULL, ring->cqLen, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, 
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    
+    if(ring->sqPtr == MAP_FAILED || ring->cqPtr == MAP_FAILED || 
+            ring->sqes == MAP_FAILED)
+    {
+        if(ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqesLen);
+        if(ring->cqPtr != MAP_FAILED && ring->cqPtr != ring->sqPtr)
+            munmap(ring->cqPtr, ring->cqLen);
+        if(ring->sqPtr != MAP_FAILED)
+            munmap(ring->sqPtr, ring->sqLen);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+    
+    ring->sqHead = (unsigned*)((char*)ring->sqPtr + params.sq_off.head);
+    ring->sqTail = (unsigned*)((char*)ring->sqPtr + params.sq_off.tail);
+    ring->sqMask = (unsigned*)((char*)ring->sqPtr + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)((char*)ring->sqPtr + params.sq_off.array);
+    ring->cqHead = (unsigned*)((char*)ring->cqPtr + params.cq_off.head);
+    ring->cqTail = (unsigned*)((char*)ring->cqPtr + params.cq_off.tail);
+    ring->cqMask = (unsigned*)((char*)ring->cqPtr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cqPtr + 
+            params.cq_off.cqes);
+    
+    ring->nFree = entries < params.sq_entries ? entries : params.sq_entries;
+    for(i = 0; i < (unsigned)ring->nFree; i++)
+        ring->freeSlots[i] = i;
+    
+    return ring;
+}
+
+/*******************************************************************************
+* Function name:  ringFree
+*                                                                             
+* Description:    Unmap and close an io_uring instance
+*                                                                             
+* Parameters:     struct Ring* ring - IMPORT - ring to release, may be NULL
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void ringFree(struct Ring* ring)
+{
+    if(ring == NULL)
+        return;
+    
+    munmap(ring->sqes, ring->sqesLen);
+    if(ring->cqPtr != ring->sqPtr)
+        munmap(ring->cqPtr, ring->cqLen);
+    munmap(ring->sqPtr, ring->sqLen);
+    close(ring->fd);
+    free(ring);
+}
+
+/*******************************************************************************
+* Function name:  uringProbe
+*                                                                             
+* Description:    Check that io_uring can be set up and that the kernel
+*                   supports the statx and openat operations
+*                                                                             
+* Parameters:     none
+*                                                                             
+* Return Value:   1 if the uring engine can be used
+*                 0 if not
+*******************************************************************************/
+int uringProbe(void)
+{
+    struct Ring* ring;
+    struct io_uring_probe* probe;
+    int ok = 0;
+    
+    ring = ringOpen(8);
+    if(ring == NULL)
+        return 0;
+    
+    probe = calloc(1, sizeof(struct io_uring_probe) + 
+            256 * sizeof(struct io_uring_probe_op));
+    if(probe != NULL && 
+            syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+                probe, 256) == 0)
+    {
+        ok = probe->ops_len > IORING_OP_STATX && 
+                (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) &&
+                (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED);
+    }
+    
+    free(probe);
+    ringFree(ring);
+    
+    return ok;
+}
+
+/*******************************************************************************
+* Function name:  uringReadAhead
+*                                                                             
+* Description:    Read a whole directory with getdents64() and collect the
+*                   stat results it needs through the calling thread's
+*                   io_uring. Up to URING_ENTRIES statx operations are kept in
+*                   flight and each slot is refilled as soon as its completion
+*                   arrives. With SCAN_PREOPEN the first URING_MAX_PREOPEN
+*                   subdirectories are opened in the same batches. If no ring
+*                   can be created the directory is read synchronously
+*                                                                             
+* Parameters:     struct DirScan* ds - IMPORT/EXPORT - scan opened by
+*                   scanOpen() with the getdents buffer allocated
+*                 int flags          - IMPORT - flags given to scanOpen()
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void uringReadAhead(struct DirScan* ds, int flags)
+{
+    struct Ring* ring;
+    struct ScanItem* item;
+    struct LinuxDirent64* d;
+    struct io_uring_sqe* sqe;
+    struct io_uring_cqe* cqe;
+    char* names;
+    size_t nameLen, namesLen = 0, namesCap = GETDENTS_BUF_SIZE;
+    long n, pos, capItems = 0, next = 0, inflight = 0, preopened = 0;
+    unsigned head, tail;
+    int slot, op;
+    
+    if(threadRing == NULL)
+        threadRing = ringOpen(URING_ENTRIES);
+    ring = threadRing;
+    if(ring == NULL)
+        return;
+    
+    names = malloc(namesCap);
+    if(names == NULL)
+    {
+        perror("Error in uringReadAhead (malloc)");
+        exit(1);
+    }
+    
+    //read every entry, keeping the names in one block
+    while((n = syscall(SYS_getdents64, ds->fd, ds->buf, GETDENTS_BUF_SIZE)) > 0)
+    {
+        for(pos = 0; pos < n; pos += d->d_reclen)
+        {
+            d = (struct LinuxDirent64*)(ds->buf + pos);
+            nameLen = strlen(d->d_name) + 1;
+            
+            if((flags & SCAN_FILTER) && !filterName(d->d_name, d->d_type))
+                continue;
+            
+            if(namesLen + nameLen > namesCap)
+            {
+                namesCap *= 2;
+                names = realloc(names, namesCap);
+            }
+            if(ds->nItems == capItems)
+            {
+                capItems = capItems ? capItems * 2 : 256;
+                ds->items = realloc(ds->items, 
+                        capItems * sizeof(struct ScanItem));
+            }
+            if(names == NULL || ds->items == NULL)
+            {
+                perror("Error in uringReadAhead (realloc)");
+                exit(1);
+            }
+            
+            item = &ds->items[ds->nItems++];
+            item->nameOff = namesLen;
+            item->type = d->d_type;
+            item->res = 0;
+            item->fd = -1;
+            memcpy(names + namesLen, d->d_name, nameLen);
+            namesLen += nameLen;
+        }
+    }
+    if(n == -1)
+        perror("Error in uringReadAhead (getdents64)");
+    
+    free(ds->buf);
+    ds->buf = names;
+    
+    //an empty directory still has to read as one with no entries
+    if(ds->items == NULL)
+        ds->items = malloc(sizeof(struct ScanItem));
+    
+    while(next < ds->nItems || inflight > 0)
+    {
+        //fill every free slot
+        while(ring->nFree > 0 && next < ds->nItems)
+        {
+            item = &ds->items[next];
+            op = -1;
+            
+            if(typeNeedsStat(item->type))
+                op = IORING_OP_STATX;
+            else if((flags & SCAN_PREOPEN) && item->type == DT_DIR &&
+                    preopened < URING_MAX_PREOPEN)
+            {
+                op = IORING_OP_OPENAT;
+                preopened++;
+            }
+            
+            if(op == -1)
+            {
+                next++;
+                continue;
+            }
+            
+            slot = ring->freeSlots[--ring->nFree];
+            ring->slotItem[slot] = next;
+            
+            tail = *ring->sqTail;
+            sqe = &ring->sqes[tail & *ring->sqMask];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = op;
+            sqe->fd = ds->fd;
+            sqe->addr = (unsigned long)(names + item->nameOff);
+            sqe->user_data = slot;
+            if(op == IORING_OP_STATX)
+            {
+                sqe->len = opts.statxMask;
+                sqe->addr2 = (unsigned long)&ring->stx[slot];
+                sqe->statx_flags = AT_NO_AUTOMOUNT;
+            }
+            else
+                sqe->open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+            
+            ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+            __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+            
+            inflight++;
+            next++;
+        }
+        
+        if(inflight == 0)
+            break;
+        
+        //submit whatever the kernel has not consumed yet and wait for one
+        if(syscall(__NR_io_uring_enter, ring->fd, 
+                *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE),
+                1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && 
+                errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("Error in uringReadAhead (io_uring_enter)");
+            exit(1);
+        }
+        
+        //finish every entry that has completed
+        head = *ring->cqHead;
+        while(head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &ring->cqes[head & *ring->cqMask];
+            slot = cqe->user_data;
+            item = &ds->items[ring->slotItem[slot]];
+            
+            if(typeNeedsStat(item->type))
+            {
+                if(cqe->res < 0)
+                    item->res = cqe->res;
+                else
+                    statxToStat(&ring->stx[slot], &item->st);
+            }
+            else if(cqe->res >= 0)
+                item->fd = cqe->res;
+            
+            ring->freeSlots[ring->nFree++] = slot;
+            inflight--;
+            head++;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+/*******************************************************************************
+* Function name:  compareEngines
+*                                                                             
+* Description:    Walk a directory once with each engine, discarding the
+*                   listing, and print the wall-clock and CPU time each walk
+*                   took. An untimed walk first warms the caches so every
+*                   engine sees the same state
+*                                                                             
+* Parameters:     char* dirName - IMPORT - directory to walk
+*                 int nThreads  - IMPORT - worker threads, or -1 for the
+*                   single-threaded walk
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void compareEngines(char* dirName, int nThreads)
+{
+    int engines[3] = {ENGINE_READDIR, ENGINE_GETDENTS, ENGINE_URING};
+    char* engineNames[3] = {"readdir", "getdents", "uring"};
+    double wall[4], cpu[4];
+    int available[4];
+    int i, run, savedOut, devNull, saved = opts.engine;
+    struct timespec t0, t1;
+    struct rusage r0, r1;
+    
+    available[0] = available[1] = available[2] = 1;
+    available[3] = uringProbe();
+    
+    outFlush();
+    savedOut = dup(STDOUT_FILENO);
+    devNull = open("/dev/null", O_WRONLY);
+    if(savedOut == -1 || devNull == -1)
+    {
+        perror("Error in compareEngines (open)");
+        return;
+    }
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+    
+    //run 0 warms the caches with the readdir engine and is not reported
+    for(run = 0; run < 4; run++)
+    {
+        if(!available[run])
+            continue;
+        
+        opts.engine = engines[run ? run - 1 : 0];
+        
+        getrusage(RUSAGE_SELF, &r0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        
+        if(nThreads > 0)
+            parallelDirInfo(dirName, nThreads);
+        else
+            dirInfo(dirName);
+        outFlush();
+        
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        getrusage(RUSAGE_SELF, &r1);
+        
+        wall[run] = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        cpu[run] = (r1.ru_utime.tv_sec - r0.ru_utime.tv_sec) + 
+                (r1.ru_stime.tv_sec - r0.ru_stime.tv_sec) +
+                (r1.ru_utime.tv_usec - r0.ru_utime.tv_usec) / 1e6 +
+                (r1.ru_stime.tv_usec - r0.ru_stime.tv_usec) / 1e6;
+    }
+    
+    ringFree(threadRing);
+    threadRing = NULL;
+    
+    dup2(savedOut, STDOUT_FILENO);
+    close(savedOut);
+    opts.engine = saved;
+    
+    printf("%-10s\t%12s\t%12s\n", "Engine", "Wall (s)", "CPU (s)");
+    for(i = 0; i < 3; i++)
+    {
+        if(available[i + 1])
+            printf("%-10s\t%12.4f\t%12.4f\n", engineNames[i], wall[i + 1],
+                    cpu[i + 1]);
+        else
+            printf("%-10s\t%12s\t%12s\n", engineNames[i], "unavailable", "-");
+    }
+}
+
+/*******************************************************************************
+* Function name:  snapshotDirInfo
+*                                                                             
+* Description:    Print the directory hierarchy using the snapshot named by
+*                   -s to skip unchanged directories, then replace the
+*                   snapshot with one describing the tree as it is now
+*                                                                             
+* Parameters:     char* dirName - IMPORT - name of the directory to begin
+*                   processing
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void snapshotDirInfo(char* dirName)
+{
+    struct Snapshot old, cur;
+    struct SnapRun run;
+    struct WalkOps ops = {snapVisit, snapEnter, snapList, NULL};
+    
+    memset(&old, 0, sizeof(struct Snapshot));
+    memset(&cur, 0, sizeof(struct Snapshot));
+    
+    if(snapLoad(opts.snapshot, &old) == -1 && errno != ENOENT)
+        fprintf(stderr, "Ignoring snapshot %s: %s\n", opts.snapshot,
+                strerror(errno));
+    
+    run.old = &old;
+    run.cur = &cur;
+    walkTree(dirName, &ops, &run);
+    fflush(stdout);
+    
+    if(snapSave(opts.snapshot, &cur) == -1)
+        perror("Error in snapshotDirInfo (save)");
+    
+    if(old.map != NULL)
+        munmap(old.map, old.mapLen);
+    free(cur.dirs);
+    free(cur.entries);
+    free(cur.names);
+}
+
+/*******************************************************************************
+* Function name:  snapVisit
+*                                                                             
+* Description:    walkTree() visitor that prints each entry unless -c asked
+*                   for the changes only
+*                                                                             
+* Parameters:     void* arg       - IMPORT - the run, unused
+*                 the rest as for emitEntry()
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void snapVisit(void* arg, char* dirPath, char* name, int depth, int kind, 
+        struct stat* st)
+{
+    if(!opts.changesOnly)
+        emitEntry(&outBuf, dirPath, name, depth, kind, st);
+}
+
+/*******************************************************************************
+* Function name:  snapEnter
+*                                                                             
+* Description:    walkTree() hook that adds a directory to the new snapshot.
+*                   If the old snapshot holds the directory with the same
+*                   mtime and ctime its entries are copied from there;
+*                   otherwise the directory is read with the selected engine
+*                   and, with -c, compared against the old entries. The
+*                   entries are then handed to the walk by snapList()
+*                                                                             
+* Parameters:     void* arg                - IMPORT/EXPORT - the run
+*                 struct WalkFrame* frame  - IMPORT/EXPORT - the directory
+*                 char* path               - IMPORT - its full path
+*                 int depth                - IMPORT - nesting level, unused
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void snapEnter(void* arg, struct WalkFrame* frame, char* path, int depth)
+{
+    struct SnapRun* run = arg;
+    struct Snapshot* old = run->old;
+    struct Snapshot* cur = run->cur;
+    struct SnapDir* prev;
+    struct SnapDir* dir;
+    struct SnapEntry* e;
+    struct SnapEntry entry;
+    struct DirScan ds;
+    struct stat dirSt, st;
+    uint64_t i, first = cur->nEntries, count;
+    int modeNum, type, reused;
+    char* name;
+    
+    frame->next = frame->end = first;
+    
+    if(fstat(frame->ds.fd, &dirSt) == -1)
+    {
+        perror("Error in snapEnter (stat)");
+        return;
+    }
+    frame->dev = dirSt.st_dev;
+    frame->ino = dirSt.st_ino;
+    frame->haveId = 1;
+    
+    prev = snapFindDir(old, dirSt.st_dev, dirSt.st_ino);
+    reused = prev != NULL && 
+            prev->mtime == dirSt.st_mtim.tv_sec && 
+            prev->mtimeNsec == dirSt.st_mtim.tv_nsec &&
+            prev->ctime == dirSt.st_ctim.tv_sec && 
+            prev->ctimeNsec == dirSt.st_ctim.tv_nsec;
+    for(i = 0; reused && i < prev->count; i++)
+        if(old->entries[prev->first + i].nameOff >= old->namesLen)
+            reused = 0;
+    
+    if(reused)
+    {
+        for(i = 0; i < prev->count; i++)
+        {
+            e = &old->entries[prev->first + i];
+            snapAddEntry(cur, old->names + e->nameOff, e);
+        }
+    }
+    else
+    {
+        if(scanOpen(&ds, frame->ds.fd, ".", path, 0) == -1)
+        {
+            perror("Error in snapEnter (opendir)");
+            return;
+        }
+        
+        while((name = scanNext(&ds, &type)) != NULL)
+        {
+            if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+            
+            modeNum = entryMode(&ds, name, type, &st);
+            if(modeNum == 0)
+            {
+                perror("Error in snapEnter (stat)");
+                break;
+            }
+            
+            if(modeNum == 1)
+                statToEntry(&st, modeNum, &entry);
+            else
+                statToEntry(NULL, modeNum, &entry);
+            snapAddEntry(cur, name, &entry);
+        }
+        
+        scanClose(&ds);
+    }
+    
+    count = cur->nEntries - first;
+    
+    if(opts.changesOnly && !reused)
+        snapDiff(old, prev, cur, first, count, path);
+    
+    if(cur->nDirs == cur->capDirs)
+    {
+        cur->capDirs = cur->capDirs ? cur->capDirs * 2 : 1024;
+        cur->dirs = realloc(cur->dirs, cur->capDirs * sizeof(struct SnapDir));
+        if(cur->dirs == NULL)
+        {
+            perror("Error in snapEnter (realloc)");
+            exit(1);
+        }
+    }
+    dir = &cur->dirs[cur->nDirs++];
+    dir->dev = dirSt.st_dev;
+    dir->ino = dirSt.st_ino;
+    dir->mtime = dirSt.st_mtim.tv_sec;
+    dir->mtimeNsec = dirSt.st_mtim.tv_nsec;
+    dir->ctime = dirSt.st_ctim.tv_sec;
+    dir->ctimeNsec = dirSt.st_ctim.tv_nsec;
+    dir->first = first;
+    dir->count = count;
+    
+    frame->end = first + count;
+}
+
+/*******************************************************************************
+* Function name:  snapList
+*                                                                             
+* Description:    walkTree() hook that returns the next of the entries
+*                   snapEnter() collected for a directory. Subdirectories are
+*                   stat'ed so that their snapshot entries, and the cycle
+*                   check, see them as they are now
+*                                                                             
+* Parameters:     void* arg               - IMPORT/EXPORT - the run
+*                 struct WalkFrame* frame - IMPORT/EXPORT - the directory
+*                 int* type               - EXPORT - d_type to give the walk
+*                 int* kind               - EXPORT - fileOrDir() result
+*                 struct stat* st         - EXPORT - entry information
+*                                                                             
+* Return Value:   pointer to the entry name, valid until the next call, or
+*                  null pointer when the directory is done
+*******************************************************************************/
+char* snapList(void* arg, struct WalkFrame* frame, int* type, int* kind, 
+        struct stat* st)
+{
+    struct SnapRun* run = arg;
+    struct SnapEntry* e;
+    
+    if(frame->next >= frame->end)
+        return NULL;
+    
+    //the snapshot arrays grow while subdirectories are entered, so entries
+    //are looked up by index
+    e = &run->cur->entries[frame->next++];
+    strcpy(run->name, run->cur->names + e->nameOff);
+    *type = DT_UNKNOWN;
+    *kind = e->kind;
+    entryToStat(e, st);
+    
+    //a directory that cannot be stat'ed will not open either, and the walk
+    //reports that
+    if(e->kind == 2 && fstatat(frame->ds.fd, run->name, st, 0) == 0)
+        statToEntry(st, 2, e);
+    
+    return run->name;
+}
+
+/*******************************************************************************
+* Function name:  snapDiff
+*                                                                             
+* Description:    Print the differences between a directory's entries in the
+*                   old snapshot and the entries just read: "+" for added,
+*                   "-" for removed and "~" for files whose size or mtime
+*                   changed
+*                                                                             
+* Parameters:     struct Snapshot* old  - IMPORT - snapshot from the last run
+*                 struct SnapDir* prev  - IMPORT - the directory in old, or
+*                   NULL if it is new
+*                 struct Snapshot* cur  - IMPORT - snapshot being built
+*                 uint64_t first        - IMPORT - first new entry in cur
+*                 uint64_t count        - IMPORT - number of new entries
+*                 char* path            - IMPORT - full path of the directory
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void snapDiff(struct Snapshot* old, struct SnapDir* prev, 
+        struct Snapshot* cur, uint64_t first, uint64_t count, char* path)
+{
+    struct SnapEntry* e;
+    struct SnapEntry* o;
+    uint64_t* order;
+    char* seen;
+    char* name;
+    uint64_t i, n = prev ? prev->count : 0;
+    long lo, hi, mid;
+    int cmp;
+    
+    order = malloc((n + 1) * sizeof(uint64_t));
+    seen = calloc(n + 1, 1);
+    if(order == NULL || seen == NULL)
+    {
+        perror("Error in snapDiff (malloc)");
+        exit(1);
+    }
+    
+    //sort the old entries by name so each new entry is a binary search
+    for(i = 0; i < n; i++)
+        order[i] = prev->first + i;
+    qsort_r(order, n, sizeof(uint64_t), snapNameCompare, old);
+    
+    for(i = first; i < first + count; i++)
+    {
+        e = &cur->entries[i];
+        name = cur->names + e->nameOff;
+        
+        lo = 0;
+        hi = (long)n - 1;
+        o = NULL;
+        while(lo <= hi)
+        {
+            mid = (lo + hi) / 2;
+            cmp = strcmp(old->names + old->entries[order[mid]].nameOff, name);
+            if(cmp == 0)
+            {
+                o = &old->entries[order[mid]];
+                seen[mid] = 1;
+                break;
+            }
+            if(cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid - 1;
+        }
+        
+        if(o == NULL)
+            bufPrintf(&outBuf, "+ %s/%s%s\n", path, name, 
+                    e->kind == 2 ? "/" : "");
+        else if(o->kind != e->kind || (e->kind == 1 && 
+                (o->size != e->size || o->mtime != e->mtime)))
+            bufPrintf(&outBuf, "~ %s/%s%s\n", path, name, 
+                    e->kind == 2 ? "/" : "");
+    }
+    
+    for(i = 0; i < n; i++)
+    {
+        o = &old->entries[order[i]];
+        if(!seen[i])
+            bufPrintf(&outBuf, "- %s/%s%s\n", path, old->names + o->nameOff, 
+                    o->kind == 2 ? "/" : "");
+    }
+    
+    free(order);
+    free(seen);
+}
+
+/*******************************************************************************
+* Function name:  statToEntry
+*                                                                             
+* Description:    Fill in a snapshot entry from a stat struct
+*                                                                             
+* Parameters:     struct stat* st      - IMPORT - entry information, or NULL
+*                   if the entry was not stat'ed
+*                 int kind             - IMPORT - fileOrDir() result
+*                 struct SnapEntry* e  - EXPORT - entry to fill in; nameOff
+*                   is left alone
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void statToEntry(struct stat* st, int kind, struct SnapEntry* e)
+{
+    e->kind = kind;
+    e->dev = st ? st->st_dev : 0;
+    e->ino = st ? st->st_ino : 0;
+    e->size = st ? st->st_size : 0;
+    e->atime = st ? st->st_atime : 0;
+    e->mtime = st ? st->st_mtime : 0;
+    e->ctime = st ? st->st_ctime : 0;
+    e->mode = st ? st->st_mode : 0;
+    e->uid = st ? st->st_uid : 0;
+    e->reserved = 0;
+}
+
+/*******************************************************************************
+* Function name:  entryToStat
+*                                                                             
+* Description:    Rebuild the stat fields the listing uses from a snapshot
+*                   entry
+*                                                                             
+* Parameters:     struct SnapEntry* e  - IMPORT - entry to convert
+*                 struct stat* st      - EXPORT - stat struct to fill in
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void entryToStat(struct SnapEntry* e, struct stat* st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = e->dev;
+    st->st_ino = e->ino;
+    st->st_size = e->size;
+    st->st_atime = e->atime;
+    st->st_mtime = e->mtime;
+    st->st_ctime = e->ctime;
+    st->st_mode = e->mode;
+    st->st_uid = e->uid;
+}
+
+/*******************************************************************************
+* Function name:  snapAddEntry
+*                                                                             
+* Description:    Append an entry and its name to a snapshot being built
+*                                                                             
+* Parameters:     struct Snapshot* snap - IMPORT/EXPORT - snapshot to extend
+*                 char* name            - IMPORT - entry name
+*                 struct SnapEntry* e   - IMPORT - entry fields to copy
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void snapAddEntry(struct Snapshot* snap, char* name, struct SnapEntry* e)
+{
+    size_t len = strlen(name) + 1;
+    
+    if(snap->nEntries == snap->capEntries)
+    {
+        snap->capEntries = snap->capEntries ? snap->capEntries * 2 : 4096;
+        snap->entries = realloc(snap->entries, 
+                snap->capEntries * sizeof(struct SnapEntry));
+    }
+    while(snap->namesLen + len > snap->namesCap)
+    {
+        snap->namesCap = snap->namesCap ? snap->namesCap * 2 : 65536;
+        snap->names = realloc(snap->names, snap->namesCap);
+    }
+    if(snap->entries == NULL || snap->names == NULL)
+    {
+        perror("Error in snapAddEntry (realloc)");
+        exit(1);
+    }
+    
+    snap->entries[snap->nEntries] = *e;
+    snap->entries[snap->nEntries].nameOff = snap->namesLen;
+    snap->nEntries++;
+    memcpy(snap->names + snap->namesLen, name, len);
+    snap->namesLen += len;
+}
+
+/*******************************************************************************
+* Function name:  snapFindDir
+*                                                                             
+* Description:    Binary search a loaded snapshot for a directory
+*                                                                             
+* Parameters:     struct Snapshot* snap - IMPORT - snapshot to search
+*                 uint64_t dev          - IMPORT - device of the directory
+*                 uint64_t ino          - IMPORT - inode of the directory
+*                                                                             
+* Return Value:   pointer to the directory record or null pointer if it is
+*                  not in the snapshot
+*******************************************************************************/
+struct SnapDir* snapFindDir(struct Snapshot* snap, uint64_t dev, uint64_t ino)
+{
+    struct SnapDir* d;
+    uint64_t lo = 0, hi = snap->nDirs, mid;
+    
+    while(lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        d = &snap->dirs[mid];
+        
+        if(d->dev == dev && d->ino == ino)
+        {
+            //a damaged record is treated as missing
+            if(d->first > snap->nEntries || 
+                    d->count > snap->nEntries - d->first)
+                return NULL;
+            return d;
+        }
+        
+        if(d->dev < dev || (d->dev == dev && d->ino < ino))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    return NULL;
+}
+
+/*******************************************************************************
+* Function name:  snapDirCompare
+*                                                                             
+* Description:    qsort() comparison ordering directories by (dev, ino)
+*                                                                             
+* Parameters:     const void* a - IMPORT - first struct SnapDir
+*                 const void* b - IMPORT - second struct SnapDir
+*                                                                             
+* Return Value:   negative, zero or positive as a sorts before, with or
+*                  after b
+*******************************************************************************/
+int snapDirCompare(const void* a, const void* b)
+{
+    const struct SnapDir* x = a;
+    const struct SnapDir* y = b;
+    
+    if(x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if(x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  snapNameCompare
+*                                                                             
+* Description:    qsort_r() comparison ordering entry indices by entry name
+*                                                                             
+* Parameters:     const void* a - IMPORT - first entry index (uint64_t)
+*                 const void* b - IMPORT - second entry index (uint64_t)
+*                 void* arg     - IMPORT - the struct Snapshot holding them
+*                                                                             
+* Return Value:   negative, zero or positive as a sorts before, with or
+*                  after b
+*******************************************************************************/
+int snapNameCompare(const void* a, const void* b, void* arg)
+{
+    struct Snapshot* snap = arg;
+    
+    return strcmp(snap->names + snap->entries[*(const uint64_t*)a].nameOff,
+            snap->names + snap->entries[*(const uint64_t*)b].nameOff);
+}
+
+/*******************************************************************************
+* Function name:  snapLoad
+*                                                                             
+* Description:    Map a snapshot file and check that its header and sizes
+*                   are consistent
+*                                                                             
+* Parameters:     char* fileName        - IMPORT - snapshot file
+*                 struct Snapshot* snap - EXPORT - the mapped snapshot
+*                                                                             
+* Return Value:   0 on success
+*                -1 on failure with errno set
+*******************************************************************************/
+int snapLoad(char* fileName, struct Snapshot* snap)
+{
+    struct SnapHeader* hdr;
+    struct stat st;
+    uint64_t size;
+    void* map;
+    int fd;
+    
+    fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return -1;
+    
+    if(fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if((size_t)st.st_size < sizeof(struct SnapHeader))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+    
+    hdr = map;
+    size = st.st_size - sizeof(struct SnapHeader);
+    if(memcmp(hdr->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+            hdr->version != SNAP_VERSION ||
+            hdr->nDirs > size / sizeof(struct SnapDir) ||
+            hdr->nEntries > size / sizeof(struct SnapEntry) ||
+            hdr->nDirs * sizeof(struct SnapDir) + 
+                hdr->nEntries * sizeof(struct SnapEntry) + 
+                hdr->namesLen != size ||
+            (hdr->namesLen > 0 && 
+                ((char*)map)[st.st_size - 1] != '\0'))
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    snap->map = map;
+    snap->mapLen = st.st_size;
+    snap->nDirs = hdr->nDirs;
+    snap->nEntries = hdr->nEntries;
+    snap->namesLen = hdr->namesLen;
+    snap->dirs = (struct SnapDir*)(hdr + 1);
+    snap->entries = (struct SnapEntry*)(snap->dirs + hdr->nDirs);
+    snap->names = (char*)(snap->entries + hdr->nEntries);
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  snapSave
+*                                                                             
+* Description:    Write a snapshot to disk. The file is written under a
+*                   temporary name and renamed over the old one, so an
+*                   interrupted run leaves the previous snapshot intact
+*                                                                             
+* Parameters:     char* fileName        - IMPORT - snapshot file
+*                 struct Snapshot* snap - IMPORT/EXPORT - snapshot to write;
+*                   its directories are sorted in place
+*                                                                             
+* Return Value:   0 on success
+*                -1 on failure with errno set
+*******************************************************************************/
+int snapSave(char* fileName, struct Snapshot* snap)
+{
+    struct SnapHeader hdr;
+    FILE* file;
+    char* tmpName;
+    int ok;
+    
+    tmpName = malloc(strlen(fileName) + 5);
+    if(tmpName == NULL)
+        return -1;
+    sprintf(tmpName, "%s.tmp", fileName);
+    
+    file = fopen(tmpName, "w");
+    if(file == NULL)
+    {
+        free(tmpName);
+        return -1;
+    }
+    
+    qsort(snap->dirs, snap->nDirs, sizeof(struct SnapDir), snapDirCompare);
+    
+    memset(&hdr, 0, sizeof(struct SnapHeader));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC));
+    hdr.version = SNAP_VERSION;
+    hdr.nDirs = snap->nDirs;
+    hdr.nEntries = snap->nEntries;
+    hdr.namesLen = snap->namesLen;
+    
+    ok = fwrite(&hdr, sizeof(struct SnapHeader), 1, file) == 1 &&
+            fwrite(snap->dirs, sizeof(struct SnapDir), snap->nDirs, file) 
+                == snap->nDirs &&
+            fwrite(snap->entries, sizeof(struct SnapEntry), snap->nEntries,
+                file) == snap->nEntries &&
+            fwrite(snap->names, 1, snap->namesLen, file) == snap->namesLen;
+    
+    if(fclose(file) != 0)
+        ok = 0;
+    if(ok)
+        ok = rename(tmpName, fileName) == 0;
+    else
+        unlink(tmpName);
+    
+    free(tmpName);
+    
+    return ok ? 0 : -1;
+}
+
+/*******************************************************************************
+* Function name:  watchDirInfo
+*                                                                             
+* Description:    List a directory hierarchy once, then keep the in-memory
+*                   copy current from filesystem events, printing each change
+*                   as it is seen and the whole listing again every interval
+*                   if anything changed. Runs until interrupted
+*                                                                             
+* Parameters:     char* dirName - IMPORT - name of the directory to watch
+*                 int interval  - IMPORT - seconds between refreshes
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchDirInfo(char* dirName, int interval)
+{
+    struct Watch w;
+    struct WatchDir* dir;
+    struct pollfd fds[2];
+    struct timespec now;
+    long long nowMs, nextRefresh, windowEnd;
+    int nfds, ready;
+    
+    memset(&w, 0, sizeof(struct Watch));
+    w.inFd = -1;
+    w.rootPath = dirName;
+    w.interval = interval;
+    w.hashSize = 4096;
+    w.handleHashSize = 1024;
+    w.entryHash = calloc(w.hashSize, sizeof(struct WatchEntry*));
+    w.handleHash = calloc(w.handleHashSize, sizeof(struct WatchDir*));
+    w.eventBuf = malloc(WATCH_EVENT_BUF);
+    w.root = calloc(1, sizeof(struct WatchDir));
+    if(w.entryHash == NULL || w.handleHash == NULL || w.eventBuf == NULL ||
+            w.root == NULL)
+    {
+        perror("Error in watchDirInfo (malloc)");
+        exit(1);
+    }
+    w.root->wd = -1;
+    
+    //a filesystem-wide fanotify mark needs no per-directory watches
+    w.fanFd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | 
+            FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+    if(w.fanFd != -1 && fanotify_mark(w.fanFd, FAN_MARK_ADD | 
+            FAN_MARK_FILESYSTEM, WATCH_FAN_MASK, AT_FDCWD, dirName) == -1)
+    {
+        close(w.fanFd);
+        w.fanFd = -1;
+    }
+    
+    watchLoadDir(&w, w.root, 0);
+    
+    outHeader(dirName);
+    watchPrint(w.root, 0);
+    bufAppend(&outBuf, "==========================================="
+            "================\n", 60);
+    outFlush();
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nextRefresh = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + 
+            interval * 1000LL;
+    windowEnd = -1;
+    
+    for(;;)
+    {
+        nfds = 0;
+        if(w.fanFd != -1)
+        {
+            fds[nfds].fd = w.fanFd;
+            fds[nfds++].events = POLLIN;
+        }
+        if(w.inFd != -1)
+        {
+            fds[nfds].fd = w.inFd;
+            fds[nfds++].events = POLLIN;
+        }
+        
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        nowMs = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+        
+        //while gathering a batch, wait only until its window closes
+        if(windowEnd != -1 && windowEnd < nextRefresh)
+            ready = poll(fds, nfds, windowEnd > nowMs ? windowEnd - nowMs : 0);
+        else
+            ready = poll(fds, nfds, 
+                    nextRefresh > nowMs ? nextRefresh - nowMs : 0);
+        
+        if(ready == -1 && errno != EINTR)
+        {
+            perror("Error in watchDirInfo (poll)");
+            break;
+        }
+        if(ready > 0)
+        {
+            watchRead(&w);
+            if(windowEnd == -1)
+                windowEnd = nowMs + WATCH_COALESCE_MS;
+        }
+        
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        nowMs = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+        
+        if(windowEnd != -1 && nowMs >= windowEnd)
+        {
+            watchFlush(&w);
+            windowEnd = -1;
+        }
+        
+        if(nowMs >= nextRefresh)
+        {
+            //directories without a watch are re-read every interval
+            for(dir = w.polled; dir != NULL; dir = dir->pollNext)
+                watchResync(&w, dir, 0);
+            watchFlush(&w);
+            windowEnd = -1;
+            
+            if(w.changed)
+            {
+                outHeader(w.rootPath);
+                watchPrint(w.root, 0);
+                bufAppend(&outBuf, "========================================"
+                        "===================\n", 60);
+                w.changed = 0;
+            }
+            nextRefresh += interval * 1000LL;
+            if(nextRefresh <= nowMs)
+                nextRefresh = nowMs + interval * 1000LL;
+        }
+        
+        outFlush();
+    }
+}
+
+/*******************************************************************************
+* Function name:  watchLoadDir
+*                                                                             
+* Description:    Read a directory and everything below it into the
+*                   in-memory tree. Every directory gets its watch before it
+*                   is read so that nothing created during the read is
+*                   missed
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT/EXPORT - watch state
+*                 struct WatchDir* dir  - IMPORT/EXPORT - directory to load
+*                 int report            - IMPORT - print "+" for each entry
+*                   (a subtree that appeared while watching)
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchLoadDir(struct Watch* w, struct WatchDir* dir, int report)
+{
+    struct WatchLoad load = {w, NULL, 0, dir, report};
+    struct WalkOps ops = {watchVisit, watchEnter, NULL, NULL};
+    char* path;
+    
+    path = strdup(watchPath(w, dir, NULL));
+    if(path == NULL)
+    {
+        perror("Error in watchLoadDir (strdup)");
+        exit(1);
+    }
+    
+    walkTree(path, &ops, &load);
+    
+    free(path);
+    free(load.dirs);
+}
+
+/*******************************************************************************
+* Function name:  watchVisit
+*                                                                             
+* Description:    walkTree() visitor that adds each entry to the in-memory
+*                   tree
+*                                                                             
+* Parameters:     void* arg       - IMPORT/EXPORT - the load
+*                 the rest as for emitEntry()
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchVisit(void* arg, char* dirPath, char* name, int depth, int kind, 
+        struct stat* st)
+{
+    struct WatchLoad* load = arg;
+    struct WatchEntry* e;
+    
+    e = watchInsert(load->w, load->dirs[depth], name, kind, 
+            kind == 1 ? st : NULL);
+    if(load->report)
+        bufPrintf(&outBuf, "+ %s/%s%s\n", dirPath, name, 
+                kind == 2 ? "/" : "");
+    
+    //the walk descends into a directory right after visiting it
+    if(kind == 2)
+        load->next = e->dir;
+}
+
+/*******************************************************************************
+* Function name:  watchEnter
+*                                                                             
+* Description:    walkTree() hook that watches a directory as soon as it is
+*                   open, before any of it is read
+*                                                                             
+* Parameters:     void* arg               - IMPORT/EXPORT - the load
+*                 struct WalkFrame* frame - IMPORT - the directory
+*                 char* path              - IMPORT - its path, unused
+*                 int depth               - IMPORT - nesting level
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchEnter(void* arg, struct WalkFrame* frame, char* path, int depth)
+{
+    struct WatchLoad* load = arg;
+    
+    if(depth == load->capDirs)
+    {
+        load->capDirs = load->capDirs ? load->capDirs * 2 : 64;
+        load->dirs = realloc(load->dirs, 
+                load->capDirs * sizeof(struct WatchDir*));
+        if(load->dirs == NULL)
+        {
+            perror("Error in watchEnter (realloc)");
+            exit(1);
+        }
+    }
+    
+    load->dirs[depth] = load->next;
+    watchAddDir(load->w, load->next, frame->ds.fd);
+}
+
+/*******************************************************************************
+* Function name:  watchAddDir
+*                                                                             
+* Description:    Arrange for events in a directory to be delivered. On the
+*                   fanotify-marked filesystem the directory's file handle is
+*                   recorded; elsewhere it gets an inotify watch. If the
+*                   inotify limit has been reached the directory is polled.
+*                   The directory is named by an open descriptor, so its
+*                   path may be of any length
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT/EXPORT - watch state
+*                 struct WatchDir* dir  - IMPORT/EXPORT - directory to watch
+*                 int fd                - IMPORT - the directory, open
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchAddDir(struct Watch* w, struct WatchDir* dir, int fd)
+{
+    struct file_handle* fh;
+    unsigned long h;
+    char procPath[32];
+    int mountId, wd, newCap;
+    
+    w->nDirs++;
+    
+    if(w->fanFd != -1)
+    {
+        fh = malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+        if(fh == NULL)
+        {
+            perror("Error in watchAddDir (malloc)");
+            exit(1);
+        }
+        fh->handle_bytes = MAX_HANDLE_SZ;
+        
+        if(name_to_handle_at(fd, "", fh, &mountId, AT_EMPTY_PATH) == 0 &&
+                (dir == w->root || mountId == w->rootMount))
+        {
+            if(dir == w->root)
+                w->rootMount = mountId;
+            
+            dir->handleType = fh->handle_type;
+            dir->handleBytes = fh->handle_bytes;
+            dir->handle = malloc(fh->handle_bytes);
+            if(dir->handle == NULL)
+            {
+                perror("Error in watchAddDir (malloc)");
+                exit(1);
+            }
+            memcpy(dir->handle, fh->f_handle, fh->handle_bytes);
+            
+            h = handleHash(fh->handle_type, fh->f_handle, fh->handle_bytes) %
+                    w->handleHashSize;
+            dir->handleNext = w->handleHash[h];
+            w->handleHash[h] = dir;
+            free(fh);
+            return;
+        }
+        free(fh);
+    }
+    
+    if(w->inFd == -1)
+        w->inFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    
+    //inotify only takes a path; without /proc fall back to the full one
+    wd = -1;
+    snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+    if(w->inFd != -1)
+        wd = inotify_add_watch(w->inFd, procPath, WATCH_IN_MASK);
+    if(w->inFd != -1 && wd == -1 && errno == ENOENT)
+        wd = inotify_add_watch(w->inFd, watchPath(w, dir, NULL), 
+                WATCH_IN_MASK);
+    
+    if(wd == -1 && w->nPolled == 0 && (errno == ENOSPC || errno == ENOMEM))
+        fprintf(stderr, "inotify watch limit reached after %ld directories "
+                "(see fs.inotify.max_user_watches); polling the rest every "
+                "%d seconds\n", w->nDirs - 1, w->interval);
+    else if(wd == -1 && errno != ENOSPC && errno != ENOMEM)
+        perror("Error in watchAddDir (inotify_add_watch)");
+    
+    //a second path to an already watched directory shares its watch
+    //descriptor, so it is polled rather than stealing the first one's events
+    if(wd != -1 && wd < w->capWd && w->byWd[wd] != NULL)
+        wd = -1;
+    
+    if(wd == -1)
+    {
+        dir->polled = 1;
+        dir->pollPrev = NULL;
+        dir->pollNext = w->polled;
+        if(w->polled != NULL)
+            w->polled->pollPrev = dir;
+        w->polled = dir;
+        w->nPolled++;
+        return;
+    }
+    
+    if(wd >= w->capWd)
+    {
+        newCap = w->capWd ? w->capWd : 1024;
+        while(newCap <= wd)
+            newCap *= 2;
+        w->byWd = realloc(w->byWd, newCap * sizeof(struct WatchDir*));
+        if(w->byWd == NULL)
+        {
+            perror("Error in watchAddDir (realloc)");
+            exit(1);
+        }
+        memset(w->byWd + w->capWd, 0, 
+                (newCap - w->capWd) * sizeof(struct WatchDir*));
+        w->capWd = newCap;
+    }
+    
+    w->byWd[wd] = dir;
+    dir->wd = wd;
+}
+
+/*******************************************************************************
+* Function name:  watchInsert
+*                                                                             
+* Description:    Append an entry to a directory of the in-memory tree,
+*                   creating its WatchDir if the entry is a directory
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT/EXPORT - watch state
+*                 struct WatchDir* dir  - IMPORT/EXPORT - owning directory
+*                 char* name            - IMPORT - entry name
+*                 int kind              - IMPORT - fileOrDir() result
+*                 struct stat* st       - IMPORT - file information, or NULL
+*                                                                             
+* Return Value:   pointer to the new entry
+*******************************************************************************/
+struct WatchEntry* watchInsert(struct Watch* w, struct WatchDir* dir, 
+        char* name, int kind, struct stat* st)
+{
+    struct WatchEntry* e;
+    struct WatchEntry** table;
+    struct WatchEntry* next;
+    size_t i, h, newSize;
+    
+    //keep the hash table at most one entry per bucket on average
+    if(w->nHashed >= w->hashSize)
+    {
+        newSize = w->hashSize * 2;
+        table = calloc(newSize, sizeof(struct WatchEntry*));
+        if(table == NULL)
+        {
+            perror("Error in watchInsert (calloc)");
+            exit(1);
+        }
+        for(i = 0; i < w->hashSize; i++)
+        {
+            for(e = w->entryHash[i]; e != NULL; e = next)
+            {
+                next = e->hashNext;
+                h = watchHash(e->owner, e->name) % newSize;
+                e->hashNext = table[h];
+                table[h] = e;
+            }
+        }
+        free(w->entryHash);
+        w->entryHash = table;
+        w->hashSize = newSize;
+    }
+    
+    e = calloc(1, sizeof(struct WatchEntry));
+    if(e != NULL)
+        e->name = strdup(name);
+    if(e == NULL || e->name == NULL)
+    {
+        perror("Error in watchInsert (malloc)");
+        exit(1);
+    }
+    
+    e->owner = dir;
+    e->kind = kind;
+    if(st != NULL)
+    {
+        e->size = st->st_size;
+        e->atime = st->st_atime;
+        e->mtime = st->st_mtime;
+    }
+    
+    if(kind == 2)
+    {
+        e->dir = calloc(1, sizeof(struct WatchDir));
+        if(e->dir == NULL)
+        {
+            perror("Error in watchInsert (calloc)");
+            exit(1);
+        }
+        e->dir->parent = dir;
+        e->dir->self = e;
+        e->dir->wd = -1;
+    }
+    
+    e->prev = dir->last;
+    if(dir->last != NULL)
+        dir->last->next = e;
+    else
+        dir->first = e;
+    dir->last = e;
+    
+    h = watchHash(dir, name) % w->hashSize;
+    e->hashNext = w->entryHash[h];
+    w->entryHash[h] = e;
+    w->nHashed++;
+    
+    return e;
+}
+
+/*******************************************************************************
+* Function name:  watchRemove
+*                                                                             
+* Description:    Remove an entry from the in-memory tree. A directory's
+*                   whole subtree is removed with it, its watches dropped and
+*                   its WatchDir nodes parked until the current batch ends
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT/EXPORT - watch state
+*                 struct WatchEntry* e  - IMPORT - entry to remove
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchRemove(struct Watch* w, struct WatchEntry* e)
+{
+    struct WatchDir* dir = e->dir;
+    struct WatchDir** link;
+    struct WatchEntry** hp;
+    
+    if(dir != NULL)
+    {
+        while(dir->first != NULL)
+            watchRemove(w, dir->first);
+        
+        if(dir->wd != -1)
+        {
+            inotify_rm_watch(w->inFd, dir->wd);
+            w->byWd[dir->wd] = NULL;
+        }
+        if(dir->handle != NULL)
+        {
+            for(link = &w->handleHash[handleHash(dir->handleType, 
+                    dir->handle, dir->handleBytes) % w->handleHashSize];
+                    *link != dir; link = &(*link)->handleNext)
+                ;
+            *link = dir->handleNext;
+        }
+        if(dir->polled)
+        {
+            if(dir->pollPrev != NULL)
+                dir->pollPrev->pollNext = dir->pollNext;
+            else
+                w->polled = dir->pollNext;
+            if(dir->pollNext != NULL)
+                dir->pollNext->pollPrev = dir->pollPrev;
+            w->nPolled--;
+        }
+        
+        dir->dead = 1;
+        dir->graveNext = w->graveyard;
+        w->graveyard = dir;
+        w->nDirs--;
+    }
+    
+    for(hp = &w->entryHash[watchHash(e->owner, e->name) % w->hashSize];
+            *hp != e; hp = &(*hp)->hashNext)
+        ;
+    *hp = e->hashNext;
+    w->nHashed--;
+    
+    if(e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        e->owner->first = e->next;
+    if(e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        e->owner->last = e->prev;
+    
+    free(e->name);
+    free(e);
+}
+
+/*******************************************************************************
+* Function name:  watchFind
+*                                                                             
+* Description:    Look up an entry of the in-memory tree by directory and name
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT - watch state
+*                 struct WatchDir* dir  - IMPORT - owning directory
+*                 char* name            - IMPORT - entry name
+*                                                                             
+* Return Value:   pointer to the entry or null pointer if there is none
+*******************************************************************************/
+struct WatchEntry* watchFind(struct Watch* w, struct WatchDir* dir, char* name)
+{
+    struct WatchEntry* e;
+    
+    for(e = w->entryHash[watchHash(dir, name) % w->hashSize]; e != NULL; 
+            e = e->hashNext)
+        if(e->owner == dir && strcmp(e->name, name) == 0)
+            return e;
+    
+    return NULL;
+}
+
+/*******************************************************************************
+* Function name:  watchFindHandle
+*                                                                             
+* Description:    Look up a directory of the in-memory tree by the file handle
+*                   fanotify reported for it
+*                                                                             
+* Parameters:     struct Watch* w         - IMPORT - watch state
+*                 struct file_handle* fh  - IMPORT - handle from the event
+*                                                                             
+* Return Value:   pointer to the directory or null pointer if the handle is
+*                  not part of the watched tree
+*******************************************************************************/
+struct WatchDir* watchFindHandle(struct Watch* w, struct file_handle* fh)
+{
+    struct WatchDir* dir;
+    
+    for(dir = w->handleHash[handleHash(fh->handle_type, fh->f_handle, 
+            fh->handle_bytes) % w->handleHashSize]; dir != NULL; 
+            dir = dir->handleNext)
+        if(dir->handleType == fh->handle_type && 
+                dir->handleBytes == fh->handle_bytes &&
+                memcmp(dir->handle, fh->f_handle, fh->handle_bytes) == 0)
+            return dir;
+    
+    return NULL;
+}
+
+/*******************************************************************************
+* Function name:  watchHash
+*                                                                             
+* Description:    FNV-1a hash of an entry name mixed with its directory
+*                                                                             
+* Parameters:     struct WatchDir* dir - IMPORT - owning directory
+*                 char* name           - IMPORT - entry name
+*                                                                             
+* Return Value:   hash value
+*******************************************************************************/
+unsigned long watchHash(struct WatchDir* dir, char* name)
+{
+    unsigned long h = 14695981039346656037UL ^ (unsigned long)dir;
+    
+    while(*name != '\0')
+    {
+        h ^= (unsigned char)*name++;
+        h *= 1099511628211UL;
+    }
+    
+    return h;
+}
+
+/*******************************************************************************
+* Function name:  handleHash
+*                                                                             
+* Description:    FNV-1a hash of a file handle
+*                                                                             
+* Parameters:     int type              - IMPORT - handle type
+*                 unsigned char* bytes  - IMPORT - handle contents
+*                 unsigned int len      - IMPORT - number of bytes
+*                                                                             
+* Return Value:   hash value
+*******************************************************************************/
+unsigned long handleHash(int type, unsigned char* bytes, unsigned int len)
+{
+    unsigned long h = 14695981039346656037UL ^ (unsigned)type;
+    unsigned int i;
+    
+    for(i = 0; i < len; i++)
+    {
+        h ^= bytes[i];
+        h *= 1099511628211UL;
+    }
+    
+    return h;
+}
+
+/*******************************************************************************
+* Function name:  watchPath
+*                                                                             
+* Description:    Build the path of a directory, or of an entry within it,
+*                   from the in-memory tree
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT/EXPORT - watch state
+*                 struct WatchDir* dir  - IMPORT - directory
+*                 char* name            - IMPORT - entry name, or NULL for
+*                   the directory itself
+*                                                                             
+* Return Value:   pointer to the path, valid until the next call
+*******************************************************************************/
+char* watchPath(struct Watch* w, struct WatchDir* dir, char* name)
+{
+    struct WatchDir* d;
+    size_t len, pos;
+    
+    //measure, then fill in from the end
+    len = strlen(w->rootPath) + (name ? strlen(name) + 1 : 0);
+    for(d = dir; d->parent != NULL; d = d->parent)
+        len += strlen(d->self->name) + 1;
+    
+    if(len + 1 > w->pathCap)
+    {
+        w->pathCap = (len + 1) * 2;
+        w->pathBuf = realloc(w->pathBuf, w->pathCap);
+        if(w->pathBuf == NULL)
+        {
+            perror("Error in watchPath (realloc)");
+            exit(1);
+        }
+    }
+    
+    pos = len;
+    w->pathBuf[pos] = '\0';
+    if(name != NULL)
+    {
+        pos -= strlen(name);
+        memcpy(w->pathBuf + pos, name, strlen(name));
+        w->pathBuf[--pos] = '/';
+    }
+    for(d = dir; d->parent != NULL; d = d->parent)
+    {
+        pos -= strlen(d->self->name);
+        memcpy(w->pathBuf + pos, d->self->name, strlen(d->self->name));
+        w->pathBuf[--pos] = '/';
+    }
+    memcpy(w->pathBuf, w->rootPath, pos);
+    
+    return w->pathBuf;
+}
+
+/*******************************************************************************
+* Function name:  watchMark
+*                                                                             
+* Description:    Record that an entry needs to be checked when the current
+*                   batch of events is flushed
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT/EXPORT - watch state
+*                 struct WatchDir* dir  - IMPORT - directory of the entry
+*                 char* name            - IMPORT - entry name
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchMark(struct Watch* w, struct WatchDir* dir, char* name)
+{
+    if(w->nDirty == w->capDirty)
+    {
+        w->capDirty = w->capDirty ? w->capDirty * 2 : 256;
+        w->dirty = realloc(w->dirty, w->capDirty * sizeof(struct Dirty));
+        if(w->dirty == NULL)
+        {
+            perror("Error in watchMark (realloc)");
+            exit(1);
+        }
+    }
+    
+    w->dirty[w->nDirty].dir = dir;
+    w->dirty[w->nDirty].name = strdup(name);
+    if(w->dirty[w->nDirty].name == NULL)
+    {
+        perror("Error in watchMark (strdup)");
+        exit(1);
+    }
+    w->nDirty++;
+}
+
+/*******************************************************************************
+* Function name:  watchResync
+*                                                                             
+* Description:    Mark every entry of a directory, both those in memory and
+*                   those on disk, to be checked. Used for polled directories
+*                   and after the kernel's event queue overflowed
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT/EXPORT - watch state
+*                 struct WatchDir* dir  - IMPORT - directory to check
+*                 int recursive         - IMPORT - also check every
+*                   subdirectory
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchResync(struct Watch* w, struct WatchDir* dir, int recursive)
+{
+    struct WatchEntry* e;
+    struct DirScan ds;
+    char* name;
+    int type, fd;
+    
+    for(e = dir->first; e != NULL; e = e->next)
+    {
+        watchMark(w, dir, e->name);
+        if(recursive && e->kind == 2)
+            watchResync(w, e->dir, 1);
+    }
+    
+    fd = openPath(watchPath(w, dir, NULL), O_RDONLY | O_DIRECTORY | 
+            O_CLOEXEC);
+    if(fd == -1 || scanOpen(&ds, fd, NULL, NULL, 0) == -1)
+        return;
+    
+    while((name = scanNext(&ds, &type)) != NULL)
+        if(strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+            watchMark(w, dir, name);
+    
+    scanClose(&ds);
+}
+
+/*******************************************************************************
+* Function name:  watchRead
+*                                                                             
+* Description:    Drain the pending inotify and fanotify events, marking the
+*                   entries they name
+*                                                                             
+* Parameters:     struct Watch* w - IMPORT/EXPORT - watch state
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchRead(struct Watch* w)
+{
+    struct inotify_event* ev;
+    struct fanotify_event_metadata* meta;
+    struct fanotify_event_info_fid* info;
+    struct file_handle* fh;
+    struct WatchDir* dir;
+    char* name;
+    char* p;
+    ssize_t n;
+    
+    while(w->inFd != -1 && 
+            (n = read(w->inFd, w->eventBuf, WATCH_EVENT_BUF)) > 0)
+    {
+        for(p = w->eventBuf; p < w->eventBuf + n; 
+                p += sizeof(struct inotify_event) + ev->len)
+        {
+            ev = (struct inotify_event*)p;
+            
+            if(ev->mask & IN_Q_OVERFLOW)
+            {
+                fprintf(stderr, "Event queue overflowed, resynchronizing\n");
+                watchResync(w, w->root, 1);
+                continue;
+            }
+            if(ev->wd < 0 || ev->wd >= w->capWd || w->byWd[ev->wd] == NULL)
+                continue;
+            
+            //the kernel dropped the watch; the parent's event removes the
+            //directory itself
+            if(ev->mask & IN_IGNORED)
+            {
+                w->byWd[ev->wd]->wd = -1;
+                w->byWd[ev->wd] = NULL;
+                continue;
+            }
+            
+            if(ev->len > 0)
+                watchMark(w, w->byWd[ev->wd], ev->name);
+        }
+    }
+    
+    while(w->fanFd != -1 && 
+            (n = read(w->fanFd, w->eventBuf, WATCH_EVENT_BUF)) > 0)
+    {
+        for(meta = (struct fanotify_event_metadata*)w->eventBuf; 
+                FAN_EVENT_OK(meta, n); meta = FAN_EVENT_NEXT(meta, n))
+        {
+            if(meta->fd >= 0)
+                close(meta->fd);
+            
+            if(meta->mask & FAN_Q_OVERFLOW)
+            {
+                fprintf(stderr, "Event queue overflowed, resynchronizing\n");
+                watchResync(w, w->root, 1);
+                continue;
+            }
+            
+            info = (struct fanotify_event_info_fid*)(meta + 1);
+            if(meta->event_len < meta->metadata_len + sizeof(*info) ||
+                    info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+                continue;
+            
+            //events from outside the tree do not match any handle
+            fh = (struct file_handle*)info->handle;
+            name = (char*)fh->f_handle + fh->handle_bytes;
+            dir = watchFindHandle(w, fh);
+            if(dir != NULL && strcmp(name, ".") != 0)
+                watchMark(w, dir, name);
+        }
+    }
+}
+
+/*******************************************************************************
+* Function name:  watchFlush
+*                                                                             
+* Description:    Check each entry marked since the last flush exactly once,
+*                   then release the directories removed along the way
+*                                                                             
+* Parameters:     struct Watch* w - IMPORT/EXPORT - watch state
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchFlush(struct Watch* w)
+{
+    struct WatchDir* dir;
+    size_t i;
+    
+    qsort(w->dirty, w->nDirty, sizeof(struct Dirty), dirtyCompare);
+    
+    for(i = 0; i < w->nDirty; i++)
+    {
+        if(i == 0 || dirtyCompare(&w->dirty[i - 1], &w->dirty[i]) != 0)
+            watchReconcile(w, w->dirty[i].dir, w->dirty[i].name);
+    }
+    for(i = 0; i < w->nDirty; i++)
+        free(w->dirty[i].name);
+    w->nDirty = 0;
+    
+    while(w->graveyard != NULL)
+    {
+        dir = w->graveyard;
+        w->graveyard = dir->graveNext;
+        free(dir->handle);
+        free(dir);
+    }
+}
+
+/*******************************************************************************
+* Function name:  dirtyCompare
+*                                                                             
+* Description:    qsort() comparison grouping marked entries by directory and
+*                   name so duplicates end up next to each other
+*                                                                             
+* Parameters:     const void* a - IMPORT - first struct Dirty
+*                 const void* b - IMPORT - second struct Dirty
+*                                                                             
+* Return Value:   negative, zero or positive as a sorts before, with or
+*                  after b
+*******************************************************************************/
+int dirtyCompare(const void* a, const void* b)
+{
+    const struct Dirty* x = a;
+    const struct Dirty* y = b;
+    
+    if(x->dir != y->dir)
+        return x->dir < y->dir ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+/*******************************************************************************
+* Function name:  watchReconcile
+*                                                                             
+* Description:    stat() one entry and bring the in-memory tree in line with
+*                   it, printing "+", "-" or "~" for visible changes. Access
+*                   time changes are kept quietly for the next refresh
+*                                                                             
+* Parameters:     struct Watch* w       - IMPORT/EXPORT - watch state
+*                 struct WatchDir* dir  - IMPORT - directory of the entry
+*                 char* name            - IMPORT - entry name
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchReconcile(struct Watch* w, struct WatchDir* dir, char* name)
+{
+    struct WatchEntry* e;
+    struct stat st;
+    char* path;
+    int kind, fd, found;
+    
+    if(dir->dead)
+        return;
+    
+    //stat relative to the directory, whose path may be too long for stat()
+    fd = openPath(watchPath(w, dir, NULL), O_RDONLY | O_DIRECTORY | 
+            O_CLOEXEC);
+    found = fd != -1 && fstatat(fd, name, &st, 0) == 0;
+    if(fd != -1)
+        close(fd);
+    
+    e = watchFind(w, dir, name);
+    path = watchPath(w, dir, name);
+    
+    if(!found)
+    {
+        if(e != NULL)
+        {
+            bufPrintf(&outBuf, "- %s%s\n", path, e->kind == 2 ? "/" : "");
+            watchRemove(w, e);
+            w->changed = 1;
+        }
+        return;
+    }
+    
+    kind = fileOrDir(&st);
+    
+    if(e != NULL && e->kind != kind)
+    {
+        bufPrintf(&outBuf, "- %s%s\n", path, e->kind == 2 ? "/" : "");
+        watchRemove(w, e);
+        e = NULL;
+    }
+    
+    if(e == NULL)
+    {
+        bufPrintf(&outBuf, "+ %s%s\n", path, kind == 2 ? "/" : "");
+        e = watchInsert(w, dir, name, kind, &st);
+        if(kind == 2)
+            watchLoadDir(w, e->dir, 1);
+        w->changed = 1;
+        return;
+    }
+    
+    if(kind != 1)
+        return;
+    
+    if(e->size != st.st_size || e->mtime != st.st_mtime)
+        bufPrintf(&outBuf, "~ %s\n", path);
+    if(e->size != st.st_size || e->mtime != st.st_mtime || 
+            e->atime != st.st_atime)
+        w->changed = 1;
+    
+    e->size = st.st_size;
+    e->atime = st.st_atime;
+    e->mtime = st.st_mtime;
+}
+
+/*******************************************************************************
+* Function name:  watchPrint
+*                                                                             
+* Description:    Print the in-memory tree in the same format as dirInfo()
+*                                                                             
+* Parameters:     struct WatchDir* dir - IMPORT - directory to print
+*                 int depth            - IMPORT - nesting level below the root
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void watchPrint(struct WatchDir* dir, int depth)
+{
+    struct WatchEntry* e;
+    struct stat st;
+    
+    memset(&st, 0, sizeof(struct stat));
+    for(e = dir->first; e != NULL; e = e->next)
+    {
+        st.st_size = e->size;
+        st.st_atime = e->atime;
+        st.st_mtime = e->mtime;
+        emitEntry(&outBuf, NULL, e->name, depth, e->kind, &st);
+        if(e->kind == 2)
+            watchPrint(e->dir, depth + 1);
+    }
+}
+
+/*******************************************************************************
+* Function name:  rollupDirInfo
+*                                                                             
+* Description:    Print cumulative size, file count and access time range
+*                   for the directories of a hierarchy, followed by the
+*                   largest files and directories
+*                                                                             
+* Parameters:     char* dirName - IMPORT - name of the directory to begin
+*                   processing
+*                 int maxDepth  - IMPORT - deepest directory level to print,
+*                   -1 for all, -2 for no rollup lines
+*                 int topN      - IMPORT - number of largest files and
+*                   directories to report, 0 for none
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void rollupDirInfo(char* dirName, int maxDepth, int topN)
+{
+    struct RollupRun run;
+    struct TopHeap files, dirs;
+    struct WalkOps ops = {rollupVisit, rollupEnter, NULL, rollupLeave};
+    
+    memset(&run, 0, sizeof(struct RollupRun));
+    run.maxDepth = maxDepth;
+    run.files = &files;
+    run.dirs = &dirs;
+    files.n = dirs.n = 0;
+    files.cap = dirs.cap = topN;
+    files.items = calloc(topN + 1, sizeof(struct TopItem));
+    dirs.items = calloc(topN + 1, sizeof(struct TopItem));
+    if(files.items == NULL || dirs.items == NULL)
+    {
+        perror("Error in rollupDirInfo (calloc)");
+        exit(1);
+    }
+    
+    printf("===========================================================\n");
+    if(maxDepth != -2)
+        printf("%14s\t%10s\t%-19s\t%-19s\t%s\n", "Bytes", "Files", 
+                "Oldest access", "Newest access", "Directory");
+    
+    walkTree(dirName, &ops, &run);
+    
+    if(topN > 0)
+    {
+        topPrint(&files, "Largest files:");
+        topPrint(&dirs, "Largest directories:");
+    }
+    printf("===========================================================\n");
+    
+    free(files.items);
+    free(dirs.items);
+    free(run.sums);
+}
+
+/*******************************************************************************
+* Function name:  rollupVisit
+*                                                                             
+* Description:    walkTree() visitor that adds each file to its directory's
+*                   totals and offers it to the largest files
+*                                                                             
+* Parameters:     void* arg       - IMPORT/EXPORT - the run
+*                 the rest as for emitEntry()
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void rollupVisit(void* arg, char* dirPath, char* name, int depth, int kind, 
+        struct stat* st)
+{
+    struct RollupRun* run = arg;
+    struct Rollup* mine = &run->sums[depth];
+    
+    if(kind != 1)
+        return;
+    
+    if(mine->files == 0 || st->st_atime < mine->oldest)
+        mine->oldest = st->st_atime;
+    if(mine->files == 0 || st->st_atime > mine->newest)
+        mine->newest = st->st_atime;
+    mine->bytes += st->st_size;
+    mine->files++;
+    
+    if(topWants(run->files, st->st_size))
+        topPush(run->files, st->st_size, dirPath, name);
+}
+
+/*******************************************************************************
+* Function name:  rollupEnter
+*                                                                             
+* Description:    walkTree() hook that starts a directory's totals at zero
+*                                                                             
+* Parameters:     void* arg               - IMPORT/EXPORT - the run
+*                 struct WalkFrame* frame - IMPORT - the directory, unused
+*                 char* path              - IMPORT - its path, unused
+*                 int depth               - IMPORT - nesting level
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void rollupEnter(void* arg, struct WalkFrame* frame, char* path, int depth)
+{
+    struct RollupRun* run = arg;
+    
+    if(depth == run->capSums)
+    {
+        run->capSums = run->capSums ? run->capSums * 2 : 64;
+        run->sums = realloc(run->sums, run->capSums * sizeof(struct Rollup));
+        if(run->sums == NULL)
+        {
+            perror("Error in rollupEnter (realloc)");
+            exit(1);
+        }
+    }
+    
+    memset(&run->sums[depth], 0, sizeof(struct Rollup));
+}
+
+/*******************************************************************************
+* Function name:  rollupLeave
+*                                                                             
+* Description:    walkTree() hook that prints a directory's rollup once
+*                   everything below it has been counted and adds it to its
+*                   parent's totals
+*                                                                             
+* Parameters:     void* arg  - IMPORT/EXPORT - the run
+*                 char* path - IMPORT - path of the directory
+*                 int depth  - IMPORT - nesting level
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void rollupLeave(void* arg, char* path, int depth)
+{
+    struct RollupRun* run = arg;
+    struct Rollup* mine = &run->sums[depth];
+    struct Rollup* sum = depth > 0 ? &run->sums[depth - 1] : &run->total;
+    
+    if(run->maxDepth == -1 || depth <= run->maxDepth)
+        rollupPrint(mine, path);
+    if(topWants(run->dirs, mine->bytes))
+        topPush(run->dirs, mine->bytes, path, NULL);
+    
+    if(mine->files > 0)
+    {
+        if(sum->files == 0 || mine->oldest < sum->oldest)
+            sum->oldest = mine->oldest;
+        if(sum->files == 0 || mine->newest > sum->newest)
+            sum->newest = mine->newest;
+    }
+    sum->bytes += mine->bytes;
+    sum->files += mine->files;
+}
+
+/*******************************************************************************
+* Function name:  rollupPrint
+*                                                                             
+* Description:    Print one directory's rollup line
+*                                                                             
+* Parameters:     struct Rollup* r - IMPORT - the directory's totals
+*                 char* path       - IMPORT - path of the directory
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void rollupPrint(struct Rollup* r, char* path)
+{
+    char oldest[32], newest[32];
+    struct tm tmBuf;
+    
+    strcpy(oldest, "-");
+    strcpy(newest, "-");
+    if(r->files > 0)
+    {
+        strftime(oldest, sizeof(oldest), "%Y-%m-%d %H:%M:%S", 
+                localtime_r(&r->oldest, &tmBuf));
+        strftime(newest, sizeof(newest), "%Y-%m-%d %H:%M:%S", 
+                localtime_r(&r->newest, &tmBuf));
+    }
+    
+    printf("%14lld\t%10ld\t%-19s\t%-19s\t%s/\n", r->bytes, r->files, oldest,
+            newest, path);
+}
+
+/*******************************************************************************
+* Function name:  topWants
+*                                                                             
+* Description:    Check whether a size would enter a top-N heap, so callers
+*                   only build a path for sizes that will be kept
+*                                                                             
+* Parameters:     struct TopHeap* heap - IMPORT - heap to check
+*                 long long size       - IMPORT - candidate size
+*                                                                             
+* Return Value:   1 if the size belongs in the heap
+*                 0 if not
+*******************************************************************************/
+int topWants(struct TopHeap* heap, long long size)
+{
+    return heap->cap > 0 && (heap->n < heap->cap || size > heap->items[0].size);
+}
+
+/*******************************************************************************
+* Function name:  topPush
+*                                                                             
+* Description:    Add a size to a top-N min-heap, evicting the smallest entry
+*                   when the heap is full
+*                                                                             
+* Parameters:     struct TopHeap* heap - IMPORT/EXPORT - heap to add to
+*                 long long size       - IMPORT - size of the file/directory
+*                 char* path           - IMPORT - path, or directory path
+*                   when name is not NULL
+*                 char* name           - IMPORT - entry name within path, or
+*                   NULL
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void topPush(struct TopHeap* heap, long long size, char* path, char* name)
+{
+    struct TopItem item, tmp;
+    int i, child;
+    
+    item.size = size;
+    item.path = malloc(strlen(path) + (name ? strlen(name) + 2 : 1));
+    if(item.path == NULL)
+    {
+        perror("Error in topPush (malloc)");
+        exit(1);
+    }
+    if(name != NULL)
+        sprintf(item.path, "%s/%s", path, name);
+    else
+        strcpy(item.path, path);
+    
+    if(heap->n < heap->cap)
+    {
+        //sift up
+        i = heap->n++;
+        heap->items[i] = item;
+        while(i > 0 && heap->items[(i - 1) / 2].size > heap->items[i].size)
+        {
+            tmp = heap->items[i];
+            heap->items[i] = heap->items[(i - 1) / 2];
+            heap->items[(i - 1) / 2] = tmp;
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+    
+    //replace the smallest and sift down
+    free(heap->items[0].path);
+    heap->items[0] = item;
+    i = 0;
+    for(;;)
+    {
+        child = 2 * i + 1;
+        if(child >= heap->n)
+            break;
+        if(child + 1 < heap->n && 
+                heap->items[child + 1].size < heap->items[child].size)
+            child++;
+        if(heap->items[i].size <= heap->items[child].size)
+            break;
+        tmp = heap->items[i];
+        heap->items[i] = heap->items[child];
+        heap->items[child] = tmp;
+        i = child;
+    }
+}
+
+/*******************************************************************************
+* Function name:  topPrint
+*                                                                             
+* Description:    Print a top-N heap from largest to smallest, emptying it
+*                                                                             
+* Parameters:     struct TopHeap* heap - IMPORT/EXPORT - heap to print
+*                 char* title          - IMPORT - heading line
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void topPrint(struct TopHeap* heap, char* title)
+{
+    struct TopItem tmp;
+    int i, j;
+    
+    //the heap is small; a simple sort is enough
+    for(i = 1; i < heap->n; i++)
+    {
+        tmp = heap->items[i];
+        for(j = i; j > 0 && heap->items[j - 1].size < tmp.size; j--)
+            heap->items[j] = heap->items[j - 1];
+        heap->items[j] = tmp;
+    }
+    
+    printf("%s\n", title);
+    for(i = 0; i < heap->n; i++)
+    {
+        printf("%14lld\t%s\n", heap->items[i].size, heap->items[i].path);
+        free(heap->items[i].path);
+    }
+    heap->n = 0;
+}
+
+/*******************************************************************************
+* Function name:  dupDirInfo
+*                                                                             
+* Description:    Find regular files with identical contents below a
+*                   directory and print them in sets, largest first. The
+*                   files are narrowed down in stages so that few of them
+*                   are ever read in full: files of a unique size are
+*                   dropped, hard links to one inode count as one file, the
+*                   rest are compared by a hash of their first and last
+*                   blocks, only files that still match are hashed
+*                   completely, and files whose hashes agree are compared
+*                   byte for byte. The work is spread over a pool of threads
+*                                                                             
+* Parameters:     char* dirName - IMPORT - name of the directory to begin
+*                   processing
+*                 int threads   - IMPORT - number of hashing threads
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void dupDirInfo(char* dirName, int threads)
+{
+    struct DupFinder f;
+    struct DupFile* file;
+    struct WalkOps ops = {dupVisit, NULL, NULL, NULL};
+    size_t i, j, k, first, nGroups = 0, hashed;
+    long long wasted = 0, total = 0;
+    int link;
+    
+    memset(&f, 0, sizeof(struct DupFinder));
+    
+    walkTree(dirName, &ops, &f);
+    
+    //largest first, with the links to each inode next to each other
+    qsort(f.files, f.nFiles, sizeof(struct DupFile), dupFileCompare);
+    
+    f.cand = malloc((f.nFiles + 1) * sizeof(size_t));
+    if(f.cand == NULL)
+    {
+        perror("Error in dupDirInfo (malloc)");
+        exit(1);
+    }
+    for(i = 0; i < f.nFiles; i = j)
+    {
+        total += f.files[i].size;
+        for(j = i + 1; j < f.nFiles && f.files[j].dev == f.files[i].dev &&
+                f.files[j].ino == f.files[i].ino; j++)
+            ;
+        f.files[i].links = j - i;
+        f.cand[f.nCand++] = i;
+    }
+    
+    dupFilter(&f);
+    hashed = f.nCand;
+    dupStage(&f, 0, threads);
+    dupStage(&f, 1, threads);
+    dupStage(&f, 2, threads);
+    
+    printf("===========================================================\n");
+    for(i = 0; i < f.nCand; i = j)
+    {
+        first = f.cand[i];
+        for(j = i + 1; j < f.nCand && dupSame(&f.files[first], 
+                &f.files[f.cand[j]]); j++)
+            ;
+        
+        nGroups++;
+        wasted += f.files[first].size * (long long)(j - i - 1);
+        printf("%lld bytes x %zu (%lld bytes reclaimable)\n", 
+                f.files[first].size, j - i, 
+                f.files[first].size * (long long)(j - i - 1));
+        for(k = i; k < j; k++)
+        {
+            file = &f.files[f.cand[k]];
+            printf("    %s\n", f.paths.data + file->pathOff);
+            for(link = 1; link < file->links; link++)
+                printf("    %s (hard link)\n", 
+                        f.paths.data + file[link].pathOff);
+        }
+    }
+    printf("===========================================================\n");
+    printf("%zu duplicate sets, %lld bytes reclaimable\n", nGroups, wasted);
+    printf("%zu files (%lld bytes), %zu hashed, %lld bytes read\n", 
+            f.nFiles, total, hashed, f.bytesRead);
+    if(f.skipped > 0)
+        printf("%zu files could not be read and were skipped\n", f.skipped);
+    
+    free(f.files);
+    free(f.paths.data);
+    free(f.cand);
+}
+
+/*******************************************************************************
+* Function name:  dupVisit
+*                                                                             
+* Description:    walkTree() visitor that records every non-empty regular
+*                   file
+*                                                                             
+* Parameters:     void* arg       - IMPORT/EXPORT - the duplicate finder
+*                 the rest as for emitEntry()
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void dupVisit(void* arg, char* dirPath, char* name, int depth, int kind, 
+        struct stat* st)
+{
+    struct DupFinder* f = arg;
+    struct DupFile* file;
+    size_t dirLen = strlen(dirPath), nameLen = strlen(name);
+    
+    if(kind != 1 || st->st_size == 0)
+        return;
+    
+    if(f->nFiles == f->capFiles)
+    {
+        f->capFiles = f->capFiles ? f->capFiles * 2 : 1024;
+        f->files = realloc(f->files, f->capFiles * sizeof(struct DupFile));
+        if(f->files == NULL)
+        {
+            perror("Error in dupVisit (realloc)");
+            exit(1);
+        }
+    }
+    
+    file = &f->files[f->nFiles++];
+    file->pathOff = f->paths.len;
+    file->size = st->st_size;
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->links = 1;
+    file->failed = 0;
+    file->pair = 0;
+    file->hash[0] = file->hash[1] = 0;
+    file->set = 0;
+    
+    bufReserve(&f->paths, dirLen + nameLen + 2);
+    memcpy(f->paths.data + f->paths.len, dirPath, dirLen);
+    f->paths.data[f->paths.len + dirLen] = '/';
+    memcpy(f->paths.data + f->paths.len + dirLen + 1, name, nameLen + 1);
+    f->paths.len += dirLen + nameLen + 2;
+}
+
+/*******************************************************************************
+* Function name:  dupStage
+*                                                                             
+* Description:    Hash or compare every remaining candidate on a pool of
+*                   threads, then keep only the candidates that still have a
+*                   match
+*                                                                             
+* Parameters:     struct DupFinder* f - IMPORT/EXPORT - the duplicate finder
+*                 int stage           - IMPORT - 0 to hash the first and last
+*                   blocks, 1 to hash whole files, 2 to compare files whose
+*                   hashes match byte for byte
+*                 int threads         - IMPORT - number of threads
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void dupStage(struct DupFinder* f, int stage, int threads)
+{
+    pthread_t* ids;
+    int i, started;
+    
+    f->stage = stage;
+    f->next = 0;
+    
+    if(threads > (long)f->nCand)
+        threads = f->nCand;
+    if(threads < 1)
+        threads = 1;
+    
+    ids = malloc(threads * sizeof(pthread_t));
+    if(ids == NULL)
+    {
+        perror("Error in dupStage (malloc)");
+        exit(1);
+    }
+    
+    //the calling thread is the last worker
+    for(started = 0; started < threads - 1; started++)
+    {
+        if(pthread_create(&ids[started], NULL, dupWorker, f) != 0)
+        {
+            perror("Error in dupStage (pthread_create)");
+            break;
+        }
+    }
+    dupWorker(f);
+    for(i = 0; i < started; i++)
+        pthread_join(ids[i], NULL);
+    
+    free(ids);
+    dupFilter(f);
+}
+
+/*******************************************************************************
+* Function name:  dupWorker
+*                                                                             
+* Description:    Take candidates one at a time until all are hashed or
+*                   compared
+*                                                                             
+* Parameters:     void* arg - IMPORT/EXPORT - the duplicate finder
+*                                                                             
+* Return Value:   NULL
+*******************************************************************************/
+void* dupWorker(void* arg)
+{
+    struct DupFinder* f = arg;
+    unsigned char* buf;
+    long long bytes = 0;
+    size_t i;
+    
+    buf = malloc(DUP_READ_SIZE);
+    if(buf == NULL)
+    {
+        perror("Error in dupWorker (malloc)");
+        exit(1);
+    }
+    
+    while((i = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED)) < f->nCand)
+    {
+        if(f->stage == 2)
+            bytes += dupVerify(f, i, buf);
+        else
+            bytes += dupHashFile(f, &f->files[f->cand[i]], buf);
+    }
+    
+    __atomic_add_fetch(&f->bytesRead, bytes, __ATOMIC_RELAXED);
+    free(buf);
+    
+    return NULL;
+}
+
+/*******************************************************************************
+* Function name:  dupHashFile
+*                                                                             
+* Description:    Hash a candidate's first and last DUP_BLOCK bytes, or the
+*                   whole file. A file no larger than two blocks is hashed
+*                   whole in the first stage and left alone in the second, as
+*                   is one with a single partner left, since comparing the
+*                   two reads no more than hashing them. Whole files are
+*                   read sequentially in DUP_READ_SIZE
+*                   pieces, without updating their access time when we are
+*                   allowed to ask for that
+*                                                                             
+* Parameters:     struct DupFinder* f   - IMPORT - the duplicate finder
+*                 struct DupFile* file  - IMPORT/EXPORT - file to hash
+*                 unsigned char* buf    - IMPORT - DUP_READ_SIZE bytes of
+*                   scratch space
+*                                                                             
+* Return Value:   number of bytes read
+*******************************************************************************/
+long long dupHashFile(struct DupFinder* f, struct DupFile* file, 
+        unsigned char* buf)
+{
+    char* path = f->paths.data + file->pathOff;
+    int small = file->size <= 2 * DUP_BLOCK;
+    int full = f->stage == 1;
+    long long bytes = 0;
+    ssize_t n;
+    size_t want;
+    int fd;
+    
+    if(full && (small || file->pair))
+        return 0;
+    
+    fd = dupOpen(f, file);
+    if(fd == -1)
+        return 0;
+    
+    file->hash[0] = 0x9E3779B185EBCA87ULL;
+    file->hash[1] = 0xC2B2AE3D27D4EB4FULL;
+    
+    errno = 0;
+    if(!full)
+    {
+        //head and tail, or everything when they would overlap
+        want = small ? (size_t)file->size : DUP_BLOCK;
+        if(pread(fd, buf, want, 0) == (ssize_t)want && (small || 
+                pread(fd, buf + want, want, file->size - want) == 
+                (ssize_t)want))
+            bytes = small ? want : 2 * want;
+        hashUpdate(file->hash, buf, bytes);
+    }
+    else
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        while((n = dupRead(fd, buf, DUP_READ_SIZE)) > 0)
+        {
+            hashUpdate(file->hash, buf, n);
+            bytes += n;
+            if(n < DUP_READ_SIZE)
+                break;
+        }
+    }
+    
+    //a short read means the file changed while we were looking at it
+    if(bytes != (full || small ? file->size : 2 * DUP_BLOCK))
+    {
+        fprintf(stderr, "Error in dupHashFile (read): %s: %s\n", path, 
+                errno ? strerror(errno) : "file changed");
+        file->failed = 1;
+    }
+    hashFinish(file->hash, file->size);
+    
+    close(fd);
+    
+    return bytes;
+}
+
+/*******************************************************************************
+* Function name:  dupVerify
+*                                                                             
+* Description:    Split a run of candidates with equal size and hash into
+*                   sets of byte-identical files. Each file joins the first
+*                   set whose first member it equals, or starts a new one.
+*                   The run is handled by whichever worker takes its first
+*                   member; the others return at once
+*                                                                             
+* Parameters:     struct DupFinder* f - IMPORT/EXPORT - the duplicate finder
+*                 size_t i            - IMPORT - candidate taken
+*                 unsigned char* buf  - IMPORT - DUP_READ_SIZE bytes of
+*                   scratch space
+*                                                                             
+* Return Value:   number of bytes read
+*******************************************************************************/
+long long dupVerify(struct DupFinder* f, size_t i, unsigned char* buf)
+{
+    struct DupFile* file;
+    struct DupFile* first;
+    long long bytes = 0;
+    size_t j, k, r;
+    
+    if(i > 0 && dupSameHash(&f->files[f->cand[i - 1]], &f->files[f->cand[i]]))
+        return 0;
+    for(j = i + 1; j < f->nCand && dupSameHash(&f->files[f->cand[i]], 
+            &f->files[f->cand[j]]); j++)
+        ;
+    
+    for(k = i; k < j; k++)
+    {
+        file = &f->files[f->cand[k]];
+        file->set = f->cand[k];
+        
+        for(r = i; r < k && !file->failed; r++)
+        {
+            first = &f->files[f->cand[r]];
+            if(first->failed || first->set != f->cand[r])
+                continue;
+            if(dupEqual(f, first, file, buf, &bytes))
+            {
+                file->set = first->set;
+                break;
+            }
+        }
+    }
+    
+    return bytes;
+}
+
+/*******************************************************************************
+* Function name:  dupEqual
+*                                                                             
+* Description:    Compare two files of the same size byte for byte, reading
+*                   each into one half of the buffer. A file that cannot be
+*                   read is reported and marked failed
+*                                                                             
+* Parameters:     struct DupFinder* f  - IMPORT - the duplicate finder
+*                 struct DupFile* x    - IMPORT/EXPORT - first file
+*                 struct DupFile* y    - IMPORT/EXPORT - second file
+*                 unsigned char* buf   - IMPORT - DUP_READ_SIZE bytes of
+*                   scratch space
+*                 long long* bytes     - IMPORT/EXPORT - bytes read so far
+*                                                                             
+* Return Value:   1 if the contents are identical
+*                 0 if they differ or could not be read
+*******************************************************************************/
+int dupEqual(struct DupFinder* f, struct DupFile* x, struct DupFile* y, 
+        unsigned char* buf, long long* bytes)
+{
+    struct DupFile* bad;
+    size_t half = DUP_READ_SIZE / 2, want;
+    long long done = 0;
+    ssize_t nx, ny = 0;
+    int fx, fy, same = 1;
+    
+    fx = dupOpen(f, x);
+    if(fx == -1)
+        return 0;
+    fy = dupOpen(f, y);
+    if(fy == -1)
+    {
+        close(fx);
+        return 0;
+    }
+    posix_fadvise(fx, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fy, 0, 0, POSIX_FADV_SEQUENTIAL);
+    
+    errno = 0;
+    while(same && done < x->size)
+    {
+        want = x->size - done < (long long)half ? x->size - done : half;
+        nx = dupRead(fx, buf, want);
+        if(nx == (ssize_t)want)
+            ny = dupRead(fy, buf + half, want);
+        
+        //a short read means the file changed while we were looking at it
+        if(nx != (ssize_t)want || ny != (ssize_t)want)
+        {
+            bad = nx != (ssize_t)want ? x : y;
+            fprintf(stderr, "Error in dupEqual (read): %s: %s\n", 
+                    f->paths.data + bad->pathOff, 
+                    errno ? strerror(errno) : "file changed");
+            bad->failed = 1;
+            same = 0;
+            break;
+        }
+        
+        *bytes += 2 * want;
+        same = memcmp(buf, buf + half, want) == 0;
+        done += want;
+    }
+    
+    close(fx);
+    close(fy);
+    
+    return same;
+}
+
+/*******************************************************************************
+* Function name:  dupOpen
+*                                                                             
+* Description:    Open a candidate for reading, without updating its access
+*                   time when we are allowed to ask for that. Paths too long
+*                   for open() are opened one directory at a time. A file
+*                   that cannot be opened is reported and marked failed
+*                                                                             
+* Parameters:     struct DupFinder* f   - IMPORT - the duplicate finder
+*                 struct DupFile* file  - IMPORT/EXPORT - file to open
+*                                                                             
+* Return Value:   open descriptor, or -1 on failure
+*******************************************************************************/
+int dupOpen(struct DupFinder* f, struct DupFile* file)
+{
+    char* path = f->paths.data + file->pathOff;
+    int fd;
+    
+    fd = openPath(path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if(fd == -1 && errno == EPERM)
+        fd = openPath(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        fprintf(stderr, "Error in dupOpen: %s: %s\n", path, strerror(errno));
+        file->failed = 1;
+    }
+    
+    return fd;
+}
+
+/*******************************************************************************
+* Function name:  dupRead
+*                                                                             
+* Description:    read() until the buffer is full or the file ends
+*                                                                             
+* Parameters:     int fd             - IMPORT - file to read
+*                 unsigned char* buf - EXPORT - buffer to fill
+*                 size_t len         - IMPORT - size of the buffer
+*                                                                             
+* Return Value:   number of bytes read, -1 on error with errno set
+*******************************************************************************/
+ssize_t dupRead(int fd, unsigned char* buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+    
+    while(done < len)
+    {
+        n = read(fd, buf + done, len - done);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1)
+            return -1;
+        if(n == 0)
+            break;
+        done += n;
+    }
+    
+    return done;
+}
+
+/*******************************************************************************
+* Function name:  hashUpdate
+*                                                                             
+* Description:    Feed bytes into a 128-bit hash: two 64-bit lanes taking
+*                   alternate words, with the round of xxHash64. It is not
+*                   cryptographic, just fast and well mixed, so matches are
+*                   confirmed by dupEqual(). Every call but the last must
+*                   pass a multiple of 16 bytes
+*                                                                             
+* Parameters:     uint64_t* h               - IMPORT/EXPORT - the two lanes
+*                 const unsigned char* data - IMPORT - bytes to add
+*                 size_t len                - IMPORT - number of bytes
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void hashUpdate(uint64_t* h, const unsigned char* data, size_t len)
+{
+    unsigned char tail[16];
+    uint64_t a, b;
+    size_t i;
+    
+    for(i = 0; i < len; i += 16)
+    {
+        if(len - i < 16)
+        {
+            memset(tail, 0, 16);
+            memcpy(tail, data + i, len - i);
+            data = tail - i;
+        }
+        memcpy(&a, data + i, 8);
+        memcpy(&b, data + i + 8, 8);
+        
+        h[0] += a * 0xC2B2AE3D27D4EB4FULL;
+        h[0] = (h[0] << 31 | h[0] >> 33) * 0x9E3779B185EBCA87ULL;
+        h[1] += b * 0xC2B2AE3D27D4EB4FULL;
+        h[1] = (h[1] << 31 | h[1] >> 33) * 0x9E3779B185EBCA87ULL;
+    }
+}
+
+/*******************************************************************************
+* Function name:  hashFinish
+*                                                                             
+* Description:    Mix the length and the two lanes of a hash together
+*                                                                             
+* Parameters:     uint64_t* h     - IMPORT/EXPORT - the two lanes
+*                 long long len   - IMPORT - number of bytes hashed
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void hashFinish(uint64_t* h, long long len)
+{
+    int i;
+    
+    h[0] ^= len;
+    h[1] ^= h[0];
+    h[0] += h[1];
+    for(i = 0; i < 2; i++)
+    {
+        h[i] ^= h[i] >> 33;
+        h[i] *= 0xC2B2AE3D27D4EB4FULL;
+        h[i] ^= h[i] >> 29;
+        h[i] *= 0x165667B19E3779F9ULL;
+        h[i] ^= h[i] >> 32;
+    }
+}
+
+/*******************************************************************************
+* Function name:  dupFilter
+*                                                                             
+* Description:    Drop candidates that failed to read, sort the rest by size,
+*                   hash and byte-identical set and keep only those with at
+*                   least one equal partner
+*                                                                             
+* Parameters:     struct DupFinder* f - IMPORT/EXPORT - the duplicate finder
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void dupFilter(struct DupFinder* f)
+{
+    size_t i, j, k, kept = 0;
+    
+    for(i = 0; i < f->nCand; i++)
+    {
+        if(!f->files[f->cand[i]].failed)
+            f->cand[kept++] = f->cand[i];
+        else
+            f->skipped++;
+    }
+    
+    qsort_r(f->cand, kept, sizeof(size_t), dupCandCompare, f->files);
+    
+    f->nCand = 0;
+    for(i = 0; i < kept; i = j)
+    {
+        for(j = i + 1; j < kept && dupSame(&f->files[f->cand[i]], 
+                &f->files[f->cand[j]]); j++)
+            ;
+        if(j - i == 1)
+            continue;
+        for(k = i; k < j; k++)
+        {
+            f->files[f->cand[k]].pair = j - i == 2;
+            f->cand[f->nCand++] = f->cand[k];
+        }
+    }
+}
+
+/*******************************************************************************
+* Function name:  dupFileCompare
+*                                                                             
+* Description:    qsort() comparison of files: larger first, then by device
+*                   and inode, then in the order they were found
+*                                                                             
+* Parameters:     const void* a - IMPORT - first file
+*                 const void* b - IMPORT - second file
+*                                                                             
+* Return Value:   negative, zero or positive as a sorts before, with or
+*                  after b
+*******************************************************************************/
+int dupFileCompare(const void* a, const void* b)
+{
+    const struct DupFile* x = a;
+    const struct DupFile* y = b;
+    
+    if(x->size != y->size)
+        return x->size > y->size ? -1 : 1;
+    if(x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if(x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return x->pathOff < y->pathOff ? -1 : x->pathOff > y->pathOff;
+}
+
+/*******************************************************************************
+* Function name:  dupCandCompare
+*                                                                             
+* Description:    qsort_r() comparison of candidate indices: larger first,
+*                   then by hash and set, and in file order within a set
+*                                                                             
+* Parameters:     const void* a - IMPORT - first candidate index
+*                 const void* b - IMPORT - second candidate index
+*                 void* arg     - IMPORT - the files array
+*                                                                             
+* Return Value:   negative, zero or positive as a sorts before, with or
+*                  after b
+*******************************************************************************/
+int dupCandCompare(const void* a, const void* b, void* arg)
+{
+    const struct DupFile* files = arg;
+    const struct DupFile* x = &files[*(const size_t*)a];
+    const struct DupFile* y = &files[*(const size_t*)b];
+    
+    if(x->size != y->size)
+        return x->size > y->size ? -1 : 1;
+    if(x->hash[0] != y->hash[0])
+        return x->hash[0] < y->hash[0] ? -1 : 1;
+    if(x->hash[1] != y->hash[1])
+        return x->hash[1] < y->hash[1] ? -1 : 1;
+    if(x->set != y->set)
+        return x->set < y->set ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+/*******************************************************************************
+* Function name:  dupSame
+*                                                                             
+* Description:    Check whether two candidates still look identical
+*                                                                             
+* Parameters:     struct DupFile* x - IMPORT - first file
+*                 struct DupFile* y - IMPORT - second file
+*                                                                             
+* Return Value:   1 if size, hash and set match, 0 if not
+*******************************************************************************/
+int dupSame(struct DupFile* x, struct DupFile* y)
+{
+    return dupSameHash(x, y) && x->set == y->set;
+}
+
+/*******************************************************************************
+* Function name:  dupSameHash
+*                                                                             
+* Description:    Check whether two candidates have the same size and hash,
+*                   whatever their comparison found
+*                                                                             
+* Parameters:     struct DupFile* x - IMPORT - first file
+*                 struct DupFile* y - IMPORT - second file
+*                                                                             
+* Return Value:   1 if size and hash match, 0 if not
+*******************************************************************************/
+int dupSameHash(struct DupFile* x, struct DupFile* y)
+{
+    return x->size == y->size && x->hash[0] == y->hash[0] && 
+            x->hash[1] == y->hash[1];
 }
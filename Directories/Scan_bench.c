@@ -0,0 +1,1086 @@
+/*******************************************************************************
+* Date:        October 17, 2026
+* File:        Scan_bench.c
+* Purpose:     This program measures the throughput of File_dir_info on
+*               synthetic directory trees. A tree is generated under each
+*               given directory (by default /dev/shm, normally a tmpfs, and
+*               the current directory, normally on disk), File_dir_info is
+*               run against it once for every variant of its options, and
+*               one line of results is printed per tree and variant:
+*                   tag, file system type and base directory
+*                   tree shape and number of entries
+*                   variant (the options passed to File_dir_info)
+*                   median and fastest wall-clock time
+*                   user and system CPU time of the median run
+*                   entries listed per second
+*                   system calls per entry
+*                   peak resident set size
+*
+*               Usage: Scan_bench [-p program] [-d depth] [-f fanout]
+*                                 [-n files] [-l length] [-s bytes]
+*                                 [-r runs] [-v options]... [-t tag]
+*                                 [-o csv|json] [-k] [directory...]
+*
+*               -p names the File_dir_info binary (./File_dir_info).
+*               -d, -f, -n and -l shape the tree: every directory down to
+*               the given depth (4) holds fanout subdirectories (4) and the
+*               given number of files (32), and every name is the given
+*               number of characters long (12). -s gives each file that
+*               many bytes (0). Names are drawn from a fixed seed, so the
+*               same options always build the same tree.
+*               -r sets the number of timed runs per variant (5); an untimed
+*               run before them warms the caches, so the figures describe a
+*               tree whose metadata is in memory.
+*               -v replaces the default variants with the given option
+*               strings, one -v per variant. The defaults are each engine on
+*               its own, the getdents engine with -n, and the getdents and
+*               uring engines with -j 0.
+*               -t labels every result line, so results from different
+*               builds can be kept in one file and compared.
+*               -o selects CSV with a header line (the default) or one JSON
+*               object per line.
+*               -k keeps the generated trees instead of removing them.
+*
+*               Wall-clock time runs from the exec of File_dir_info to its
+*               exit, with the listing sent to /dev/null. CPU time and peak
+*               RSS come from wait4() and include every thread. System calls
+*               are counted by a raw_syscalls:sys_enter perf event when
+*               tracefs is mounted and perf events are permitted, and by
+*               tracing a separate run with ptrace otherwise. The count for
+*               an empty directory is subtracted first, so the figure
+*               excludes process start-up. An empty field means no method
+*               was available.
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <ftw.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <sys/ptrace.h>
+#include <sys/vfs.h>
+#include <linux/perf_event.h>
+#include <linux/magic.h>
+
+#define DEFAULT_PROGRAM		"./File_dir_info"
+#define DEFAULT_DEPTH		4
+#define DEFAULT_FANOUT		4
+#define DEFAULT_FILES		32
+#define DEFAULT_NAME_LEN	12
+#define DEFAULT_RUNS		5
+#define MAX_RUNS			100
+#define MAX_VARIANT_ARGS	32
+#define NAME_SEED			0x5ca9b3e1u
+
+#define FORMAT_CSV			0
+#define FORMAT_JSON			1
+
+#define COUNT_NONE			0		//no way to count system calls
+#define COUNT_PERF			1		//raw_syscalls:sys_enter perf event
+#define COUNT_PTRACE		2		//PTRACE_SYSCALL on a separate run
+
+#define SYS_ENTER_ID_PATH	"events/raw_syscalls/sys_enter/id"
+
+//settings chosen on the command line
+struct Bench
+{
+	char* program;
+	int depth;
+	int fanout;
+	int files;
+	int nameLen;
+	long fileSize;
+	int runs;
+	char* tag;
+	int format;
+	int keep;
+	int countMethod;
+	long long sysEnterId;		//tracepoint id for COUNT_PERF
+};
+
+//a set of File_dir_info options
+struct Variant
+{
+	char* text;					//as given, for the report
+	char* argv[MAX_VARIANT_ARGS + 3];
+	int argc;
+};
+
+//a generated tree
+struct Tree
+{
+	char* base;
+	char* root;
+	char* empty;				//empty directory for the start-up baseline
+	char fsType[16];
+	long long dirs;				//root not included
+	long long files;
+};
+
+//what one run of File_dir_info cost
+struct RunResult
+{
+	int ok;
+	double wall;
+	double user;
+	double sys;
+	long maxRss;				//kilobytes
+	long long syscalls;			//-1 when not counted
+};
+
+static struct Bench bench;
+static uint32_t nameState;
+
+void usage(char*);
+int parseVariant(char*, struct Variant*);
+int buildTree(char*, struct Tree*);
+int fillDir(int, int, char*);
+void makeName(char*, long, char);
+uint32_t nextRandom(void);
+int removeEntry(const char*, const struct stat*, int, struct FTW*);
+void removeTree(char*);
+void fsName(char*, char*, size_t);
+int countProbe(long long*);
+int runOnce(struct Variant*, char*, int, struct RunResult*);
+long long countPtrace(struct Variant*, char*);
+long long countSyscalls(struct Variant*, char*);
+void benchTree(struct Tree*, struct Variant*, int);
+int compareDouble(const void*, const void*);
+void printHeader(void);
+void printResult(struct Tree*, struct Variant*, struct RunResult*, double,
+		long, long long);
+void printJsonString(char*);
+
+int main(int argc, char** argv)
+{
+	char* defaults[] = {"-e readdir", "-e getdents", "-e uring",
+			"-e getdents -n", "-e getdents -j 0", "-e uring -j 0"};
+	char* defaultDirs[] = {"/dev/shm", "."};
+	struct Variant* variants;
+	struct Tree tree;
+	int nVariants = 0, nDefaults = sizeof(defaults) / sizeof(defaults[0]);
+	int opt, i, bad = 0;
+	char* end;
+
+	bench.program = DEFAULT_PROGRAM;
+	bench.depth = DEFAULT_DEPTH;
+	bench.fanout = DEFAULT_FANOUT;
+	bench.files = DEFAULT_FILES;
+	bench.nameLen = DEFAULT_NAME_LEN;
+	bench.fileSize = 0;
+	bench.runs = DEFAULT_RUNS;
+	bench.tag = "";
+	bench.format = FORMAT_CSV;
+	bench.keep = 0;
+
+	variants = malloc(sizeof(struct Variant) * (argc + nDefaults));
+	if(variants == NULL)
+	{
+		perror("Error in main (malloc)");
+		return 1;
+	}
+
+	while((opt = getopt(argc, argv, "p:d:f:n:l:s:r:v:t:o:k")) != -1)
+	{
+		long value = 0;
+
+		if(strchr("dfnlsr", opt) != NULL)
+		{
+			value = strtol(optarg, &end, 10);
+			if(*end != '\0' || value < 0 || value > 1000000)
+				bad = 1;
+		}
+
+		if(opt == 'p')
+			bench.program = optarg;
+		else if(opt == 'd')
+			bench.depth = value;
+		else if(opt == 'f')
+			bench.fanout = value;
+		else if(opt == 'n')
+			bench.files = value;
+		else if(opt == 'l')
+			bench.nameLen = value;
+		else if(opt == 's')
+			bench.fileSize = value;
+		else if(opt == 'r')
+			bench.runs = value;
+		else if(opt == 'v')
+		{
+			if(parseVariant(optarg, &variants[nVariants++]) == -1)
+				bad = 1;
+		}
+		else if(opt == 't')
+			bench.tag = optarg;
+		else if(opt == 'o' && strcmp(optarg, "csv") == 0)
+			bench.format = FORMAT_CSV;
+		else if(opt == 'o' && strcmp(optarg, "json") == 0)
+			bench.format = FORMAT_JSON;
+		else if(opt == 'k')
+			bench.keep = 1;
+		else
+			bad = 1;
+	}
+
+	if(bad || bench.runs < 1 || bench.runs > MAX_RUNS || bench.nameLen < 1 ||
+			bench.nameLen > NAME_MAX)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(access(bench.program, X_OK) == -1)
+	{
+		fprintf(stderr, "Error in main: cannot run %s: %s\n", bench.program,
+				strerror(errno));
+		return 1;
+	}
+
+	if(nVariants == 0)
+	{
+		for(i = 0; i < nDefaults; i++)
+			parseVariant(defaults[i], &variants[nVariants++]);
+	}
+
+	bench.countMethod = countProbe(&bench.sysEnterId);
+
+	printHeader();
+
+	if(optind == argc)
+	{
+		argv = defaultDirs;
+		argc = sizeof(defaultDirs) / sizeof(defaultDirs[0]);
+		optind = 0;
+	}
+
+	for(i = optind; i < argc; i++)
+	{
+		if(buildTree(argv[i], &tree) == -1)
+			continue;
+
+		benchTree(&tree, variants, nVariants);
+
+		if(bench.keep)
+			fprintf(stderr, "Kept %s\n", tree.root);
+		else
+			removeTree(tree.root);
+
+		free(tree.root);
+		free(tree.empty);
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  usage
+*
+* Description:    Prints the command line syntax
+*
+* Parameters:     char* name - IMPORT - name the program was run as
+*
+* Return Value:   none
+*******************************************************************************/
+void usage(char* name)
+{
+	printf("Usage: %s [-p program] [-d depth] [-f fanout] [-n files] "
+			"[-l length] [-s bytes] [-r runs] [-v options]... [-t tag] "
+			"[-o csv|json] [-k] [directory...]\n", name);
+}
+
+/*******************************************************************************
+* Function name:  parseVariant
+*
+* Description:    Splits a string of File_dir_info options on white space
+*                  into the argument vector of a variant. The program name
+*                  goes first and a slot is left for the directory
+*
+* Parameters:     char* text               - IMPORT - options, e.g. "-e uring"
+*                 struct Variant* variant  - EXPORT - the argument vector
+*
+* Return Value:   0 on success, -1 if there are too many options
+*******************************************************************************/
+int parseVariant(char* text, struct Variant* variant)
+{
+	char* copy = strdup(text);
+	char* save;
+	char* word;
+
+	if(copy == NULL)
+		return -1;
+
+	variant->text = text;
+	variant->argc = 0;
+	variant->argv[variant->argc++] = bench.program;
+
+	for(word = strtok_r(copy, " \t", &save); word != NULL;
+			word = strtok_r(NULL, " \t", &save))
+	{
+		if(variant->argc > MAX_VARIANT_ARGS)
+			return -1;
+		variant->argv[variant->argc++] = word;
+	}
+
+	variant->argv[variant->argc + 1] = NULL;
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  buildTree
+*
+* Description:    Creates a tree of the configured shape in a new directory
+*                  under base, and an empty directory beside it
+*
+* Parameters:     char* base         - IMPORT - where to create the tree
+*                 struct Tree* tree  - EXPORT - where it was created and what
+*                   it holds
+*
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int buildTree(char* base, struct Tree* tree)
+{
+	long long level, dirsAtLevel = 1;
+	int fd;
+
+	tree->base = base;
+	fsName(base, tree->fsType, sizeof(tree->fsType));
+
+	if(asprintf(&tree->root, "%s/scan_bench.%d", base, (int)getpid()) == -1)
+		return -1;
+	if(asprintf(&tree->empty, "%s/scan_bench.%d.empty", base,
+			(int)getpid()) == -1)
+	{
+		free(tree->root);
+		return -1;
+	}
+
+	tree->dirs = 0;
+	for(level = 1; level <= bench.depth; level++)
+	{
+		dirsAtLevel *= bench.fanout;
+		tree->dirs += dirsAtLevel;
+	}
+	tree->files = (tree->dirs + 1) * bench.files;
+
+	fprintf(stderr, "Building %s (%s): %lld directories, %lld files\n",
+			tree->root, tree->fsType, tree->dirs, tree->files);
+
+	if(mkdir(tree->root, 0755) == -1 || mkdir(tree->empty, 0755) == -1)
+	{
+		fprintf(stderr, "Error in buildTree: %s: %s\n", base, strerror(errno));
+		removeTree(tree->root);
+		free(tree->root);
+		free(tree->empty);
+		return -1;
+	}
+
+	nameState = NAME_SEED;
+
+	fd = open(tree->root, O_RDONLY | O_DIRECTORY);
+	if(fd == -1 || fillDir(fd, 0, NULL) == -1)
+	{
+		perror("Error in buildTree");
+		if(fd != -1)
+			close(fd);
+		removeTree(tree->root);
+		free(tree->root);
+		free(tree->empty);
+		return -1;
+	}
+
+	close(fd);
+	sync();
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  fillDir
+*
+* Description:    Creates the files of one directory and, above the last
+*                  level, its subdirectories and their contents
+*
+* Parameters:     int dirFd     - IMPORT - the directory, closed by the caller
+*                 int level     - IMPORT - depth of the directory, 0 for the
+*                   root
+*                 char* content - IMPORT - bytes written to each file, NULL
+*                   to allocate them here
+*
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int fillDir(int dirFd, int level, char* content)
+{
+	char name[NAME_MAX + 1];
+	int i, fd, rc = 0, owned = 0;
+
+	if(content == NULL && bench.fileSize > 0)
+	{
+		content = malloc(bench.fileSize);
+		if(content == NULL)
+			return -1;
+		memset(content, 'x', bench.fileSize);
+		owned = 1;
+	}
+
+	for(i = 0; i < bench.files && rc == 0; i++)
+	{
+		makeName(name, i, 'f');
+
+		fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if(fd == -1)
+			rc = -1;
+		else
+		{
+			if(bench.fileSize > 0 &&
+					write(fd, content, bench.fileSize) != bench.fileSize)
+				rc = -1;
+			close(fd);
+		}
+	}
+
+	for(i = 0; level < bench.depth && i < bench.fanout && rc == 0; i++)
+	{
+		makeName(name, i, 'd');
+
+		if(mkdirat(dirFd, name, 0755) == -1)
+			rc = -1;
+		else if((fd = openat(dirFd, name, O_RDONLY | O_DIRECTORY)) == -1)
+			rc = -1;
+		else
+		{
+			rc = fillDir(fd, level + 1, content);
+			close(fd);
+		}
+	}
+
+	if(owned)
+		free(content);
+
+	return rc;
+}
+
+/*******************************************************************************
+* Function name:  makeName
+*
+* Description:    Builds an entry name of the configured length from random
+*                  characters, ending in the entry's index so names never
+*                  collide within a directory
+*
+* Parameters:     char* name  - EXPORT - at least NAME_MAX + 1 bytes
+*                 long index  - IMPORT - position in the directory
+*                 char kind   - IMPORT - 'f' or 'd', kept in the name so
+*                   files and directories cannot collide
+*
+* Return Value:   none
+*******************************************************************************/
+void makeName(char* name, long index, char kind)
+{
+	const char* chars = "abcdefghijklmnopqrstuvwxyz0123456789_-.";
+	char suffix[24];
+	int i, len, suffixLen;
+
+	suffixLen = snprintf(suffix, sizeof(suffix), "%c%ld", kind, index);
+	len = bench.nameLen > suffixLen ? bench.nameLen : suffixLen;
+
+	for(i = 0; i < len - suffixLen; i++)
+		name[i] = chars[nextRandom() % 39];
+
+	//a leading '.' would hide the entry from ls, and "." and ".." are taken
+	if(len > suffixLen && name[0] == '.')
+		name[0] = '_';
+
+	memcpy(name + len - suffixLen, suffix, suffixLen + 1);
+}
+
+/*******************************************************************************
+* Function name:  nextRandom
+*
+* Description:    Advances the xorshift generator used for names
+*
+* Parameters:     none
+*
+* Return Value:   the next 32-bit value
+*******************************************************************************/
+uint32_t nextRandom(void)
+{
+	nameState ^= nameState << 13;
+	nameState ^= nameState >> 17;
+	nameState ^= nameState << 5;
+
+	return nameState;
+}
+
+/*******************************************************************************
+* Function name:  removeEntry
+*
+* Description:    nftw() callback that removes one entry, children first
+*
+* Parameters:     const char* path          - IMPORT - entry to remove
+*                 const struct stat* st     - IMPORT - unused
+*                 int type                  - IMPORT - unused
+*                 struct FTW* ftw           - IMPORT - unused
+*
+* Return Value:   0 so the walk continues
+*******************************************************************************/
+int removeEntry(const char* path, const struct stat* st, int type,
+		struct FTW* ftw)
+{
+	if(remove(path) == -1)
+		fprintf(stderr, "Error in removeTree: %s: %s\n", path,
+				strerror(errno));
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  removeTree
+*
+* Description:    Removes a generated tree and the empty directory beside it
+*
+* Parameters:     char* root - IMPORT - root of the tree
+*
+* Return Value:   none
+*******************************************************************************/
+void removeTree(char* root)
+{
+	char empty[PATH_MAX];
+
+	nftw(root, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+
+	snprintf(empty, sizeof(empty), "%s.empty", root);
+	rmdir(empty);
+}
+
+/*******************************************************************************
+* Function name:  fsName
+*
+* Description:    Names the type of file system a directory is on
+*
+* Parameters:     char* path  - IMPORT - the directory
+*                 char* name  - EXPORT - e.g. "tmpfs", or the magic number
+*                 size_t size - IMPORT - bytes available in name
+*
+* Return Value:   none
+*******************************************************************************/
+void fsName(char* path, char* name, size_t size)
+{
+	struct statfs fs;
+
+	if(statfs(path, &fs) == -1)
+		snprintf(name, size, "unknown");
+	else if(fs.f_type == TMPFS_MAGIC)
+		snprintf(name, size, "tmpfs");
+	else if(fs.f_type == EXT4_SUPER_MAGIC)
+		snprintf(name, size, "ext4");
+	else if(fs.f_type == XFS_SUPER_MAGIC)
+		snprintf(name, size, "xfs");
+	else if(fs.f_type == BTRFS_SUPER_MAGIC)
+		snprintf(name, size, "btrfs");
+	else if(fs.f_type == OVERLAYFS_SUPER_MAGIC)
+		snprintf(name, size, "overlay");
+	else
+		snprintf(name, size, "0x%lx", (unsigned long)fs.f_type);
+}
+
+/*******************************************************************************
+* Function name:  countProbe
+*
+* Description:    Decides how system calls will be counted: a perf event on
+*                  the raw_syscalls:sys_enter tracepoint if tracefs is
+*                  mounted and the event can be opened, ptrace otherwise
+*
+* Parameters:     long long* id - EXPORT - the tracepoint id for COUNT_PERF
+*
+* Return Value:   COUNT_PERF, COUNT_PTRACE or COUNT_NONE
+*******************************************************************************/
+int countProbe(long long* id)
+{
+	char* roots[] = {"/sys/kernel/tracing/", "/sys/kernel/debug/tracing/"};
+	char path[128];
+	struct perf_event_attr attr;
+	FILE* file;
+	int i, fd;
+	pid_t pid;
+
+	*id = -1;
+	for(i = 0; i < 2 && *id == -1; i++)
+	{
+		snprintf(path, sizeof(path), "%s%s", roots[i], SYS_ENTER_ID_PATH);
+		file = fopen(path, "r");
+		if(file == NULL)
+			continue;
+		if(fscanf(file, "%lld", id) != 1)
+			*id = -1;
+		fclose(file);
+	}
+
+	if(*id != -1)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_TRACEPOINT;
+		attr.config = *id;
+		attr.disabled = 1;
+
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+				PERF_FLAG_FD_CLOEXEC);
+		if(fd != -1)
+		{
+			close(fd);
+			return COUNT_PERF;
+		}
+	}
+
+	//ptrace may be forbidden by a seccomp filter or the Yama policy
+	pid = fork();
+	if(pid == 0)
+	{
+		if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+			_exit(1);
+		_exit(0);
+	}
+	if(pid > 0 && waitpid(pid, &i, 0) == pid && WIFEXITED(i) &&
+			WEXITSTATUS(i) == 0)
+		return COUNT_PTRACE;
+
+	fprintf(stderr, "Neither perf events nor ptrace are available; system "
+			"calls will not be counted\n");
+
+	return COUNT_NONE;
+}
+
+/*******************************************************************************
+* Function name:  runOnce
+*
+* Description:    Runs File_dir_info on a directory with its output sent to
+*                  /dev/null and measure it. The child waits on a pipe
+*                  until the parent has attached a perf counter, so the
+*                  counter follows it from the exec on
+*
+* Parameters:     struct Variant* variant    - IMPORT - options to run with
+*                 char* dir                  - IMPORT - directory to list
+*                 int count                  - IMPORT - count system calls
+*                   with a perf event (COUNT_PERF only)
+*                 struct RunResult* result   - EXPORT - the measurements
+*
+* Return Value:   0 on success, -1 if the run could not be made or failed
+*******************************************************************************/
+int runOnce(struct Variant* variant, char* dir, int count,
+		struct RunResult* result)
+{
+	struct perf_event_attr attr;
+	struct timespec t0, t1;
+	struct rusage usage;
+	int go[2], status, devNull, perfFd = -1;
+	long long value;
+	char byte = 0;
+	pid_t pid;
+
+	result->ok = 0;
+	result->syscalls = -1;
+	variant->argv[variant->argc] = dir;
+
+	if(pipe2(go, O_CLOEXEC) == -1)
+	{
+		perror("Error in runOnce (pipe)");
+		return -1;
+	}
+
+	pid = fork();
+	if(pid == -1)
+	{
+		perror("Error in runOnce (fork)");
+		close(go[0]);
+		close(go[1]);
+		return -1;
+	}
+
+	if(pid == 0)
+	{
+		close(go[1]);
+		devNull = open("/dev/null", O_WRONLY);
+		if(devNull != -1)
+			dup2(devNull, STDOUT_FILENO);
+		if(read(go[0], &byte, 1) != 1)
+			_exit(127);
+		execv(bench.program, variant->argv);
+		_exit(127);
+	}
+
+	close(go[0]);
+
+	if(count && bench.countMethod == COUNT_PERF)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_TRACEPOINT;
+		attr.config = bench.sysEnterId;
+		attr.disabled = 1;
+		attr.enable_on_exec = 1;
+		attr.inherit = 1;
+
+		perfFd = syscall(SYS_perf_event_open, &attr, pid, -1, -1,
+				PERF_FLAG_FD_CLOEXEC);
+		if(perfFd == -1)
+			perror("Error in runOnce (perf_event_open)");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if(write(go[1], &byte, 1) != 1)
+		kill(pid, SIGKILL);
+	close(go[1]);
+
+	while(wait4(pid, &status, 0, &usage) == -1)
+	{
+		if(errno != EINTR)
+		{
+			perror("Error in runOnce (wait4)");
+			if(perfFd != -1)
+				close(perfFd);
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if(perfFd != -1)
+	{
+		if(read(perfFd, &value, sizeof(value)) == sizeof(value))
+			result->syscalls = value;
+		close(perfFd);
+	}
+
+	result->wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	result->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+	result->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	result->maxRss = usage.ru_maxrss;
+	result->ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+	if(!result->ok)
+	{
+		fprintf(stderr, "Error in runOnce: %s %s %s ", bench.program,
+				variant->text, dir);
+		if(WIFEXITED(status))
+			fprintf(stderr, "exited with status %d\n", WEXITSTATUS(status));
+		else
+			fprintf(stderr, "was killed by signal %d\n", WTERMSIG(status));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  countPtrace
+*
+* Description:    Runs File_dir_info on a directory under ptrace and counts
+*                  the system calls made by all of its threads. Tracing
+*                  makes every call far slower, so this run is not timed
+*
+* Parameters:     struct Variant* variant - IMPORT - options to run with
+*                 char* dir               - IMPORT - directory to list
+*
+* Return Value:   the number of system calls entered, or -1 on error
+*******************************************************************************/
+long long countPtrace(struct Variant* variant, char* dir)
+{
+	struct __ptrace_syscall_info info;
+	long long calls = 0;
+	int status, devNull, sig;
+	pid_t pid, tid;
+
+	variant->argv[variant->argc] = dir;
+
+	pid = fork();
+	if(pid == -1)
+	{
+		perror("Error in countPtrace (fork)");
+		return -1;
+	}
+
+	if(pid == 0)
+	{
+		devNull = open("/dev/null", O_WRONLY);
+		if(devNull != -1)
+			dup2(devNull, STDOUT_FILENO);
+		if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+			_exit(127);
+		raise(SIGSTOP);
+		execv(bench.program, variant->argv);
+		_exit(127);
+	}
+
+	if(waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status) ||
+			ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD |
+			PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)
+			== -1)
+	{
+		perror("Error in countPtrace (ptrace)");
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+		return -1;
+	}
+
+	//calls made before the exec (the rest of raise()) are not counted
+	ptrace(PTRACE_CONT, pid, NULL, NULL);
+
+	while((tid = waitpid(-1, &status, __WALL)) != -1)
+	{
+		if(!WIFSTOPPED(status))
+			continue;
+
+		sig = 0;
+		if(WSTOPSIG(status) == (SIGTRAP | 0x80))
+		{
+			if(ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0
+					&& info.op == PTRACE_SYSCALL_INFO_ENTRY)
+				calls++;
+		}
+		else if(status >> 16 == PTRACE_EVENT_EXEC && tid == pid)
+			calls = 1;			//the execve() itself
+		else if(WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP)
+			sig = WSTOPSIG(status);
+
+		ptrace(PTRACE_SYSCALL, tid, NULL, (void*)(long)sig);
+	}
+
+	if(errno != ECHILD)
+	{
+		perror("Error in countPtrace (waitpid)");
+		return -1;
+	}
+
+	return calls;
+}
+
+/*******************************************************************************
+* Function name:  countSyscalls
+*
+* Description:    Counts the system calls a run of File_dir_info makes on a
+*                  directory with whichever method is available
+*
+* Parameters:     struct Variant* variant - IMPORT - options to run with
+*                 char* dir               - IMPORT - directory to list
+*
+* Return Value:   the number of system calls, or -1 if they were not counted
+*******************************************************************************/
+long long countSyscalls(struct Variant* variant, char* dir)
+{
+	struct RunResult result;
+
+	if(bench.countMethod == COUNT_PERF)
+	{
+		if(runOnce(variant, dir, 1, &result) == -1)
+			return -1;
+		return result.syscalls;
+	}
+
+	if(bench.countMethod == COUNT_PTRACE)
+		return countPtrace(variant, dir);
+
+	return -1;
+}
+
+/*******************************************************************************
+* Function name:  benchTree
+*
+* Description:    Runs every variant against a tree and prints a result line
+*                  for each. The runs of one variant are sorted by wall
+*                  time and the median run is reported, together with the
+*                  fastest time and the highest peak RSS of all runs
+*
+* Parameters:     struct Tree* tree          - IMPORT - the tree to list
+*                 struct Variant* variants   - IMPORT - options to run with
+*                 int nVariants              - IMPORT - number of variants
+*
+* Return Value:   none
+*******************************************************************************/
+void benchTree(struct Tree* tree, struct Variant* variants, int nVariants)
+{
+	struct RunResult runs[MAX_RUNS];
+	struct RunResult warm;
+	double walls[MAX_RUNS];
+	long long calls, baseline;
+	long maxRss;
+	int v, r, failed, median;
+
+	for(v = 0; v < nVariants; v++)
+	{
+		fprintf(stderr, "  %s\n", variants[v].text);
+
+		failed = runOnce(&variants[v], tree->root, 0, &warm) == -1;
+		maxRss = 0;
+
+		for(r = 0; r < bench.runs && !failed; r++)
+		{
+			failed = runOnce(&variants[v], tree->root, 0, &runs[r]) == -1;
+			walls[r] = runs[r].wall;
+			if(runs[r].maxRss > maxRss)
+				maxRss = runs[r].maxRss;
+		}
+
+		if(failed)
+		{
+			printResult(tree, &variants[v], NULL, 0, 0, -1);
+			continue;
+		}
+
+		calls = countSyscalls(&variants[v], tree->root);
+		baseline = calls == -1 ? -1 : countSyscalls(&variants[v],
+				tree->empty);
+		if(baseline == -1)
+			calls = -1;
+		else
+			calls -= baseline;
+
+		qsort(walls, bench.runs, sizeof(double), compareDouble);
+		for(median = 0; runs[median].wall != walls[bench.runs / 2]; median++)
+			;
+
+		printResult(tree, &variants[v], &runs[median], walls[0], maxRss,
+				calls);
+	}
+}
+
+/*******************************************************************************
+* Function name:  compareDouble
+*
+* Description:    qsort() comparison for ascending doubles
+*
+* Parameters:     const void* a - IMPORT - first value
+*                 const void* b - IMPORT - second value
+*
+* Return Value:   negative, 0 or positive as a is below, equal to or above b
+*******************************************************************************/
+int compareDouble(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+* Function name:  printHeader
+*
+* Description:    Prints the CSV column names; JSON lines need no header
+*
+* Parameters:     none
+*
+* Return Value:   none
+*******************************************************************************/
+void printHeader(void)
+{
+	if(bench.format != FORMAT_CSV)
+		return;
+
+	printf("tag,fs,base,depth,fanout,files_per_dir,name_len,file_size,"
+			"entries,variant,runs,status,wall_ms,wall_min_ms,user_ms,sys_ms,"
+			"entries_per_sec,syscalls_per_entry,max_rss_kb\n");
+	fflush(stdout);
+}
+
+/*******************************************************************************
+* Function name:  printResult
+*
+* Description:    Prints the result line for one tree and variant
+*
+* Parameters:     struct Tree* tree          - IMPORT - the tree listed
+*                 struct Variant* variant    - IMPORT - options run with
+*                 struct RunResult* median   - IMPORT - the median run, NULL
+*                   if a run failed
+*                 double wallMin             - IMPORT - fastest run (s)
+*                 long maxRss                - IMPORT - highest peak RSS (kB)
+*                 long long calls            - IMPORT - system calls beyond
+*                   start-up, or -1 if not counted
+*
+* Return Value:   none
+*******************************************************************************/
+void printResult(struct Tree* tree, struct Variant* variant,
+		struct RunResult* median, double wallMin, long maxRss, long long calls)
+{
+	long long entries = tree->dirs + tree->files;
+	char perEntry[32] = "";
+	char* status = median == NULL ? "failed" : "ok";
+
+	if(calls >= 0 && median != NULL)
+		snprintf(perEntry, sizeof(perEntry), "%.3f", (double)calls / entries);
+
+	if(bench.format == FORMAT_CSV)
+	{
+		//quotes keep option strings with commas in one column
+		printf("%s,%s,%s,%d,%d,%d,%d,%ld,%lld,\"%s\",%d,%s,", bench.tag,
+				tree->fsType, tree->base, bench.depth, bench.fanout,
+				bench.files, bench.nameLen, bench.fileSize, entries,
+				variant->text, bench.runs, status);
+		if(median != NULL)
+			printf("%.3f,%.3f,%.3f,%.3f,%.0f,%s,%ld\n", median->wall * 1e3,
+					wallMin * 1e3, median->user * 1e3, median->sys * 1e3,
+					entries / median->wall, perEntry, maxRss);
+		else
+			printf(",,,,,,\n");
+	}
+	else
+	{
+		printf("{\"tag\":");
+		printJsonString(bench.tag);
+		printf(",\"fs\":");
+		printJsonString(tree->fsType);
+		printf(",\"base\":");
+		printJsonString(tree->base);
+		printf(",\"depth\":%d,\"fanout\":%d,\"files_per_dir\":%d,"
+				"\"name_len\":%d,\"file_size\":%ld,\"entries\":%lld,"
+				"\"variant\":", bench.depth, bench.fanout, bench.files,
+				bench.nameLen, bench.fileSize, entries);
+		printJsonString(variant->text);
+		printf(",\"runs\":%d,\"status\":\"%s\"", bench.runs, status);
+		if(median != NULL)
+			printf(",\"wall_ms\":%.3f,\"wall_min_ms\":%.3f,\"user_ms\":%.3f,"
+					"\"sys_ms\":%.3f,\"entries_per_sec\":%.0f,"
+					"\"syscalls_per_entry\":%s,\"max_rss_kb\":%ld",
+					median->wall * 1e3, wallMin * 1e3, median->user * 1e3,
+					median->sys * 1e3, entries / median->wall,
+					perEntry[0] ? perEntry : "null", maxRss);
+		printf("}\n");
+	}
+
+	fflush(stdout);
+}
+
+/*******************************************************************************
+* Function name:  printJsonString
+*
+* Description:    Prints a string as a quoted JSON string
+*
+* Parameters:     char* text - IMPORT - the string
+*
+* Return Value:   none
+*******************************************************************************/
+void printJsonString(char* text)
+{
+	unsigned char* p;
+
+	putchar('"');
+	for(p = (unsigned char*)text; *p != '\0'; p++)
+	{
+		if(*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if(*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
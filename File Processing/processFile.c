@@ -7,63 +7,498 @@
 *               contained within the file people.dat. If the name is found, the
 *               person's first name, last name, birthdate, and age (in years and
 *               months) is printed.
+*
+*               Usage: processFile [Last Name]
+*                      processFile -b [names file]
+*                      processFile -c [threads] | -v
+*                      processFile -d socket
+*                      processFile -s socket [names file]
+*                      processFile -a [minAge maxAge]
+*                      processFile -m megabytes [any of the above but -s]
+*
+*               Every record with the given last name is printed, in the
+*               order they appear in the file. -b answers many names from
+*               one load: one last name per line of the given file, or of
+*               standard input if none is given.
+*
+*               Lookups are answered from people.db, a compiled form of
+*               people.dat that is mapped into memory and used as it lies,
+*               with no parsing. It holds a fixed-width record for each
+*               person, with the birth date packed into one integer, a
+*               string table of the names, and the records grouped by last
+*               name and indexed in an open-addressing hash table with one
+*               slot per name, so a lookup costs a few probes however large
+*               the file is or however many share the name. The header
+*               carries a format version, the size and modification time of
+*               the people.dat it was compiled from, and checksums of
+*               itself and of the data. people.db is compiled again
+*               whenever it is missing, damaged or out of date; if it
+*               cannot be written, the compiled form is used from memory.
+*               -c compiles it now, reading people.dat with the given
+*               number of threads (default one per online core); -v checks
+*               it against its data checksum.
+*
+*               people.dat is mapped into memory rather than read, and each
+*               record points at its names where they lie in the mapping,
+*               so loading copies nothing and any length of line is
+*               accepted. Lines that are not records, or whose names are
+*               over 65535 bytes, are reported and skipped. The records
+*               are loaded into a store of one array per field, carved from
+*               a single arena: last name hashes and lengths and packed
+*               birth dates lie contiguous, so passes over every record
+*               read only the fields they need, and the whole store is
+*               freed at once.
+*
+*               people.dat is read in parallel: it is cut into one byte
+*               range per thread, each ending at a newline, and every
+*               thread parses its range into its own stretch of the store,
+*               which is closed up in file order afterwards. Files under a
+*               megabyte per thread use fewer threads. Commas and newlines
+*               are found 64 bytes at a time with AVX2 where the CPU has
+*               it, SSE2 otherwise on x86-64, or a byte at a time elsewhere
+*               or when built with -DNO_SIMD.
+*
+*               -d runs a server that opens people.db once and answers
+*               lookups over a Unix domain socket at the given path, from
+*               one epoll loop, until SIGINT or SIGTERM. A request is a
+*               16-bit length and a last name; the answer is a 32-bit
+*               length of the rest, a 32-bit record count, and for each
+*               record 16-bit name lengths, the 32-bit packed birth date
+*               and the first and last names, all in network byte order.
+*               Clients may send many requests before reading the answers,
+*               which come back in order. When people.dat is written or
+*               replaced, a second thread opens (compiling as needed) the
+*               new database while the loop goes on answering from the old
+*               one, and the loop swaps them between two requests. -s is a
+*               client: it looks up the names in the given file, or
+*               standard input, through the server, keeping up to 64
+*               requests in flight, and prints the answers as -b would,
+*               with the time taken on standard error.
+*
+*               -a analyzes the whole database: it prints how many people
+*               are of each age in five-year bands, how many were born in
+*               each month, and how many are aged from minAge to maxAge
+*               (default 18 to 64, at most 120). Ages are exact whole
+*               years, worked out from the packed birth dates by integer
+*               arithmetic against today's date, which is looked up once.
+*               The birth dates are also stored as a column of their own
+*               after the records, so the pass reads them contiguously, a
+*               block at a time, in loops the compiler vectorizes.
+*
+*               -m is for files larger than memory. It uses people.idx in
+*               place of people.db: the same database, but with no hash
+*               table, its records sorted by last name instead and found
+*               by binary search through the mapping, so a lookup touches
+*               only the pages it reads. people.idx is built within the
+*               given number of megabytes (at least 4) by an external
+*               sort: people.dat is read a buffer at a time, each buffer's
+*               records are sorted and written as a run to a temporary file
+*               beside people.idx, and the runs are merged into it, in
+*               passes if there are too many to merge at once. All the runs
+*               share the one file, so the sort holds a few descriptors
+*               open however many runs there are. The limit covers every
+*               buffer and stream of the sort, with 1 MB of it left for
+*               the program's own code, libraries and thread stacks.
+*
+*               Compile with -pthread.
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) && !defined(NO_SIMD)
+#include <immintrin.h>
+#endif
+
+#define SEARCH_START	((size_t)-1)	//position to begin a search from
+#define MAX_YEAR	9999
+#define MAX_NAME	UINT16_MAX	//longest first or last name, in bytes
+#define MIN_RECORD	8		//shortest record line: ",,1/1/1\n"
+#define STORE_RECORD	(2 * sizeof(uint32_t) + 2 * sizeof(uint16_t) + \
+			sizeof(char*))	//bytes of a RecordStore per record
+#define MIN_CHUNK	(1 << 20)	//least bytes worth a thread of its own
+#define SCAN_BLOCK	64		//bytes scanned for delimiters at once
+#define MAX_AGE		120		//ages above this are counted with it
+#define ANALYZE_BLOCK	4096		//birth dates analyzed at once
+#define HIST_TABLES	4		//copies of each histogram, interleaved
+#define MIN_MEMORY	4		//least megabytes to sort people.idx in
+#define SORT_RESERVE	(1 << 20)	//of those, left for code and stacks
+#define MERGE_BUFFER	(64 * 1024)	//buffer of each run and output stream
+#define MAX_FAN_IN	256		//most runs merged at once
+#define PREFETCH_AHEAD	16		//records fetched ahead of writing a run
+
+#define SERVE_EVENTS	64		//epoll events handled per wakeup
+#define SERVE_LISTEN	1		//epoll tags of the server's own
+#define SERVE_NOTIFY	2		//  descriptors; clients are tagged
+#define SERVE_SIGNAL	3		//  with their struct Client
+#define SERVE_RELOADED	4
+#define CLIENT_IN	(128 * 1024)	//holds any one request
+#define OUT_LIMIT	(1024 * 1024)	//answers waiting before reading stops
+#define CLIENT_WINDOW	64		//requests a client keeps in flight
+
+#define DB_NAME		"people.db"
+#define IDX_NAME	"people.idx"	//sorted by -m
+#define DB_MAGIC	"PEOPLEDB"
+#define DB_VERSION	3
+#define CHECKSUM_SEED	14695981039346656037ULL
 
+#define PACK_DATE(year, month, day)	((year) << 9 | (month) << 5 | (day))
+#define DATE_YEAR(date)		((date) >> 9)
+#define DATE_MONTH(date)	((date) >> 5 & 15)
+#define DATE_DAY(date)		((date) & 31)
+
+//a person, as printed
 struct NameRec
 {
-	struct NameRec* next;
-	char firstName[20];
-	char lastName[20];
+	char* firstName;		//not terminated
+	char* lastName;
+	int firstLength, lastLength;
 	int day, month, year;
 };
 
+//a bump allocator over one reserved region
+struct Arena
+{
+	char* base;
+	size_t used;
+	size_t size;
+};
+
+//the records of people.dat, one array per field; the names stay in the
+//mapped file, the last name one byte after the first name's end
+struct RecordStore
+{
+	struct Arena arena;		//holds every array below
+	size_t count;
+	size_t capacity;
+	uint32_t* lastHash;		//hashName() of the last name
+	uint32_t* birth;		//PACK_DATE(year, month, day)
+	uint16_t* lastLength;
+	uint16_t* firstLength;
+	char** firstName;
+};
+
+//a byte range of people.dat parsed by one thread
+struct LoadChunk
+{
+	pthread_t thread;
+	struct RecordStore* store;
+	char* start;			//starts a line
+	char* end;			//just after a newline, or the end of file
+	size_t first;			//store slot of its first record
+	size_t count;			//records parsed
+	size_t lines;			//lines seen
+	size_t* badLines;		//line numbers, from 1 within the range,
+	size_t nBad, badCapacity;	//  of lines that are not records
+};
+
+//finds the commas and newlines in SCAN_BLOCK bytes
+typedef uint64_t (*ScanFunc)(char*);
+
+//a file mapped into memory
+struct Mapping
+{
+	char* data;
+	size_t size;
+};
+
+//header of the compiled database, which is in the byte order of the
+//machine that compiled it; the records, birth dates, index and string
+//table follow
+struct DbHeader
+{
+	char magic[8];			//DB_MAGIC
+	uint32_t version;		//DB_VERSION
+	uint32_t headerSize;
+	uint64_t recordCount;
+	uint64_t slotCount;		//index slots, a power of 2, or 0 if
+					//  the records are sorted by last name
+	uint64_t stringsSize;
+	uint64_t sourceSize;		//people.dat as it was compiled
+	int64_t sourceSec, sourceNsec;	//  and its modification time
+	uint64_t headerChecksum;	//of the fields above
+	uint64_t dataChecksum;		//of everything after the header
+};
+
+//a person in the compiled database
+struct DbRecord
+{
+	uint64_t names;			//first name then last name, in strings
+	uint16_t firstLength, lastLength;
+	uint32_t birth;			//PACK_DATE(year, month, day)
+};
+
+//the compiled database, mapped from its file or built in memory
+struct Database
+{
+	char* data;
+	size_t size;
+	int mapped;
+	struct DbHeader* header;
+	struct DbRecord* records;
+	uint32_t* births;		//each record's birth, for whole-file passes
+	uint32_t* slots;		//open-addressing hash table of the record
+	char* strings;			//  number + 1 of the first with each
+					//  last name, 0 if empty
+};
+
+//the key a record is sorted on in a run
+struct SortKey
+{
+	uint64_t prefix;		//namePrefix() of the last name
+	uint32_t record;		//in the store, which breaks ties
+	uint16_t length;		//of the last name
+};
+
+//a record in a sorted run; the first and last names follow it
+struct RunRecord
+{
+	uint16_t firstLength, lastLength;
+	uint32_t birth;
+};
+
+//the merge's place in one run
+struct RunCursor
+{
+	int file;			//the temporary file of runs
+	off_t offset, end;		//next byte of the run to read, and its end
+	char* buffer;			//MERGE_BUFFER bytes read from the run
+	size_t start, filled;		//  and how far into them the merge is
+	struct RunRecord record;	//the record at the top of the run
+	char* names;			//  and its names
+	size_t capacity;
+	int run;			//earlier runs win ties
+};
+
+//where a merge writes: a run, or the parts of the sorted database
+struct MergeOut
+{
+	FILE* run;			//null pointer if writing the database
+	FILE* records;
+	FILE* births;
+	FILE* strings;
+	char* buffers[4];		//the streams', in that order
+	uint64_t names;			//bytes written to strings so far
+};
+
+//the lookup server
+struct Server
+{
+	int epoll;
+	int listenFd;
+	int notifyFd;			//inotify, on the directory of people.dat
+	int signalFd;
+	int reloadRequest[2];		//loop to reloader: open the database
+	int reloadDone[2];		//reloader to loop: the new database
+	int reloading;
+	int reloadPending;		//people.dat changed during the reload
+	pthread_t reloader;
+	struct Database* db;		//what requests are answered from
+	size_t memory;			//to sort it in, or 0 for people.db
+};
+
+//a connection to the lookup server
+struct Client
+{
+	int fd;
+	uint32_t events;		//epoll events waited for
+	char in[CLIENT_IN];		//requests not yet answered
+	size_t inUsed;
+	char* out;			//answers not yet sent
+	size_t outUsed, outSent, outSize;
+};
+
 FILE* openFile();
-void readFile(FILE*, struct NameRec*);
-struct NameRec* search(struct NameRec*, char*);
+int mapFile(char*, struct Mapping*);
+int arenaCreate(struct Arena*, size_t);
+void* arenaAlloc(struct Arena*, size_t);
+void arenaFree(struct Arena*);
+int storeCreate(struct RecordStore*, size_t);
+void storeFree(struct RecordStore*);
+size_t readFile(struct Mapping*, struct RecordStore*, int, size_t*);
+void* loadChunk(void*);
+void addRecord(struct LoadChunk*, char*, char*, char*, char*);
+void storeMove(struct RecordStore*, size_t, size_t, size_t);
+ScanFunc chooseScanner(void);
+uint64_t scanScalar(char*);
+#if defined(__x86_64__) && !defined(NO_SIMD)
+uint64_t scanSse2(char*);
+uint64_t scanAvx2(char*);
+#endif
+int parseDate(char*, char*, int*, int*, int*);
+int openDatabase(struct Database*, char*, char*, size_t);
+int compileDatabase(struct Database*, char*, char*, int);
+int sortDatabase(struct Database*, char*, char*, size_t);
+int spillRuns(int, char*, size_t, int*, off_t**, int*, uint64_t*,
+		uint64_t*);
+uint64_t namePrefix(char*, size_t);
+void sortKeys(struct SortKey*, struct SortKey*, size_t, struct RecordStore*);
+int compareKeys(const void*, const void*, void*);
+int compareNames(char*, size_t, char*, size_t);
+int tempRun(char*);
+FILE* openRun(int, char*, char**);
+FILE* openOutput(char*, off_t, char**);
+int closeStream(FILE*, char*);
+int writeRun(FILE*, struct RecordStore*, struct SortKey*);
+int mergeRuns(int, off_t*, int, struct MergeOut*);
+int readRun(struct RunCursor*);
+int readRunBytes(struct RunCursor*, void*, size_t);
+int cursorBefore(struct RunCursor*, struct RunCursor*);
+void siftUp(struct RunCursor**, int, struct RunCursor*);
+void siftDown(struct RunCursor**, int, struct RunCursor*);
+int buildDatabase(struct Database*, struct RecordStore*, struct stat*);
+int groupNames(struct RecordStore*, uint32_t*, uint32_t*, uint32_t*, size_t*);
+int attachDatabase(struct Database*, char*, size_t);
+int verifyDatabase(struct Database*);
+uint64_t checksum(void*, size_t);
+uint64_t extendChecksum(uint64_t, void*, size_t);
+uint32_t hashName(char*, size_t);
+double monotonicMs(void);
+struct DbRecord* search(struct Database*, char*, size_t, size_t*);
+struct DbRecord* searchSorted(struct Database*, char*, size_t, size_t*);
+struct DbRecord* recordNamed(struct Database*, size_t, char*, size_t);
+int lookup(struct Database*, char*);
+void lookupBatch(struct Database*, FILE*);
+int serve(char*, size_t);
+void serveAccept(struct Server*);
+int serveRead(struct Server*, struct Client*);
+int serveRequests(struct Server*, struct Client*);
+int serveWrite(struct Server*, struct Client*);
+void serveClose(struct Server*, struct Client*);
+int answer(struct Database*, struct Client*, char*, size_t);
+int outReserve(struct Client*, size_t);
+void serveNotify(struct Server*);
+void serveReloaded(struct Server*);
+void* reloader(void*);
+void closeDatabase(struct Database*);
+int queryServer(char*, FILE*);
+void analyze(struct Database*, int, int);
+size_t ageBlock(uint32_t*, uint32_t, int, int, uint8_t*, uint8_t*);
+uint32_t currentDate(void);
 void printRecord(struct NameRec*);
 
 int main(int argc, char** argv)
 {
-	FILE* file;
-	struct NameRec Head;
-	struct NameRec* Current;
-	char* lastName;
+	FILE* names = stdin;
+	struct Database db;
+	char* end = "";
+	char* memoryEnd = "";
+	char* dbName = DB_NAME;
+	int batch, compile, server, client, ages, sorted = 0;
+	long threads = 1, minAge = 18, maxAge = 64, memory = 0;
 	
-	if(argc != 2)
+	//-m comes before the rest, which are then read as without it
+	if(argc >= 3 && !strcmp(argv[1], "-m"))
 	{
-		printf("Usage: a.out [Last Name]\n");
+		memory = strtol(argv[2], &memoryEnd, 10);
+		dbName = IDX_NAME;
+		sorted = 1;
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
 	}
-	else if((file = openFile("people.dat")) == NULL)
+	
+	batch = argc >= 2 && !strcmp(argv[1], "-b");
+	compile = argc >= 2 && !strcmp(argv[1], "-c");
+	server = argc >= 2 && !strcmp(argv[1], "-d");
+	client = argc >= 2 && !strcmp(argv[1], "-s");
+	ages = argc >= 2 && !strcmp(argv[1], "-a");
+	
+	if(argc == 3 && compile)
+		threads = strtol(argv[2], &end, 10);
+	if(argc == 4 && ages)
 	{
-		perror("An error occurred");
+		minAge = strtol(argv[2], &end, 10);
+		if(*end == '\0')
+			maxAge = strtol(argv[3], &end, 10);
+	}
+	
+	if((argc != 2 && !(batch && argc == 3) && !(compile && argc == 3) &&
+			!(server && argc == 3) && !(client && (argc == 3 ||
+			argc == 4)) && !(ages && argc == 4)) ||
+			((server || client) && argc == 2) || threads < 1 ||
+			minAge < 0 || maxAge < minAge || maxAge > MAX_AGE ||
+			*end != '\0' || *memoryEnd != '\0' || (sorted &&
+			(memory < MIN_MEMORY || (size_t)memory > SIZE_MAX >> 20 ||
+			client || (compile && argc == 3))))
+	{
+		printf("Usage: %s [Last Name]\n", argv[0]);
+		printf("       %s -b [names file]\n", argv[0]);
+		printf("       %s -c [threads] | -v\n", argv[0]);
+		printf("       %s -d socket\n", argv[0]);
+		printf("       %s -s socket [names file]\n", argv[0]);
+		printf("       %s -a [minAge maxAge]\n", argv[0]);
+		printf("       %s -m megabytes [any of the above but -s]\n",
+				argv[0]);
+	}
+	else if(((batch && argc == 3) || (client && argc == 4)) &&
+			(names = openFile(argv[argc - 1])) == NULL)
+	{
+		perror(argv[argc - 1]);
+	}
+	else if(server)
+	{
+		return serve(argv[2], (size_t)memory << 20) == -1;
+	}
+	else if(client)
+	{
+		return queryServer(argv[2], names) == -1;
+	}
+	else if(compile && memory > 0)
+	{
+		return sortDatabase(&db, dbName, "people.dat",
+				(size_t)memory << 20) == -1;
+	}
+	else if(compile)
+	{
+		return compileDatabase(&db, DB_NAME, "people.dat",
+				argc == 3 ? threads : 0) == -1;
+	}
+	else if(openDatabase(&db, dbName, "people.dat",
+			(size_t)memory << 20) == -1)
+	{
+		return 1;
+	}
+	else if(!strcmp(argv[1], "-v"))
+	{
+		if(verifyDatabase(&db) == -1)
+		{
+			printf("%s is damaged\n", dbName);
+			return 1;
+		}
+		printf("%s: %llu records, checksum correct\n", dbName,
+				(unsigned long long)db.header->recordCount);
+	}
+	else if(ages)
+	{
+		analyze(&db, minAge, maxAge);
 	}
 	else
 	{
 		printf("File opened successfully\n");
 		
-		//store name given in command line argument
-		lastName = (char*) malloc(sizeof(argv[1]));
-		lastName = strcpy(lastName, argv[1]);
-		
-		//read in contents of file
-		readFile(file, &Head);
-		
-		//check if person exists
-		if(Current = search(&Head, lastName))
-		{
-			printf("Record found:\n");
-			printRecord(Current);
-		}
+		if(batch)
+			lookupBatch(&db, names);
 		else
-		{
-			printf("No record for %s\n", lastName);
-		}
+			lookup(&db, argv[1]);
 	}
 	
 	return 0;
@@ -84,118 +519,2961 @@ FILE* openFile(char* fileName)
 }
 
 /*******************************************************************************
-* Function name:  readFile
-*                                                                             
-* Description:    Stores the contents of the given file in a linked list
-*                                                                             
-* Parameters:     FILE* file - IMPORT - pointer to file to read
-*                 struct NameRec* current - IMPORT/EXPORT - beginning of the
-*                     linked list
-*                                                                             
+* Function name:  mapFile
+*
+* Description:    Maps the whole of a file into memory, read only
+*
+* Parameters:     char* fileName - IMPORT - name of file to map
+*                 struct Mapping* file - EXPORT - where it was mapped
+*
+* Return Value:   0 on success, -1 if the file cannot be opened or mapped
+*******************************************************************************/
+int mapFile(char* fileName, struct Mapping* file)
+{
+	struct stat info;
+	int fd;
+
+	if((fd = open(fileName, O_RDONLY)) == -1)
+		return -1;
+
+	if(fstat(fd, &info) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	file->size = info.st_size;
+	file->data = NULL;
+
+	//an empty file cannot be mapped, and holds no records anyway
+	if(file->size > 0)
+	{
+		file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(file->data == MAP_FAILED)
+		{
+			close(fd);
+			return -1;
+		}
+		madvise(file->data, file->size, MADV_SEQUENTIAL);
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  arenaCreate
+*
+* Description:    Reserves address space for an arena. Pages are only
+*                  backed by memory once something is allocated in them, so
+*                  an arena may be sized for the worst case
+*
+* Parameters:     struct Arena* arena - EXPORT - the arena
+*                 size_t size - IMPORT - most bytes it will hold
+*
+* Return Value:   0 on success, -1 if the space cannot be reserved
+*******************************************************************************/
+int arenaCreate(struct Arena* arena, size_t size)
+{
+	arena->used = 0;
+	arena->size = size > 0 ? size : 1;
+	arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return arena->base == MAP_FAILED ? -1 : 0;
+}
+
+/*******************************************************************************
+* Function name:  arenaAlloc
+*
+* Description:    Takes the next block from an arena, aligned to 64 bytes so
+*                  that each block starts on a cache line of its own
+*
+* Parameters:     struct Arena* arena - IMPORT/EXPORT - the arena
+*                 size_t size - IMPORT - size of the block
+*
+* Return Value:   the block, or null pointer if the arena is full
+*******************************************************************************/
+void* arenaAlloc(struct Arena* arena, size_t size)
+{
+	size_t start = (arena->used + 63) & ~(size_t)63;
+
+	if(start > arena->size || size > arena->size - start)
+		return NULL;
+
+	arena->used = start + size;
+	return arena->base + start;
+}
+
+/*******************************************************************************
+* Function name:  arenaFree
+*
+* Description:    Frees everything allocated in an arena at once
+*
+* Parameters:     struct Arena* arena - IMPORT/EXPORT - the arena
+*
 * Return Value:   none
 *******************************************************************************/
-void readFile(FILE* file, struct NameRec* current)
+void arenaFree(struct Arena* arena)
 {
-	char line[50];
-	char* loc;
-	char* loc2;
-	char* start;
-	struct NameRec* NewNameRec;
-	
-	fgets(line, 50, file);
-	
-	while(!feof(file))
+	munmap(arena->base, arena->size);
+	arena->base = NULL;
+	arena->used = arena->size = 0;
+}
+
+/*******************************************************************************
+* Function name:  storeCreate
+*
+* Description:    Makes an empty record store with room for a given number
+*                  of records, each column a block of one arena
+*
+* Parameters:     struct RecordStore* store - EXPORT - the store
+*                 size_t capacity - IMPORT - most records it will hold
+*
+* Return Value:   0 on success, -1 if the space cannot be reserved
+*******************************************************************************/
+int storeCreate(struct RecordStore* store, size_t capacity)
+{
+	if(arenaCreate(&store->arena, capacity * STORE_RECORD + 5 * 64) == -1)
+		return -1;
+
+	store->count = 0;
+	store->capacity = capacity;
+	store->lastHash = arenaAlloc(&store->arena, capacity * sizeof(uint32_t));
+	store->birth = arenaAlloc(&store->arena, capacity * sizeof(uint32_t));
+	store->lastLength = arenaAlloc(&store->arena,
+			capacity * sizeof(uint16_t));
+	store->firstLength = arenaAlloc(&store->arena,
+			capacity * sizeof(uint16_t));
+	store->firstName = arenaAlloc(&store->arena, capacity * sizeof(char*));
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  storeFree
+*
+* Description:    Frees a record store
+*
+* Parameters:     struct RecordStore* store - IMPORT/EXPORT - the store
+*
+* Return Value:   none
+*******************************************************************************/
+void storeFree(struct RecordStore* store)
+{
+	arenaFree(&store->arena);
+	store->count = store->capacity = 0;
+}
+
+/*******************************************************************************
+* Function name:  readFile
+*
+* Description:    Adds the records of a mapped file to a record store. The
+*                  file is cut into one byte range per thread, each ending
+*                  at a newline, and each range is parsed on its own thread
+*                  into its own stretch of the store's arrays; the stretches
+*                  are then closed up in file order. The names are left
+*                  where they lie in the mapping; each record points at
+*                  them. Lines that are not records are reported and skipped
+*
+* Parameters:     struct Mapping* file - IMPORT - the mapped file
+*                 struct RecordStore* store - IMPORT/EXPORT - the store, with
+*                     room for a record per MIN_RECORD bytes of the file
+*                     and one more per thread
+*                 int threads - IMPORT - number of threads to parse with
+*                 size_t* lines - IMPORT/EXPORT - lines before the file,
+*                     for reporting line numbers, then after it
+*
+* Return Value:   number of records read
+*******************************************************************************/
+size_t readFile(struct Mapping* file, struct RecordStore* store, int threads,
+		size_t* lines)
+{
+	struct LoadChunk* chunks;
+	char* end = file->data + file->size;
+	char* start = file->data;
+	char* split;
+	size_t i;
+	int t;
+
+	chunks = (struct LoadChunk*) calloc(threads, sizeof(struct LoadChunk));
+	if(chunks == NULL)
 	{
-		//store first name
-		loc = strtok(line, ",");
-		loc = strtok(NULL, ",");
-		strncpy(current->firstName, line, loc - line);
-		
-		//store last name
-		loc2 = strtok(NULL, ",");
-		strncpy(current->lastName, loc, loc2 - loc);
-		
-		//store month, day, and year
-		sscanf((char*)loc2, "%d%*c%d%*c%d", &(current->month), &(current->day), &(current->year));
-		
-		fgets(line, 50, file);
-		
-		if(feof(file))
+		perror("An error occurred");
+		exit(1);
+	}
+
+	for(t = 0; t < threads; t++)
+	{
+		split = t == threads - 1 ? end :
+				file->data + file->size / threads * (t + 1);
+		if(split < start)
+			split = start;
+		if(split < end)
 		{
-			printf("Finished reading\n");
-			return;
+			split = memchr(split, '\n', end - split);
+			split = split == NULL ? end : split + 1;
 		}
-		
-		//create a NameRec for next record
-		NewNameRec = (struct NameRec*) malloc(sizeof(struct NameRec));
-		current->next = NewNameRec;
-		current = NewNameRec;
+
+		chunks[t].store = store;
+		chunks[t].start = start;
+		chunks[t].end = split;
+		start = split;
+
+		//no more records than MIN_RECORD bytes each, plus one without
+		//a newline, fit between here and the next chunk's first slot
+		chunks[t].first = (chunks[t].start - file->data) / MIN_RECORD + t;
+
+		if(t > 0 && pthread_create(&chunks[t].thread, NULL, loadChunk,
+				&chunks[t]) != 0)
+		{
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	loadChunk(&chunks[0]);
+
+	for(t = 0; t < threads; t++)
+	{
+		if(t > 0)
+			pthread_join(chunks[t].thread, NULL);
+
+		for(i = 0; i < chunks[t].nBad; i++)
+			fprintf(stderr, "Line %zu is not a record, skipped\n",
+					*lines + chunks[t].badLines[i]);
+		free(chunks[t].badLines);
+		*lines += chunks[t].lines;
+
+		storeMove(store, chunks[t].first, store->count, chunks[t].count);
+		store->count += chunks[t].count;
 	}
+
+	free(chunks);
+
+	return store->count;
 }
 
 /*******************************************************************************
-* Function name:  search
-*                                                                             
-* Description:    Searches the list of people for a given last name
-*                                                                             
-* Parameters:     struct NameRec* Head - IMPORT - beginning of the list
-*                 char* name - IMPORT - name to search for
-*                                                                             
-* Return Value:   pointer to the NameRec that matches the name if found 
-*                  or null pointer if not found
+* Function name:  loadChunk
+*
+* Description:    Parses one byte range of the file into the store, from the
+*                  chunk's first slot on. The commas and newlines of each 64
+*                  bytes are found at once by the scanner chosen for this
+*                  CPU, and the lines are cut at them
+*
+* Parameters:     void* arg - IMPORT/EXPORT - the struct LoadChunk
+*
+* Return Value:   NULL
 *******************************************************************************/
-struct NameRec* search(struct NameRec* Head, char* name)
+void* loadChunk(void* arg)
 {
-	struct NameRec* current = Head;
-	while(current != NULL)
+	struct LoadChunk* chunk = arg;
+	ScanFunc scan = chooseScanner();
+	char tail[SCAN_BLOCK];
+	char* block;
+	char* bytes;
+	char* line = chunk->start;
+	char* loc = NULL;
+	char* loc2 = NULL;
+	char* p;
+	uint64_t mask;
+	int fields = 0;
+
+	for(block = chunk->start; block < chunk->end; block += SCAN_BLOCK)
 	{
-		//debug
-		//printf("%s,%s,%d/%d/%d\n", current->firstName, current->lastName, 
-		//		current->month, current->day, current->year);
-		if(!strcmp(current->lastName, name))
-			return current;
-		current = current->next;
+		//the last block is copied so the scan stays inside the file
+		bytes = block;
+		if(chunk->end - block < SCAN_BLOCK)
+		{
+			memset(tail, 0, SCAN_BLOCK);
+			memcpy(tail, block, chunk->end - block);
+			bytes = tail;
+		}
+
+		for(mask = scan(bytes); mask != 0; mask &= mask - 1)
+		{
+			p = block + __builtin_ctzll(mask);
+			if(bytes[p - block] == ',')
+			{
+				if(fields == 0)
+					loc = p;
+				else if(fields == 1)
+					loc2 = p;
+				fields++;
+				continue;
+			}
+
+			addRecord(chunk, line, p, loc, fields >= 2 ? loc2 : NULL);
+			line = p + 1;
+			fields = 0;
+		}
 	}
-	
-	return current;
+
+	if(line < chunk->end)
+		addRecord(chunk, line, chunk->end, loc, fields >= 2 ? loc2 : NULL);
+
+	return NULL;
 }
 
 /*******************************************************************************
-* Function name:  printRecord
-*                                                                             
-* Description:    Prints the information held in a record and calculates the 
-*                  age of the person
-*                                                                             
-* Parameters:     struct NameRec* Record - IMPORT - record to print
-*                                                                             
+* Function name:  addRecord
+*
+* Description:    Adds one line to a chunk's records, or notes it as bad
+*
+* Parameters:     struct LoadChunk* chunk - IMPORT/EXPORT - the chunk
+*                 char* line - IMPORT - start of the line
+*                 char* eol - IMPORT - its newline, or the end of the file
+*                 char* loc - IMPORT - comma after the first name
+*                 char* loc2 - IMPORT - comma after the last name, or null
+*                     pointer if the line has fewer than two
+*
 * Return Value:   none
 *******************************************************************************/
-void printRecord(struct NameRec* Record)
+void addRecord(struct LoadChunk* chunk, char* line, char* eol, char* loc,
+		char* loc2)
 {
-	time_t timer;
-	struct tm* birthday;
-	double timeDif;
-	int years, months;
-	char printMonth[3];
-	
-	printf("First Name: %s\n", Record->firstName);
-	printf("Last Name: %s\n", Record->lastName);
-	
-	//create tm struct with birth date
-	birthday = localtime(&timer);
-	birthday->tm_year = Record->year - 1900;
-	birthday->tm_mon = Record->month - 1;
-	birthday->tm_mday = Record->day;
-	
-	time(&timer);
-	//calculate age in seconds
-	timeDif = difftime(timer, mktime(birthday));
-	years = ((int)timeDif)/31556940;
-	months = (((int)timeDif)%31556940)/2592000;
-	
-	//get birth month in string form
-	sscanf(asctime(birthday), "%*s %s", printMonth);
-	
-	printf("Birthdate: %s %d, %d\n", printMonth, Record->day, Record->year);
-	printf("Age: %d years %d months\n", years, months);
+	struct RecordStore* store = chunk->store;
+	size_t i;
+	int month, day, year;
+
+	chunk->lines++;
+
+	if(loc2 == NULL || loc - line > MAX_NAME || loc2 - loc - 1 > MAX_NAME ||
+			parseDate(loc2 + 1, eol, &month, &day, &year))
+	{
+		if(eol == line || (eol == line + 1 && *line == '\r'))
+			return;
+
+		if(chunk->nBad == chunk->badCapacity)
+		{
+			chunk->badCapacity = chunk->badCapacity * 2 + 16;
+			chunk->badLines = (size_t*) realloc(chunk->badLines,
+					chunk->badCapacity * sizeof(size_t));
+			if(chunk->badLines == NULL)
+			{
+				perror("An error occurred");
+				exit(1);
+			}
+		}
+		chunk->badLines[chunk->nBad++] = chunk->lines;
+		return;
+	}
+
+	i = chunk->first + chunk->count++;
+	store->firstName[i] = line;
+	store->firstLength[i] = loc - line;
+	store->lastLength[i] = loc2 - loc - 1;
+	store->lastHash[i] = hashName(loc + 1, loc2 - loc - 1);
+	store->birth[i] = PACK_DATE(year, month, day);
+}
+
+/*******************************************************************************
+* Function name:  storeMove
+*
+* Description:    Moves a run of records down the store's arrays
+*
+* Parameters:     struct RecordStore* store - IMPORT/EXPORT - the store
+*                 size_t from - IMPORT - first record of the run
+*                 size_t to - IMPORT - where it goes, not after from
+*                 size_t count - IMPORT - number of records in the run
+*
+* Return Value:   none
+*******************************************************************************/
+void storeMove(struct RecordStore* store, size_t from, size_t to,
+		size_t count)
+{
+	if(from == to || count == 0)
+		return;
+
+	memmove(&store->lastHash[to], &store->lastHash[from],
+			count * sizeof(uint32_t));
+	memmove(&store->birth[to], &store->birth[from], count * sizeof(uint32_t));
+	memmove(&store->lastLength[to], &store->lastLength[from],
+			count * sizeof(uint16_t));
+	memmove(&store->firstLength[to], &store->firstLength[from],
+			count * sizeof(uint16_t));
+	memmove(&store->firstName[to], &store->firstName[from],
+			count * sizeof(char*));
+}
+
+/*******************************************************************************
+* Function name:  chooseScanner
+*
+* Description:    Picks the fastest delimiter scanner this CPU can run
+*
+* Parameters:     none
+*
+* Return Value:   the scanner
+*******************************************************************************/
+ScanFunc chooseScanner(void)
+{
+#if defined(__x86_64__) && !defined(NO_SIMD)
+	if(__builtin_cpu_supports("avx2"))
+		return scanAvx2;
+	return scanSse2;
+#else
+	return scanScalar;
+#endif
+}
+
+/*******************************************************************************
+* Function name:  scanScalar
+*
+* Description:    Finds the commas and newlines in SCAN_BLOCK bytes, a byte
+*                  at a time
+*
+* Parameters:     char* bytes - IMPORT - the block
+*
+* Return Value:   a mask with bit i set if byte i is a comma or newline
+*******************************************************************************/
+uint64_t scanScalar(char* bytes)
+{
+	uint64_t mask = 0;
+	int i;
+
+	for(i = 0; i < SCAN_BLOCK; i++)
+		mask |= (uint64_t)(bytes[i] == ',' || bytes[i] == '\n') << i;
+
+	return mask;
+}
+
+#if defined(__x86_64__) && !defined(NO_SIMD)
+/*******************************************************************************
+* Function name:  scanSse2
+*
+* Description:    Finds the commas and newlines in SCAN_BLOCK bytes, 16 at a
+*                  time with SSE2
+*
+* Parameters:     char* bytes - IMPORT - the block
+*
+* Return Value:   a mask with bit i set if byte i is a comma or newline
+*******************************************************************************/
+uint64_t scanSse2(char* bytes)
+{
+	__m128i comma = _mm_set1_epi8(',');
+	__m128i newline = _mm_set1_epi8('\n');
+	__m128i v;
+	uint64_t mask = 0;
+	int i;
+
+	for(i = 0; i < SCAN_BLOCK; i += 16)
+	{
+		v = _mm_loadu_si128((__m128i*) (bytes + i));
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_or_si128(
+				_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, newline))) << i;
+	}
+
+	return mask;
+}
+
+/*******************************************************************************
+* Function name:  scanAvx2
+*
+* Description:    Finds the commas and newlines in SCAN_BLOCK bytes, 32 at a
+*                  time with AVX2. Built for AVX2 whatever the compiler's
+*                  target, and only called if the CPU has it
+*
+* Parameters:     char* bytes - IMPORT - the block
+*
+* Return Value:   a mask with bit i set if byte i is a comma or newline
+*******************************************************************************/
+__attribute__((target("avx2")))
+uint64_t scanAvx2(char* bytes)
+{
+	__m256i comma = _mm256_set1_epi8(',');
+	__m256i newline = _mm256_set1_epi8('\n');
+	__m256i low = _mm256_loadu_si256((__m256i*) bytes);
+	__m256i high = _mm256_loadu_si256((__m256i*) (bytes + 32));
+
+	return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(low, comma), _mm256_cmpeq_epi8(low, newline))) |
+			(uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(high, comma),
+			_mm256_cmpeq_epi8(high, newline))) << 32;
+}
+#endif
+
+/*******************************************************************************
+* Function name:  parseDate
+*
+* Description:    Parses a date in the form month/day/year that runs to the
+*                  end of the text, which may end in a carriage return. Any
+*                  single character other than a digit separates the fields.
+*                  The date must exist in the Gregorian calendar
+*
+* Parameters:     char* text - IMPORT - start of the date
+*                 char* end - IMPORT - end of the line
+*                 int* month - EXPORT - month, 1 to 12
+*                 int* day - EXPORT - day of the month, 1 to its length
+*                 int* year - EXPORT - year, 1 to MAX_YEAR
+*
+* Return Value:   0 on success, -1 if the text is not such a date
+*******************************************************************************/
+int parseDate(char* text, char* end, int* month, int* day, int* year)
+{
+	static int monthDays[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30,
+			31};
+	int* fields[3] = {month, day, year};
+	int i, digits, leap;
+
+	for(i = 0; i < 3; i++)
+	{
+		if(i > 0)
+		{
+			if(text == end || (unsigned)(*text - '0') < 10)
+				return -1;
+			text++;
+		}
+
+		*fields[i] = 0;
+		for(digits = 0; text < end && (unsigned)(*text - '0') < 10 &&
+				digits < 9; digits++)
+			*fields[i] = *fields[i] * 10 + (*text++ - '0');
+
+		if(digits == 0)
+			return -1;
+	}
+
+	if(text < end && *text == '\r')
+		text++;
+
+	if(text != end || *month < 1 || *month > 12 || *year < 1 ||
+			*year > MAX_YEAR)
+		return -1;
+
+	leap = (*year % 4 == 0 && *year % 100 != 0) || *year % 400 == 0;
+	if(*day < 1 || *day > monthDays[*month - 1] + (*month == 2 && leap))
+		return -1;
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  openDatabase
+*
+* Description:    Maps the compiled database, compiling it first if it is
+*                  missing, damaged, or was not compiled from the source
+*                  file as it is now. If the source cannot be read, a
+*                  sound database is used as it is
+*
+* Parameters:     struct Database* db - EXPORT - the database
+*                 char* dbName - IMPORT - name of the compiled file
+*                 char* sourceName - IMPORT - name of the CSV file
+*                 size_t memory - IMPORT - bytes to sort it in with
+*                     sortDatabase(), or 0 to compile it in memory
+*
+* Return Value:   0 on success, -1 if neither file can be used
+*******************************************************************************/
+int openDatabase(struct Database* db, char* dbName, char* sourceName,
+		size_t memory)
+{
+	struct stat source;
+	struct Mapping file;
+	int haveSource;
+
+	haveSource = stat(sourceName, &source) == 0;
+
+	if(mapFile(dbName, &file) == 0)
+	{
+		if(attachDatabase(db, file.data, file.size) == 0 && (!haveSource ||
+				(db->header->sourceSize == (uint64_t)source.st_size &&
+				db->header->sourceSec == source.st_mtim.tv_sec &&
+				db->header->sourceNsec == source.st_mtim.tv_nsec)))
+		{
+			db->mapped = 1;
+			return 0;
+		}
+
+		if(file.data != NULL)
+			munmap(file.data, file.size);
+	}
+
+	if(!haveSource)
+	{
+		perror(sourceName);
+		return -1;
+	}
+
+	if(memory > 0)
+		return sortDatabase(db, dbName, sourceName, memory);
+	return compileDatabase(db, dbName, sourceName, 0);
+}
+
+/*******************************************************************************
+* Function name:  compileDatabase
+*
+* Description:    Reads the CSV file and compiles it into the database. The
+*                  new file is written beside the old one and renamed over
+*                  it, so a reader never sees it half written. If it cannot
+*                  be written, the compiled image is used from memory
+*
+* Parameters:     struct Database* db - EXPORT - the new database
+*                 char* dbName - IMPORT - name of the compiled file
+*                 char* sourceName - IMPORT - name of the CSV file
+*                 int threads - IMPORT - most threads to read with, or 0
+*                     for one per online core
+*
+* Return Value:   0 on success, -1 if the source cannot be read or compiled
+*******************************************************************************/
+int compileDatabase(struct Database* db, char* dbName, char* sourceName,
+		int threads)
+{
+	struct Mapping people;
+	struct RecordStore store;
+	struct stat source;
+	char tempName[4096];
+	size_t count, lines = 0;
+	double start;
+	FILE* out;
+
+	//a change made after the stat makes the next run compile again
+	if(stat(sourceName, &source) == -1 || mapFile(sourceName, &people) == -1)
+	{
+		perror(sourceName);
+		return -1;
+	}
+
+	if(threads == 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if((size_t)threads > people.size / MIN_CHUNK + 1)
+		threads = people.size / MIN_CHUNK + 1;
+
+	if(storeCreate(&store, people.size / MIN_RECORD + threads) == -1)
+	{
+		perror("An error occurred");
+		return -1;
+	}
+	start = monotonicMs();
+	count = readFile(&people, &store, threads, &lines);
+	start = monotonicMs() - start;
+	printf("Finished reading\n");
+
+	if(buildDatabase(db, &store, &source) == -1)
+		return -1;
+
+	//the names are copied into the database, so the source can go
+	storeFree(&store);
+	if(people.data != NULL)
+		munmap(people.data, people.size);
+
+	snprintf(tempName, sizeof(tempName), "%s.%d", dbName, getpid());
+	if((out = fopen(tempName, "w")) == NULL ||
+			fwrite(db->data, 1, db->size, out) != db->size ||
+			fclose(out) != 0 || rename(tempName, dbName) == -1)
+	{
+		fprintf(stderr, "Cannot write %s (%s), using it from memory\n",
+				dbName, strerror(errno));
+		unlink(tempName);
+	}
+	else
+		printf("Compiled %zu records into %s (read in %.1f ms on %d "
+				"thread%s)\n", count, dbName, start, threads,
+				threads == 1 ? "" : "s");
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  sortDatabase
+*
+* Description:    Builds the database from the CSV file within a fixed
+*                  amount of memory, however large the file, as a sorted
+*                  index rather than a hash table: the records are in order
+*                  of last name, and of line within a name, and are found by
+*                  binary search. The file is read a buffer at a time; each
+*                  buffer's records are sorted and spilled as a run to a
+*                  temporary file, and the runs are merged into the new
+*                  file, in passes if there are too many to merge at once,
+*                  each pass writing the longer runs it makes to a file of
+*                  its own. The new file is then renamed over the old one
+*                  and mapped
+*
+* Parameters:     struct Database* db - EXPORT - the new database
+*                 char* dbName - IMPORT - name of the sorted file
+*                 char* sourceName - IMPORT - name of the CSV file
+*                 size_t memory - IMPORT - most bytes to use, at least
+*                     MIN_MEMORY megabytes
+*
+* Return Value:   0 on success, -1 if the source cannot be read or sorted
+*******************************************************************************/
+int sortDatabase(struct Database* db, char* dbName, char* sourceName,
+		size_t memory)
+{
+	struct DbHeader header;
+	struct MergeOut out;
+	struct Mapping image;
+	struct stat source;
+	char tempName[4096];
+	uint64_t count, stringsSize;
+	ssize_t got;
+	char* buffer;
+	off_t* runs = NULL;
+	off_t* merged;
+	int nRuns = 0, fanIn, i, fd, spill;
+	double start = monotonicMs();
+	FILE* file;
+
+	if((fd = open(sourceName, O_RDONLY)) == -1 || fstat(fd, &source) == -1)
+	{
+		perror(sourceName);
+		return -1;
+	}
+
+	if(spillRuns(fd, dbName, memory, &spill, &runs, &nRuns, &count,
+			&stringsSize) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if(count >= UINT32_MAX)
+	{
+		fprintf(stderr, "Cannot compile %llu records\n",
+				(unsigned long long)count);
+		return -1;
+	}
+
+	//each run merged needs a buffer and room for the longest names, next
+	//to the buffers of the three streams the last merge writes
+	fanIn = (memory - SORT_RESERVE - 3 * MERGE_BUFFER) / (MERGE_BUFFER +
+			2 * MAX_NAME + sizeof(struct RunCursor) +
+			sizeof(struct RunCursor*));
+	fanIn = fanIn > MAX_FAN_IN ? MAX_FAN_IN : fanIn < 2 ? 2 : fanIn;
+
+	memset(&out, 0, sizeof(out));
+	while(nRuns > fanIn)
+	{
+		merged = (off_t*) malloc((nRuns / fanIn + 2) * sizeof(off_t));
+		if(merged == NULL || (fd = tempRun(dbName)) == -1 ||
+				(out.run = openRun(fd, "w", &out.buffers[0])) == NULL)
+		{
+			perror("Cannot merge runs");
+			return -1;
+		}
+
+		merged[0] = 0;
+		for(i = 0; i * fanIn < nRuns; i++)
+		{
+			if(mergeRuns(spill, runs + i * fanIn,
+					nRuns - i * fanIn < fanIn ? nRuns - i * fanIn : fanIn,
+					&out) == -1 ||
+					(merged[i + 1] = ftello(out.run)) == -1)
+			{
+				perror("Cannot merge runs");
+				return -1;
+			}
+		}
+		if(closeStream(out.run, out.buffers[0]) != 0)
+		{
+			perror("Cannot merge runs");
+			return -1;
+		}
+
+		close(spill);
+		free(runs);
+		spill = fd;
+		runs = merged;
+		nRuns = i;
+	}
+
+	//the records, birth dates and strings are written at once, each
+	//through its own stream into its own part of the file
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DB_MAGIC, sizeof(header.magic));
+	header.version = DB_VERSION;
+	header.headerSize = sizeof(struct DbHeader);
+	header.recordCount = count;
+	header.stringsSize = stringsSize;
+	header.sourceSize = source.st_size;
+	header.sourceSec = source.st_mtim.tv_sec;
+	header.sourceNsec = source.st_mtim.tv_nsec;
+
+	memset(&out, 0, sizeof(out));
+	snprintf(tempName, sizeof(tempName), "%s.%d", dbName, getpid());
+	if((file = fopen(tempName, "w")) == NULL || ftruncate(fileno(file),
+			sizeof(struct DbHeader) + count * sizeof(struct DbRecord) +
+			count * sizeof(uint32_t) + stringsSize) == -1 ||
+			fclose(file) != 0 ||
+			(out.records = openOutput(tempName, sizeof(struct DbHeader),
+			&out.buffers[1])) == NULL ||
+			(out.births = openOutput(tempName, sizeof(struct DbHeader) +
+			count * sizeof(struct DbRecord), &out.buffers[2])) == NULL ||
+			(out.strings = openOutput(tempName, sizeof(struct DbHeader) +
+			count * (sizeof(struct DbRecord) + sizeof(uint32_t)),
+			&out.buffers[3])) == NULL ||
+			mergeRuns(spill, runs, nRuns, &out) == -1 ||
+			closeStream(out.records, out.buffers[1]) != 0 ||
+			closeStream(out.births, out.buffers[2]) != 0 ||
+			closeStream(out.strings, out.buffers[3]) != 0)
+	{
+		fprintf(stderr, "Cannot write %s (%s)\n", dbName, strerror(errno));
+		unlink(tempName);
+		return -1;
+	}
+	close(spill);
+	free(runs);
+
+	//the data checksum is taken over the file as written, read back a
+	//buffer at a time so that it is not all held in memory at once
+	if((fd = open(tempName, O_RDONLY)) == -1 ||
+			(buffer = (char*) malloc(MERGE_BUFFER)) == NULL ||
+			lseek(fd, sizeof(struct DbHeader), SEEK_SET) == -1)
+	{
+		perror(tempName);
+		unlink(tempName);
+		return -1;
+	}
+	header.dataChecksum = CHECKSUM_SEED;
+	while((got = read(fd, buffer, MERGE_BUFFER)) > 0)
+		header.dataChecksum = extendChecksum(header.dataChecksum, buffer,
+				got);
+	free(buffer);
+	close(fd);
+	if(got == -1)
+	{
+		perror(tempName);
+		unlink(tempName);
+		return -1;
+	}
+	header.headerChecksum = checksum(&header,
+			offsetof(struct DbHeader, headerChecksum));
+
+	if((fd = open(tempName, O_WRONLY)) == -1 || pwrite(fd, &header,
+			sizeof(header), 0) != sizeof(header) || close(fd) == -1 ||
+			rename(tempName, dbName) == -1 || mapFile(dbName, &image) == -1 ||
+			attachDatabase(db, image.data, image.size) == -1)
+	{
+		fprintf(stderr, "Cannot write %s (%s)\n", dbName, strerror(errno));
+		unlink(tempName);
+		return -1;
+	}
+	db->mapped = 1;
+
+	start = monotonicMs() - start;
+	printf("Sorted %llu records into %s in %.1f ms (%.1f MB/s, %zu MB of "
+			"memory)\n", (unsigned long long)count, dbName, start,
+			start > 0 ? source.st_size / start / 1e3 : 0.0,
+			memory >> 20);
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  spillRuns
+*
+* Description:    Reads the CSV file a buffer at a time and writes each
+*                  buffer's records, sorted by last name, to a run of its
+*                  own, the runs one after another in a temporary file. The
+*                  buffer, the record store it is parsed into, the sort
+*                  keys and the run stream take at most the given memory,
+*                  less SORT_RESERVE, whatever the length of the lines: the
+*                  buffer is sized so that a record every MIN_RECORD bytes
+*                  of it still fits. A line that does not fit in the buffer
+*                  is too long to be a record
+*
+* Parameters:     int fd - IMPORT - the CSV file
+*                 char* dbName - IMPORT - name of the sorted file, beside
+*                     which the runs are made
+*                 size_t memory - IMPORT - most bytes to use
+*                 int* spill - EXPORT - the runs' file, unlinked
+*                 off_t** runs - EXPORT - where each run starts in it, then
+*                     where the last one ends
+*                 int* nRuns - EXPORT - the number of runs
+*                 uint64_t* count - EXPORT - the number of records
+*                 uint64_t* stringsSize - EXPORT - the length of their names
+*
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int spillRuns(int fd, char* dbName, size_t memory, int* spill, off_t** runs,
+		int* nRuns, uint64_t* count, uint64_t* stringsSize)
+{
+	struct RecordStore store;
+	struct SortKey* keys;
+	struct SortKey* spare;
+	struct Mapping text;
+	size_t perRecord = 2 * sizeof(struct SortKey) + STORE_RECORD;
+	size_t bufferSize, used = 0, lines = 0, i;
+	ssize_t got = 1;
+	char* buffer;
+	char* split;
+	char* spillBuffer;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN), skipping = 0;
+	FILE* runFile;
+
+	if((size_t)threads > memory / 8 / MIN_CHUNK + 1)
+		threads = memory / 8 / MIN_CHUNK + 1;
+
+	//MIN_RECORD bytes of text per record, and a record more per thread
+	bufferSize = (memory - SORT_RESERVE - MERGE_BUFFER - threads *
+			perRecord) / (MIN_RECORD + perRecord) * MIN_RECORD;
+
+	buffer = (char*) malloc(bufferSize);
+	keys = (struct SortKey*) malloc((bufferSize / MIN_RECORD + threads) *
+			sizeof(struct SortKey));
+	spare = (struct SortKey*) malloc((bufferSize / MIN_RECORD + threads) *
+			sizeof(struct SortKey));
+	*runs = (off_t*) malloc(sizeof(off_t));
+	if(buffer == NULL || keys == NULL || spare == NULL || *runs == NULL ||
+			storeCreate(&store, bufferSize / MIN_RECORD + threads) == -1)
+	{
+		perror("An error occurred");
+		return -1;
+	}
+
+	if((*spill = tempRun(dbName)) == -1 ||
+			(runFile = openRun(*spill, "w", &spillBuffer)) == NULL)
+	{
+		perror("Cannot write a run");
+		return -1;
+	}
+	(*runs)[0] = 0;
+
+	*count = *stringsSize = 0;
+	while(got > 0 || used > 0)
+	{
+		while(used < bufferSize && (got = read(fd, buffer + used,
+				bufferSize - used)) > 0)
+			used += got;
+		if(got == -1)
+		{
+			perror("An error occurred");
+			return -1;
+		}
+
+		//the buffer is cut after its last newline, unless it is the end
+		split = got == 0 ? buffer + used : memrchr(buffer, '\n', used);
+		if(split == NULL || skipping)
+		{
+			//the rest of an overlong line is passed over
+			if(!skipping)
+				fprintf(stderr, "Line %zu is not a record, skipped\n",
+						++lines);
+			split = memchr(buffer, '\n', used);
+			skipping = split == NULL;
+			split = split == NULL ? buffer + used : split + 1;
+			used -= split - buffer;
+			memmove(buffer, split, used);
+			continue;
+		}
+		if(split < buffer + used && *split == '\n')
+			split++;
+
+		text.data = buffer;
+		text.size = split - buffer;
+		store.count = 0;
+		readFile(&text, &store, threads, &lines);
+
+		for(i = 0; i < store.count; i++)
+		{
+			keys[i].prefix = namePrefix(store.firstName[i] +
+					store.firstLength[i] + 1, store.lastLength[i]);
+			keys[i].record = i;
+			keys[i].length = store.lastLength[i];
+			*stringsSize += store.firstLength[i] + store.lastLength[i];
+		}
+		*count += store.count;
+
+		if(store.count > 0)
+		{
+			sortKeys(keys, spare, store.count, &store);
+			*runs = (off_t*) realloc(*runs, (*nRuns + 2) * sizeof(off_t));
+			if(*runs == NULL || writeRun(runFile, &store, keys) == -1 ||
+					((*runs)[*nRuns + 1] = ftello(runFile)) == -1)
+			{
+				perror("Cannot write a run");
+				return -1;
+			}
+			(*nRuns)++;
+		}
+
+		used -= split - buffer;
+		memmove(buffer, split, used);
+	}
+
+	if(closeStream(runFile, spillBuffer) != 0)
+	{
+		perror("Cannot write a run");
+		return -1;
+	}
+
+	storeFree(&store);
+	free(keys);
+	free(spare);
+	free(buffer);
+
+	printf("Finished reading\n");
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  namePrefix
+*
+* Description:    Packs the first eight bytes of a name, padded with zero
+*                  bytes, into an integer that orders as the names do
+*
+* Parameters:     char* name - IMPORT - the name
+*                 size_t length - IMPORT - its length
+*
+* Return Value:   the prefix
+*******************************************************************************/
+uint64_t namePrefix(char* name, size_t length)
+{
+	uint64_t prefix = 0;
+	size_t i;
+
+	for(i = 0; i < 8; i++)
+		prefix = prefix << 8 | (i < length ? (unsigned char)name[i] : 0);
+
+	return prefix;
+}
+
+/*******************************************************************************
+* Function name:  sortKeys
+*
+* Description:    Sorts a run's keys by last name, then by place in the
+*                  store. The name prefixes are sorted by a radix sort, a
+*                  byte a time from the last, which keeps keys with equal
+*                  prefixes in store order; bytes that are the same in
+*                  every key are passed over. Only keys that share a prefix
+*                  but may differ after it are then compared in full
+*
+* Parameters:     struct SortKey* keys - IMPORT/EXPORT - the keys, in store
+*                     order
+*                 struct SortKey* spare - IMPORT - room for as many again
+*                 size_t count - IMPORT - the number of keys
+*                 struct RecordStore* store - IMPORT - the records
+*
+* Return Value:   none
+*******************************************************************************/
+void sortKeys(struct SortKey* keys, struct SortKey* spare, size_t count,
+		struct RecordStore* store)
+{
+	size_t counts[8][256];
+	struct SortKey* from = keys;
+	struct SortKey* to = spare;
+	struct SortKey* swap;
+	size_t i, start, end, offset, n;
+	int pass, tied;
+
+	if(count == 0)
+		return;
+
+	memset(counts, 0, sizeof(counts));
+	for(i = 0; i < count; i++)
+		for(pass = 0; pass < 8; pass++)
+			counts[pass][keys[i].prefix >> 8 * pass & 255]++;
+
+	for(pass = 0; pass < 8; pass++)
+	{
+		if(counts[pass][keys[0].prefix >> 8 * pass & 255] == count)
+			continue;
+
+		for(i = 0, offset = 0; i < 256; i++)
+		{
+			n = counts[pass][i];
+			counts[pass][i] = offset;
+			offset += n;
+		}
+		for(i = 0; i < count; i++)
+			to[counts[pass][from[i].prefix >> 8 * pass & 255]++] = from[i];
+
+		swap = from;
+		from = to;
+		to = swap;
+	}
+	if(from != keys)
+		memcpy(keys, from, count * sizeof(struct SortKey));
+
+	for(start = 0; start < count; start = end)
+	{
+		tied = 0;
+		for(end = start + 1; end < count &&
+				keys[end].prefix == keys[start].prefix; end++)
+			tied |= keys[end].length != keys[start].length ||
+					keys[end].length > 8;
+		if(tied)
+			qsort_r(keys + start, end - start, sizeof(struct SortKey),
+					compareKeys, store);
+	}
+}
+
+/*******************************************************************************
+* Function name:  compareKeys
+*
+* Description:    Orders two records of a store by last name, then by their
+*                  place in the store, for qsort_r()
+*
+* Parameters:     const void* a - IMPORT - a struct SortKey
+*                 const void* b - IMPORT - another
+*                 void* arg - IMPORT - the struct RecordStore
+*
+* Return Value:   less than, equal to or greater than 0 as a comes before,
+*                  is or comes after b
+*******************************************************************************/
+int compareKeys(const void* a, const void* b, void* arg)
+{
+	const struct SortKey* first = a;
+	const struct SortKey* second = b;
+	struct RecordStore* store = arg;
+	uint32_t i = first->record, j = second->record;
+	int order;
+
+	if(first->prefix != second->prefix)
+		return first->prefix < second->prefix ? -1 : 1;
+
+	//names of up to eight bytes are all in the prefix
+	if(first->length <= 8 && second->length <= 8 &&
+			first->length != second->length)
+		return first->length < second->length ? -1 : 1;
+
+	order = compareNames(store->firstName[i] + store->firstLength[i] + 1,
+			store->lastLength[i], store->firstName[j] +
+			store->firstLength[j] + 1, store->lastLength[j]);
+	if(order != 0)
+		return order;
+
+	return i < j ? -1 : i > j;
+}
+
+/*******************************************************************************
+* Function name:  compareNames
+*
+* Description:    Orders two names byte by byte, a name coming before any
+*                  longer name it begins
+*
+* Parameters:     char* a - IMPORT - one name
+*                 size_t aLength - IMPORT - its length
+*                 char* b - IMPORT - the other
+*                 size_t bLength - IMPORT - its length
+*
+* Return Value:   less than, equal to or greater than 0 as a comes before,
+*                  is or comes after b
+*******************************************************************************/
+int compareNames(char* a, size_t aLength, char* b, size_t bLength)
+{
+	int order = memcmp(a, b, aLength < bLength ? aLength : bLength);
+
+	if(order != 0)
+		return order;
+
+	return aLength < bLength ? -1 : aLength > bLength;
+}
+
+/*******************************************************************************
+* Function name:  tempRun
+*
+* Description:    Makes a temporary file for runs beside the sorted file and
+*                  unlinks it, so it is gone once closed, however the
+*                  program ends
+*
+* Parameters:     char* dbName - IMPORT - name of the sorted file
+*
+* Return Value:   the file's descriptor, or -1 on error
+*******************************************************************************/
+int tempRun(char* dbName)
+{
+	char name[4096];
+	int fd;
+
+	snprintf(name, sizeof(name), "%s.run.XXXXXX", dbName);
+	if((fd = mkstemp(name)) != -1)
+		unlink(name);
+
+	return fd;
+}
+
+/*******************************************************************************
+* Function name:  openRun
+*
+* Description:    Opens a stream on a file of runs from its start, with a
+*                  buffer of MERGE_BUFFER bytes. Closing the stream with
+*                  closeStream() leaves the file open
+*
+* Parameters:     int fd - IMPORT - the file
+*                 char* mode - IMPORT - "r" or "w"
+*                 char** buffer - EXPORT - the stream's buffer
+*
+* Return Value:   the stream, or null pointer on error
+*******************************************************************************/
+FILE* openRun(int fd, char* mode, char** buffer)
+{
+	FILE* stream;
+	int copy;
+
+	if(lseek(fd, 0, SEEK_SET) == -1 || (copy = dup(fd)) == -1)
+		return NULL;
+
+	if((stream = fdopen(copy, mode)) == NULL)
+	{
+		close(copy);
+		return NULL;
+	}
+
+	//stdio would pick a buffer of a few kilobytes
+	if((*buffer = (char*) malloc(MERGE_BUFFER)) != NULL)
+		setvbuf(stream, *buffer, _IOFBF, MERGE_BUFFER);
+
+	return stream;
+}
+
+/*******************************************************************************
+* Function name:  openOutput
+*
+* Description:    Opens a stream writing into a file from a given offset,
+*                  with a buffer of MERGE_BUFFER bytes
+*
+* Parameters:     char* fileName - IMPORT - the file
+*                 off_t offset - IMPORT - where to start writing
+*                 char** buffer - EXPORT - the stream's buffer
+*
+* Return Value:   the stream, or null pointer on error
+*******************************************************************************/
+FILE* openOutput(char* fileName, off_t offset, char** buffer)
+{
+	FILE* stream;
+
+	if((stream = fopen(fileName, "r+")) == NULL)
+		return NULL;
+
+	if((*buffer = (char*) malloc(MERGE_BUFFER)) != NULL)
+		setvbuf(stream, *buffer, _IOFBF, MERGE_BUFFER);
+	if(fseeko(stream, offset, SEEK_SET) == -1)
+	{
+		closeStream(stream, *buffer);
+		return NULL;
+	}
+
+	return stream;
+}
+
+/*******************************************************************************
+* Function name:  closeStream
+*
+* Description:    Closes a stream opened by openRun() or openOutput(), if it
+*                  was, and frees its buffer
+*
+* Parameters:     FILE* stream - IMPORT - the stream, or null pointer
+*                 char* buffer - IMPORT - its buffer
+*
+* Return Value:   0 on success, EOF if its data could not be written
+*******************************************************************************/
+int closeStream(FILE* stream, char* buffer)
+{
+	int result = stream == NULL ? 0 : fclose(stream);
+
+	free(buffer);
+	return result;
+}
+
+/*******************************************************************************
+* Function name:  writeRun
+*
+* Description:    Writes a store's records as a run in sorted order, each
+*                  as a struct RunRecord followed by its first and last names
+*
+* Parameters:     FILE* run - IMPORT - the file of runs, at the run's start
+*                 struct RecordStore* store - IMPORT - the records
+*                 struct SortKey* keys - IMPORT - their order
+*
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int writeRun(FILE* run, struct RecordStore* store, struct SortKey* keys)
+{
+	struct RunRecord record;
+	size_t i;
+	uint32_t r;
+
+	for(i = 0; i < store->count; i++)
+	{
+		//the records are taken in no order the cache can guess, so each
+		//one's fields, then its names, are fetched some way ahead
+		if(i + PREFETCH_AHEAD < store->count)
+		{
+			r = keys[i + PREFETCH_AHEAD].record;
+			__builtin_prefetch(&store->firstName[r]);
+			__builtin_prefetch(&store->firstLength[r]);
+			__builtin_prefetch(&store->lastLength[r]);
+			__builtin_prefetch(&store->birth[r]);
+		}
+		if(i + PREFETCH_AHEAD / 2 < store->count)
+			__builtin_prefetch(store->firstName[keys[i +
+					PREFETCH_AHEAD / 2].record]);
+
+		r = keys[i].record;
+		record.firstLength = store->firstLength[r];
+		record.lastLength = store->lastLength[r];
+		record.birth = store->birth[r];
+		fwrite_unlocked(&record, sizeof(record), 1, run);
+		fwrite_unlocked(store->firstName[r], 1, record.firstLength, run);
+		fwrite_unlocked(store->firstName[r] + record.firstLength + 1, 1,
+				record.lastLength, run);
+	}
+
+	return ferror(run) ? -1 : 0;
+}
+
+/*******************************************************************************
+* Function name:  mergeRuns
+*
+* Description:    Merges sorted runs. A binary heap holds the next record of
+*                  each run, least last name on top, with ties going to the
+*                  earlier run so records sharing a name stay in file order.
+*                  Each run is read through a buffer of its own with
+*                  pread(), so the runs share the file's one descriptor
+*
+* Parameters:     int spill - IMPORT - the file of runs
+*                 off_t* runs - IMPORT - where each run starts, in file
+*                     order, then where the last one ends
+*                 int nRuns - IMPORT - the number of runs
+*                 struct MergeOut* out - IMPORT/EXPORT - where to write
+*
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int mergeRuns(int spill, off_t* runs, int nRuns, struct MergeOut* out)
+{
+	struct RunCursor* cursors;
+	struct RunCursor** heap;
+	struct RunCursor* top;
+	struct DbRecord record;
+	int live = 0, i, error = 0;
+
+	cursors = (struct RunCursor*) calloc(nRuns + 1, sizeof(struct RunCursor));
+	heap = (struct RunCursor**) malloc((nRuns + 1) *
+			sizeof(struct RunCursor*));
+	if(cursors == NULL || heap == NULL)
+		return -1;
+
+	for(i = 0; i < nRuns; i++)
+	{
+		cursors[i].run = i;
+		cursors[i].file = spill;
+		cursors[i].offset = runs[i];
+		cursors[i].end = runs[i + 1];
+		if((cursors[i].buffer = (char*) malloc(MERGE_BUFFER)) == NULL)
+			return -1;
+		if(readRun(&cursors[i]) == 1)
+			siftUp(heap, live++, &cursors[i]);
+	}
+
+	while(live > 0)
+	{
+		top = heap[0];
+		if(out->run != NULL)
+		{
+			fwrite_unlocked(&top->record, sizeof(top->record), 1, out->run);
+			fwrite_unlocked(top->names, 1, top->record.firstLength +
+					top->record.lastLength, out->run);
+		}
+		else
+		{
+			record.names = out->names;
+			record.firstLength = top->record.firstLength;
+			record.lastLength = top->record.lastLength;
+			record.birth = top->record.birth;
+			fwrite_unlocked(&record, sizeof(record), 1, out->records);
+			fwrite_unlocked(&record.birth, sizeof(record.birth), 1, out->births);
+			fwrite_unlocked(top->names, 1, record.firstLength + record.lastLength,
+					out->strings);
+			out->names += record.firstLength + record.lastLength;
+		}
+
+		switch(readRun(top))
+		{
+			case 1:
+				siftDown(heap, live, top);
+				break;
+			case -1:
+				error = 1;
+				//fall through
+			default:
+				live--;
+				if(live > 0)
+					siftDown(heap, live, heap[live]);
+		}
+	}
+
+	for(i = 0; i < nRuns; i++)
+	{
+		free(cursors[i].buffer);
+		free(cursors[i].names);
+	}
+	free(cursors);
+	free(heap);
+
+	return error ? -1 : 0;
+}
+
+/*******************************************************************************
+* Function name:  readRun
+*
+* Description:    Reads the next record of a run
+*
+* Parameters:     struct RunCursor* cursor - IMPORT/EXPORT - the run
+*
+* Return Value:   1 if a record was read, 0 at the end of the run, -1 if
+*                  the run is cut short or cannot be read
+*******************************************************************************/
+int readRun(struct RunCursor* cursor)
+{
+	size_t length;
+
+	if(cursor->start == cursor->filled && cursor->offset == cursor->end)
+		return 0;
+
+	if(readRunBytes(cursor, &cursor->record, sizeof(cursor->record)) == -1)
+		return -1;
+
+	length = cursor->record.firstLength + cursor->record.lastLength;
+	if(length > cursor->capacity)
+	{
+		cursor->capacity = length;
+		cursor->names = (char*) realloc(cursor->names, length);
+		if(cursor->names == NULL)
+			return -1;
+	}
+
+	if(readRunBytes(cursor, cursor->names, length) == -1)
+		return -1;
+
+	return 1;
+}
+
+/*******************************************************************************
+* Function name:  readRunBytes
+*
+* Description:    Takes bytes from a run's buffer, filling it again from
+*                  the run as it empties
+*
+* Parameters:     struct RunCursor* cursor - IMPORT/EXPORT - the run
+*                 void* data - EXPORT - where to put the bytes
+*                 size_t length - IMPORT - how many
+*
+* Return Value:   0 on success, -1 if the run is cut short or cannot be read
+*******************************************************************************/
+int readRunBytes(struct RunCursor* cursor, void* data, size_t length)
+{
+	char* to = data;
+	size_t n;
+	ssize_t got;
+
+	while(length > 0)
+	{
+		if(cursor->start == cursor->filled)
+		{
+			n = cursor->end - cursor->offset < MERGE_BUFFER ?
+					cursor->end - cursor->offset : MERGE_BUFFER;
+			if(n == 0 || (got = pread(cursor->file, cursor->buffer, n,
+					cursor->offset)) <= 0)
+				return -1;
+			cursor->offset += got;
+			cursor->start = 0;
+			cursor->filled = got;
+		}
+
+		n = cursor->filled - cursor->start < length ?
+				cursor->filled - cursor->start : length;
+		memcpy(to, cursor->buffer + cursor->start, n);
+		cursor->start += n;
+		to += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  cursorBefore
+*
+* Description:    Says whether one run's record goes before another's
+*
+* Parameters:     struct RunCursor* a - IMPORT - one run
+*                 struct RunCursor* b - IMPORT - the other
+*
+* Return Value:   1 if a's record goes first, 0 if not
+*******************************************************************************/
+int cursorBefore(struct RunCursor* a, struct RunCursor* b)
+{
+	int order = compareNames(a->names + a->record.firstLength,
+			a->record.lastLength, b->names + b->record.firstLength,
+			b->record.lastLength);
+
+	return order < 0 || (order == 0 && a->run < b->run);
+}
+
+/*******************************************************************************
+* Function name:  siftUp
+*
+* Description:    Adds a run to the end of the merge heap and moves it up to
+*                  its place
+*
+* Parameters:     struct RunCursor** heap - IMPORT/EXPORT - the heap
+*                 int i - IMPORT - the number of runs already in it
+*                 struct RunCursor* cursor - IMPORT - the run to add
+*
+* Return Value:   none
+*******************************************************************************/
+void siftUp(struct RunCursor** heap, int i, struct RunCursor* cursor)
+{
+	while(i > 0 && cursorBefore(cursor, heap[(i - 1) / 2]))
+	{
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = cursor;
+}
+
+/*******************************************************************************
+* Function name:  siftDown
+*
+* Description:    Puts a run at the top of the merge heap and moves it down
+*                  to its place
+*
+* Parameters:     struct RunCursor** heap - IMPORT/EXPORT - the heap
+*                 int count - IMPORT - the number of runs in it
+*                 struct RunCursor* cursor - IMPORT - the run for the top
+*
+* Return Value:   none
+*******************************************************************************/
+void siftDown(struct RunCursor** heap, int count, struct RunCursor* cursor)
+{
+	int i = 0, child;
+
+	while((child = 2 * i + 1) < count)
+	{
+		if(child + 1 < count && cursorBefore(heap[child + 1], heap[child]))
+			child++;
+		if(!cursorBefore(heap[child], cursor))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = cursor;
+}
+
+/*******************************************************************************
+* Function name:  buildDatabase
+*
+* Description:    Lays out the database image in memory: the header, a
+*                  fixed-width record for each person, everyone's birth
+*                  date again in one array, the last name index and the
+*                  string table holding each first name followed
+*                  by its last name. The records are grouped by last name,
+*                  each group in file order, and the index is an
+*                  open-addressing hash table with one slot per name, kept
+*                  at most half full, holding the record number + 1 of the
+*                  first of its group
+*
+* Parameters:     struct Database* db - EXPORT - the image
+*                 struct RecordStore* store - IMPORT - the records
+*                 struct stat* source - IMPORT - the CSV file compiled
+*
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int buildDatabase(struct Database* db, struct RecordStore* store,
+		struct stat* source)
+{
+	struct DbHeader* header;
+	struct DbRecord* record;
+	uint64_t stringsSize = 0, slotCount = 2, slot;
+	size_t count = store->count, groups, i;
+	uint32_t* position;
+	uint32_t* first;
+	uint32_t* next;
+	uint32_t size;
+	char* names;
+
+	for(i = 0; i < count; i++)
+		stringsSize += store->firstLength[i] + store->lastLength[i];
+
+	if(count >= UINT32_MAX)
+	{
+		fprintf(stderr, "Cannot compile %zu records\n", count);
+		return -1;
+	}
+
+	position = (uint32_t*) malloc((count + 1) * sizeof(uint32_t));
+	first = (uint32_t*) malloc((count + 1) * sizeof(uint32_t));
+	next = (uint32_t*) malloc((count + 1) * sizeof(uint32_t));
+	if(position == NULL || first == NULL || next == NULL ||
+			groupNames(store, position, first, next, &groups) == -1)
+	{
+		perror("An error occurred");
+		free(position);
+		free(first);
+		free(next);
+		return -1;
+	}
+
+	while(slotCount < groups * 2)
+		slotCount *= 2;
+
+	db->size = sizeof(struct DbHeader) + count * sizeof(struct DbRecord) +
+			count * sizeof(uint32_t) + slotCount * sizeof(uint32_t) +
+			stringsSize;
+	db->data = calloc(1, db->size);
+	if(db->data == NULL)
+	{
+		perror("An error occurred");
+		free(position);
+		free(first);
+		free(next);
+		return -1;
+	}
+	db->mapped = 0;
+
+	header = (struct DbHeader*) db->data;
+	memcpy(header->magic, DB_MAGIC, sizeof(header->magic));
+	header->version = DB_VERSION;
+	header->headerSize = sizeof(struct DbHeader);
+	header->recordCount = count;
+	header->slotCount = slotCount;
+	header->stringsSize = stringsSize;
+	header->sourceSize = source->st_size;
+	header->sourceSec = source->st_mtim.tv_sec;
+	header->sourceNsec = source->st_mtim.tv_nsec;
+	header->headerChecksum = checksum(header,
+			offsetof(struct DbHeader, headerChecksum));
+
+	attachDatabase(db, db->data, db->size);
+
+	//each group starts where the one before it ends
+	for(i = 0, slot = 0; i < groups; i++)
+	{
+		size = next[i];
+		next[i] = slot;
+		slot += size;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		position[i] = next[position[i]]++;
+		record = &db->records[position[i]];
+		record->firstLength = store->firstLength[i];
+		record->lastLength = store->lastLength[i];
+		record->birth = store->birth[i];
+		db->births[position[i]] = store->birth[i];
+	}
+
+	names = db->strings;
+	for(i = 0; i < count; i++)
+	{
+		record = &db->records[i];
+		record->names = names - db->strings;
+		names += record->firstLength + record->lastLength;
+	}
+
+	for(i = 0; i < count; i++)
+	{
+		names = db->strings + db->records[position[i]].names;
+		memcpy(names, store->firstName[i], store->firstLength[i]);
+		memcpy(names + store->firstLength[i], store->firstName[i] +
+				store->firstLength[i] + 1, store->lastLength[i]);
+	}
+
+	for(i = 0; i < groups; i++)
+	{
+		slot = store->lastHash[first[i]] & (slotCount - 1);
+		while(db->slots[slot] != 0)
+			slot = (slot + 1) & (slotCount - 1);
+		db->slots[slot] = position[first[i]] + 1;
+	}
+
+	free(position);
+	free(first);
+	free(next);
+
+	header->dataChecksum = checksum(db->data + sizeof(struct DbHeader),
+			db->size - sizeof(struct DbHeader));
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  groupNames
+*
+* Description:    Sorts the records into groups by last name, numbered in
+*                  order of each name's first appearance, through a hash
+*                  table of the groups kept at most half full
+*
+* Parameters:     struct RecordStore* store - IMPORT - the records
+*                 uint32_t* group - EXPORT - each record's group
+*                 uint32_t* first - EXPORT - each group's first record
+*                 uint32_t* size - EXPORT - number of records in each group
+*                 size_t* groups - EXPORT - number of groups
+*
+* Return Value:   0 on success, -1 if memory runs out
+*******************************************************************************/
+int groupNames(struct RecordStore* store, uint32_t* group, uint32_t* first,
+		uint32_t* size, size_t* groups)
+{
+	size_t tableSize = 2, slot, i;
+	uint32_t* table;
+	uint32_t entry;
+	char* name;
+
+	while(tableSize < store->count * 2)
+		tableSize *= 2;
+
+	table = (uint32_t*) calloc(tableSize, sizeof(uint32_t));
+	if(table == NULL)
+		return -1;
+
+	*groups = 0;
+	for(i = 0; i < store->count; i++)
+	{
+		name = store->firstName[i] + store->firstLength[i] + 1;
+		slot = store->lastHash[i] & (tableSize - 1);
+		while((entry = table[slot]) != 0)
+		{
+			entry = first[entry - 1];
+			if(store->lastHash[entry] == store->lastHash[i] &&
+					store->lastLength[entry] == store->lastLength[i] &&
+					!memcmp(store->firstName[entry] +
+					store->firstLength[entry] + 1, name,
+					store->lastLength[i]))
+				break;
+			slot = (slot + 1) & (tableSize - 1);
+		}
+
+		if(table[slot] == 0)
+		{
+			first[*groups] = i;
+			size[*groups] = 0;
+			table[slot] = ++*groups;
+		}
+		group[i] = table[slot] - 1;
+		size[group[i]]++;
+	}
+
+	free(table);
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  attachDatabase
+*
+* Description:    Checks a database image's header and finds its parts. The
+*                  data checksum is not checked here, as that means reading
+*                  the whole file; see verifyDatabase()
+*
+* Parameters:     struct Database* db - EXPORT - the database
+*                 char* data - IMPORT - the image
+*                 size_t size - IMPORT - size of the image
+*
+* Return Value:   0 on success, -1 if the image is not a database of this
+*                  version, its size does not match its header, or its
+*                  index is too small to hold an empty slot
+*******************************************************************************/
+int attachDatabase(struct Database* db, char* data, size_t size)
+{
+	struct DbHeader* header = (struct DbHeader*) data;
+
+	if(size < sizeof(struct DbHeader) ||
+			memcmp(header->magic, DB_MAGIC, sizeof(header->magic)) ||
+			header->version != DB_VERSION ||
+			header->headerSize != sizeof(struct DbHeader))
+		return -1;
+
+	if(header->headerChecksum !=
+			checksum(header, offsetof(struct DbHeader, headerChecksum)))
+		return -1;
+
+	//an index is built with at least one name's slot and one empty one
+	if(header->recordCount >= UINT32_MAX || (header->slotCount != 0 &&
+			((header->slotCount & (header->slotCount - 1)) != 0 ||
+			header->slotCount < 2)) ||
+			size != sizeof(struct DbHeader) +
+			header->recordCount * sizeof(struct DbRecord) +
+			header->recordCount * sizeof(uint32_t) +
+			header->slotCount * sizeof(uint32_t) + header->stringsSize)
+		return -1;
+
+	db->data = data;
+	db->size = size;
+	db->header = header;
+	db->records = (struct DbRecord*) (data + sizeof(struct DbHeader));
+	db->births = (uint32_t*) (db->records + header->recordCount);
+	db->slots = db->births + header->recordCount;
+	db->strings = (char*) (db->slots + header->slotCount);
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  verifyDatabase
+*
+* Description:    Checks the data checksum of a database, that every
+*                  record and index entry stays inside the file, that the
+*                  index has an empty slot, and that a sorted database is
+*                  in order
+*
+* Parameters:     struct Database* db - IMPORT - the database
+*
+* Return Value:   0 if the database is sound, -1 if not
+*******************************************************************************/
+int verifyDatabase(struct Database* db)
+{
+	struct DbRecord* record;
+	uint64_t i, used = 0;
+
+	if(db->header->dataChecksum != checksum(db->data +
+			sizeof(struct DbHeader), db->size - sizeof(struct DbHeader)))
+		return -1;
+
+	for(i = 0; i < db->header->recordCount; i++)
+	{
+		record = &db->records[i];
+		if(record->names + record->firstLength + record->lastLength >
+				db->header->stringsSize)
+			return -1;
+
+		if(db->header->slotCount == 0 && i > 0 && compareNames(db->strings +
+				record[-1].names + record[-1].firstLength,
+				record[-1].lastLength, db->strings + record->names +
+				record->firstLength, record->lastLength) > 0)
+			return -1;
+	}
+
+	for(i = 0; i < db->header->slotCount; i++)
+	{
+		if(db->slots[i] > db->header->recordCount)
+			return -1;
+		used += db->slots[i] != 0;
+	}
+
+	if(db->header->slotCount != 0 && used == db->header->slotCount)
+		return -1;
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  checksum
+*
+* Description:    64-bit checksum of a block, eight bytes at a time, then
+*                  the bytes left over
+*
+* Parameters:     void* data - IMPORT - the block
+*                 size_t size - IMPORT - its size
+*
+* Return Value:   the checksum
+*******************************************************************************/
+uint64_t checksum(void* data, size_t size)
+{
+	return extendChecksum(CHECKSUM_SEED, data, size);
+}
+
+/*******************************************************************************
+* Function name:  extendChecksum
+*
+* Description:    Carries a checksum on over a further block, so a file can
+*                  be checksummed a piece at a time. Every piece but the
+*                  last must be a whole number of eight-byte words
+*
+* Parameters:     uint64_t hash - IMPORT - checksum of what came before, or
+*                     CHECKSUM_SEED at the start
+*                 void* data - IMPORT - the block
+*                 size_t size - IMPORT - its size
+*
+* Return Value:   the checksum
+*******************************************************************************/
+uint64_t extendChecksum(uint64_t hash, void* data, size_t size)
+{
+	unsigned char* bytes = data;
+	uint64_t word;
+
+	for(; size >= 8; size -= 8, bytes += 8)
+	{
+		memcpy(&word, bytes, 8);
+		hash = (hash ^ word) * 1099511628211ULL;
+		hash ^= hash >> 29;
+	}
+
+	for(; size > 0; size--)
+		hash = (hash ^ *bytes++) * 1099511628211ULL;
+
+	return hash;
+}
+
+/*******************************************************************************
+* Function name:  hashName
+*
+* Description:    FNV-1a hash of a name
+*
+* Parameters:     char* name - IMPORT - name to hash
+*                 size_t length - IMPORT - length of the name
+*
+* Return Value:   the hash
+*******************************************************************************/
+uint32_t hashName(char* name, size_t length)
+{
+	uint32_t hash = 2166136261u;
+
+	while(length-- > 0)
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/*******************************************************************************
+* Function name:  monotonicMs
+*
+* Description:    Reads the monotonic clock
+*
+* Parameters:     none
+*
+* Return Value:   the time in milliseconds
+*******************************************************************************/
+double monotonicMs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+/*******************************************************************************
+* Function name:  search
+*
+* Description:    Finds the next record with a given last name. Call with
+*                  *position set to SEARCH_START for the first match, then
+*                  again with the same position for each further one. The
+*                  index leads to the first record with the name, and the
+*                  others follow it
+*
+* Parameters:     struct Database* db - IMPORT - the database
+*                 char* name - IMPORT - name to search for
+*                 size_t length - IMPORT - length of the name
+*                 size_t* position - IMPORT/EXPORT - record number of the
+*                     last match
+*
+* Return Value:   pointer to the next record that matches the name, or null
+*                  pointer if there are no more
+*******************************************************************************/
+struct DbRecord* search(struct Database* db, char* name, size_t length,
+		size_t* position)
+{
+	struct DbRecord* current;
+	size_t mask = db->header->slotCount - 1, slot, probes;
+	uint32_t entry;
+
+	if(db->header->slotCount == 0)
+		return searchSorted(db, name, length, position);
+
+	if(*position != SEARCH_START)
+		return recordNamed(db, ++*position, name, length);
+
+	//a name's slot lies between its home slot and the next empty one;
+	//an unverified index may have none, so stop after one lap
+	slot = hashName(name, length) & mask;
+	for(probes = 0; probes <= mask && (entry = db->slots[slot]) != 0;
+			probes++)
+	{
+		current = recordNamed(db, entry - 1, name, length);
+		if(current != NULL)
+		{
+			*position = entry - 1;
+			return current;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+/*******************************************************************************
+* Function name:  searchSorted
+*
+* Description:    search() for a database whose records are sorted by last
+*                  name: the first match is found by binary search, and
+*                  each further one is the next record. A record whose
+*                  names lie outside the file is taken to sort first
+*
+* Parameters:     struct Database* db - IMPORT - the database
+*                 char* name - IMPORT - name to search for
+*                 size_t length - IMPORT - length of the name
+*                 size_t* position - IMPORT/EXPORT - record number of the
+*                     last match
+*
+* Return Value:   pointer to the next record that matches the name, or null
+*                  pointer if there are no more
+*******************************************************************************/
+struct DbRecord* searchSorted(struct Database* db, char* name, size_t length,
+		size_t* position)
+{
+	struct DbRecord* current;
+	size_t low = 0, high = db->header->recordCount, middle;
+
+	if(*position != SEARCH_START)
+		return recordNamed(db, ++*position, name, length);
+
+	//the first record whose name is not before this one
+	while(low < high)
+	{
+		middle = low + (high - low) / 2;
+		current = &db->records[middle];
+		if(current->names + current->firstLength + current->lastLength >
+				db->header->stringsSize || compareNames(db->strings +
+				current->names + current->firstLength,
+				current->lastLength, name, length) < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	*position = low;
+
+	return recordNamed(db, low, name, length);
+}
+
+/*******************************************************************************
+* Function name:  recordNamed
+*
+* Description:    Looks at one record to see if it has a given last name. A
+*                  record whose names lie outside the file has none
+*
+* Parameters:     struct Database* db - IMPORT - the database
+*                 size_t position - IMPORT - record number
+*                 char* name - IMPORT - name to look for
+*                 size_t length - IMPORT - length of the name
+*
+* Return Value:   pointer to the record if it has the name, or null pointer
+*                  if not or if there is no such record
+*******************************************************************************/
+struct DbRecord* recordNamed(struct Database* db, size_t position, char* name,
+		size_t length)
+{
+	struct DbRecord* current;
+
+	if(position >= db->header->recordCount)
+		return NULL;
+
+	current = &db->records[position];
+	if(current->lastLength == length && current->names +
+			current->firstLength + length <= db->header->stringsSize &&
+			!memcmp(db->strings + current->names + current->firstLength,
+			name, length))
+		return current;
+
+	return NULL;
+}
+
+/*******************************************************************************
+* Function name:  lookup
+*
+* Description:    Prints every record with a given last name
+*
+* Parameters:     struct Database* db - IMPORT - the database
+*                 char* name - IMPORT - name to look up
+*
+* Return Value:   number of records found
+*******************************************************************************/
+int lookup(struct Database* db, char* name)
+{
+	struct DbRecord* found;
+	struct NameRec Current;
+	size_t position = SEARCH_START;
+	int count = 0;
+
+	while((found = search(db, name, strlen(name), &position)) != NULL)
+	{
+		if(count++ == 0)
+			printf("Record found:\n");
+
+		memset(&Current, 0, sizeof(Current));
+		Current.firstName = db->strings + found->names;
+		Current.firstLength = found->firstLength;
+		Current.lastName = Current.firstName + found->firstLength;
+		Current.lastLength = found->lastLength;
+		Current.year = DATE_YEAR(found->birth);
+		Current.month = DATE_MONTH(found->birth);
+		Current.day = DATE_DAY(found->birth);
+		printRecord(&Current);
+	}
+
+	if(count == 0)
+		printf("No record for %s\n", name);
+
+	return count;
+}
+
+/*******************************************************************************
+* Function name:  lookupBatch
+*
+* Description:    Looks up each last name in a file, one per line. Blank
+*                  lines are skipped
+*
+* Parameters:     struct Database* db - IMPORT - the database
+*                 FILE* names - IMPORT - the names to look up
+*
+* Return Value:   none
+*******************************************************************************/
+void lookupBatch(struct Database* db, FILE* names)
+{
+	char name[256];
+	size_t length;
+
+	while(fgets(name, sizeof(name), names) != NULL)
+	{
+		length = strcspn(name, "\r\n");
+		name[length] = '\0';
+		if(length > 0)
+			lookup(db, name);
+	}
+}
+
+/*******************************************************************************
+* Function name:  serve
+*
+* Description:    Answers lookups over a Unix domain socket until SIGINT or
+*                  SIGTERM. One thread runs an epoll loop over the listening
+*                  socket, every client, an inotify watch on the directory
+*                  of people.dat and the reloader's pipe. When people.dat is
+*                  replaced or rewritten, the reloader thread opens (and if
+*                  need be compiles) the database again while lookups go on
+*                  against the old one, and the loop swaps in the new one
+*                  between two requests, so each request sees one or the
+*                  other whole
+*
+* Parameters:     char* path - IMPORT - path of the socket
+*                 size_t memory - IMPORT - bytes to sort people.idx in and
+*                     answer from it, or 0 to use people.db
+*
+* Return Value:   0 on a clean shutdown, -1 if the server cannot start
+*******************************************************************************/
+int serve(char* path, size_t memory)
+{
+	struct Server server;
+	struct sockaddr_un address;
+	struct epoll_event event, events[SERVE_EVENTS];
+	struct signalfd_siginfo info;
+	struct Client* client;
+	sigset_t signals;
+	int i, n;
+
+	memset(&server, 0, sizeof(server));
+	server.memory = memory;
+	server.db = (struct Database*) malloc(sizeof(struct Database));
+	if(server.db == NULL || openDatabase(server.db, memory > 0 ? IDX_NAME :
+			DB_NAME, "people.dat", memory))
+		return -1;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+
+	//SIGINT and SIGTERM are read from a signalfd so the socket is removed
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	signal(SIGPIPE, SIG_IGN);
+
+	unlink(path);
+	if((server.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+			SOCK_CLOEXEC, 0)) == -1 || bind(server.listenFd,
+			(struct sockaddr*) &address, sizeof(address)) == -1 ||
+			listen(server.listenFd, SOMAXCONN) == -1 ||
+			(server.epoll = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+			(server.notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ||
+			inotify_add_watch(server.notifyFd, ".", IN_CLOSE_WRITE |
+			IN_MOVED_TO) == -1 ||
+			pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0 ||
+			(server.signalFd = signalfd(-1, &signals, SFD_CLOEXEC)) == -1 ||
+			pipe2(server.reloadRequest, O_CLOEXEC) == -1 ||
+			pipe2(server.reloadDone, O_CLOEXEC) == -1 ||
+			pthread_create(&server.reloader, NULL, reloader, &server) != 0)
+	{
+		perror("An error occurred");
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u64 = SERVE_LISTEN;
+	epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.listenFd, &event);
+	event.data.u64 = SERVE_NOTIFY;
+	epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.notifyFd, &event);
+	event.data.u64 = SERVE_SIGNAL;
+	epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.signalFd, &event);
+	event.data.u64 = SERVE_RELOADED;
+	epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.reloadDone[0], &event);
+
+	printf("Serving %llu records on %s\n",
+			(unsigned long long)server.db->header->recordCount, path);
+	fflush(stdout);
+
+	for(;;)
+	{
+		n = epoll_wait(server.epoll, events, SERVE_EVENTS, -1);
+
+		for(i = 0; i < n; i++)
+		{
+			if(events[i].data.u64 == SERVE_LISTEN)
+				serveAccept(&server);
+			else if(events[i].data.u64 == SERVE_NOTIFY)
+				serveNotify(&server);
+			else if(events[i].data.u64 == SERVE_RELOADED)
+				serveReloaded(&server);
+			else if(events[i].data.u64 == SERVE_SIGNAL)
+			{
+				read(server.signalFd, &info, sizeof(info));
+				unlink(path);
+				printf("Stopped by signal %u\n", info.ssi_signo);
+				return 0;
+			}
+			else
+			{
+				client = (struct Client*) events[i].data.ptr;
+				if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				{
+					if(serveRead(&server, client) == -1)
+						continue;
+				}
+				if(events[i].events & EPOLLOUT)
+					serveWrite(&server, client);
+			}
+		}
+	}
+}
+
+/*******************************************************************************
+* Function name:  serveAccept
+*
+* Description:    Accepts every waiting connection
+*
+* Parameters:     struct Server* server - IMPORT/EXPORT - the server
+*
+* Return Value:   none
+*******************************************************************************/
+void serveAccept(struct Server* server)
+{
+	struct epoll_event event;
+	struct Client* client;
+	int fd;
+
+	while((fd = accept4(server->listenFd, NULL, NULL, SOCK_NONBLOCK |
+			SOCK_CLOEXEC)) != -1)
+	{
+		client = (struct Client*) calloc(1, sizeof(struct Client));
+		if(client == NULL)
+		{
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->events = EPOLLIN;
+		event.events = EPOLLIN;
+		event.data.ptr = client;
+		epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+/*******************************************************************************
+* Function name:  serveRead
+*
+* Description:    Reads what a client has sent and answers the requests it
+*                  completes
+*
+* Parameters:     struct Server* server - IMPORT/EXPORT - the server
+*                 struct Client* client - IMPORT/EXPORT - the client
+*
+* Return Value:   0, or -1 if the client has gone and was closed
+*******************************************************************************/
+int serveRead(struct Server* server, struct Client* client)
+{
+	ssize_t got;
+
+	got = read(client->fd, client->in + client->inUsed,
+			sizeof(client->in) - client->inUsed);
+
+	if(got == 0 || (got == -1 && errno != EAGAIN && errno != EINTR))
+	{
+		serveClose(server, client);
+		return -1;
+	}
+
+	if(got > 0)
+		client->inUsed += got;
+
+	return serveRequests(server, client);
+}
+
+/*******************************************************************************
+* Function name:  serveRequests
+*
+* Description:    Answers the complete requests in a client's input, until
+*                  too many answers are waiting to be sent, and sends what
+*                  it can
+*
+* Parameters:     struct Server* server - IMPORT/EXPORT - the server
+*                 struct Client* client - IMPORT/EXPORT - the client
+*
+* Return Value:   0, or -1 if the client was closed
+*******************************************************************************/
+int serveRequests(struct Server* server, struct Client* client)
+{
+	size_t used = 0;
+	uint16_t length;
+
+	while(client->inUsed - used >= 2 &&
+			client->outUsed - client->outSent < OUT_LIMIT)
+	{
+		memcpy(&length, client->in + used, 2);
+		length = ntohs(length);
+		if(client->inUsed - used < 2 + (size_t)length)
+			break;
+
+		if(answer(server->db, client, client->in + used + 2, length) == -1)
+		{
+			serveClose(server, client);
+			return -1;
+		}
+		used += 2 + length;
+	}
+
+	memmove(client->in, client->in + used, client->inUsed - used);
+	client->inUsed -= used;
+
+	return serveWrite(server, client);
+}
+
+/*******************************************************************************
+* Function name:  serveWrite
+*
+* Description:    Sends as much of a client's answers as the socket takes,
+*                  and waits for the socket to drain or for more requests as
+*                  needed. Reading stops while too many answers are waiting
+*
+* Parameters:     struct Server* server - IMPORT/EXPORT - the server
+*                 struct Client* client - IMPORT/EXPORT - the client
+*
+* Return Value:   0, or -1 if the client was closed
+*******************************************************************************/
+int serveWrite(struct Server* server, struct Client* client)
+{
+	struct epoll_event event;
+	ssize_t sent;
+	int wasBlocked = client->outUsed - client->outSent >= OUT_LIMIT;
+
+	while(client->outSent < client->outUsed)
+	{
+		sent = send(client->fd, client->out + client->outSent,
+				client->outUsed - client->outSent, MSG_NOSIGNAL);
+		if(sent == -1 && errno == EINTR)
+			continue;
+		if(sent == -1 && errno == EAGAIN)
+			break;
+		if(sent == -1)
+		{
+			serveClose(server, client);
+			return -1;
+		}
+		client->outSent += sent;
+	}
+
+	if(client->outSent == client->outUsed)
+		client->outSent = client->outUsed = 0;
+
+	//answers held back by the limit can go out now
+	if(wasBlocked && client->outUsed - client->outSent < OUT_LIMIT &&
+			client->inUsed > 0)
+		return serveRequests(server, client);
+
+	event.events = 0;
+	if(client->outUsed - client->outSent < OUT_LIMIT)
+		event.events |= EPOLLIN;
+	if(client->outSent < client->outUsed)
+		event.events |= EPOLLOUT;
+
+	if(event.events != client->events)
+	{
+		client->events = event.events;
+		event.data.ptr = client;
+		epoll_ctl(server->epoll, EPOLL_CTL_MOD, client->fd, &event);
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  serveClose
+*
+* Description:    Closes a client's connection and frees it
+*
+* Parameters:     struct Server* server - IMPORT/EXPORT - the server
+*                 struct Client* client - IMPORT/EXPORT - the client
+*
+* Return Value:   none
+*******************************************************************************/
+void serveClose(struct Server* server, struct Client* client)
+{
+	epoll_ctl(server->epoll, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	free(client->out);
+	free(client);
+}
+
+/*******************************************************************************
+* Function name:  answer
+*
+* Description:    Adds the answer to one request to a client's output: the
+*                  length of the rest, the number of records, then for each
+*                  record the lengths of its names, its packed birth date
+*                  and the names, every number in network byte order
+*
+* Parameters:     struct Database* db - IMPORT - the database
+*                 struct Client* client - IMPORT/EXPORT - the client
+*                 char* name - IMPORT - last name asked for
+*                 size_t length - IMPORT - its length
+*
+* Return Value:   0 on success, -1 if memory runs out
+*******************************************************************************/
+int answer(struct Database* db, struct Client* client, char* name,
+		size_t length)
+{
+	struct DbRecord* found;
+	size_t position = SEARCH_START, start = client->outUsed;
+	uint32_t count = 0, word;
+	uint16_t half;
+	char* out;
+
+	if(outReserve(client, 8) == -1)
+		return -1;
+	client->outUsed += 8;
+
+	while((found = search(db, name, length, &position)) != NULL)
+	{
+		if(outReserve(client, 8 + found->firstLength +
+				found->lastLength) == -1)
+			return -1;
+
+		out = client->out + client->outUsed;
+		half = htons(found->firstLength);
+		memcpy(out, &half, 2);
+		half = htons(found->lastLength);
+		memcpy(out + 2, &half, 2);
+		word = htonl(found->birth);
+		memcpy(out + 4, &word, 4);
+		memcpy(out + 8, db->strings + found->names,
+				found->firstLength + found->lastLength);
+
+		client->outUsed += 8 + found->firstLength + found->lastLength;
+		count++;
+	}
+
+	word = htonl(client->outUsed - start - 4);
+	memcpy(client->out + start, &word, 4);
+	word = htonl(count);
+	memcpy(client->out + start + 4, &word, 4);
+
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  outReserve
+*
+* Description:    Makes room for more bytes in a client's output
+*
+* Parameters:     struct Client* client - IMPORT/EXPORT - the client
+*                 size_t bytes - IMPORT - bytes about to be added
+*
+* Return Value:   0 on success, -1 if memory runs out
+*******************************************************************************/
+int outReserve(struct Client* client, size_t bytes)
+{
+	size_t size = client->outSize > 0 ? client->outSize : 4096;
+	char* out;
+
+	if(client->outUsed + bytes <= client->outSize)
+		return 0;
+
+	while(size < client->outUsed + bytes)
+		size *= 2;
+
+	if((out = (char*) realloc(client->out, size)) == NULL)
+		return -1;
+
+	client->out = out;
+	client->outSize = size;
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  serveNotify
+*
+* Description:    Reads the inotify events and asks for a reload if
+*                  people.dat was written or moved into place. A change
+*                  during a reload is picked up by another once it is done
+*
+* Parameters:     struct Server* server - IMPORT/EXPORT - the server
+*
+* Return Value:   none
+*******************************************************************************/
+void serveNotify(struct Server* server)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event* event;
+	ssize_t got;
+	char* p;
+
+	while((got = read(server->notifyFd, buffer, sizeof(buffer))) > 0)
+	{
+		for(p = buffer; p < buffer + got; p += sizeof(*event) + event->len)
+		{
+			event = (struct inotify_event*) p;
+			if(event->len == 0 || strcmp(event->name, "people.dat"))
+				continue;
+
+			if(server->reloading)
+				server->reloadPending = 1;
+			else
+			{
+				server->reloading = 1;
+				write(server->reloadRequest[1], "", 1);
+			}
+		}
+	}
+}
+
+/*******************************************************************************
+* Function name:  serveReloaded
+*
+* Description:    Swaps in the database the reloader has opened and closes
+*                  the old one, which no request can be using between
+*                  events. If people.dat changed during the reload, another
+*                  is started
+*
+* Parameters:     struct Server* server - IMPORT/EXPORT - the server
+*
+* Return Value:   none
+*******************************************************************************/
+void serveReloaded(struct Server* server)
+{
+	struct Database* db;
+
+	if(read(server->reloadDone[0], &db, sizeof(db)) != sizeof(db))
+		return;
+
+	if(db == NULL)
+		fprintf(stderr, "Reload failed, still serving the old records\n");
+	else
+	{
+		closeDatabase(server->db);
+		server->db = db;
+		printf("Reloaded %llu records\n",
+				(unsigned long long)db->header->recordCount);
+		fflush(stdout);
+	}
+
+	server->reloading = server->reloadPending;
+	server->reloadPending = 0;
+	if(server->reloading)
+		write(server->reloadRequest[1], "", 1);
+}
+
+/*******************************************************************************
+* Function name:  reloader
+*
+* Description:    Body of the reloader thread: for each request, opens the
+*                  database again, compiling it if people.dat has changed,
+*                  and hands it to the loop
+*
+* Parameters:     void* arg - IMPORT - the struct Server
+*
+* Return Value:   NULL
+*******************************************************************************/
+void* reloader(void* arg)
+{
+	struct Server* server = arg;
+	struct Database* db;
+	char byte;
+
+	while(read(server->reloadRequest[0], &byte, 1) == 1)
+	{
+		db = (struct Database*) malloc(sizeof(struct Database));
+		if(db != NULL && openDatabase(db, server->memory > 0 ? IDX_NAME :
+				DB_NAME, "people.dat", server->memory) == -1)
+		{
+			free(db);
+			db = NULL;
+		}
+
+		write(server->reloadDone[1], &db, sizeof(db));
+	}
+
+	return NULL;
+}
+
+/*******************************************************************************
+* Function name:  closeDatabase
+*
+* Description:    Unmaps or frees a database opened by openDatabase(), and
+*                  the struct holding it
+*
+* Parameters:     struct Database* db - IMPORT/EXPORT - the database
+*
+* Return Value:   none
+*******************************************************************************/
+void closeDatabase(struct Database* db)
+{
+	if(db->mapped)
+		munmap(db->data, db->size);
+	else
+		free(db->data);
+	free(db);
+}
+
+/*******************************************************************************
+* Function name:  queryServer
+*
+* Description:    Looks up each last name in a file, one per line, through
+*                  a server, and prints the answers as lookup() does. Up to
+*                  CLIENT_WINDOW requests are sent before waiting for
+*                  answers. The number of requests and the time they took
+*                  are printed to standard error
+*
+* Parameters:     char* path - IMPORT - path of the server's socket
+*                 FILE* names - IMPORT - the names to look up
+*
+* Return Value:   0 on success, -1 if the server cannot be reached or hangs
+*                  up
+*******************************************************************************/
+int queryServer(char* path, FILE* names)
+{
+	static char sent[CLIENT_WINDOW][256];
+	struct sockaddr_un address;
+	struct NameRec Current;
+	char request[CLIENT_WINDOW * 258];
+	char* body = NULL;
+	size_t requestUsed, length, bodySize = 0, queries = 0;
+	uint32_t header[2], count, birth;
+	uint16_t lengths[2];
+	int fd, outstanding = 0, next = 0, done = 0;
+	double start = monotonicMs();
+	FILE* in;
+	char* p;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 || connect(fd,
+			(struct sockaddr*) &address, sizeof(address)) == -1 ||
+			(in = fdopen(fd, "r")) == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	for(;;)
+	{
+		//send as many requests as the window has room for
+		requestUsed = 0;
+		while(!done && outstanding < CLIENT_WINDOW)
+		{
+			p = sent[(next + outstanding) % CLIENT_WINDOW];
+			if(fgets(p, sizeof(sent[0]), names) == NULL)
+			{
+				done = 1;
+				break;
+			}
+			length = strcspn(p, "\r\n");
+			p[length] = '\0';
+			if(length == 0)
+				continue;
+
+			lengths[0] = htons(length);
+			memcpy(request + requestUsed, lengths, 2);
+			memcpy(request + requestUsed + 2, p, length);
+			requestUsed += 2 + length;
+			outstanding++;
+		}
+
+		if(requestUsed > 0 && write(fd, request, requestUsed) !=
+				(ssize_t) requestUsed)
+		{
+			perror(path);
+			return -1;
+		}
+
+		if(outstanding == 0)
+			break;
+
+		//then print the answer to the oldest
+		if(fread(header, 4, 2, in) != 2 || ntohl(header[0]) < 4)
+		{
+			fprintf(stderr, "%s: connection lost\n", path);
+			return -1;
+		}
+
+		length = ntohl(header[0]) - 4;
+		if(length > bodySize)
+		{
+			bodySize = length;
+			if((body = (char*) realloc(body, bodySize)) == NULL)
+			{
+				perror("An error occurred");
+				return -1;
+			}
+		}
+		if(fread(body, 1, length, in) != length)
+		{
+			fprintf(stderr, "%s: connection lost\n", path);
+			return -1;
+		}
+
+		count = ntohl(header[1]);
+		if(count == 0)
+			printf("No record for %s\n", sent[next]);
+		else
+			printf("Record found:\n");
+
+		for(p = body; count > 0 && p + 8 <= body + length; count--)
+		{
+			memcpy(lengths, p, 4);
+			memcpy(&birth, p + 4, 4);
+			birth = ntohl(birth);
+
+			memset(&Current, 0, sizeof(Current));
+			Current.firstName = p + 8;
+			Current.firstLength = ntohs(lengths[0]);
+			Current.lastName = Current.firstName + Current.firstLength;
+			Current.lastLength = ntohs(lengths[1]);
+			if(p + 8 + Current.firstLength + Current.lastLength >
+					body + length)
+				break;
+			Current.year = DATE_YEAR(birth);
+			Current.month = DATE_MONTH(birth);
+			Current.day = DATE_DAY(birth);
+			printRecord(&Current);
+
+			p += 8 + Current.firstLength + Current.lastLength;
+		}
+
+		next = (next + 1) % CLIENT_WINDOW;
+		outstanding--;
+		queries++;
+	}
+
+	fprintf(stderr, "%zu queries in %.1f ms\n", queries,
+			monotonicMs() - start);
+
+	free(body);
+	fclose(in);
+	return 0;
+}
+
+/*******************************************************************************
+* Function name:  analyze
+*
+* Description:    Prints a histogram of everyone's age in whole years, the
+*                  number born in each month and how many are aged within a
+*                  range, from the column of packed birth dates. Records are
+*                  taken a block at a time: ageBlock() works out the ages in
+*                  loops free of branches and calls, which the compiler
+*                  vectorizes, and the counts are then kept in several
+*                  tables at once so no increment waits on the one before.
+*                  The last block is copied and padded with year 0, whose
+*                  people are older than any range counted
+*
+* Parameters:     struct Database* db - IMPORT - the database
+*                 int minAge - IMPORT - least age in the range
+*                 int maxAge - IMPORT - greatest age in the range
+*
+* Return Value:   none
+*******************************************************************************/
+void analyze(struct Database* db, int minAge, int maxAge)
+{
+	static char* monthNames[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	uint64_t ageCounts[HIST_TABLES][MAX_AGE + 2];
+	uint64_t monthCounts[HIST_TABLES][16];
+	uint64_t total, inRange = 0, sum, count = db->header->recordCount;
+	uint8_t ages[ANALYZE_BLOCK], months[ANALYZE_BLOCK];
+	uint32_t tail[ANALYZE_BLOCK];
+	uint32_t* births;
+	uint32_t today = currentDate();
+	double start = monotonicMs();
+	size_t i, j, n;
+	int age, t;
+
+	memset(ageCounts, 0, sizeof(ageCounts));
+	memset(monthCounts, 0, sizeof(monthCounts));
+
+	for(i = 0; i < count; i += n)
+	{
+		n = count - i < ANALYZE_BLOCK ? count - i : ANALYZE_BLOCK;
+		births = db->births + i;
+		if(n < ANALYZE_BLOCK)
+		{
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, births, n * sizeof(uint32_t));
+			births = tail;
+		}
+		inRange += ageBlock(births, today, minAge, maxAge, ages, months);
+
+		for(j = 0; j + HIST_TABLES <= n; j += HIST_TABLES)
+		{
+			for(t = 0; t < HIST_TABLES; t++)
+			{
+				ageCounts[t][ages[j + t]]++;
+				monthCounts[t][months[j + t]]++;
+			}
+		}
+		for(; j < n; j++)
+		{
+			ageCounts[0][ages[j]]++;
+			monthCounts[0][months[j]]++;
+		}
+	}
+
+	start = monotonicMs() - start;
+
+	for(t = 1; t < HIST_TABLES; t++)
+	{
+		for(age = 0; age < MAX_AGE + 2; age++)
+			ageCounts[0][age] += ageCounts[t][age];
+		for(j = 0; j < 16; j++)
+			monthCounts[0][j] += monthCounts[t][j];
+	}
+	total = count > 0 ? count : 1;
+
+	printf("%llu records analyzed in %.1f ms (%.0f million per second)\n",
+			(unsigned long long)count, start,
+			start > 0 ? count / start / 1000 : 0.0);
+
+	printf("\n%-10s%12s%9s\n", "Age", "People", "Share");
+	if(ageCounts[0][0] > 0)
+		printf("%-10s%12llu%8.2f%%\n", "unborn",
+				(unsigned long long)ageCounts[0][0],
+				100.0 * ageCounts[0][0] / total);
+	for(age = 0; age <= MAX_AGE; age += 5)
+	{
+		for(sum = 0, j = age + 1; j <= (size_t)age + 5 && j < MAX_AGE + 2; j++)
+			sum += ageCounts[0][j];
+		if(age == MAX_AGE)
+			printf("%d+%*s%12llu%8.2f%%\n", age, 6, "",
+					(unsigned long long)sum, 100.0 * sum / total);
+		else
+			printf("%3d - %-4d%12llu%8.2f%%\n", age, age + 4,
+					(unsigned long long)sum, 100.0 * sum / total);
+	}
+
+	printf("\n%-10s%12s%9s\n", "Born in", "People", "Share");
+	for(j = 1; j <= 12; j++)
+		printf("%-10s%12llu%8.2f%%\n", monthNames[j - 1],
+				(unsigned long long)monthCounts[0][j],
+				100.0 * monthCounts[0][j] / total);
+
+	printf("\nAged %d to %d: %llu (%.2f%%)\n", minAge, maxAge,
+			(unsigned long long)inRange, 100.0 * inRange / total);
+}
+
+/*******************************************************************************
+* Function name:  ageBlock
+*
+* Description:    Works out the age of each of a block of people from their
+*                  packed birth dates, as an index into the age histogram:
+*                  0 for someone not yet born, age + 1 up to MAX_AGE, and
+*                  MAX_AGE + 1 beyond. A year is counted once the birthday's
+*                  month and day come round: with both packed as month * 32
+*                  + day, that is one integer comparison. The block is
+*                  always ANALYZE_BLOCK long, so the loop needs no scalar
+*                  remainder and is vectorized at -O2
+*
+* Parameters:     uint32_t* births - IMPORT - ANALYZE_BLOCK packed dates
+*                 uint32_t today - IMPORT - today's packed date
+*                 int minAge - IMPORT - least age counted
+*                 int maxAge - IMPORT - greatest age counted
+*                 uint8_t* ages - EXPORT - histogram index of each age
+*                 uint8_t* months - EXPORT - birth month of each
+*
+* Return Value:   the number aged from minAge to maxAge
+*******************************************************************************/
+size_t ageBlock(uint32_t* restrict births, uint32_t today, int minAge,
+		int maxAge, uint8_t* restrict ages, uint8_t* restrict months)
+{
+	int32_t year = today >> 9, monthDay = today & 511, age;
+	size_t i, inRange = 0;
+
+	for(i = 0; i < ANALYZE_BLOCK; i++)
+	{
+		age = year - (int32_t)(births[i] >> 9) -
+				((int32_t)(births[i] & 511) > monthDay);
+		inRange += age >= minAge && age <= maxAge;
+		age = age < -1 ? -1 : age;
+		age = age > MAX_AGE ? MAX_AGE : age;
+		ages[i] = age + 1;
+		months[i] = births[i] >> 5 & 15;
+	}
+
+	return inRange;
+}
+
+/*******************************************************************************
+* Function name:  currentDate
+*
+* Description:    Finds today's date in the local time zone, once
+*
+* Parameters:     none
+*
+* Return Value:   the date, packed as PACK_DATE(year, month, day)
+*******************************************************************************/
+uint32_t currentDate(void)
+{
+	static uint32_t today;
+	struct tm now;
+	time_t timer;
+
+	if(today == 0)
+	{
+		time(&timer);
+		localtime_r(&timer, &now);
+		today = PACK_DATE(now.tm_year + 1900, now.tm_mon + 1, now.tm_mday);
+	}
+
+	return today;
+}
+
+/*******************************************************************************
+* Function name:  printRecord
+*                                                                             
+* Description:    Prints the information held in a record and calculates the 
+*                  age of the person, in whole years and months, from the
+*                  calendar dates alone
+*                                                                             
+* Parameters:     struct NameRec* Record - IMPORT - record to print
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void printRecord(struct NameRec* Record)
+{
+	static char* monthNames[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+			"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	uint32_t today = currentDate();
+	int months;
+	
+	printf("First Name: %.*s\n", Record->firstLength, Record->firstName);
+	printf("Last Name: %.*s\n", Record->lastLength, Record->lastName);
+	
+	//a month is counted once its day of the month comes round
+	months = (DATE_YEAR(today) - Record->year) * 12 +
+			DATE_MONTH(today) - Record->month -
+			((int)DATE_DAY(today) < Record->day);
+	
+	printf("Birthdate: %s %d, %d\n", monthNames[Record->month - 1],
+			Record->day, Record->year);
+	if(months < 0)
+		printf("Age: not born yet\n");
+	else
+		printf("Age: %d years %d months\n", months / 12, months % 12);
 }
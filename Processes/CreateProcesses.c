@@ -6,8 +6,110 @@
 *               1 and 12, and creates N child processes. Each child process runs
 *               an empty for loop [its PID] number of times, and information 
 *               about each running process is printed.
+*
+*               Usage: CreateProcesses [-s fork|vfork|spawn|clone] [-r] [-u]
+*                                      [-a cpus | -A nodes] N
+*                      CreateProcesses -e running [-t ms] [-s backend] [-u]
+*                                      [-a cpus | -A nodes] N
+*                      CreateProcesses -p workers [-u] [-a cpus | -A nodes] N
+*                      CreateProcesses -b count [-m sizes]
+*                      CreateProcesses -k kernels [-w workers] [-d ms]
+*                      CreateProcesses -q count [-w workers]
+*
+*               Compile with -pthread.
+*
+*               -u adds each process's resource usage from wait4() to its
+*               exit line: user and system CPU time, peak RSS, voluntary and
+*               involuntary context switches, and minor and major page
+*               faults. After the last exit a summary gives the totals for
+*               all children, the wall-clock time and the CPU utilization
+*               they amount to, and the user, system and busy share of each
+*               online CPU over the run, taken from /proc/stat.
+*               -a pins the children (or pool workers) round-robin to the
+*               CPUs in the given list, e.g. 0-3,8; -A pins them round-robin
+*               to the given NUMA nodes, each child allowed on all of its
+*               node's CPUs. Forked children pin themselves; for the other
+*               backends the parent holds the child's CPUs while spawning
+*               it, so the child inherits them from its first instruction.
+*
+*               -r has the children report through a result ring instead
+*               of printing: a memfd mapped shared by the parent and every
+*               child (exec'd children are handed its descriptor), holding a
+*               lock-free multi-producer queue of fixed-size records. A
+*               child claims a slot with one compare-and-swap, writes its
+*               record in place and publishes it by bumping the slot's
+*               sequence number; the parent reads records where they lie
+*               and sleeps on a futex only when the ring stays empty. Each
+*               child publishes a start record, its progress at 25, 50 and
+*               75% and its result (loops run and time taken). The parent
+*               prints every child's records and exit line together, child
+*               1 first, so the output is the same on every run.
+*               -q measures that channel against one shared pipe written a
+*               record at a time: one child, then the given number (default
+*               one per online core), each sending count records, with the
+*               records per second and megabytes per second the parent
+*               reads.
+*
+*               -k compares processes with threads on workload kernels
+*               (comma separated, or all):
+*                   cpu      a dependent chain of integer multiply and shift
+*                            steps (Mops/s)
+*                   mem      the STREAM triad over 48 MB per worker (GB/s)
+*                   syscall  getppid() system calls (Mcalls/s)
+*               Each kernel runs with 1, 2, 4, ... up to the given number of
+*               workers (default one per online core), once as forked
+*               processes and once on a pool of threads. Every worker does
+*               the same work, sized so one worker takes about the given
+*               time (default 200 ms), and sets up its memory before the
+*               clock starts. Throughput and the scaling efficiency against
+*               one worker of the same model are printed for each count.
+*
+*               -s selects how the children are created:
+*                   fork    fork(), with the child running in a copy of the
+*                           parent (the default)
+*                   vfork   vfork() and an exec of this program
+*                   spawn   posix_spawn() of this program
+*                   clone   clone() with CLONE_VM, so no page tables are
+*                           copied, on a stack of its own; the child only
+*                           resets signal handlers and execs this program,
+*                           and the parent waits for the exec before it
+*                           reuses anything the child could touch
+*               fork() copies the parent's page tables, so its cost grows
+*               with the parent's memory; the others do not copy them.
+*
+*               -b measures each backend: the parent grows to each of the
+*               given sizes (comma separated, k/M/G suffixes, default
+*               0,256M,1G of touched memory), then spawns count children
+*               one at a time, each exec'ing this program to exit at once.
+*               For every backend and size, the p50, p99 and maximum time
+*               until the spawn call returned and until the child's exit
+*               was collected are printed in microseconds.
+*
+*               -e creates N children, where N may be any positive number,
+*               keeping at most the given number running at once and
+*               starting a new one as soon as another is reaped. Each child
+*               gets a pidfd in one epoll set, so an exit costs one event
+*               and one waitpid() for that child however many are running;
+*               on kernels without pidfds one signalfd for SIGCHLD is used
+*               instead. -t gives each child that many milliseconds: a
+*               timerfd in the same epoll set fires at the oldest deadline
+*               and a child still running then is killed with SIGKILL.
+*
+*               -p runs N jobs, where N may be any positive number, on a
+*               pool of pre-forked worker processes instead of forking a
+*               child per task (0 workers, the default count, selects one
+*               per online core). Each job runs the same empty loop [the
+*               worker's PID] times and ends with status 15. Jobs are handed
+*               to workers over a pipe per worker, at most two at a time so
+*               a worker never waits for its next job, and results come back
+*               over one shared pipe. Each job's status is printed as it
+*               arrives, in the same form as a child's exit. A worker that
+*               dies is reported, its job is reported as killed, its queued
+*               jobs go back to the queue and a new worker takes its place.
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -15,32 +117,460 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/futex.h>
+
+#define POOL_DEPTH      2       //jobs queued to a worker at once
+
+#define SPAWN_FORK      0
+#define SPAWN_VFORK     1
+#define SPAWN_POSIX     2
+#define SPAWN_CLONE     3
+#define SPAWN_COUNT     4
+
+#define CLONE_STACK     (64 * 1024)
+#define BENCH_SIZES     "0,256M,1G"
+#define MAX_SIZES       16
+
+#define EV_BATCH        256     //epoll events handled per wakeup
+
+#define NODE_CPULIST    "/sys/devices/system/node/node%d/cpulist"
+
+#define KERNEL_COUNT    3
+#define KERNEL_MS       200     //default time for one worker's share
+#define MEM_ELEMENTS    (2 * 1024 * 1024)   //doubles in each triad array
+
+#define RING_SLOTS      4096    //records in the result ring, a power of 2
+#define RING_SPINS      1000    //empty polls before the parent sleeps
+#define RING_WAIT_MS    100     //longest sleep before looking for exits
+#define CHANNEL_BATCH   2048    //records read from the pipe at once
+
+#define RECORD_START    0
+#define RECORD_PROGRESS 1
+#define RECORD_RESULT   2
+
+#define SELF_EXE        "/proc/self/exe"
+#define CHILD_ARG       "--child"       //run as child number argv[2]
+#define EXIT_ARG        "--exit"        //exit at once (benchmark child)
+
+//a job handed to a worker
+struct Job
+{
+    long id;
+};
+
+//what a worker sends back when a job is done
+struct JobResult
+{
+    long id;
+    pid_t pid;
+    int status;                 //in the form wait() reports
+};
+
+//a pool worker and the jobs it has been given but not finished
+struct Worker
+{
+    pid_t pid;
+    int jobFd;
+    long pending[POOL_DEPTH];   //oldest first
+    int nPending;
+};
+
+//the pre-forked pool and its queue of jobs
+struct Pool
+{
+    struct Worker* workers;
+    int nWorkers;
+    int resultFd;
+    int resultWriteFd;
+    long nextJob;               //next job never handed out
+    long nJobs;
+    long* retry;                //jobs taken back from dead workers
+    long nRetry;
+    long done;
+};
+
+//what a clone()d child needs before its exec
+struct CloneArgs
+{
+    char** argv;
+    int errFd;                  //close-on-exec pipe for the exec's errno
+    sigset_t mask;              //signal mask to restore before the exec
+};
+
+//a running child of the event loop
+struct EvChild
+{
+    pid_t pid;
+    int number;
+    int pidFd;                  //-1 when reaping through the signalfd
+    long long deadline;         //CLOCK_MONOTONIC ns, 0 for no timeout
+    int killed;                 //1 once SIGKILL reached it at its deadline
+    struct EvChild* older;      //children with deadlines, oldest first
+    struct EvChild* newer;
+    struct EvChild* hashNext;   //next child in the same PID bucket
+};
+
+//state of the event-driven mode
+struct EventLoop
+{
+    int epollFd;
+    int timerFd;
+    int sigFd;                  //-1 when every child has a pidfd
+    struct EvChild* slots;
+    struct EvChild** freeSlots;
+    int nFree;
+    struct EvChild** byPid;
+    int hashMask;
+    struct EvChild* oldest;     //next deadline to expire
+    struct EvChild* newest;
+    long long armed;            //deadline the timer is set for, 0 if none
+    long long timeoutNs;
+    int backend;
+    long started;
+    int running;
+};
+
+//one CPU's line of /proc/stat, in clock ticks
+struct CpuTimes
+{
+    int online;
+    unsigned long long user;    //user and nice
+    unsigned long long sys;     //system, irq and softirq
+    unsigned long long total;
+};
+
+//resource usage of every process reaped, kept for -u
+struct Accounting
+{
+    int enabled;
+    long processes;
+    double user;
+    double sys;
+    long maxRss;
+    long volSwitches;
+    long involSwitches;
+    long minorFaults;
+    long majorFaults;
+    long long startNs;
+    struct CpuTimes* cpuStart;
+    int nCpus;
+};
+
+//a workload kernel for -k
+struct Kernel
+{
+    char* name;
+    char* unit;
+    double unitsPerIteration;
+    void* (*setup)(void);       //per worker, before the clock starts
+    uint64_t (*run)(void*, long);
+    void (*cleanup)(void*);
+};
+
+//a thread of the kernel thread pool
+struct KernelThread
+{
+    pthread_t thread;
+    struct Kernel* kernel;
+    long iterations;
+    pthread_barrier_t* barrier;
+    uint64_t result;
+};
+
+//a record a child publishes to the result ring
+struct Record
+{
+    uint32_t type;              //RECORD_START, RECORD_PROGRESS, RECORD_RESULT
+    uint32_t child;             //child number, from 1
+    uint32_t seq;               //record number within the child
+    int32_t pid;
+    int64_t value;              //percent done, or the result
+    int64_t ns;                 //time since the child started
+};
+
+//a slot of the result ring, one cache line
+struct RingSlot
+{
+    uint64_t seq;               //ticket + 1 once published, ticket + slots
+    struct Record record;       //  once free for the next lap
+} __attribute__((aligned(64)));
+
+//the result ring, shared by the parent and every child through a memfd;
+//the counters sit on lines of their own so producers and the consumer
+//do not contend for one line
+struct ResultRing
+{
+    uint64_t enqueue __attribute__((aligned(64)));  //next ticket to claim
+    uint64_t dequeue __attribute__((aligned(64)));  //parent only
+    uint32_t wake __attribute__((aligned(64)));     //futex word
+    uint32_t sleeping;          //the parent waits on wake
+    struct RingSlot slots[RING_SLOTS];
+};
+
+//what the parent holds of a child until its turn to be printed
+struct ChildOutput
+{
+    FILE* file;                 //its records, while an earlier child runs
+    char* text;
+    size_t len;
+    int done;                   //no more records will come
+    int reaped;
+    int status;
+    struct rusage usage;
+};
+
+static struct Accounting totals;
+static cpu_set_t* pinSets;      //CPUs for child 1, 2, ... in turn
+static int nPinSets;
+static int sigPipe[2] = {-1, -1};
+static struct ResultRing* resultRing;   //children report here with -r
+static int ringFd = -1;
+static char* spawnNames[SPAWN_COUNT] = {"fork", "vfork", "spawn", "clone"};
+extern char** environ;
 
-void createChildren(long);
+void createChildren(long, int);
+void childMain(int);
+pid_t spawnChild(int, char**);
+pid_t cloneChild(char**);
+int cloneStart(void*);
+void spawnBench(long, char*);
+int parseSizes(char*, long long*);
+int compareLong(const void*, const void*);
+void createEvented(long, int, int, long);
+int evStart(struct EventLoop*, int);
+int evSpawn(struct EventLoop*);
+void evReap(struct EventLoop*, struct EvChild*, int, struct rusage*);
+void evExpire(struct EventLoop*);
+void evArm(struct EventLoop*);
+void evUnlink(struct EventLoop*, struct EvChild*);
+struct EvChild* evFind(struct EventLoop*, pid_t);
+long long monotonicNs(void);
+void reportStatus(long, pid_t, int, struct rusage*);
+void acctStart(void);
+void acctSummary(void);
+int readCpuTimes(struct CpuTimes*, int);
+int parseCpuList(char*, cpu_set_t*, int);
+int pinSetup(char*, int);
+void pinSelf(int);
+pid_t spawnPinned(int, char**, int);
+int kernelBench(char*, int, long);
+long kernelCalibrate(struct Kernel*, long);
+double kernelProcesses(struct Kernel*, int, long);
+double kernelThreads(struct Kernel*, int, long);
+void* kernelThreadMain(void*);
+uint64_t cpuRun(void*, long);
+void* memSetup(void);
+uint64_t memRun(void*, long);
+uint64_t syscallRun(void*, long);
+void* noSetup(void);
+struct ResultRing* ringCreate(void);
+struct ResultRing* ringAttach(int);
+void ringPublish(struct ResultRing*, struct Record*);
+struct Record* ringPeek(struct ResultRing*);
+struct Record* ringConsume(struct ResultRing*, int);
+void ringRelease(struct ResultRing*);
+void childPublish(int, int, int, long long, long long);
+void collectResults(long, pid_t*);
+void printRecord(FILE*, struct Record*);
+void channelBench(long, int);
+double channelRun(int, int, long);
+
+static struct Kernel kernels[KERNEL_COUNT] = {
+    {"cpu", "Mops/s", 1e-6, noSetup, cpuRun, free},
+    {"mem", "GB/s", 24e-9 * MEM_ELEMENTS, memSetup, memRun, free},
+    {"syscall", "Mcalls/s", 1e-6, noSetup, syscallRun, free}
+};
+
+static volatile uint64_t kernelSink;    //kernel results, so none is dropped
+void createPool(long, int);
+int poolStart(struct Pool*, int);
+int poolSpawn(struct Pool*, int);
+void poolFeed(struct Pool*);
+void poolResults(struct Pool*);
+void poolReap(struct Pool*);
+void workerLoop(int, int);
+int runJob(struct Job*);
+void onChild(int);
 
 int main(int argc, char** argv)
 {
-    long n;
+    long n, benchCount = 0, timeoutMs = 0, kernelMs = KERNEL_MS;
+    int i, opt, workers = -1, backend = SPAWN_FORK, running = 0, nodes = 0;
+    int kernelWorkers = 0, useRing = 0;
+    long channelCount = 0;
+    char* pins = NULL;
+    char* kernelNames = NULL;
     char* end;
-    char* usage = "Usage: %s N (where N is an integer between 1 and 12)\n";
+    char* sizes = BENCH_SIZES;
+    char* usage = "Usage: %s [-s fork|vfork|spawn|clone] [-r] [-u] "
+            "[-a cpus | -A nodes] N (where N is an integer between 1 and 12)\n"
+            "       %s -e running [-t ms] [-s backend] [-u] "
+            "[-a cpus | -A nodes] N (where N is any positive number)\n"
+            "       %s -p workers [-u] [-a cpus | -A nodes] N (where N is any "
+            "positive number of jobs)\n"
+            "       %s -b count [-m sizes]\n"
+            "       %s -k cpu|mem|syscall|all [-w workers] [-d ms]\n"
+            "       %s -q count [-w workers]\n";
+    
+    // Children started by the exec'ing backends come back in here, with
+    // the result ring's descriptor after their number under -r
+    if(argc == 4 && strcmp(argv[1], CHILD_ARG) == 0 &&
+            (resultRing = ringAttach(atoi(argv[3]))) == NULL)
+        return 1;
+    if((argc == 3 || argc == 4) && strcmp(argv[1], CHILD_ARG) == 0)
+        childMain(atoi(argv[2]));
+    if(argc == 2 && strcmp(argv[1], EXIT_ARG) == 0)
+        return 0;
+    
+    while((opt = getopt(argc, argv, "p:s:b:m:e:t:ua:A:k:w:d:rq:")) != -1)
+    {
+        if(opt == 'p')
+        {
+            workers = strtol(optarg, &end, 10);
+            if(*end != '\0' || workers < 0)
+                workers = -2;
+        }
+        else if(opt == 's')
+        {
+            for(i = 0; i < SPAWN_COUNT && strcmp(optarg, spawnNames[i]); i++);
+            backend = i;
+        }
+        else if(opt == 'b')
+        {
+            benchCount = strtol(optarg, &end, 10);
+            if(*end != '\0' || benchCount < 1)
+                workers = -2;
+        }
+        else if(opt == 'm')
+            sizes = optarg;
+        else if(opt == 'e')
+        {
+            running = strtol(optarg, &end, 10);
+            if(*end != '\0' || running < 1)
+                workers = -2;
+        }
+        else if(opt == 't')
+        {
+            timeoutMs = strtol(optarg, &end, 10);
+            if(*end != '\0' || timeoutMs < 1)
+                workers = -2;
+        }
+        else if(opt == 'u')
+            totals.enabled = 1;
+        else if(opt == 'r')
+            useRing = 1;
+        else if(opt == 'q')
+        {
+            channelCount = strtol(optarg, &end, 10);
+            if(*end != '\0' || channelCount < 1)
+                workers = -2;
+        }
+        else if(opt == 'k')
+            kernelNames = optarg;
+        else if(opt == 'd')
+        {
+            kernelMs = strtol(optarg, &end, 10);
+            if(*end != '\0' || kernelMs < 1)
+                workers = -2;
+        }
+        else if(opt == 'w')
+        {
+            kernelWorkers = strtol(optarg, &end, 10);
+            if(*end != '\0' || kernelWorkers < 1)
+                workers = -2;
+        }
+        else if(opt == 'a' || opt == 'A')
+        {
+            if(pins != NULL)
+                workers = -2;
+            pins = optarg;
+            nodes = opt == 'A';
+        }
+        else
+            workers = -2;
+    }
+    
+    if(kernelNames != NULL && optind == argc && workers == -1 && 
+            benchCount == 0 && timeoutMs == 0 && !totals.enabled && 
+            pins == NULL && backend == SPAWN_FORK && running == 0 &&
+            !useRing && channelCount == 0 &&
+            kernelBench(kernelNames, kernelWorkers > 0 ? kernelWorkers : 
+            sysconf(_SC_NPROCESSORS_ONLN), kernelMs) == 0)
+        return 0;
+    
+    if(benchCount > 0 && optind == argc && workers == -1 && 
+            backend == SPAWN_FORK && running == 0 && timeoutMs == 0 &&
+            !totals.enabled && pins == NULL && !useRing && channelCount == 0)
+    {
+        spawnBench(benchCount, sizes);
+        return 0;
+    }
+    
+    if(channelCount > 0 && optind == argc && workers == -1 && 
+            backend == SPAWN_FORK && running == 0 && timeoutMs == 0 &&
+            !totals.enabled && pins == NULL && !useRing && 
+            kernelNames == NULL && benchCount == 0 && kernelMs == KERNEL_MS)
+    {
+        channelBench(channelCount, kernelWorkers > 0 ? kernelWorkers :
+                sysconf(_SC_NPROCESSORS_ONLN));
+        return 0;
+    }
 	
-	if(argc != 2)
+	if(optind != argc - 1 || workers == -2 || backend == SPAWN_COUNT || 
+            benchCount > 0 || kernelNames != NULL || kernelWorkers > 0 ||
+            kernelMs != KERNEL_MS || channelCount > 0 ||
+            (useRing && (workers >= 0 || running > 0)) || 
+            (workers >= 0 && backend != SPAWN_FORK) ||
+            (workers >= 0 && running > 0) || (timeoutMs > 0 && running == 0) ||
+            (pins != NULL && pinSetup(pins, nodes) == -1))
 	{
-		printf(usage, argv[0]);
+		printf(usage, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
     
-    n = strtol(argv[1], &end, 10);
+    n = strtol(argv[optind], &end, 10);
     
-    if(n < 1 || n > 12)
+    if(*end != '\0' || n < 1 || (workers == -1 && running == 0 && n > 12))
     {
-        printf(usage, argv[0]);
+        printf(usage, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
     
-    createChildren(n);
-	
-	return 0;
+    if(workers == 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    if(totals.enabled)
+        acctStart();
+    
+    if(useRing && (resultRing = ringCreate()) == NULL)
+        return 1;
+    
+    if(workers > 0)
+        createPool(n, workers);
+    else if(running > 0)
+        createEvented(n, backend, running, timeoutMs);
+    else
+        createChildren(n, backend);
+    
+    if(totals.enabled)
+        acctSummary();
+    
+    return 0;
 }
 
 /*******************************************************************************
@@ -49,19 +579,39 @@ int main(int argc, char** argv)
 * Description:    Creates a specified number of child processes and prints 
 *                  information about the process IDs as a process is created
 *                  or exits. Each child process runs an empty for loop [its PID]
-*                  number of times.
+*                  number of times. With the result ring the children's
+*                  records and exits are printed in child order.
 *                                                                             
-* Parameters:     long n - IMPORT - number of processes to create
+* Parameters:     long n      - IMPORT - number of processes to create
+*                 int backend - IMPORT - SPAWN_FORK, or how to start a copy
+*                   of this program that runs the child's part
 *                                                                             
 * Return Value:   none
 *******************************************************************************/
-void createChildren(long n)
+void createChildren(long n, int backend)
 {
     int i, idx, status;
     int childrenLeft = n;
+    char number[24], fd[24];
+    char* childArgv[] = {SELF_EXE, CHILD_ARG, number, NULL, NULL};
+    struct rusage usage;
     pid_t pid;
+    pid_t* pids = NULL;
+
+    if (resultRing != NULL)
+    {
+        snprintf(fd, sizeof(fd), "%d", ringFd);
+        childArgv[3] = fd;
+        pids = malloc(sizeof(pid_t) * n);
+        if (pids == NULL)
+        {
+            perror("malloc");
+            exit(1);
+        }
+    }
 
     printf("Parent PID = %d creating %d processes\n", getpid(), n);
+    fflush(stdout);
     
     /* The following code has been modified from 
     http://faculty.kutztown.edu/frye/secure/CSC352/Examples/waitpid_ex.c
@@ -70,6 +620,16 @@ void createChildren(long n)
     for(i = 0; i < n; i++)
     {
         // Create a child process
+        if (backend != SPAWN_FORK)
+        {
+            snprintf(number, sizeof(number), "%d", i+1);
+            if ((pid = spawnPinned(backend, childArgv, i+1)) == -1)
+                exit(1);
+            if (pids != NULL)
+                pids[i] = pid;
+            continue;
+        }
+        
         if ((pid = fork()) < 0)
         {
             perror("fork");
@@ -78,29 +638,2433 @@ void createChildren(long n)
 
         if (pid == 0)
         {
-            // Child process
-            int count, childPID;
-            childPID = getpid();
-            printf("Child process %d created: PID = %d\n", i+1, childPID);
-            for(count = 1; count <= childPID; count++);
-            exit(15);
+            pinSelf(i+1);
+            childMain(i+1);
         }
+        if (pids != NULL)
+            pids[i] = pid;
+    }
+
+    if (pids != NULL)
+    {
+        collectResults(n, pids);
+        free(pids);
+        return;
     }
 
     while(childrenLeft > 0)
     {
         // Parent process
-        pid = wait(&status);
-
-        if (WIFEXITED(status))
-            printf("PID %d exits: %d\n", pid, WEXITSTATUS(status));
-        else if (WIFSTOPPED(status))
-            printf("PID %d stopped by: %d\n", pid, WSTOPSIG(status));
-        else if (WIFSIGNALED(status))
-            printf("PID %d killed by: %d\n", pid, WTERMSIG(status));
+        pid = wait4(-1, &status, 0, &usage);
+        reportStatus(-1, pid, status, &usage);
+        childrenLeft--;
+    }
+}
+
+/*******************************************************************************
+* Function name:  childMain
+*                                                                             
+* Description:    The child's part: prints its number and PID and runs an
+*                  empty for loop [its PID] number of times. With the result
+*                  ring it publishes those, its progress each quarter of the
+*                  way and its result instead of printing
+*                                                                             
+* Parameters:     int number - IMPORT - which child this is, from 1
+*                                                                             
+* Return Value:   none; exits with status 15
+*******************************************************************************/
+void childMain(int number)
+{
+    volatile int count;
+    int childPID, quarter;
+    long long start = monotonicNs();
+    
+    childPID = getpid();
+    if (resultRing == NULL)
+        printf("Child process %d created: PID = %d\n", number, childPID);
+    else
+        childPublish(RECORD_START, number, 0, 0, start);
+    
+    count = 1;
+    for(quarter = 1; quarter <= 4; quarter++)
+    {
+        for(; count <= (long long)childPID * quarter / 4; count++);
+        if (resultRing == NULL)
+            continue;
+        if (quarter < 4)
+            childPublish(RECORD_PROGRESS, number, quarter, quarter * 25, start);
         else
-            perror("Waitpid");
+            childPublish(RECORD_RESULT, number, quarter, count - 1, start);
+    }
+    exit(15);
+}
+
+/*******************************************************************************
+* Function name:  spawnChild
+*                                                                             
+* Description:    Starts a program in a new process with one of the spawn
+*                  backends. Except with fork, the call returns once the
+*                  exec has happened
+*                                                                             
+* Parameters:     int backend  - IMPORT - SPAWN_FORK, SPAWN_VFORK, 
+*                   SPAWN_POSIX or SPAWN_CLONE
+*                 char** argv  - IMPORT - program and its arguments
+*                                                                             
+* Return Value:   the child's PID, or -1 on error
+*******************************************************************************/
+pid_t spawnChild(int backend, char** argv)
+{
+    pid_t pid;
+    int rc;
+    
+    if (backend == SPAWN_POSIX)
+    {
+        rc = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+        if (rc != 0)
+        {
+            errno = rc;
+            perror("posix_spawn");
+            return -1;
+        }
+        return pid;
+    }
+    
+    if (backend == SPAWN_CLONE)
+        return cloneChild(argv);
+    
+    // The vfork child shares our memory until the exec, so it may only
+    // exec or _exit
+    pid = backend == SPAWN_VFORK ? vfork() : fork();
+    if (pid == 0)
+    {
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0)
+        perror(spawnNames[backend]);
+    
+    return pid;
+}
+
+/*******************************************************************************
+* Function name:  cloneChild
+*                                                                             
+* Description:    Starts a program with clone(CLONE_VM): the child runs on a
+*                  stack of its own in our address space until its exec, so
+*                  no page tables are copied. Signals stay blocked until the
+*                  child has reset our handlers, and we wait on a close-on-
+*                  exec pipe until the child has exec'd or failed to
+*                  before freeing its stack
+*                                                                             
+* Parameters:     char** argv - IMPORT - program and its arguments
+*                                                                             
+* Return Value:   the child's PID, or -1 on error
+*******************************************************************************/
+pid_t cloneChild(char** argv)
+{
+    struct CloneArgs args;
+    sigset_t all;
+    char* stack;
+    int fds[2], err, status;
+    ssize_t got;
+    pid_t pid;
+    
+    stack = mmap(NULL, CLONE_STACK, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        munmap(stack, CLONE_STACK);
+        return -1;
+    }
+    
+    args.argv = argv;
+    args.errFd = fds[1];
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &args.mask);
+    
+    // The stack grows down on every architecture Linux runs this on
+    pid = clone(cloneStart, stack + CLONE_STACK, CLONE_VM | SIGCHLD, &args);
+    err = errno;
+    
+    sigprocmask(SIG_SETMASK, &args.mask, NULL);
+    close(fds[1]);
+    
+    if (pid != -1)
+    {
+        // EOF once the exec succeeds, or the exec's errno if it fails
+        while ((got = read(fds[0], &err, sizeof(err))) == -1 && 
+                errno == EINTR);
+        if (got == sizeof(err))
+        {
+            waitpid(pid, &status, 0);
+            pid = -1;
+        }
+    }
+    
+    close(fds[0]);
+    munmap(stack, CLONE_STACK);
+    
+    if (pid == -1)
+    {
+        errno = err;
+        perror("clone");
+    }
+    
+    return pid;
+}
+
+/*******************************************************************************
+* Function name:  cloneStart
+*                                                                             
+* Description:    First function of a clone()d child. It shares the parent's
+*                  memory, so it only resets caught signals to their default
+*                  (a handler would run on the parent's data), restores the
+*                  signal mask and execs
+*                                                                             
+* Parameters:     void* arg - IMPORT - the struct CloneArgs
+*                                                                             
+* Return Value:   does not return
+*******************************************************************************/
+int cloneStart(void* arg)
+{
+    struct CloneArgs* args = arg;
+    struct sigaction sa;
+    int sig, err;
+    
+    for (sig = 1; sig < NSIG; sig++)
+    {
+        if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler != SIG_DFL &&
+                sa.sa_handler != SIG_IGN)
+        {
+            sa.sa_handler = SIG_DFL;
+            sa.sa_flags = 0;
+            sigaction(sig, &sa, NULL);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &args->mask, NULL);
+    
+    execv(args->argv[0], args->argv);
+    
+    // errno is the parent thread's, but the parent is blocked in read()
+    err = errno;
+    if (write(args->errFd, &err, sizeof(err)) == -1)
+        ; // The parent will see EOF and an exit status of 127
+    _exit(127);
+}
+
+/*******************************************************************************
+* Function name:  spawnBench
+*                                                                             
+* Description:    For each parent memory size and spawn backend, spawns a
+*                  number of children one at a time and prints the p50, p99
+*                  and maximum time until the spawn call returned and until
+*                  the child's exit was collected
+*                                                                             
+* Parameters:     long count  - IMPORT - children per backend and size
+*                 char* sizes - IMPORT - comma separated parent sizes
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void spawnBench(long count, char* sizes)
+{
+    long long sizeList[MAX_SIZES];
+    long* spawnNs;
+    long* exitNs;
+    char* ballast = NULL;
+    char* childArgv[] = {SELF_EXE, EXIT_ARG, NULL};
+    struct timespec t0, t1, t2;
+    int nSizes, s, b, status;
+    long i;
+    pid_t pid;
+    
+    nSizes = parseSizes(sizes, sizeList);
+    spawnNs = malloc(sizeof(long) * count);
+    exitNs = malloc(sizeof(long) * count);
+    if (nSizes == -1 || spawnNs == NULL || exitNs == NULL)
+    {
+        printf("Invalid sizes or out of memory\n");
+        return;
+    }
+    
+    printf("%-8s%12s%10s%10s%10s%10s%10s%10s\n", "Backend", "Parent MB",
+            "Spawn p50", "p99", "max", "Exit p50", "p99", "max");
+    
+    for (s = 0; s < nSizes; s++)
+    {
+        // Touch every page so each one has a page table entry to copy
+        free(ballast);
+        ballast = NULL;
+        if (sizeList[s] > 0)
+        {
+            ballast = malloc(sizeList[s]);
+            if (ballast == NULL)
+            {
+                perror("malloc");
+                break;
+            }
+            memset(ballast, 1, sizeList[s]);
+        }
+        
+        for (b = 0; b < SPAWN_COUNT; b++)
+        {
+            for (i = 0; i < count; i++)
+            {
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                pid = spawnChild(b, childArgv);
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                if (pid == -1 || waitpid(pid, &status, 0) != pid)
+                    break;
+                clock_gettime(CLOCK_MONOTONIC, &t2);
+                
+                spawnNs[i] = (t1.tv_sec - t0.tv_sec) * 1000000000L + 
+                        (t1.tv_nsec - t0.tv_nsec);
+                exitNs[i] = (t2.tv_sec - t0.tv_sec) * 1000000000L + 
+                        (t2.tv_nsec - t0.tv_nsec);
+            }
             
-        childrenLeft--;
+            if (i < count)
+            {
+                printf("%-8s%12lld%10s\n", spawnNames[b], sizeList[s] >> 20,
+                        "failed");
+                continue;
+            }
+            
+            qsort(spawnNs, count, sizeof(long), compareLong);
+            qsort(exitNs, count, sizeof(long), compareLong);
+            
+            printf("%-8s%12lld%10.1f%10.1f%10.1f%10.1f%10.1f%10.1f\n", 
+                    spawnNames[b], sizeList[s] >> 20, 
+                    spawnNs[count / 2] / 1e3, spawnNs[count * 99 / 100] / 1e3,
+                    spawnNs[count - 1] / 1e3, exitNs[count / 2] / 1e3,
+                    exitNs[count * 99 / 100] / 1e3, exitNs[count - 1] / 1e3);
+            fflush(stdout);
+        }
+    }
+    
+    free(ballast);
+    free(spawnNs);
+    free(exitNs);
+}
+
+/*******************************************************************************
+* Function name:  parseSizes
+*                                                                             
+* Description:    Parses a comma separated list of sizes in bytes, each with
+*                  an optional k, M or G suffix
+*                                                                             
+* Parameters:     char* text          - IMPORT - the list
+*                 long long* sizes    - EXPORT - at most MAX_SIZES sizes
+*                                                                             
+* Return Value:   number of sizes, or -1 if the list is invalid
+*******************************************************************************/
+int parseSizes(char* text, long long* sizes)
+{
+    int n = 0;
+    char* end;
+    
+    while (*text != '\0' && n < MAX_SIZES)
+    {
+        sizes[n] = strtoll(text, &end, 10);
+        if (end == text || sizes[n] < 0)
+            return -1;
+        
+        if (*end == 'k' || *end == 'K')
+            sizes[n] <<= 10, end++;
+        else if (*end == 'M')
+            sizes[n] <<= 20, end++;
+        else if (*end == 'G')
+            sizes[n] <<= 30, end++;
+        
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        
+        text = end;
+        n++;
+    }
+    
+    return *text == '\0' && n > 0 ? n : -1;
+}
+
+/*******************************************************************************
+* Function name:  compareLong
+*                                                                             
+* Description:    qsort() comparison for ascending longs
+*                                                                             
+* Parameters:     const void* a - IMPORT - first value
+*                 const void* b - IMPORT - second value
+*                                                                             
+* Return Value:   negative, 0 or positive as a is below, equal to or above b
+*******************************************************************************/
+int compareLong(const void* a, const void* b)
+{
+    long x = *(const long*)a, y = *(const long*)b;
+    
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+* Function name:  createEvented
+*                                                                             
+* Description:    Creates a number of child processes, keeping a bounded 
+*                  number running and reaping them from an epoll loop, with
+*                  an optional time limit per child. Child and exit lines
+*                  are printed as without -e
+*                                                                             
+* Parameters:     long n          - IMPORT - number of processes to create
+*                 int backend     - IMPORT - how to create them
+*                 int maxRunning  - IMPORT - children running at once
+*                 long timeoutMs  - IMPORT - time limit per child, 0 for none
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void createEvented(long n, int backend, int maxRunning, long timeoutMs)
+{
+    struct EventLoop loop;
+    struct epoll_event events[EV_BATCH];
+    struct signalfd_siginfo info[16];
+    struct EvChild* child;
+    struct rusage usage;
+    uint64_t expirations;
+    int i, nEvents, status;
+    pid_t pid;
+    
+    if(maxRunning > n)
+        maxRunning = n;
+    
+    // Children write to the same stdout while we print, so never leave
+    // half a line in the buffer for one of them to land in
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    
+    printf("Parent PID = %d creating %ld processes, %d at a time\n", 
+            getpid(), n, maxRunning);
+    
+    loop.backend = backend;
+    loop.timeoutNs = timeoutMs * 1000000LL;
+    if(evStart(&loop, maxRunning) == -1)
+        exit(1);
+    
+    while(loop.started < n || loop.running > 0)
+    {
+        while(loop.running < maxRunning && loop.started < n)
+        {
+            if(evSpawn(&loop) == -1)
+                exit(1);
+        }
+        
+        evArm(&loop);
+        
+        nEvents = epoll_wait(loop.epollFd, events, EV_BATCH, -1);
+        if(nEvents == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        
+        for(i = 0; i < nEvents; i++)
+        {
+            if(events[i].data.ptr == &loop.timerFd)
+            {
+                if(read(loop.timerFd, &expirations, sizeof(expirations)) > 0)
+                    evExpire(&loop);
+            }
+            else if(events[i].data.ptr == &loop.sigFd)
+            {
+                // Signals merge, so every exited child is collected
+                while(read(loop.sigFd, info, sizeof(info)) > 0);
+                while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+                {
+                    if((child = evFind(&loop, pid)) != NULL)
+                        evReap(&loop, child, status, &usage);
+                }
+            }
+            else
+            {
+                // Readable pidfd: this child has exited
+                child = events[i].data.ptr;
+                if(wait4(child->pid, &status, WNOHANG, &usage) == child->pid)
+                    evReap(&loop, child, status, &usage);
+            }
+        }
     }
+    
+    close(loop.epollFd);
+    close(loop.timerFd);
+    if(loop.sigFd != -1)
+        close(loop.sigFd);
+    free(loop.slots);
+    free(loop.freeSlots);
+    free(loop.byPid);
+}
+
+/*******************************************************************************
+* Function name:  evStart
+*                                                                             
+* Description:    Sets up the epoll set, its timerfd, the signalfd when the
+*                  kernel has no pidfds, and room for the running children.
+*                  Raises the soft descriptor limit if the pidfds need it
+*                                                                             
+* Parameters:     struct EventLoop* loop - EXPORT - the loop
+*                 int maxRunning         - IMPORT - children running at once
+*                                                                             
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int evStart(struct EventLoop* loop, int maxRunning)
+{
+    struct epoll_event ev;
+    struct rlimit limit;
+    sigset_t chld;
+    int i, fd;
+    
+    loop->started = 0;
+    loop->running = 0;
+    loop->oldest = NULL;
+    loop->newest = NULL;
+    loop->armed = 0;
+    loop->sigFd = -1;
+    
+    for(loop->hashMask = 1; loop->hashMask < maxRunning * 2; 
+            loop->hashMask <<= 1);
+    loop->slots = calloc(maxRunning, sizeof(struct EvChild));
+    loop->freeSlots = malloc(sizeof(struct EvChild*) * maxRunning);
+    loop->byPid = calloc(loop->hashMask, sizeof(struct EvChild*));
+    loop->hashMask--;
+    if(loop->slots == NULL || loop->freeSlots == NULL || loop->byPid == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    for(i = 0; i < maxRunning; i++)
+        loop->freeSlots[i] = &loop->slots[maxRunning - 1 - i];
+    loop->nFree = maxRunning;
+    
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && 
+            limit.rlim_cur < (rlim_t)maxRunning + 64)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if(loop->epollFd == -1 || loop->timerFd == -1)
+    {
+        perror("epoll");
+        return -1;
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->timerFd;
+    epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->timerFd, &ev);
+    
+    // Without pidfds, SIGCHLD must be blocked for the signalfd to see it;
+    // children then start with it blocked too
+    fd = syscall(SYS_pidfd_open, getpid(), 0);
+    if(fd != -1)
+        close(fd);
+    else
+    {
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld, NULL);
+        
+        loop->sigFd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+        if(loop->sigFd == -1)
+        {
+            perror("signalfd");
+            return -1;
+        }
+        ev.data.ptr = &loop->sigFd;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->sigFd, &ev);
+    }
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  evSpawn
+*                                                                             
+* Description:    Starts the next child, gives it a pidfd in the epoll set
+*                  and a deadline if there is a time limit
+*                                                                             
+* Parameters:     struct EventLoop* loop - IMPORT/EXPORT - the loop
+*                                                                             
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int evSpawn(struct EventLoop* loop)
+{
+    struct epoll_event ev;
+    struct EvChild* child;
+    char number[24];
+    char* childArgv[] = {SELF_EXE, CHILD_ARG, number, NULL};
+    int bucket;
+    pid_t pid;
+    
+    child = loop->freeSlots[--loop->nFree];
+    child->number = ++loop->started;
+    
+    // Anything still buffered would be printed again by a forked child
+    fflush(stdout);
+    
+    if(loop->backend != SPAWN_FORK)
+    {
+        snprintf(number, sizeof(number), "%d", child->number);
+        if((pid = spawnPinned(loop->backend, childArgv, child->number)) == -1)
+            return -1;
+    }
+    else if((pid = fork()) < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    else if(pid == 0)
+    {
+        pinSelf(child->number);
+        childMain(child->number);
+    }
+    
+    child->pid = pid;
+    child->pidFd = -1;
+    child->killed = 0;
+    
+    if(loop->sigFd == -1)
+    {
+        // The child cannot be reaped before we wait for it, so its PID
+        // still names it here even if it has already exited
+        child->pidFd = syscall(SYS_pidfd_open, pid, 0);
+        if(child->pidFd == -1)
+        {
+            perror("pidfd_open");
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = child;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, child->pidFd, &ev);
+    }
+    
+    bucket = pid & loop->hashMask;
+    child->hashNext = loop->byPid[bucket];
+    loop->byPid[bucket] = child;
+    
+    // Every child gets the same limit, so deadlines expire in start order
+    child->deadline = 0;
+    child->older = NULL;
+    child->newer = NULL;
+    if(loop->timeoutNs > 0)
+    {
+        child->deadline = monotonicNs() + loop->timeoutNs;
+        child->older = loop->newest;
+        if(loop->newest != NULL)
+            loop->newest->newer = child;
+        else
+            loop->oldest = child;
+        loop->newest = child;
+    }
+    
+    loop->running++;
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  evReap
+*                                                                             
+* Description:    Prints how a child ended and frees its slot. A child
+*                  is only said to have timed out if the SIGKILL sent at
+*                  its deadline is what ended it
+*                                                                             
+* Parameters:     struct EventLoop* loop - IMPORT/EXPORT - the loop
+*                 struct EvChild* child  - IMPORT - the child collected
+*                 int status             - IMPORT - its wait() status
+*                 struct rusage* usage   - IMPORT - its resource usage
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void evReap(struct EventLoop* loop, struct EvChild* child, int status,
+        struct rusage* usage)
+{
+    struct EvChild** link;
+    
+    if(child->killed && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)
+        printf("PID %d timed out after %lld ms\n", child->pid, 
+                loop->timeoutNs / 1000000);
+    reportStatus(-1, child->pid, status, usage);
+    
+    // Closing the pidfd also takes it out of the epoll set
+    if(child->pidFd != -1)
+        close(child->pidFd);
+    
+    evUnlink(loop, child);
+    
+    for(link = &loop->byPid[child->pid & loop->hashMask]; *link != child;
+            link = &(*link)->hashNext);
+    *link = child->hashNext;
+    
+    loop->freeSlots[loop->nFree++] = child;
+    loop->running--;
+}
+
+/*******************************************************************************
+* Function name:  evExpire
+*                                                                             
+* Description:    Kills every child whose deadline has passed. They are 
+*                  reaped like any other child once they have died. A
+*                  child reaped here may still have an event in the batch
+*                  being handled; its waitpid() there simply fails. One
+*                  that exits before the signal lands is reported as a
+*                  normal exit
+*                                                                             
+* Parameters:     struct EventLoop* loop - IMPORT/EXPORT - the loop
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void evExpire(struct EventLoop* loop)
+{
+    struct EvChild* child;
+    struct rusage usage;
+    long long now = monotonicNs();
+    int status;
+    
+    loop->armed = 0;
+    
+    while((child = loop->oldest) != NULL && child->deadline <= now)
+    {
+        // It may have exited just before its deadline, with the event
+        // still waiting behind this one
+        if(wait4(child->pid, &status, WNOHANG, &usage) == child->pid)
+        {
+            evReap(loop, child, status, &usage);
+            continue;
+        }
+        
+        // A pidfd cannot reach a new process that reused the PID. If the
+        // child is already gone the signal fails and it exited on its own
+        if(child->pidFd != -1)
+            child->killed = syscall(SYS_pidfd_send_signal, child->pidFd,
+                    SIGKILL, NULL, 0) == 0;
+        else
+            child->killed = kill(child->pid, SIGKILL) == 0;
+        
+        evUnlink(loop, child);
+    }
+}
+
+/*******************************************************************************
+* Function name:  evArm
+*                                                                             
+* Description:    Sets the timerfd for the oldest deadline still pending,
+*                  or disarms it if there is none
+*                                                                             
+* Parameters:     struct EventLoop* loop - IMPORT/EXPORT - the loop
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void evArm(struct EventLoop* loop)
+{
+    struct itimerspec when;
+    long long deadline = loop->oldest != NULL ? loop->oldest->deadline : 0;
+    
+    if(deadline == loop->armed)
+        return;
+    
+    memset(&when, 0, sizeof(when));
+    when.it_value.tv_sec = deadline / 1000000000;
+    when.it_value.tv_nsec = deadline % 1000000000;
+    timerfd_settime(loop->timerFd, TFD_TIMER_ABSTIME, &when, NULL);
+    loop->armed = deadline;
+}
+
+/*******************************************************************************
+* Function name:  evUnlink
+*                                                                             
+* Description:    Takes a child out of the deadline list, if it is in it
+*                                                                             
+* Parameters:     struct EventLoop* loop - IMPORT/EXPORT - the loop
+*                 struct EvChild* child  - IMPORT - the child
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void evUnlink(struct EventLoop* loop, struct EvChild* child)
+{
+    if(child->deadline == 0)
+        return;
+    
+    if(child->older != NULL)
+        child->older->newer = child->newer;
+    else
+        loop->oldest = child->newer;
+    
+    if(child->newer != NULL)
+        child->newer->older = child->older;
+    else
+        loop->newest = child->older;
+    
+    child->deadline = 0;
+}
+
+/*******************************************************************************
+* Function name:  evFind
+*                                                                             
+* Description:    Looks up a running child by PID
+*                                                                             
+* Parameters:     struct EventLoop* loop - IMPORT - the loop
+*                 pid_t pid              - IMPORT - the PID
+*                                                                             
+* Return Value:   the child, or NULL if it is not one of ours
+*******************************************************************************/
+struct EvChild* evFind(struct EventLoop* loop, pid_t pid)
+{
+    struct EvChild* child;
+    
+    for(child = loop->byPid[pid & loop->hashMask]; child != NULL && 
+            child->pid != pid; child = child->hashNext);
+    
+    return child;
+}
+
+/*******************************************************************************
+* Function name:  monotonicNs
+*                                                                             
+* Description:    Reads CLOCK_MONOTONIC
+*                                                                             
+* Parameters:     none
+*                                                                             
+* Return Value:   the time in nanoseconds
+*******************************************************************************/
+long long monotonicNs(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*******************************************************************************
+* Function name:  kernelBench
+*
+* Description:    Runs each chosen kernel with 1, 2, 4, ... and finally the
+*                  given number of workers, as forked processes and as
+*                  threads, and prints the throughput and the scaling
+*                  efficiency against one worker of the same model. Every
+*                  worker does the same amount of work, calibrated so one
+*                  worker alone takes about the given time
+*
+* Parameters:     char* names     - IMPORT - comma separated kernel names, or
+*                   "all"
+*                 int maxWorkers  - IMPORT - largest number of workers
+*                 long durationMs - IMPORT - target time for one worker
+*
+* Return Value:   0 on success, -1 if a kernel name is unknown
+*******************************************************************************/
+int kernelBench(char* names, int maxWorkers, long durationMs)
+{
+    struct Kernel* kernel;
+    char list[256];
+    char* name;
+    char* save;
+    double wall, base[2], rate;
+    long iterations;
+    int k, model, workers;
+
+    snprintf(list, sizeof(list), "%s", strcmp(names, "all") == 0 ?
+            "cpu,mem,syscall" : names);
+    for(name = strtok_r(list, ",", &save); name != NULL;
+            name = strtok_r(NULL, ",", &save))
+    {
+        for(k = 0; k < KERNEL_COUNT && strcmp(name, kernels[k].name); k++);
+        if(k == KERNEL_COUNT)
+            return -1;
+    }
+
+    printf("%-8s%-9s%8s%10s%16s%12s\n", "Kernel", "Model", "Workers",
+            "Wall (s)", "Throughput", "Efficiency");
+
+    snprintf(list, sizeof(list), "%s", strcmp(names, "all") == 0 ?
+            "cpu,mem,syscall" : names);
+    for(name = strtok_r(list, ",", &save); name != NULL;
+            name = strtok_r(NULL, ",", &save))
+    {
+        for(k = 0; strcmp(name, kernels[k].name); k++);
+        kernel = &kernels[k];
+        iterations = kernelCalibrate(kernel, durationMs);
+
+        for(workers = 1; ; workers = workers * 2 < maxWorkers ?
+                workers * 2 : maxWorkers)
+        {
+            for(model = 0; model < 2; model++)
+            {
+                wall = model == 0 ?
+                        kernelProcesses(kernel, workers, iterations) :
+                        kernelThreads(kernel, workers, iterations);
+                if(wall < 0)
+                {
+                    printf("%-8s%-9s%8d%10s\n", kernel->name,
+                            model == 0 ? "process" : "thread", workers,
+                            "failed");
+                    continue;
+                }
+
+                rate = workers * iterations * kernel->unitsPerIteration / wall;
+                if(workers == 1)
+                    base[model] = rate;
+
+                printf("%-8s%-9s%8d%10.3f%10.2f %-6s%11.1f%%\n", kernel->name,
+                        model == 0 ? "process" : "thread", workers, wall, rate,
+                        kernel->unit, 100 * rate / (workers * base[model]));
+                fflush(stdout);
+            }
+
+            if(workers == maxWorkers)
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  kernelCalibrate
+*
+* Description:    Finds how many iterations of a kernel one worker runs in
+*                  about the given time, by timing doubling trial runs
+*
+* Parameters:     struct Kernel* kernel - IMPORT - the kernel
+*                 long durationMs       - IMPORT - target time
+*
+* Return Value:   the number of iterations
+*******************************************************************************/
+long kernelCalibrate(struct Kernel* kernel, long durationMs)
+{
+    void* state = kernel->setup();
+    long iterations = 1;
+    long long start, elapsed;
+
+    for(;;)
+    {
+        start = monotonicNs();
+        kernelSink ^= kernel->run(state, iterations);
+        elapsed = monotonicNs() - start;
+
+        // A tenth of the target is long enough to scale from
+        if(elapsed * 10 >= durationMs * 1000000LL)
+            break;
+        iterations *= 2;
+    }
+
+    kernel->cleanup(state);
+
+    iterations = iterations * (durationMs * 1000000.0 / elapsed);
+
+    return iterations > 0 ? iterations : 1;
+}
+
+/*******************************************************************************
+* Function name:  kernelProcesses
+*
+* Description:    Runs a kernel in forked child processes. Each child sets
+*                  up its state, reports ready over a pipe and waits for the
+*                  start pipe to close, so only the kernels are timed
+*
+* Parameters:     struct Kernel* kernel - IMPORT - the kernel
+*                 int workers           - IMPORT - number of children
+*                 long iterations       - IMPORT - iterations per child
+*
+* Return Value:   wall-clock seconds from the start to the last exit, or -1
+*                  if a child failed
+*******************************************************************************/
+double kernelProcesses(struct Kernel* kernel, int workers, long iterations)
+{
+    int ready[2], go[2], i, status, failed = 0;
+    long long start;
+    uint64_t result;
+    void* state;
+    char byte;
+
+    if(pipe(ready) == -1 || pipe(go) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+
+    for(i = 0; i < workers; i++)
+    {
+        if(fork() == 0)
+        {
+            close(ready[0]);
+            close(go[1]);
+
+            state = kernel->setup();
+            if(write(ready[1], "", 1) != 1 || read(go[0], &byte, 1) != 0)
+                _exit(1);
+
+            result = kernel->run(state, iterations);
+
+            // The result goes back so the kernel cannot be optimized away
+            _exit(write(ready[1], &result, sizeof(result)) != sizeof(result));
+        }
+    }
+
+    close(go[0]);
+
+    for(i = 0; i < workers && read(ready[0], &byte, 1) == 1; i++);
+
+    start = monotonicNs();
+    close(go[1]);
+
+    for(i = 0; i < workers; i++)
+    {
+        if(wait(&status) == -1 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+    start = monotonicNs() - start;
+
+    close(ready[1]);
+    while(read(ready[0], &result, sizeof(result)) == sizeof(result))
+        kernelSink ^= result;
+    close(ready[0]);
+
+    return failed ? -1 : start / 1e9;
+}
+
+/*******************************************************************************
+* Function name:  kernelThreads
+*
+* Description:    Runs a kernel on a pool of threads. Each thread sets up its
+*                  state and meets the others at a barrier, so only the
+*                  kernels are timed
+*
+* Parameters:     struct Kernel* kernel - IMPORT - the kernel
+*                 int workers           - IMPORT - number of threads
+*                 long iterations       - IMPORT - iterations per thread
+*
+* Return Value:   wall-clock seconds from the barrier to the last join, or
+*                  -1 if a thread could not be created
+*******************************************************************************/
+double kernelThreads(struct Kernel* kernel, int workers, long iterations)
+{
+    struct KernelThread* threads;
+    pthread_barrier_t barrier;
+    long long start;
+    int i, created;
+
+    threads = malloc(sizeof(struct KernelThread) * workers);
+    if(threads == NULL)
+        return -1;
+
+    pthread_barrier_init(&barrier, NULL, workers + 1);
+
+    for(created = 0; created < workers; created++)
+    {
+        threads[created].kernel = kernel;
+        threads[created].iterations = iterations;
+        threads[created].barrier = &barrier;
+        if(pthread_create(&threads[created].thread, NULL, kernelThreadMain,
+                &threads[created]) != 0)
+        {
+            // The barrier cannot be met now; threads already made would
+            // wait forever
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = monotonicNs();
+
+    for(i = 0; i < workers; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        kernelSink ^= threads[i].result;
+    }
+    start = monotonicNs() - start;
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+
+    return start / 1e9;
+}
+
+/*******************************************************************************
+* Function name:  kernelThreadMain
+*
+* Description:    Body of a kernel thread: set up, wait at the barrier, run
+*
+* Parameters:     void* arg - IMPORT/EXPORT - the struct KernelThread
+*
+* Return Value:   NULL
+*******************************************************************************/
+void* kernelThreadMain(void* arg)
+{
+    struct KernelThread* self = arg;
+    void* state = self->kernel->setup();
+
+    pthread_barrier_wait(self->barrier);
+    self->result = self->kernel->run(state, self->iterations);
+    self->kernel->cleanup(state);
+
+    return NULL;
+}
+
+/*******************************************************************************
+* Function name:  cpuRun
+*
+* Description:    CPU kernel: a chain of xorshift64* steps, each depending
+*                  on the last, touching no memory
+*
+* Parameters:     void* state     - IMPORT - unused
+*                 long iterations - IMPORT - steps to run
+*
+* Return Value:   the final value
+*******************************************************************************/
+uint64_t cpuRun(void* state, long iterations)
+{
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    long i;
+
+    for(i = 0; i < iterations; i++)
+    {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        x *= 0x2545f4914f6cdd1dULL;
+    }
+
+    return x;
+}
+
+/*******************************************************************************
+* Function name:  memSetup
+*
+* Description:    Allocates and fills the three arrays of the memory kernel,
+*                  each far larger than a last-level cache
+*
+* Parameters:     none
+*
+* Return Value:   the arrays, one after another, or NULL
+*******************************************************************************/
+void* memSetup(void)
+{
+    double* a = malloc(sizeof(double) * MEM_ELEMENTS * 3);
+    long i;
+
+    if(a == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    for(i = 0; i < MEM_ELEMENTS * 3; i++)
+        a[i] = i & 255;
+
+    return a;
+}
+
+/*******************************************************************************
+* Function name:  memRun
+*
+* Description:    Memory kernel: the STREAM triad a = b + 3c over the whole
+*                  arrays, 24 bytes moved per element
+*
+* Parameters:     void* state     - IMPORT/EXPORT - the arrays
+*                 long iterations - IMPORT - passes to make
+*
+* Return Value:   bits of one element, so the passes are not dropped
+*******************************************************************************/
+uint64_t memRun(void* state, long iterations)
+{
+    double* a = state;
+    double* b = a + MEM_ELEMENTS;
+    double* c = b + MEM_ELEMENTS;
+    uint64_t bits;
+    long i, pass;
+
+    for(pass = 0; pass < iterations; pass++)
+    {
+        for(i = 0; i < MEM_ELEMENTS; i++)
+            a[i] = b[i] + 3.0 * c[i];
+        b[pass % MEM_ELEMENTS] = a[(pass * 7) % MEM_ELEMENTS];
+    }
+
+    memcpy(&bits, &a[iterations % MEM_ELEMENTS], sizeof(bits));
+
+    return bits;
+}
+
+/*******************************************************************************
+* Function name:  syscallRun
+*
+* Description:    System call kernel: getppid() made directly through
+*                  syscall(), so no library cache can answer it
+*
+* Parameters:     void* state     - IMPORT - unused
+*                 long iterations - IMPORT - calls to make
+*
+* Return Value:   the sum of the results
+*******************************************************************************/
+uint64_t syscallRun(void* state, long iterations)
+{
+    uint64_t sum = 0;
+    long i;
+
+    for(i = 0; i < iterations; i++)
+        sum += syscall(SYS_getppid);
+
+    return sum;
+}
+
+/*******************************************************************************
+* Function name:  noSetup
+*
+* Description:    Setup for kernels that keep no state
+*
+* Parameters:     none
+*
+* Return Value:   NULL
+*******************************************************************************/
+void* noSetup(void)
+{
+    return NULL;
+}
+
+/*******************************************************************************
+* Function name:  ringCreate
+*                                                                             
+* Description:    Creates the result ring in a memfd and maps it. The fd is
+*                  left open across exec so exec'd children can map it too
+*                                                                             
+* Parameters:     none
+*                                                                             
+* Return Value:   the ring, or NULL on error
+*******************************************************************************/
+struct ResultRing* ringCreate(void)
+{
+    struct ResultRing* ring;
+    uint64_t i;
+
+    ringFd = memfd_create("results", 0);
+    if(ringFd == -1 || ftruncate(ringFd, sizeof(struct ResultRing)) == -1)
+    {
+        perror("memfd_create");
+        return NULL;
+    }
+
+    ring = ringAttach(ringFd);
+    if(ring == NULL)
+        return NULL;
+
+    // Slot i is free for the producer holding ticket i
+    for(i = 0; i < RING_SLOTS; i++)
+        ring->slots[i].seq = i;
+
+    return ring;
+}
+
+/*******************************************************************************
+* Function name:  ringAttach
+*                                                                             
+* Description:    Maps the result ring from its memfd
+*                                                                             
+* Parameters:     int fd - IMPORT - the memfd
+*                                                                             
+* Return Value:   the ring, or NULL on error
+*******************************************************************************/
+struct ResultRing* ringAttach(int fd)
+{
+    void* ring = mmap(NULL, sizeof(struct ResultRing), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+
+    if(ring == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    return ring;
+}
+
+/*******************************************************************************
+* Function name:  ringPublish
+*                                                                             
+* Description:    Adds a record to the ring without taking a lock. A
+*                  producer claims a ticket by compare-and-swap only when
+*                  the ticket's slot has been released, writes the record in
+*                  place and hands the slot to the consumer by storing the
+*                  ticket + 1 in the slot's sequence word. When the ring is
+*                  full it yields until the parent catches up
+*                                                                             
+* Parameters:     struct ResultRing* ring - IMPORT/EXPORT - the ring
+*                 struct Record* record   - IMPORT - the record
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void ringPublish(struct ResultRing* ring, struct Record* record)
+{
+    struct RingSlot* slot;
+    uint64_t ticket, seq;
+
+    ticket = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        slot = &ring->slots[ticket & (RING_SLOTS - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if(seq == ticket)
+        {
+            if(__atomic_compare_exchange_n(&ring->enqueue, &ticket,
+                    ticket + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if((int64_t)(seq - ticket) < 0)
+        {
+            // Full: the slot still holds a record from a lap ago
+            sched_yield();
+            ticket = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED);
+        }
+        else
+            ticket = __atomic_load_n(&ring->enqueue, __ATOMIC_RELAXED);
+    }
+
+    slot->record = *record;
+
+    // Publishing and then looking for a sleeping parent must not be
+    // reordered, or the parent could go to sleep on a record just added.
+    // Only the producer that clears the flag makes the wake-up call
+    __atomic_store_n(&slot->seq, ticket + 1, __ATOMIC_SEQ_CST);
+    if(__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST))
+    {
+        __atomic_add_fetch(&ring->wake, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &ring->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+/*******************************************************************************
+* Function name:  ringPeek
+*                                                                             
+* Description:    Returns the next record in place, without copying it
+*                                                                             
+* Parameters:     struct ResultRing* ring - IMPORT - the ring
+*                                                                             
+* Return Value:   the record, or NULL if none has been published yet
+*******************************************************************************/
+struct Record* ringPeek(struct ResultRing* ring)
+{
+    struct RingSlot* slot = &ring->slots[ring->dequeue & (RING_SLOTS - 1)];
+
+    if(__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != ring->dequeue + 1)
+        return NULL;
+
+    return &slot->record;
+}
+
+/*******************************************************************************
+* Function name:  ringConsume
+*                                                                             
+* Description:    Waits for the next record and returns it in place. The
+*                  caller hands the slot back with ringRelease()
+*                                                                             
+* Parameters:     struct ResultRing* ring - IMPORT/EXPORT - the ring
+*                 int timeoutMs           - IMPORT - longest wait
+*                                                                             
+* Return Value:   the record, or NULL if none arrived in time
+*******************************************************************************/
+struct Record* ringConsume(struct ResultRing* ring, int timeoutMs)
+{
+    struct timespec timeout = {timeoutMs / 1000, timeoutMs % 1000 * 1000000};
+    struct Record* record;
+    uint32_t wake;
+    int spins;
+
+    for(spins = 0; spins < RING_SPINS; spins++)
+    {
+        if((record = ringPeek(ring)) != NULL)
+            return record;
+    }
+
+    wake = __atomic_load_n(&ring->wake, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    if((record = ringPeek(ring)) == NULL)
+    {
+        syscall(SYS_futex, &ring->wake, FUTEX_WAIT, wake, &timeout, NULL, 0);
+        record = ringPeek(ring);
+    }
+
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+
+    return record;
+}
+
+/*******************************************************************************
+* Function name:  ringRelease
+*                                                                             
+* Description:    Hands the slot of the record last consumed back to the
+*                  producers, for the ticket one lap later
+*                                                                             
+* Parameters:     struct ResultRing* ring - IMPORT/EXPORT - the ring
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void ringRelease(struct ResultRing* ring)
+{
+    struct RingSlot* slot = &ring->slots[ring->dequeue & (RING_SLOTS - 1)];
+
+    __atomic_store_n(&slot->seq, ring->dequeue + RING_SLOTS, __ATOMIC_RELEASE);
+    ring->dequeue++;
+}
+
+/*******************************************************************************
+* Function name:  childPublish
+*                                                                             
+* Description:    Publishes a record from a child to the result ring
+*                                                                             
+* Parameters:     int type      - IMPORT - RECORD_START, RECORD_PROGRESS or
+*                   RECORD_RESULT
+*                 int number    - IMPORT - which child this is, from 1
+*                 int seq       - IMPORT - record number within the child
+*                 long long value - IMPORT - percent done or the result
+*                 long long start - IMPORT - when the child started (ns)
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void childPublish(int type, int number, int seq, long long value,
+        long long start)
+{
+    struct Record record;
+
+    record.type = type;
+    record.child = number;
+    record.seq = seq;
+    record.pid = getpid();
+    record.value = value;
+    record.ns = monotonicNs() - start;
+
+    ringPublish(resultRing, &record);
+}
+
+/*******************************************************************************
+* Function name:  collectResults
+*                                                                             
+* Description:    Reads the children's records from the result ring and
+*                  reaps the children. Each child's records are printed
+*                  together, children in order, each followed by its exit
+*                  line, so the output is the same however the children
+*                  were scheduled. A child's lines are held in memory
+*                  until every child before it is done
+*                                                                             
+* Parameters:     long n       - IMPORT - number of children
+*                 pid_t* pids  - IMPORT - PID of each child, by number - 1
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void collectResults(long n, pid_t* pids)
+{
+    struct ChildOutput* outs = calloc(n, sizeof(struct ChildOutput));
+    struct ChildOutput* out;
+    struct Record* record;
+    struct rusage usage;
+    long cursor = 0, i;
+    int status;
+    pid_t pid;
+
+    if(outs == NULL)
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    while(cursor < n)
+    {
+        record = ringConsume(resultRing, RING_WAIT_MS);
+
+        if(record != NULL)
+        {
+            out = &outs[record->child - 1];
+            if(record->child - 1 != cursor && out->file == NULL)
+                out->file = open_memstream(&out->text, &out->len);
+
+            printRecord(record->child - 1 == cursor ? stdout : out->file,
+                    record);
+            if(record->type == RECORD_RESULT)
+                out->done = 1;
+            ringRelease(resultRing);
+        }
+        else
+        {
+            // The ring is empty, so everything a reaped child published
+            // has been read
+            for(i = 0; i < n; i++)
+                outs[i].done |= outs[i].reaped;
+
+            while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+            {
+                for(i = 0; i < n && pids[i] != pid; i++);
+                if(i == n)
+                    continue;
+                outs[i].reaped = 1;
+                outs[i].status = status;
+                outs[i].usage = usage;
+            }
+        }
+
+        // Children that published their result are waited for here
+        while(cursor < n && outs[cursor].done)
+        {
+            out = &outs[cursor];
+            if(!out->reaped && wait4(pids[cursor], &out->status, 0,
+                    &out->usage) == pids[cursor])
+                out->reaped = 1;
+            if(out->reaped)
+                reportStatus(-1, pids[cursor], out->status, &out->usage);
+
+            if(++cursor < n && outs[cursor].file != NULL)
+            {
+                fclose(outs[cursor].file);
+                outs[cursor].file = NULL;
+                fwrite(outs[cursor].text, 1, outs[cursor].len, stdout);
+                free(outs[cursor].text);
+            }
+        }
+    }
+
+    free(outs);
+}
+
+/*******************************************************************************
+* Function name:  printRecord
+*                                                                             
+* Description:    Prints one record from the result ring
+*                                                                             
+* Parameters:     FILE* out             - IMPORT - where to print it
+*                 struct Record* record - IMPORT - the record
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void printRecord(FILE* out, struct Record* record)
+{
+    if(record->type == RECORD_START)
+        fprintf(out, "Child process %u created: PID = %d\n", record->child,
+                record->pid);
+    else if(record->type == RECORD_PROGRESS)
+        fprintf(out, "Child process %u (PID %d) at %lld%% after %lld us\n",
+                record->child, record->pid, (long long)record->value,
+                (long long)record->ns / 1000);
+    else
+        fprintf(out, "Child process %u (PID %d) result: %lld loops in "
+                "%lld us\n", record->child, record->pid,
+                (long long)record->value, (long long)record->ns / 1000);
+}
+
+/*******************************************************************************
+* Function name:  channelBench
+*                                                                             
+* Description:    Measures how fast children can report records to the
+*                  parent through the result ring and through one shared
+*                  pipe, written a record at a time, with one producer and
+*                  with the given number
+*                                                                             
+* Parameters:     long records    - IMPORT - records each producer sends
+*                 int maxWorkers  - IMPORT - largest number of producers
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void channelBench(long records, int maxWorkers)
+{
+    int producers[2] = {1, maxWorkers};
+    int p, channel;
+    double wall;
+
+    resultRing = ringCreate();
+    if(resultRing == NULL)
+        return;
+
+    printf("%-8s%10s%12s%10s%14s%10s\n", "Channel", "Producers", "Records",
+            "Wall (s)", "Mrecords/s", "MB/s");
+
+    for(p = 0; p < 2 && (p == 0 || maxWorkers > 1); p++)
+    {
+        for(channel = 0; channel < 2; channel++)
+        {
+            wall = channelRun(channel, producers[p], records);
+            if(wall < 0)
+            {
+                printf("%-8s%10d%12s\n", channel == 0 ? "ring" : "pipe",
+                        producers[p], "failed");
+                continue;
+            }
+
+            printf("%-8s%10d%12ld%10.3f%14.2f%10.1f\n",
+                    channel == 0 ? "ring" : "pipe", producers[p],
+                    records * producers[p], wall,
+                    records * producers[p] / wall / 1e6,
+                    records * producers[p] * sizeof(struct Record) / wall /
+                    1e6);
+            fflush(stdout);
+        }
+    }
+
+    munmap(resultRing, sizeof(struct ResultRing));
+    close(ringFd);
+}
+
+/*******************************************************************************
+* Function name:  channelRun
+*                                                                             
+* Description:    Forks the producers, starts them together and times how
+*                  long the parent takes to read every record
+*                                                                             
+* Parameters:     int usePipe   - IMPORT - 0 for the ring, 1 for a pipe
+*                 int producers - IMPORT - number of children
+*                 long records  - IMPORT - records each child sends
+*                                                                             
+* Return Value:   seconds from the start until the last record was read,
+*                  or -1 on error
+*******************************************************************************/
+double channelRun(int usePipe, int producers, long records)
+{
+    struct Record buf[CHANNEL_BATCH];
+    struct Record record;
+    struct Record* in;
+    int data[2], ready[2], go[2], i, status, failed = 0;
+    long long start, sum = 0, total = records * producers, seen = 0;
+    ssize_t got, part = 0;
+    char byte;
+
+    if(pipe(data) == -1 || pipe(ready) == -1 || pipe(go) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+
+    for(i = 0; i < producers; i++)
+    {
+        if(fork() == 0)
+        {
+            close(data[0]);
+            close(ready[0]);
+            close(go[1]);
+            if(write(ready[1], "", 1) != 1 || read(go[0], &byte, 1) != 0)
+                _exit(1);
+
+            memset(&record, 0, sizeof(record));
+            record.type = RECORD_PROGRESS;
+            record.child = i + 1;
+            record.pid = getpid();
+            for(record.seq = 0; record.seq < records; record.seq++)
+            {
+                record.value = record.seq;
+                if(!usePipe)
+                    ringPublish(resultRing, &record);
+                else if(write(data[1], &record, sizeof(record)) !=
+                        sizeof(record))
+                    _exit(1);
+            }
+            _exit(0);
+        }
+    }
+
+    close(data[1]);
+    close(ready[1]);
+    close(go[0]);
+    for(i = 0; i < producers && read(ready[0], &byte, 1) == 1; i++);
+
+    start = monotonicNs();
+    close(go[1]);
+
+    while(seen < total)
+    {
+        if(!usePipe)
+        {
+            if((in = ringConsume(resultRing, RING_WAIT_MS)) == NULL)
+            {
+                if(waitpid(-1, &status, WNOHANG) > 0 &&
+                        (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+                    break;
+                continue;
+            }
+            sum += in->value;
+            ringRelease(resultRing);
+            seen++;
+            continue;
+        }
+
+        // Records are below PIPE_BUF, so each write arrives whole, but a
+        // read can end part way through one
+        got = read(data[0], (char*)buf + part, sizeof(buf) - part);
+        if(got <= 0)
+            break;
+        part += got;
+        for(i = 0; i < part / (ssize_t)sizeof(struct Record); i++)
+            sum += buf[i].value;
+        seen += part / sizeof(struct Record);
+        memmove(buf, (char*)buf + part - part % sizeof(struct Record),
+                part % sizeof(struct Record));
+        part %= sizeof(struct Record);
+    }
+    start = monotonicNs() - start;
+
+    while(wait(&status) > 0)
+    {
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+    close(data[0]);
+    close(ready[0]);
+
+    // Each producer sends 0 .. records - 1
+    if(failed || seen != total ||
+            sum != (long long)producers * records * (records - 1) / 2)
+        return -1;
+
+    return start / 1e9;
+}
+
+/*******************************************************************************
+* Function name:  reportStatus
+*                                                                             
+* Description:    Prints how a child process or a pool job ended
+*                                                                             
+* Parameters:     long job             - IMPORT - job number, or -1 for a
+*                   process
+*                 pid_t pid            - IMPORT - process that exited or ran
+*                   the job
+*                 int status           - IMPORT - status in the form wait()
+*                   reports
+*                 struct rusage* usage - IMPORT - the process's resources
+*                   from wait4(), or NULL; printed and added to the totals
+*                   with -u
+*
+* Return Value:   none
+*******************************************************************************/
+void reportStatus(long job, pid_t pid, int status, struct rusage* usage)
+{
+    double user, sys;
+
+    if (job >= 0)
+        printf("Job %ld (", job);
+
+    if (WIFEXITED(status))
+        printf("PID %d%s exits: %d", pid, job >= 0 ? ")" : "",
+                WEXITSTATUS(status));
+    else if (WIFSTOPPED(status))
+        printf("PID %d%s stopped by: %d", pid, job >= 0 ? ")" : "",
+                WSTOPSIG(status));
+    else if (WIFSIGNALED(status))
+        printf("PID %d%s killed by: %d", pid, job >= 0 ? ")" : "",
+                WTERMSIG(status));
+    else
+    {
+        perror("Waitpid");
+        return;
+    }
+
+    if (usage != NULL && totals.enabled)
+    {
+        user = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+        sys = usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+
+        printf(" (user %.3fs, sys %.3fs, max RSS %ld kB, ctx switches "
+                "%ld/%ld, faults %ld/%ld)", user, sys, usage->ru_maxrss,
+                usage->ru_nvcsw, usage->ru_nivcsw, usage->ru_minflt,
+                usage->ru_majflt);
+
+        totals.processes++;
+        totals.user += user;
+        totals.sys += sys;
+        if (usage->ru_maxrss > totals.maxRss)
+            totals.maxRss = usage->ru_maxrss;
+        totals.volSwitches += usage->ru_nvcsw;
+        totals.involSwitches += usage->ru_nivcsw;
+        totals.minorFaults += usage->ru_minflt;
+        totals.majorFaults += usage->ru_majflt;
+    }
+
+    printf("\n");
+}
+
+/*******************************************************************************
+* Function name:  acctStart
+*
+* Description:    Notes the time and each CPU's counters at the start of the
+*                  run, for the summary printed by acctSummary()
+*
+* Parameters:     none
+*
+* Return Value:   none
+*******************************************************************************/
+void acctStart(void)
+{
+    totals.nCpus = sysconf(_SC_NPROCESSORS_CONF);
+    totals.cpuStart = calloc(totals.nCpus, sizeof(struct CpuTimes));
+    if (totals.cpuStart != NULL)
+        readCpuTimes(totals.cpuStart, totals.nCpus);
+    totals.startNs = monotonicNs();
+}
+
+/*******************************************************************************
+* Function name:  acctSummary
+*
+* Description:    Prints the totals of every process reaped, the CPU
+*                  utilization they amount to over the run, and how busy
+*                  each online CPU was
+*
+* Parameters:     none
+*
+* Return Value:   none
+*******************************************************************************/
+void acctSummary(void)
+{
+    struct CpuTimes* end;
+    double wall = (monotonicNs() - totals.startNs) / 1e9;
+    double total;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    printf("\n%10s%12s%12s%14s%12s%12s%12s%12s\n", "Processes", "User (s)",
+            "Sys (s)", "Max RSS (kB)", "Vol csw", "Invol csw", "Minor flt",
+            "Major flt");
+    printf("%10ld%12.3f%12.3f%14ld%12ld%12ld%12ld%12ld\n", totals.processes,
+            totals.user, totals.sys, totals.maxRss, totals.volSwitches,
+            totals.involSwitches, totals.minorFaults, totals.majorFaults);
+    printf("Wall %.3f s: children used %.1f%% of one CPU, %.1f%% of %ld\n",
+            wall, 100 * (totals.user + totals.sys) / wall,
+            100 * (totals.user + totals.sys) / wall / online, online);
+
+    end = calloc(totals.nCpus, sizeof(struct CpuTimes));
+    if (totals.cpuStart == NULL || end == NULL ||
+            readCpuTimes(end, totals.nCpus) == -1)
+    {
+        free(end);
+        return;
+    }
+
+    printf("\n%-6s%10s%10s%10s\n", "CPU", "User %", "Sys %", "Busy %");
+    for (i = 0; i < totals.nCpus; i++)
+    {
+        if (!end[i].online || !totals.cpuStart[i].online)
+            continue;
+
+        total = end[i].total - totals.cpuStart[i].total;
+        if (total == 0)
+            total = 1;
+        printf("%-6d%10.1f%10.1f%10.1f\n", i,
+                100 * (end[i].user - totals.cpuStart[i].user) / total,
+                100 * (end[i].sys - totals.cpuStart[i].sys) / total,
+                100 * (end[i].user - totals.cpuStart[i].user + end[i].sys -
+                totals.cpuStart[i].sys) / total);
+    }
+
+    free(end);
+}
+
+/*******************************************************************************
+* Function name:  readCpuTimes
+*
+* Description:    Reads the per-CPU lines of /proc/stat. Idle and iowait
+*                  time count toward the total only
+*
+* Parameters:     struct CpuTimes* cpus - EXPORT - one entry per CPU number
+*                 int nCpus             - IMPORT - entries in cpus
+*
+* Return Value:   0 on success, -1 if /proc/stat cannot be read
+*******************************************************************************/
+int readCpuTimes(struct CpuTimes* cpus, int nCpus)
+{
+    unsigned long long v[8];
+    char line[512];
+    FILE* stat = fopen("/proc/stat", "r");
+    int cpu, i;
+
+    if (stat == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), stat) != NULL)
+    {
+        memset(v, 0, sizeof(v));
+        if (sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
+                &cpu, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+                &v[7]) < 5 || cpu < 0 || cpu >= nCpus)
+            continue;
+
+        // user nice system idle iowait irq softirq steal
+        cpus[cpu].online = 1;
+        cpus[cpu].user = v[0] + v[1];
+        cpus[cpu].sys = v[2] + v[5] + v[6];
+        cpus[cpu].total = 0;
+        for (i = 0; i < 8; i++)
+            cpus[cpu].total += v[i];
+    }
+
+    fclose(stat);
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  parseCpuList
+*
+* Description:    Parses a CPU or node list such as 0-3,8,10-11
+*
+* Parameters:     char* text     - IMPORT - the list
+*                 cpu_set_t* set - EXPORT - the numbers in it
+*                 int max        - IMPORT - numbers must be below this
+*
+* Return Value:   how many numbers the list holds, or -1 if it is invalid
+*******************************************************************************/
+int parseCpuList(char* text, cpu_set_t* set, int max)
+{
+    long first, last;
+    char* end;
+
+    CPU_ZERO(set);
+
+    while (*text != '\0' && *text != '\n')
+    {
+        first = last = strtol(text, &end, 10);
+        if (end == text)
+            return -1;
+        if (*end == '-')
+        {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text)
+                return -1;
+        }
+        if (first < 0 || last < first || last >= max)
+            return -1;
+
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0' && *end != '\n')
+            return -1;
+        text = end;
+    }
+
+    return CPU_COUNT(set);
+}
+
+/*******************************************************************************
+* Function name:  pinSetup
+*
+* Description:    Builds the CPU sets children are pinned to in turn: one
+*                  per CPU in the list, or one per NUMA node in the list
+*                  holding all of the node's CPUs
+*
+* Parameters:     char* list - IMPORT - CPU or node list
+*                 int nodes  - IMPORT - the list names NUMA nodes
+*
+* Return Value:   0 on success, -1 if the list is invalid
+*******************************************************************************/
+int pinSetup(char* list, int nodes)
+{
+    cpu_set_t chosen, allowed;
+    char path[64], cpus[4096];
+    FILE* file;
+    int i, ok;
+
+    if (parseCpuList(list, &chosen, CPU_SETSIZE) < 1 ||
+            sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        return -1;
+
+    pinSets = malloc(sizeof(cpu_set_t) * CPU_COUNT(&chosen));
+    if (pinSets == NULL)
+        return -1;
+    nPinSets = 0;
+
+    for (i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (!CPU_ISSET(i, &chosen))
+            continue;
+
+        if (!nodes && !CPU_ISSET(i, &allowed))
+        {
+            fprintf(stderr, "CPU %d is not available\n", i);
+            return -1;
+        }
+        if (!nodes)
+        {
+            CPU_ZERO(&pinSets[nPinSets]);
+            CPU_SET(i, &pinSets[nPinSets++]);
+            continue;
+        }
+
+        snprintf(path, sizeof(path), NODE_CPULIST, i);
+        file = fopen(path, "r");
+        ok = file != NULL && fgets(cpus, sizeof(cpus), file) != NULL &&
+                parseCpuList(cpus, &pinSets[nPinSets], CPU_SETSIZE) > 0;
+        if (file != NULL)
+            fclose(file);
+        if (!ok)
+        {
+            fprintf(stderr, "NUMA node %d has no CPUs\n", i);
+            return -1;
+        }
+        nPinSets++;
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  pinSelf
+*
+* Description:    Pins the calling process to the CPUs for a child number,
+*                  if -a or -A was given
+*
+* Parameters:     int number - IMPORT - child or worker number, from 1
+*
+* Return Value:   none
+*******************************************************************************/
+void pinSelf(int number)
+{
+    if (nPinSets > 0 && sched_setaffinity(0, sizeof(cpu_set_t),
+            &pinSets[(number - 1) % nPinSets]) == -1)
+        perror("sched_setaffinity");
+}
+
+/*******************************************************************************
+* Function name:  spawnPinned
+*
+* Description:    Spawns a child with spawnChild() on the CPUs for its
+*                  number. The child cannot run our code before its exec,
+*                  so the parent takes those CPUs while spawning and hands
+*                  them down, then returns to its own
+*
+* Parameters:     int backend - IMPORT - how to spawn the child
+*                 char** argv - IMPORT - program and its arguments
+*                 int number  - IMPORT - child number, from 1
+*
+* Return Value:   the child's PID, or -1 on error
+*******************************************************************************/
+pid_t spawnPinned(int backend, char** argv, int number)
+{
+    cpu_set_t saved;
+    pid_t pid;
+
+    if (nPinSets == 0 || sched_getaffinity(0, sizeof(saved), &saved) == -1)
+        return spawnChild(backend, argv);
+
+    pinSelf(number);
+    pid = spawnChild(backend, argv);
+    sched_setaffinity(0, sizeof(saved), &saved);
+
+    return pid;
+}
+
+/*******************************************************************************
+* Function name:  createPool
+*                                                                             
+* Description:    Runs a number of jobs on a pool of worker processes forked
+*                  once at the start, printing each job's status as it
+*                  finishes and each worker's exit once the jobs are done
+*                                                                             
+* Parameters:     long nJobs    - IMPORT - number of jobs to run
+*                 int nWorkers  - IMPORT - number of workers to fork
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void createPool(long nJobs, int nWorkers)
+{
+    struct Pool pool;
+    struct pollfd fds[2];
+    char drain[64];
+    int i, status, workersLeft = 0;
+    struct rusage usage;
+    pid_t pid;
+    
+    if(nWorkers > nJobs)
+        nWorkers = nJobs;
+    
+    printf("Parent PID = %d running %ld jobs on %d workers\n", getpid(), 
+            nJobs, nWorkers);
+    
+    pool.nJobs = nJobs;
+    if(poolStart(&pool, nWorkers) == -1)
+        exit(1);
+    
+    fds[0].fd = pool.resultFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sigPipe[0];
+    fds[1].events = POLLIN;
+    
+    poolFeed(&pool);
+    
+    while(pool.done < nJobs)
+    {
+        if(poll(fds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            exit(1);
+        }
+        
+        // Results first, so a worker that finished a job and then died is
+        // not charged with it
+        poolResults(&pool);
+        
+        if(fds[1].revents & POLLIN)
+        {
+            while(read(sigPipe[0], drain, sizeof(drain)) > 0);
+            poolReap(&pool);
+        }
+        
+        poolFeed(&pool);
+    }
+    
+    // Closing the job pipes tells the workers to exit
+    signal(SIGCHLD, SIG_DFL);
+    for(i = 0; i < pool.nWorkers; i++)
+    {
+        if(pool.workers[i].pid > 0)
+        {
+            close(pool.workers[i].jobFd);
+            workersLeft++;
+        }
+    }
+    
+    while(workersLeft > 0 && (pid = wait4(-1, &status, 0, &usage)) > 0)
+    {
+        reportStatus(-1, pid, status, &usage);
+        workersLeft--;
+    }
+    
+    close(pool.resultFd);
+    close(pool.resultWriteFd);
+    close(sigPipe[0]);
+    close(sigPipe[1]);
+    free(pool.workers);
+    free(pool.retry);
+}
+
+/*******************************************************************************
+* Function name:  poolStart
+*                                                                             
+* Description:    Sets up the result pipe and the SIGCHLD notification and
+*                  forks the workers
+*                                                                             
+* Parameters:     struct Pool* pool - IMPORT/EXPORT - pool with nJobs set
+*                 int nWorkers      - IMPORT - number of workers to fork
+*                                                                             
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int poolStart(struct Pool* pool, int nWorkers)
+{
+    struct sigaction sa;
+    int fds[2], i;
+    
+    pool->workers = calloc(nWorkers, sizeof(struct Worker));
+    pool->retry = malloc(sizeof(long) * nWorkers * POOL_DEPTH);
+    pool->nWorkers = nWorkers;
+    pool->nextJob = 1;
+    pool->nRetry = 0;
+    pool->done = 0;
+    
+    if(pool->workers == NULL || pool->retry == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    
+    // Results are read until the pipe is empty, so the read end must not 
+    // block
+    if(pipe(fds) == -1 || pipe2(sigPipe, O_NONBLOCK) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+    pool->resultFd = fds[0];
+    pool->resultWriteFd = fds[1];
+    fcntl(pool->resultFd, F_SETFL, O_NONBLOCK);
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onChild;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    
+    // A write to the pipe of a dead worker must fail, not kill the parent
+    signal(SIGPIPE, SIG_IGN);
+    
+    for(i = 0; i < nWorkers; i++)
+    {
+        if(poolSpawn(pool, i) == -1)
+            return -1;
+    }
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  poolSpawn
+*                                                                             
+* Description:    Forks the worker in a slot of the pool, with a new pipe
+*                  for its jobs
+*                                                                             
+* Parameters:     struct Pool* pool - IMPORT/EXPORT - the pool
+*                 int index         - IMPORT - slot of the worker
+*                                                                             
+* Return Value:   0 on success, -1 on error
+*******************************************************************************/
+int poolSpawn(struct Pool* pool, int index)
+{
+    struct Worker* worker = &pool->workers[index];
+    int fds[2], i;
+    pid_t pid;
+    
+    if(pipe(fds) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+    
+    // Anything still buffered would be printed again by the child
+    fflush(stdout);
+    
+    if((pid = fork()) < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    
+    if(pid == 0)
+    {
+        // Worker process: keep only its own job pipe and the result pipe,
+        // or the other workers would never see the end of their jobs
+        for(i = 0; i < pool->nWorkers; i++)
+        {
+            if(i != index && pool->workers[i].pid > 0)
+                close(pool->workers[i].jobFd);
+        }
+        close(fds[1]);
+        close(pool->resultFd);
+        close(sigPipe[0]);
+        close(sigPipe[1]);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        pinSelf(index + 1);
+        
+        printf("Worker %d started: PID = %d\n", index + 1, getpid());
+        fflush(stdout);
+        workerLoop(fds[0], pool->resultWriteFd);
+        exit(0);
+    }
+    
+    close(fds[0]);
+    worker->pid = pid;
+    worker->jobFd = fds[1];
+    worker->nPending = 0;
+    
+    return 0;
+}
+
+/*******************************************************************************
+* Function name:  poolFeed
+*                                                                             
+* Description:    Hands jobs to every worker that has fewer than POOL_DEPTH,
+*                  taking jobs returned by dead workers first
+*                                                                             
+* Parameters:     struct Pool* pool - IMPORT/EXPORT - the pool
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void poolFeed(struct Pool* pool)
+{
+    struct Worker* worker;
+    struct Job job;
+    int i;
+    
+    for(i = 0; i < pool->nWorkers; i++)
+    {
+        worker = &pool->workers[i];
+        
+        while(worker->pid > 0 && worker->nPending < POOL_DEPTH &&
+                (pool->nRetry > 0 || pool->nextJob <= pool->nJobs))
+        {
+            if(pool->nRetry > 0)
+                job.id = pool->retry[--pool->nRetry];
+            else
+                job.id = pool->nextJob++;
+            
+            // Never blocks: the pipe holds at most POOL_DEPTH jobs
+            if(write(worker->jobFd, &job, sizeof(job)) != sizeof(job))
+            {
+                // The worker has died; poolReap() will replace it
+                pool->retry[pool->nRetry++] = job.id;
+                break;
+            }
+            
+            worker->pending[worker->nPending++] = job.id;
+        }
+    }
+}
+
+/*******************************************************************************
+* Function name:  poolResults
+*                                                                             
+* Description:    Reads every result waiting in the result pipe and prints
+*                  the status of each finished job
+*                                                                             
+* Parameters:     struct Pool* pool - IMPORT/EXPORT - the pool
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void poolResults(struct Pool* pool)
+{
+    struct JobResult result;
+    struct Worker* worker;
+    int i, j;
+    
+    // Results are smaller than PIPE_BUF, so each arrives whole
+    while(read(pool->resultFd, &result, sizeof(result)) == sizeof(result))
+    {
+        for(i = 0; i < pool->nWorkers; i++)
+        {
+            worker = &pool->workers[i];
+            if(worker->pid != result.pid)
+                continue;
+            
+            for(j = 0; j < worker->nPending && 
+                    worker->pending[j] != result.id; j++);
+            if(j < worker->nPending)
+            {
+                memmove(&worker->pending[j], &worker->pending[j + 1],
+                        sizeof(long) * (worker->nPending - j - 1));
+                worker->nPending--;
+            }
+        }
+        
+        reportStatus(result.id, result.pid, result.status, NULL);
+        pool->done++;
+    }
+}
+
+/*******************************************************************************
+* Function name:  poolReap
+*                                                                             
+* Description:    Collects workers that have died, reports them and the job
+*                  each was running, puts their other jobs back on the
+*                  queue and forks replacements while work remains
+*                                                                             
+* Parameters:     struct Pool* pool - IMPORT/EXPORT - the pool
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void poolReap(struct Pool* pool)
+{
+    struct Worker* worker;
+    int i, j, status;
+    struct rusage usage;
+    pid_t pid;
+    
+    while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+    {
+        reportStatus(-1, pid, status, &usage);
+        
+        for(i = 0; i < pool->nWorkers && pool->workers[i].pid != pid; i++);
+        if(i == pool->nWorkers)
+            continue;
+        
+        worker = &pool->workers[i];
+        if(worker->nPending > 0)
+        {
+            reportStatus(worker->pending[0], pid, status, NULL);
+            pool->done++;
+        }
+        for(j = worker->nPending - 1; j > 0; j--)
+            pool->retry[pool->nRetry++] = worker->pending[j];
+        
+        close(worker->jobFd);
+        worker->pid = 0;
+        worker->nPending = 0;
+        
+        if(pool->nRetry > 0 || pool->nextJob <= pool->nJobs)
+            poolSpawn(pool, i);
+    }
+}
+
+/*******************************************************************************
+* Function name:  workerLoop
+*                                                                             
+* Description:    Runs jobs from the job pipe until it is closed, sending
+*                  each job's status to the result pipe
+*                                                                             
+* Parameters:     int jobFd    - IMPORT - read end of this worker's job pipe
+*                 int resultFd - IMPORT - write end of the result pipe
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void workerLoop(int jobFd, int resultFd)
+{
+    struct Job job;
+    struct JobResult result;
+    
+    result.pid = getpid();
+    
+    while(read(jobFd, &job, sizeof(job)) == sizeof(job))
+    {
+        result.id = job.id;
+        result.status = W_EXITCODE(runJob(&job), 0);
+        
+        if(write(resultFd, &result, sizeof(result)) != sizeof(result))
+            exit(1);
+    }
+}
+
+/*******************************************************************************
+* Function name:  runJob
+*                                                                             
+* Description:    Runs one job: an empty for loop [the worker's PID] number
+*                  of times, the same work a child does without -p
+*                                                                             
+* Parameters:     struct Job* job - IMPORT - the job
+*                                                                             
+* Return Value:   the job's exit status
+*******************************************************************************/
+int runJob(struct Job* job)
+{
+    volatile int count;
+    int workerPID;
+    
+    workerPID = getpid();
+    for(count = 1; count <= workerPID; count++);
+    
+    return 15;
+}
+
+/*******************************************************************************
+* Function name:  onChild
+*                                                                             
+* Description:    SIGCHLD handler: wakes the pool's poll() so dead workers
+*                  are collected
+*                                                                             
+* Parameters:     int sig - IMPORT - signal number
+*                                                                             
+* Return Value:   none
+*******************************************************************************/
+void onChild(int sig)
+{
+    int savedErrno = errno;
+    
+    if(write(sigPipe[1], "", 1) == -1)
+        ; // The pipe is full, so a wake-up is already pending
+    
+    errno = savedErrno;
 }